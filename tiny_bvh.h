@@ -57,6 +57,8 @@ THE SOFTWARE.
 //                            which stores the bits in a separate field in tinybvh::Intersection.
 // #define C_INT 1          - the estimated cost of a primitive intersection test. Default is 1.
 // #define C_TRAV 1         - the estimated cost of a traversal step. Default is 1.
+// #define TINYBVH_TRAVERSAL_STATS - count node visits, box and primitive tests etc. in
+//                            the traversal kernels; see TraversalStats. Off by default.
 
 // See tiny_bvh_test.cpp for basic usage. In short:
 // instantiate a BVH: tinybvh::BVH bvh;
@@ -104,6 +106,28 @@ THE SOFTWARE.
 #endif
 #define AVXBINS 8 // must stay at 8.
 
+// Parallel building: with BVHContext::parallelBuild set, BVH::Build and
+// BVH::BuildAVX subdivide the subtrees below the top of the tree in parallel,
+// from this many primitives.
+#ifndef PARALLEL_BUILD_PRIMS
+#define PARALLEL_BUILD_PRIMS 65536
+#endif
+
+// Traversal: BVH4_CPU and BVH8_CPU prefetch the nodes or leaves of this many
+// freshly pushed stack entries (0 disables). BVH8_CPU::IntersectInterleaved
+// alternates between this many rays to overlap their cache misses.
+#ifndef TRAVERSAL_PREFETCH
+#define TRAVERSAL_PREFETCH 2
+#endif
+#ifndef TRAVERSAL_INTERLEAVE
+#define TRAVERSAL_INTERLEAVE 8
+#endif
+// BVH8_CWBVH::IntersectShortStack keeps this many stack entries (power of 2);
+// when it runs out, the ray is finished with the full-stack Intersect.
+#ifndef CWBVH_SHORT_STACK
+#define CWBVH_SHORT_STACK 8
+#endif
+
 // TLAS setting
 // Note: Except when INST_IDX_BITS is set to 32, the instance index is encoded in
 // the top bits of the prim idx field.
@@ -150,6 +174,16 @@ THE SOFTWARE.
 #ifndef NO_CUSTOM_GEOMETRY
 #define ENABLE_CUSTOM_GEOMETRY
 #endif
+#ifndef NO_QUAD_GEOMETRY
+#define ENABLE_QUAD_GEOMETRY
+#endif
+// No threads: compiles the JobSystem pool out; parallel loops then run on the
+// calling thread, and <thread> and friends are not needed. Implied for
+// EMSCRIPTEN builds without pthreads.
+// #define TINYBVH_NO_THREADS
+#if defined __EMSCRIPTEN__ && !defined __EMSCRIPTEN_PTHREADS__ && !defined TINYBVH_NO_THREADS
+#define TINYBVH_NO_THREADS
+#endif
 
 // Experimental / WIP features
 
@@ -183,6 +217,7 @@ THE SOFTWARE.
 #include <cstring>
 #endif
 #include <cstdint>
+#include <atomic> // for lazy BVH expansion
 
 // Platform-independent compile-time warnings.
 #define EMIT_COMPILER_WARNING_STRINGIFY0(x) #x
@@ -273,6 +308,11 @@ inline void* malloc32k( size_t size, void* = nullptr ) { return size == 0 ? 0 :
 inline void free64( void* ptr, void* = nullptr ) { _ALIGNED_FREE( ptr ); }
 inline void free4k( void* ptr, void* = nullptr ) { _ALIGNED_FREE( ptr ); }
 inline void free32k( void* ptr, void* = nullptr ) { _ALIGNED_FREE( ptr ); }
+// Huge page allocator, for BVHContext::malloc / free: blocks of 1MB and up are
+// backed by 2MB pages where the OS allows it, which reduces TLB misses during
+// traversal of large trees. Smaller blocks, and other platforms: malloc64.
+void* mallocHuge( size_t size, void* = nullptr );
+void freeHuge( void* ptr, void* = nullptr );
 }; // namespace tiybvh
 
 // Derived TLAS things; for convenience.
@@ -663,6 +703,66 @@ inline float tinybvh_intersect_aabb( Ray& ray, const bvhvec3& aabbMin, const bvh
 	if (tmax >= tmin && tmin < ray.hit.t && tmax >= 0) return tmin; else return BVH_FAR;
 }
 
+// Traversal statistics. With TINYBVH_TRAVERSAL_STATS defined, the Intersect and
+// IsOccluded kernels of BVH, BVH_SoA, BVH4_CPU, BVH8_CPU and BVH8_CWBVH (and the
+// TLAS kernels) count their work in a per-thread TraversalStats. Without it, the
+// BVH_STAT macros compile to nothing. Read or reset TraversalStats::Local()
+// around a single ray for per-ray counts; Report() merges all threads.
+struct TraversalStats
+{
+	uint64_t traversals = 0;		// kernel invocations, including BLAS traversals.
+	uint64_t blasEntries = 0;		// TLAS-to-BLAS transitions.
+	uint64_t interiorNodes = 0;		// interior nodes visited.
+	uint64_t boxTests = 0;			// child bounding boxes tested.
+	uint64_t leafVisits = 0;		// leaves visited.
+	uint64_t primTests = 0;			// primitives tested; for IsOccluded including the full final leaf.
+	uint32_t maxStackDepth = 0;		// traversal stack high-water mark.
+	uint64_t Rays() const { return traversals - blasEntries; }
+	void Stack( const uint32_t depth ) { if (depth > maxStackDepth) maxStackDepth = depth; }
+	void Reset() { *this = TraversalStats(); }
+	void Merge( const TraversalStats& s )
+	{
+		traversals += s.traversals, blasEntries += s.blasEntries, interiorNodes += s.interiorNodes;
+		boxTests += s.boxTests, leafVisits += s.leafVisits, primTests += s.primTests;
+		if (s.maxStackDepth > maxStackDepth) maxStackDepth = s.maxStackDepth;
+	}
+#ifdef TINYBVH_TRAVERSAL_STATS
+	static TraversalStats& Local();		// counters of the calling thread.
+	static TraversalStats Report();		// merged counters of all threads, including finished ones.
+	static void ResetAll();				// call these two while no traversal is in flight.
+#endif
+};
+
+#ifdef TINYBVH_TRAVERSAL_STATS
+#define BVH_STATS_RAY TraversalStats& stats = TraversalStats::Local(); stats.traversals++
+#define BVH_STAT( ... ) __VA_ARGS__
+#else
+#define BVH_STATS_RAY
+#define BVH_STAT( ... )
+#endif
+
+// Tree quality metrics, as returned by the Analyze method of each layout. SAH
+// and EPO match SAHCost and EPOCost. LCV is the leaf count variance: the
+// variance of the number of leaves pierced by a random line through the root
+// (Fuetterling et al., 2017), estimated with a fixed set of 16K lines. Wide
+// layouts report the MBVH they were converted from, plus their own memory use.
+struct BVHQuality
+{
+	float sah = 0;					// SAH cost, see SAHCost.
+	float epo = 0;					// EPO cost, see EPOCost; 0 if skipped or no triangle data.
+	float lcv = 0;					// leaf count variance.
+	float siblingOverlap = 0;		// summed overlap of all pairs of sibling boxes, relative to the root.
+	uint32_t nodes = 0;				// reachable nodes, including leaves.
+	uint32_t leaves = 0;			// reachable leaves.
+	uint32_t primRefs = 0;			// primitive references in leaves; more than triCount for an SBVH.
+	uint32_t emptySlots = 0;		// unused child slots in interior nodes of wide layouts.
+	uint32_t maxDepth = 0;			// depth of the deepest leaf; the root has depth 0.
+	uint64_t bytes = 0;				// node, index and leaf data used by traversal.
+	float bytesPerPrim = 0;			// bytes / triCount.
+	uint32_t depthHistogram[64] = {};		// leaves per depth; the last bin includes deeper leaves.
+	uint32_t leafSizeHistogram[33] = {};	// leaves per primitive count; the last bin includes larger leaves.
+};
+
 #ifdef DOUBLE_PRECISION_SUPPORT
 
 struct IntersectionEx
@@ -695,15 +795,282 @@ struct RayEx
 
 #endif
 
+// Job system: a persistent pool of worker threads, each with its own deque of
+// jobs. A thread pops jobs from the back of its own deque; idle threads steal
+// from the front of the others. A thread that waits for a loop runs pending
+// jobs in the meantime, so parallel loops may be nested. The library reaches
+// the pool through BVHContext::parallelFor; point that to your own scheduler
+// (TBB, an engine task graph) to use it for library work instead. With
+// TINYBVH_NO_THREADS, the pool has one thread: the caller.
+typedef void (*JobFunc)(void* data, uint32_t first, uint32_t last);
+class JobSystem
+{
+public:
+	// threads 0: one per hardware thread, including the caller. pinNUMA: spread the
+	// workers over the NUMA nodes and keep each on the CPUs of its node, see NUMA.
+	JobSystem( const uint32_t threads = 0, const bool pinNUMA = false );
+	JobSystem( const JobSystem& ) = delete;
+	JobSystem& operator=( const JobSystem& ) = delete;
+	~JobSystem();
+	static JobSystem& Default();
+	uint32_t ThreadCount() const { return threadCount; }
+	// Run job( data, first, last ) over [0, count) in chunks of at least grain items,
+	// and return when all chunks are done. The calling thread takes part.
+	void Run( const uint32_t count, const uint32_t grain, JobFunc job, void* data );
+	template <class F> void ParallelFor( const uint32_t count, const uint32_t grain, F func )
+	{
+		Run( count, grain, []( void* data, uint32_t first, uint32_t last ) { for (uint32_t i = first; i < last; i++) (*(F*)data)( i ); }, &func );
+	}
+	// Default BVHContext::parallelFor. userdata is a JobSystem*, or null for Default().
+	static void ParallelForHook( uint32_t count, uint32_t grain, JobFunc job, void* data, void* userdata );
+private:
+	struct Impl;
+	void Wait( const std::atomic<uint32_t>& pending );
+	Impl* impl = 0;
+	uint32_t threadCount = 1;
+};
+
+// Build statistics: time spent in each build phase, and counters. Collected by
+// the builders and layout conversions when BVHContext::buildStats is set. The
+// context is passed on to the BVHs that a layout builds internally, so one
+// BuildStats covers all phases of e.g. BVH8_CPU::Build. Values accumulate
+// until Reset. Phase times are exclusive: COMPACT excludes the compaction
+// that a builder or conversion calls. Not thread-safe; use one per thread.
+struct BuildStats
+{
+	enum Phase : uint32_t
+	{
+		PREPARE = 0,				// PrepareBuild and its variants: fragment bounds.
+		SUBDIVIDE,					// the subdivision loop of a builder.
+		COMPACT,					// BVH::Compact and BVH_Verbose::Compact.
+		COLLAPSE,					// MBVH<M>::ConvertFrom: binary to wide nodes.
+		CONVERT,					// all other ConvertFrom methods.
+		PHASE_COUNT
+	};
+	double ms[PHASE_COUNT] = {};	// time per phase, in milliseconds.
+	uint64_t builds = 0;			// completed builds.
+	uint64_t primitives = 0;		// primitives in these builds.
+	uint64_t nodes = 0;				// nodes created by these builds.
+	uint64_t splitFragments = 0;	// fragments added by spatial splits (BuildHQ).
+	uint32_t taskStackPeak = 0;		// largest subdivision task stack.
+	void* activeTimer = 0;			// innermost running phase timer; internal.
+	void Reset() { *this = BuildStats(); }
+	double TotalMs() const;
+	static const char* PhaseName( const Phase phase );
+};
+
 struct BVHContext
 {
 	void* (*malloc)(size_t size, void* userdata) = malloc64;
 	void (*free)(void* ptr, void* userdata) = free64;
 	void* userdata = nullptr;
+	BuildStats* buildStats = nullptr;	// optional build phase timings, see BuildStats.
+	// Parallel loops in builders and analysis: run job( data, first, last ) over
+	// [0, count) in chunks of at least grain items and return when all are done.
+	void (*parallelFor)(uint32_t count, uint32_t grain, JobFunc job, void* data, void* userdata) = JobSystem::ParallelForHook;
+	void* jobUserdata = nullptr;		// passed to parallelFor; for the default, a JobSystem* or null.
+	// Let builds, refits, layout conversions and compressed loads use parallelFor.
+	// Off by default: these then run on the calling thread. Analyze and the batch
+	// queries (IntersectBatch, IsOccludedBatch) always use parallelFor.
+	bool parallelBuild = false;
+};
+
+// NUMA support: on machines with several memory nodes (multi-socket systems),
+// a thread reads memory of its own node fastest. Context returns a BVHContext
+// that allocates on a given node; NUMAReplicas keeps a copy of a read-only BVH
+// on every node. Implemented for Linux, without libnuma. Elsewhere, and on
+// single-node machines, NodeCount is 1 and Context returns the base context.
+class NUMA
+{
+public:
+	static uint32_t NodeCount();
+	static uint32_t CurrentNode();	// node of the CPU that runs the calling thread.
+	static bool PinThread( const uint32_t node ); // keep the calling thread on the CPUs of a node.
+	static BVHContext Context( const uint32_t node, const BVHContext& base = {} );
+	// Allocator used by Context; userdata is the node index.
+	static void* Alloc( size_t size, void* userdata );
+	static void Free( void* ptr, void* userdata );
+};
+
+// Per-node copies of a read-only BVH: T is BVH, BVH4_CPU, BVH8_CPU or BVH8_CWBVH.
+// Each copy is made with CloneFrom, with memory on its own node. Call Update
+// after the original changed. With a single node no copies are made and all
+// nodes use the original. Traversal threads should be pinned (NUMA::PinThread,
+// or a JobSystem with pinNUMA) and look up their copy once per batch of rays.
+template <class T> class NUMAReplicas
+{
+public:
+	NUMAReplicas( const T& original ) : source( &original ) { Update(); }
+	NUMAReplicas( const NUMAReplicas& ) = delete;
+	NUMAReplicas& operator=( const NUMAReplicas& ) = delete;
+	~NUMAReplicas() { Clear(); }
+	void Update()
+	{
+		const uint32_t nodes = NUMA::NodeCount();
+		if (nodes < 2) { Clear(); return; }
+		if (count != nodes)
+		{
+			Clear();
+			replica = new T*[nodes], count = nodes;
+			for (uint32_t i = 0; i < nodes; i++) replica[i] = new T( NUMA::Context( i, source->context ) );
+		}
+		for (uint32_t i = 0; i < count; i++) replica[i]->CloneFrom( *source );
+	}
+	uint32_t Count() const { return count; } // 0 if all nodes use the original.
+	const T& operator[]( const uint32_t node ) const { return node < count ? *replica[node] : *source; }
+	const T& Local() const { return (*this)[NUMA::CurrentNode()]; }
+private:
+	void Clear()
+	{
+		for (uint32_t i = 0; i < count; i++) delete replica[i];
+		delete[] replica, replica = 0, count = 0;
+	}
+	const T* source = 0;
+	T** replica = 0;
+	uint32_t count = 0;
 };
 
+// Batch queries: trace an array of rays through a BVH of any layout, in chunks
+// of 'grain' rays, on the parallelFor of the BVH's context. occluded[i] receives
+// the result of IsOccluded for ray i.
+template <class B> void IntersectBatch( const B& bvh, Ray* rays, const uint32_t count, const uint32_t grain = 256 )
+{
+	struct Batch { const B* bvh; Ray* rays; } batch{ &bvh, rays };
+	bvh.context.parallelFor( count, grain, []( void* data, uint32_t first, uint32_t last )
+		{
+			const Batch& b = *(const Batch*)data;
+			for (uint32_t i = first; i < last; i++) b.bvh->Intersect( b.rays[i] );
+		}, &batch, bvh.context.jobUserdata );
+}
+template <class B> void IsOccludedBatch( const B& bvh, const Ray* rays, bool* occluded, const uint32_t count, const uint32_t grain = 256 )
+{
+	struct Batch { const B* bvh; const Ray* rays; bool* occluded; } batch{ &bvh, rays, occluded };
+	bvh.context.parallelFor( count, grain, []( void* data, uint32_t first, uint32_t last )
+		{
+			const Batch& b = *(const Batch*)data;
+			for (uint32_t i = first; i < last; i++) b.occluded[i] = b.bvh->IsOccluded( b.rays[i] );
+		}, &batch, bvh.context.jobUserdata );
+}
+
 enum TraceDevice : uint32_t { USE_CPU = 1, USE_GPU };
 
+// Binary file format, used by the Save / Load methods of all layouts.
+// A file starts with a 128-byte header and a table of sections. Each section
+// stores a plain array (nodes, indices, leaf data) at a 64-byte aligned offset.
+// Sections contain no pointers, so a file can be memory-mapped and traversed
+// in place. Data is stored in native byte order; the magic value detects
+// files that were written on a machine with a different endianness.
+#define TINY_BVH_FILE_MAGIC		0x48564254 // 'TBVH'
+#define TINY_BVH_FILE_VERSION	2 // 2: BVH_GPU nodes store parent indices.
+#define TINY_BVH_FILE_SECTIONS	8 // maximum number of sections in a file
+struct BVHFileHeader
+{
+	enum { REBUILDABLE = 1, REFITTABLE = 2, HOLES = 4, OVER_AABBS = 8, OVER_INDICES = 16, OVER_QUADS = 32, L_QUADS = 64, ODDEVEN = 128 };
+	uint32_t magic;					// TINY_BVH_FILE_MAGIC.
+	uint32_t fileVersion;			// TINY_BVH_FILE_VERSION.
+	uint32_t libVersion;			// library version that wrote the file.
+	uint32_t layout;				// BVHBase::BVHType of the stored BVH.
+	uint32_t flags;					// BVHBase flags, see enum above.
+	uint32_t sectionCount;			// number of BVHFileSection records after the header.
+	uint64_t triCount, idxCount, nodeCount;
+	float c_trav, c_int;
+	uint32_t hqbvhbins;
+	uint32_t bvhFlags;				// flags of the underlying BVH, for layouts that store one.
+	float aabbMin[3], aabbMax[3];	// bounds of the root node.
+	uint64_t dataChecksum;			// checksum over the contents of all sections.
+	uint64_t headerChecksum;		// checksum over header and section table.
+	uint64_t sourceHash;			// hash of the source geometry, if known; see BVHBuildCache.
+	uint32_t dummy1[4];				// total: 128 bytes.
+};
+struct BVHFileSection
+{
+	enum { NODES = 1, PRIM_INDICES, LEAF_DATA, BVH_NODES, INSTANCES, BLAS_TABLE, BLAS_DATA, PACKED_NODES, PACKED_INDICES };
+	uint32_t type, dummy;
+	uint64_t offset, size;			// in bytes, relative to the start of the file.
+};
+
+class BVHMappedFile
+{
+public:
+	// Read-only view of a BVH file, for zero-copy loading. The file is mapped
+	// into memory where the platform supports this; otherwise it is read into a
+	// buffer. A BVH loaded from a BVHMappedFile uses the mapped data directly,
+	// so the BVHMappedFile must outlive its use; the BVH can still be rebuilt
+	// or destroyed after the file is closed.
+	BVHMappedFile() = default;
+	BVHMappedFile( const char* fileName ) { Open( fileName ); }
+	BVHMappedFile( const BVHMappedFile& file, const uint64_t offset, const uint64_t bytes )
+	{
+		// non-owning view of a file embedded in another file, e.g. a BLAS in a BVHScene.
+		data = file.data + offset, size = bytes, owner = false;
+	}
+	BVHMappedFile( const BVHMappedFile& ) = delete;
+	BVHMappedFile& operator=( const BVHMappedFile& ) = delete;
+	~BVHMappedFile() { Close(); }
+	bool Open( const char* fileName );
+	void Close();
+	bool Verify() const;			// validates the data checksum; touches all pages.
+	bool Contains( const void* ptr ) const { return ptr >= data && ptr < data + size; }
+	const uint8_t* data = 0;		// file contents.
+	uint64_t size = 0;				// file size in bytes.
+private:
+	void* mapping = 0;				// platform mapping handle, if any.
+	bool mapped = false;			// false if the file was read into a buffer.
+	bool owner = true;				// false for a view into another BVHMappedFile.
+};
+
+// Ray batch file format, for capturing ray batches from an application and
+// replaying them in benchmarks. A file has a 64-byte header, 'count' 32-byte
+// ray records and, if the HITS flag is set, 'count' 20-byte hit records. With
+// the OCCLUSION flag, the rays are occlusion (shadow) rays, traced with
+// IsOccluded; their hit records hold t = 0 for occluded rays, BVH_FAR otherwise.
+// Byte order is native, as in BVH files.
+#define TINY_BVH_RAYS_MAGIC		0x59415254 // 'TRAY'
+#define TINY_BVH_RAYS_VERSION	1
+struct RayBatchHeader
+{
+	enum { HITS = 1, OCCLUSION = 2 };
+	uint32_t magic;					// TINY_BVH_RAYS_MAGIC.
+	uint32_t fileVersion;			// TINY_BVH_RAYS_VERSION.
+	uint32_t count;					// number of rays.
+	uint32_t flags;					// see enum above.
+	uint32_t rayRecordSize;			// sizeof( RayBatch::RayRecord ).
+	uint32_t hitRecordSize;			// sizeof( RayBatch::HitRecord ).
+	uint64_t checksum;				// checksum over all records.
+	uint32_t dummy[8];				// total: 64 bytes.
+};
+
+class RayBatch
+{
+public:
+	// A list of rays, with optional reference hits. To capture: Add rays before
+	// they are traced, then SetHits with the traced rays. To replay: Load, trace
+	// GetRay( i ) and validate the result with Matches( i, ray ). For occlusion
+	// batches, record results with SetOccluded and validate with Matches( i, occluded ).
+	struct RayRecord { bvhvec3 O; float tmax; bvhvec3 D; uint32_t mask; };	// 32 bytes
+	struct HitRecord { float t, u, v; uint32_t prim, inst; };				// 20 bytes; t < 0: no hit recorded.
+	RayBatch( BVHContext ctx = {} ) { context = ctx; }
+	RayBatch( const RayBatch& ) = delete;
+	RayBatch& operator=( const RayBatch& ) = delete;
+	~RayBatch() { Clear(); }
+	uint32_t Add( const Ray* rays, const uint32_t rayCount = 1 );	// returns the index of the first added ray.
+	void SetHits( const uint32_t first, const Ray* rays, const uint32_t rayCount = 1 );
+	void SetOccluded( const uint32_t idx, const bool occluded );
+	Ray GetRay( const uint32_t idx ) const;	// ray with a pristine hit record, ready for tracing.
+	bool Matches( const uint32_t idx, const Ray& ray, const float eps = 1e-4f ) const;
+	bool Matches( const uint32_t idx, const bool occluded ) const;
+	bool Save( const char* fileName ) const;
+	bool Load( const char* fileName );
+	void Clear();
+	BVHContext context;				// used to allocate the records.
+	RayRecord* ray = 0;				// ray records.
+	HitRecord* hit = 0;				// hit records, or 0 if no hits were recorded.
+	uint32_t count = 0;				// number of rays in the batch.
+	uint32_t capacity = 0;			// number of allocated records.
+	bool occlusion = false;			// occlusion rays; saved as the OCCLUSION flag.
+};
+
+class BVH;
 class BVHBase
 {
 public:
@@ -725,6 +1092,16 @@ public:
 		LAYOUT_CWBVH,
 		LAYOUT_BVH8_AVX2
 	};
+	enum NodeOrder : uint32_t
+	{
+		// Node layouts for ::Reorder. ORDER_DFS: depth-first, children in builder order.
+		// ORDER_DFS_SAH: depth-first, child with the largest surface area first.
+		// ORDER_TREELETS: small subtrees stored breadth-first ('treelets', similar to a
+		// van Emde Boas layout), treelets in ORDER_DFS_SAH order.
+		ORDER_DFS = 0,
+		ORDER_DFS_SAH,
+		ORDER_TREELETS
+	};
 	struct ALIGNED( 32 ) Fragment
 	{
 		// A fragment stores the bounds of an input primitive. The name 'Fragment' is from
@@ -742,6 +1119,7 @@ public:
 	bool may_have_holes = false;	// threaded builds and MergeLeafs produce BVHs with unused nodes.
 	bool bvh_over_aabbs = false;	// a BVH over AABBs is useful for e.g. TLAS traversal.
 	bool bvh_over_indices = false;	// a BVH over indices cannot translate primitive index to vertex index.
+	bool bvh_over_quads = false;	// primitives are quads: four vertices (or indices) per primitive.
 	BVHContext context;				// context used to provide user-defined allocation functions.
 	BVHType layout = UNDEFINED;		// BVH layout identifier.
 	// Keep track of allocated buffer size to avoid repeated allocation during layout conversion.
@@ -755,15 +1133,33 @@ public:
 	uint32_t hqbvhbins = HQBVHBINS;	// number of bins to use in SBVH construction.
 	bool hqbvhoddeven = false;		// if true, odd levels will use one extra bin during construction.
 	bvhvec3 aabbMin, aabbMax;		// bounds of the root node of the BVH.
+	const void* mappedData[TINY_BVH_FILE_SECTIONS] = {}; // section data owned by a BVHMappedFile;
+									// AlignedFree skips these pointers, and then forgets them.
 	// Custom memory allocation
 	void* AlignedAlloc( size_t size );
 	void AlignedFree( void* ptr );
 	// Common methods
 	void CopyBasePropertiesFrom( const BVHBase& original );	// copy flags from one BVH to another
+	// Section of a BVH file in memory, see BVHFileSection.
+	struct FileSection { uint32_t type; void* data; uint64_t size; };
 protected:
 	~BVHBase() {}
+	// Serialization helpers, shared by the Save / Load methods of all layouts.
+	BVHFileHeader FileHeader() const;
+	void ApplyFileHeader( const BVHFileHeader& header );
+	uint32_t FileFlags() const;
+	void ApplyFileFlags( const uint32_t flags );
+	bool WriteFile( const char* fileName, BVHFileHeader& header, const FileSection* section, const uint32_t count ) const;
+	bool ReadFile( const char* fileName, const BVHMappedFile* file, BVHFileHeader& header, FileSection* section, const uint32_t count );
+	void DiscardSections( const BVHMappedFile* file, FileSection* section, const uint32_t count );
+	void SetMappedFile( const BVHMappedFile* file, const FileSection* section = 0, const uint32_t count = 0 );
+	static bool FileMatchesGeometry( const BVHFileHeader& header, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	bool LoadLayoutFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices,
+		const uint32_t primCount, const size_t nodeSize, BVH& bvh, bool& ownBVH, void*& nodes );
 	__FORCEINLINE void IntersectTri( Ray& ray, const uint32_t idx, const bvhvec4slice& verts, const uint32_t i0, const uint32_t i1, const uint32_t i2 ) const;
 	__FORCEINLINE bool TriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t i0, const uint32_t i1, const uint32_t i2 ) const;
+	__FORCEINLINE void IntersectQuad( Ray& ray, const uint32_t idx, const bvhvec4slice& verts, const uint32_t i0, const uint32_t i1, const uint32_t i2, const uint32_t i3 ) const;
+	__FORCEINLINE bool QuadOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t i0, const uint32_t i1, const uint32_t i2, const uint32_t i3 ) const;
 	static void PrecomputeTriangle( const bvhvec4slice& vert, const uint32_t ti0, const uint32_t ti1, const uint32_t ti2, float* T );
 	static float SA( const bvhvec3& aabbMin, const bvhvec3& aabbMax );
 };
@@ -779,6 +1175,7 @@ public:
 	friend class BVH8_CPU;
 	friend class BVH8_CWBVH;
 	template <int M> friend class MBVH;
+	friend class BVHScene;
 	struct SubdivTask { uint32_t node, sliceStart, sliceEnd, depth; };
 	enum BuildFlags : uint32_t
 	{
@@ -804,14 +1201,20 @@ public:
 	void SplitLeafs( const uint32_t maxPrims );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
 	float EPOCost( const uint32_t nodeIdx = 0 ) const;
+	BVHQuality Analyze( const bool epo = true ) const;
 	int32_t NodeCount() const;
 	int32_t LeafCount() const;
 	int32_t PrimCount( const uint32_t nodeIdx = 0 ) const;
 	void Compact();
-	void Save( const char* fileName );
+	void Reorder( const NodeOrder order = ORDER_DFS_SAH, const uint32_t treeletDepth = 3 );
+	void CloneFrom( const BVH& original );
+	bool Save( const char* fileName );
 	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount );
 	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	bool Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void BuildQuick( const bvhvec4* vertices, const uint32_t primCount );
 	void BuildQuick( const bvhvec4slice& vertices );
 	void Build( const bvhvec4* vertices, const uint32_t primCount );
@@ -820,6 +1223,11 @@ public:
 	void Build( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t blasCount );
 	void Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount );
+	template <class P> void Build( const uint32_t primCount );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t primCount );
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
@@ -828,6 +1236,20 @@ public:
 	void BuildAVX( const bvhvec4slice& vertices );
 	void BuildAVX( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildAVX( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildLazy( const bvhvec4* vertices, const uint32_t primCount, const uint32_t pendingPrims = 1024 );
+	void BuildLazy( const bvhvec4slice& vertices, const uint32_t pendingPrims = 1024 );
+	void BuildLazy( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount, const uint32_t pendingPrims = 1024 );
+	uint32_t ExpandLazy( const uint32_t nodeIdx );
+	void FinishLazy();
+	int32_t IntersectLazy( Ray& ray );
+	bool IsOccludedLazy( const Ray& ray );
+	int32_t IntersectAndSample( Ray& ray );
+	float SampleRays( const Ray* rays, const uint32_t rayCount );
+	void ResetRayStats();
+	void BuildRDH( const float rayWeight = 0.5f );
+	float OptimizeRDH( const Ray* rays, const uint32_t rayCount, const uint32_t iterations = 4, const float rayWeight = 0.5f );
+	void TraceHeatmap( const Ray* rays, const uint32_t rayCount, float* rayNodes, float* rayPrims, float* nodeHeat = 0, uint32_t* primHeat = 0 ) const;
+	void SubtreeHeat( float* nodeHeat );
 #ifdef BVH_USENEON
 	void BuildNEON( const bvhvec4* vertices, const uint32_t primCount );
 	void BuildNEON( const bvhvec4slice& vertices );
@@ -846,31 +1268,59 @@ public:
 #endif
 	bool IntersectSphere( const bvhvec3& pos, const float r ) const;
 	bool IsOccluded( const Ray& ray ) const;
+	template <class P> int32_t Intersect( Ray& ray ) const;
+	template <class P> bool IsOccluded( const Ray& ray ) const;
+	template <class B> int32_t IntersectTLAS( Ray& ray ) const; // B: BLAS layout, for uniform scenes
+	template <class B> bool IsOccludedTLAS( const Ray& ray ) const;
 	void Intersect256Rays( Ray* first ) const;
 	void Intersect256RaysSSE( Ray* packet ) const; // requires BVH_USEAVX
 	// private:
 	void PrepareBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void PrepareQuadBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount );
+	void PrepareCustomBuild( const uint32_t primCount );
+	void FinalizeCustomBuild();
 	void Build();
+	uint32_t Subdivide( uint32_t nodeIdx, uint32_t& nodePtr, const uint32_t stopPrims, const float* weight = 0 );
+	uint32_t SubdivideParallel( const bool avx );
 	void BuildFullSweep();
 	bool IsOccludedTLAS( const Ray& ray ) const;
 	int32_t IntersectTLAS( Ray& ray ) const;
 	void PrepareAVXBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildAVX();
+	uint32_t SubdivideAVX( uint32_t nodeIdx, uint32_t& nodePtr, const uint32_t stopPrims );
 	void PrepareHQBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims );
 	void BuildHQ();
-	void BuildHQTask(
+	uint32_t BuildHQTask(
 		uint32_t nodeIdx, const uint32_t bins, uint32_t depth, const uint32_t maxDepth,
 		uint32_t sliceStart, uint32_t sliceEnd, const bvhvec3& minDim, const float rootArea,
-		uint32_t* triIdxB, uint32_t& nextFrag, uint32_t& taskCount,
-		SubdivTask* task
+		uint32_t* triIdxB, uint32_t& nodePtr, uint32_t& nextFrag, uint32_t& taskCount,
+		SubdivTask* task, const uint32_t maxTasks
 	);
 	bool ClipFrag( const Fragment& orig, Fragment& newFrag, bvhvec3 bmin, bvhvec3 bmax, bvhvec3 minDim, const uint32_t splitAxis ) const;
 	void SplitFrag( const Fragment& orig, Fragment& left, Fragment& right, const bvhvec3& minDim, const uint32_t splitAxis, const float splitPos, bool& leftOK, bool& rightOK ) const;
 protected:
-	template <bool posX, bool posY, bool posZ> int32_t Intersect( Ray& ray ) const;
-	template <bool posX, bool posY, bool posZ> int32_t IntersectTLAS( Ray& ray ) const;
-	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
-	template <bool posX, bool posY, bool posZ> bool IsOccludedTLAS( const Ray& ray ) const;
+	// Visitor for the traversal kernels: Interior and Leaf are called for each visited
+	// node, in traversal order. IntersectAndSample and TraceHeatmap use it to count.
+	// Expand may replace a leaf by the root of a subtree before it is visited; the
+	// lazy traversal uses it to refine pending nodes.
+	struct NoVisit
+	{
+		void Interior( const uint32_t ) {}
+		void Leaf( const uint32_t, const BVHNode& ) {}
+		uint32_t Expand( const uint32_t nodeIdx ) { return nodeIdx; }
+	};
+	struct LazyVisit : NoVisit { BVH* bvh; uint32_t Expand( const uint32_t nodeIdx ) { return bvh->ExpandLazy( nodeIdx ); } };
+	template <class V> int32_t IntersectVisit( Ray& ray, V& visit ) const;
+	template <bool posX, bool posY, bool posZ, class V> int32_t Intersect( Ray& ray, V& visit ) const;
+	template <class B, bool posX, bool posY, bool posZ> int32_t IntersectTLAS( Ray& ray ) const;
+	template <class V> bool IsOccludedVisit( const Ray& ray, V& visit ) const;
+	template <bool posX, bool posY, bool posZ, class V> bool IsOccluded( const Ray& ray, V& visit ) const;
+	template <class B, bool posX, bool posY, bool posZ> bool IsOccludedTLAS( const Ray& ray ) const;
+	template <class P, bool posX, bool posY, bool posZ> int32_t IntersectPolicy( Ray& ray ) const;
+	template <class P, bool posX, bool posY, bool posZ> bool IsOccludedPolicy( const Ray& ray ) const;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void ReserveNodes( const uint32_t capacity );
 	void BuildDefault( const bvhvec4* vertices, const uint32_t primCount );
 	void BuildDefault( const bvhvec4slice& vertices );
 	void BuildDefault( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
@@ -887,11 +1337,14 @@ public:
 	bool isBLAS() const { return instList == 0; }
 	bool isIndexed() const { return vertIdx != 0; }
 	bool hasCustomGeom() const { return customIntersect != 0; }
+	bool hasQuads() const { return bvh_over_quads; }
 	// Basic BVH data
-	bvhvec4slice verts = {};		// pointer to input primitive array: 3x16 bytes per tri.
+	bvhvec4slice verts = {};		// pointer to input primitive array: 3x16 bytes per tri, 4x16 per quad.
 	uint32_t* vertIdx = 0;			// vertex indices, only used in case the BVH is built over indexed prims.
 	uint32_t* primIdx = 0;			// primitive index array.
 	uint32_t* rrsHits = 0;			// for RDH: ray hit count per triangle.
+	uint32_t* rrsVisits = 0;		// for RDH: ray visit count per node.
+	uint32_t rrsRays = 0;			// for RDH: number of rays in rrsHits / rrsVisits.
 	BLASInstance* instList = 0;		// instance array, for top-level acceleration structure.
 	BVHBase** blasList = 0;			// blas array, for TLAS traversal.
 	uint32_t blasCount = 0;			// number of blasses in blasList.
@@ -899,11 +1352,155 @@ public:
 	uint32_t newNodePtr = 0;		// used during build to keep track of next free node in pool.
 	Fragment* fragment = 0;			// input primitive bounding boxes.
 	bool useFullSweep = false;		// for experiments only; full-sweep SAH builder.
+	uint32_t lazyNodes = 0;			// BuildLazy: size of the eagerly built top; its leaves are pending.
+	std::atomic<uint32_t>* lazyState = 0; // BuildLazy: per top node, LAZY_PENDING / _BUSY / _DONE.
+	enum { LAZY_PENDING = 0, LAZY_BUSY, LAZY_DONE };
 	// Custom geometry intersection callback
 	bool (*customIntersect)(Ray&, const unsigned) = 0;
 	bool (*customIsOccluded)(const Ray&, const unsigned) = 0;
 };
 
+// code compaction: ray/AABB test for two sibling nodes, used by BVH traversal.
+#define SLAB_TEST_TWO_NODES \
+	float tx1a = (posX ? child1->aabbMin.x : child1->aabbMax.x) * ray.rD.x - rox; /* expect fma. */ \
+	float ty1a = (posY ? child1->aabbMin.y : child1->aabbMax.y) * ray.rD.y - roy; \
+	float tz1a = (posZ ? child1->aabbMin.z : child1->aabbMax.z) * ray.rD.z - roz; \
+	float tx1b = (posX ? child2->aabbMin.x : child2->aabbMax.x) * ray.rD.x - rox; \
+	float ty1b = (posY ? child2->aabbMin.y : child2->aabbMax.y) * ray.rD.y - roy; \
+	float tz1b = (posZ ? child2->aabbMin.z : child2->aabbMax.z) * ray.rD.z - roz; \
+	float tx2a = (posX ? child1->aabbMax.x : child1->aabbMin.x) * ray.rD.x - rox; \
+	float ty2a = (posY ? child1->aabbMax.y : child1->aabbMin.y) * ray.rD.y - roy; \
+	float tz2a = (posZ ? child1->aabbMax.z : child1->aabbMin.z) * ray.rD.z - roz; \
+	float tx2b = (posX ? child2->aabbMax.x : child2->aabbMin.x) * ray.rD.x - rox; \
+	float ty2b = (posY ? child2->aabbMax.y : child2->aabbMin.y) * ray.rD.y - roy; \
+	float tz2b = (posZ ? child2->aabbMax.z : child2->aabbMin.z) * ray.rD.z - roz; \
+	float tmina = tinybvh_max( tinybvh_max( tx1a, ty1a ), tinybvh_max( tz1a, 0.0f ) ); \
+	float tminb = tinybvh_max( tinybvh_max( tx1b, ty1b ), tinybvh_max( tz1b, 0.0f ) ); \
+	float tmaxa = tinybvh_min( tinybvh_min( tx2a, ty2a ), tinybvh_min( tz2a, ray.hit.t ) ); \
+	float tmaxb = tinybvh_min( tinybvh_min( tx2b, ty2b ), tinybvh_min( tz2b, ray.hit.t ) ); \
+	if (tmaxa >= tmina) dist1 = tmina; \
+	if (tmaxb >= tminb) dist2 = tminb;
+
+// BVH with compile-time custom primitives. The primitive policy P is a type with
+// static member functions:
+//   static void GetAABB( const unsigned primIdx, bvhvec3& bmin, bvhvec3& bmax );
+//   static bool Intersect( Ray& ray, const unsigned primIdx );
+//   static bool IsOccluded( const Ray& ray, const unsigned primIdx );
+// Build<P>, Intersect<P> and IsOccluded<P> call these directly, which allows the
+// compiler to inline them in the build and traversal loops. The callbacks are also
+// stored in customIntersect / customIsOccluded, so the BVH can be used as a BLAS.
+template <class P> void BVH::Build( const uint32_t primCount )
+{
+	PrepareCustomBuild( primCount );
+	for (uint32_t i = 0; i < primCount; i++) P::GetAABB( i, fragment[i].bmin, fragment[i].bmax );
+	customIntersect = P::Intersect, customIsOccluded = P::IsOccluded;
+	FinalizeCustomBuild();
+}
+
+template <class P> int32_t BVH::Intersect( Ray& ray ) const
+{
+	const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+	if (!posX) goto negx;
+	if (posY) { if (posZ) return IntersectPolicy<P, true, true, true>( ray ); else return IntersectPolicy<P, true, true, false>( ray ); }
+	if (posZ) return IntersectPolicy<P, true, false, true>( ray ); else return IntersectPolicy<P, true, false, false>( ray );
+negx:
+	if (posY) { if (posZ) return IntersectPolicy<P, false, true, true>( ray ); else return IntersectPolicy<P, false, true, false>( ray ); }
+	if (posZ) return IntersectPolicy<P, false, false, true>( ray ); else return IntersectPolicy<P, false, false, false>( ray );
+}
+
+template <class P> bool BVH::IsOccluded( const Ray& ray ) const
+{
+	const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+	if (!posX) goto negx;
+	if (posY) { if (posZ) return IsOccludedPolicy<P, true, true, true>( ray ); else return IsOccludedPolicy<P, true, true, false>( ray ); }
+	if (posZ) return IsOccludedPolicy<P, true, false, true>( ray ); else return IsOccludedPolicy<P, true, false, false>( ray );
+negx:
+	if (posY) { if (posZ) return IsOccludedPolicy<P, false, true, true>( ray ); else return IsOccludedPolicy<P, false, true, false>( ray ); }
+	if (posZ) return IsOccludedPolicy<P, false, false, true>( ray ); else return IsOccludedPolicy<P, false, false, false>( ray );
+}
+
+template <class P, bool posX, bool posY, bool posZ> int32_t BVH::IntersectPolicy( Ray& ray ) const
+{
+	BVHNode* node = &bvhNode[0], * stack[64];
+	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
+	float cost = 0;
+	const float rox = ray.O.x * ray.rD.x;
+	const float roy = ray.O.y * ray.rD.y;
+	const float roz = ray.O.z * ray.rD.z;
+	while (1)
+	{
+		cost += c_trav;
+		if (node->isLeaf())
+		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
+			for (uint32_t i = 0; i < node->triCount; i++, cost += c_int) if (P::Intersect( ray, primIdx[node->leftFirst + i] ))
+			{
+			#if INST_IDX_BITS == 32
+				ray.hit.inst = ray.instIdx;
+			#else
+				ray.hit.prim = (ray.hit.prim & PRIM_IDX_MASK) + ray.instIdx;
+			#endif
+			}
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		BVHNode* child1 = &bvhNode[node->leftFirst], * child2 = &bvhNode[node->leftFirst + 1];
+		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
+		SLAB_TEST_TWO_NODES;
+		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
+		if (dist1 == BVH_FAR /* missed both child nodes */)
+		{
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+		}
+		else /* hit at least one node */
+		{
+			node = child1; /* continue with the nearest */
+			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+			BVH_STAT( stats.Stack( stackPtr ) );
+		}
+	}
+	return (int32_t)cost;
+}
+
+template <class P, bool posX, bool posY, bool posZ> bool BVH::IsOccludedPolicy( const Ray& ray ) const
+{
+	BVHNode* node = &bvhNode[0], * stack[64];
+	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
+	const float rox = ray.O.x * ray.rD.x;
+	const float roy = ray.O.y * ray.rD.y;
+	const float roz = ray.O.z * ray.rD.z;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
+			for (uint32_t i = 0; i < node->triCount; i++)
+				if (P::IsOccluded( ray, primIdx[node->leftFirst + i] )) return true;
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		BVHNode* child1 = &bvhNode[node->leftFirst], * child2 = &bvhNode[node->leftFirst + 1];
+		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
+		SLAB_TEST_TWO_NODES;
+		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
+		if (dist1 == BVH_FAR /* missed both child nodes */)
+		{
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+		}
+		else /* hit at least one node */
+		{
+			node = child1; /* continue with the nearest */
+			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+			BVH_STAT( stats.Stack( stackPtr ) );
+		}
+	}
+	return false;
+}
+
 #ifdef DOUBLE_PRECISION_SUPPORT
 
 class BLASInstanceEx;
@@ -936,6 +1533,9 @@ public:
 	void PrepareBuild( const bvhdbl3* vertices, const uint64_t primCount );
 	void Build();
 	double SAHCost( const uint64_t nodeIdx = 0 ) const;
+	bool Save( const char* fileName );
+	bool Load( const char* fileName, const bvhdbl3* vertices, const uint64_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhdbl3* vertices, const uint64_t primCount );
 	int32_t Intersect( RayEx& ray ) const;
 	bool IsOccluded( const RayEx& ray ) const;
 	bool IsOccludedTLAS( const RayEx& ray ) const;
@@ -957,6 +1557,8 @@ public:
 	// Custom geometry intersection callback
 	bool (*customIntersect)(RayEx&, uint64_t) = 0;
 	bool (*customIsOccluded)(const RayEx&, uint64_t) = 0;
+protected:
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const bvhdbl3* vertices, const uint64_t primCount );
 };
 
 #endif // DOUBLE_PRECISION_SUPPORT
@@ -969,12 +1571,16 @@ public:
 		// Alternative 64-byte BVH node layout, which specifies the bounds of
 		// the children rather than the node itself. This layout is used by
 		// Aila and Laine in their seminal GPU ray tracing paper.
+		// The otherwise unused 'firstTri' of an interior node and 'left' of a
+		// leaf store the index of the parent node, for stackless traversal.
 		bvhvec3 lmin; uint32_t left;
 		bvhvec3 lmax; uint32_t right;
 		bvhvec3 rmin; uint32_t triCount;
 		bvhvec3 rmax; uint32_t firstTri; // total: 64 bytes
 		bool isLeaf() const { return triCount > 0; }
+		uint32_t parent() const { return triCount > 0 ? left : firstTri; }
 	};
+	static constexpr uint32_t NO_PARENT = 0xffffffff; // parent index of the root node.
 	BVH_GPU( BVHContext ctx = {} ) { layout = LAYOUT_BVH_GPU; context = ctx; }
 	BVH_GPU( const BVH& original ) { /* DEPRICATED */ ConvertFrom( original ); }
 	~BVH_GPU();
@@ -989,13 +1595,27 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const { return bvh.SAHCost( nodeIdx ); }
+	BVHQuality Analyze( const bool epo = true ) const;
+	bool Save( const char* fileName );
+	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount );
+	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	bool Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void ConvertFrom( const BVH& original, bool compact = true );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const { FALLBACK_SHADOW_QUERY( ray ); }
+	// Stackless traversal: walks back up the tree using the parent indices.
+	int32_t IntersectStackless( Ray& ray ) const;
 	// BVH data
 	BVHNode* bvhNode = 0;			// BVH node in Aila & Laine format.
 	BVH bvh;						// BVH4 is created from BVH and uses its data.
 	bool ownBVH = true;				// False when ConvertFrom receives an external bvh.
+protected:
+	friend class BVHScene;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 };
 
 class BVH_SoA : public BVHBase
@@ -1022,10 +1642,14 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const { return bvh.SAHCost( nodeIdx ); }
-	void Save( const char* fileName );
+	BVHQuality Analyze( const bool epo = true ) const;
+	bool Save( const char* fileName );
 	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount );
 	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	bool Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void ConvertFrom( const BVH& original, bool compact = true );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
@@ -1033,6 +1657,10 @@ public:
 	BVHNode* bvhNode = 0;			// BVH node in 'structure of arrays' format.
 	BVH bvh;						// BVH_SoA is created from BVH and uses its data.
 	bool ownBVH = true;				// False when ConvertFrom receives an external bvh.
+protected:
+	friend class BVHScene;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 };
 
 class BVH_Verbose : public BVHBase
@@ -1055,6 +1683,7 @@ public:
 	~BVH_Verbose() { AlignedFree( bvhNode ); }
 	void ConvertFrom( const BVH& original, bool compact = true );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
+	BVHQuality Analyze( const bool epo = true ) const;
 	int32_t NodeCount() const;
 	int32_t PrimCount( const uint32_t nodeIdx = 0 ) const;
 	void Refit( const uint32_t nodeIdx = 0, bool skipLeafs = false );
@@ -1102,15 +1731,29 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount );
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
 	void Refit( const uint32_t nodeIdx = 0 );
 	uint32_t LeafCount( const uint32_t nodeIdx = 0 ) const;
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
+	BVHQuality Analyze( const bool epo = true ) const;
+	bool Save( const char* fileName );
+	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount );
+	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	bool Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	bool Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void ConvertFrom( const BVH& original, bool compact = true );
 	// BVH data
 	MBVHNode* mbvhNode = 0;			// BVH node for M-wide BVH.
 	BVH bvh;						// MBVH<M> is created from BVH and uses its data.
 	bool ownBVH = true;				// False when ConvertFrom receives an external bvh.
+protected:
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 };
 
 class BVH4_GPU : public BVHBase
@@ -1149,6 +1792,10 @@ public:
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
 	void ConvertFrom( const MBVH<4>& original, bool compact = true );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const { return bvh4.SAHCost( nodeIdx ); }
+	BVHQuality Analyze( const bool epo = true ) const;
+	bool Save( const char* fileName );
+	bool Load( const char* fileName, const uint32_t expectedTris );
+	bool Load( const BVHMappedFile& file, const uint32_t expectedTris );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const { FALLBACK_SHADOW_QUERY( ray ); }
 	// BVH data
@@ -1157,12 +1804,16 @@ public:
 	uint32_t usedBlocks = 0;		// actually used storage.
 	MBVH<4> bvh4;					// BVH4_GPU is created from BVH4 and uses its data.
 	bool ownBVH4 = true;			// False when ConvertFrom receives an external bvh.
+protected:
+	friend class BVHScene;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris );
 };
 
 class BVH4_CPU : public BVHBase
 {
 public:
-	enum { EMPTY_BIT = 1 << 31, LEAF_BIT = 1 << 30 };
+	enum { EMPTY_BIT = 1 << 31, LEAF_BIT = 1 << 30, CUSTOM_BIT = 1 << 29 };
 	struct BVHNode
 	{
 		// 4-way BVH node, optimized for CPU rendering.
@@ -1175,8 +1826,9 @@ public:
 	struct CacheLine { SIMDVEC4 a, b, c, d; };
 	BVH4_CPU( BVHContext ctx = {} ) { layout = LAYOUT_BVH4_CPU; context = ctx; c_int = 2; l_quads = true; }
 	~BVH4_CPU();
-	void Save( const char* fileName );
+	bool Save( const char* fileName );
 	bool Load( const char* fileName, const uint32_t expectedTris );
+	bool Load( const BVHMappedFile& file, const uint32_t expectedTris );
 	void Build( const bvhvec4* vertices, const uint32_t primCount );
 	void Build( const bvhvec4slice& vertices );
 	void Build( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims );
@@ -1185,10 +1837,18 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims );
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount );
+	void Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount );
 	void Optimize( const uint32_t iterations, bool extreme );
 	void Refit();
 	float SAHCost( const uint32_t nodeIdx ) const;
+	BVHQuality Analyze( const bool epo = true ) const;
 	void ConvertFrom( MBVH<4>& original );
+	void CloneFrom( const BVH4_CPU& original );
+	void Reorder( const NodeOrder order = ORDER_DFS_SAH, const uint32_t treeletDepth = 3 );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
 	// Intersect / IsOccluded specialize for ray octant using templated functions.
@@ -1200,6 +1860,17 @@ public:
 	bool ownBVH4 = true;			// false when ConvertFrom receives an external bvh4.
 	uint32_t allocatedBlocks = 0;	// node data and triangles are stored in 16-byte blocks.
 	uint32_t usedBlocks = 0;		// the amount of data actually used.
+	// Custom geometry intersection callbacks. The batched versions receive all
+	// primitives of a leaf; if these are not set, the per-primitive ones are used.
+	// One of each pair must be set before building over custom primitives.
+	bool (*customIntersect)(Ray&, const unsigned) = 0;
+	bool (*customIsOccluded)(const Ray&, const unsigned) = 0;
+	bool (*customIntersect4)(Ray&, const uint32_t* primIdx, const uint32_t count) = 0;
+	bool (*customIsOccluded4)(const Ray&, const uint32_t* primIdx, const uint32_t count) = 0;
+protected:
+	friend class BVHScene;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris );
 };
 
 class BVH8_CWBVH : public BVHBase
@@ -1208,8 +1879,12 @@ public:
 	BVH8_CWBVH( BVHContext ctx = {} ) { layout = LAYOUT_CWBVH; context = ctx; }
 	BVH8_CWBVH( MBVH<8>& bvh8 ) { /* DEPRECATED */ layout = LAYOUT_CWBVH; ConvertFrom( bvh8 ); }
 	~BVH8_CWBVH();
-	void Save( const char* fileName );
+	bool Save( const char* fileName );
 	bool Load( const char* fileName, const uint32_t expectedTris );
+	bool Load( const BVHMappedFile& file, const uint32_t expectedTris );
+	bool SaveCompressed( const char* fileName );
+	bool LoadCompressed( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
+	bool LoadCompressed( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void Build( const bvhvec4* vertices, const uint32_t primCount );
 	void Build( const bvhvec4slice& vertices );
 	void Build( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
@@ -1220,9 +1895,13 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
 	void ConvertFrom( MBVH<8>& original, bool compact = true );
+	void CloneFrom( const BVH8_CWBVH& original );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
+	BVHQuality Analyze( const bool epo = true ) const;
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const { FALLBACK_SHADOW_QUERY( ray ); }
+	// Traversal with a CWBVH_SHORT_STACK-entry stack, falling back to Intersect.
+	int32_t IntersectShortStack( Ray& ray ) const;
 	// BVH8 data
 	bvhvec4* bvh8Data = 0;			// nodes in CWBVH format.
 	bvhvec4* bvh8Tris = 0;			// triangle data for CWBVH nodes.
@@ -1230,6 +1909,11 @@ public:
 	uint32_t usedBlocks = 0;		// actually used blocks.
 	MBVH<8> bvh8;					// BVH8_CWBVH is created from BVH8 and uses its data.
 	bool ownBVH8 = true;			// false when ConvertFrom receives an external bvh8.
+protected:
+	friend class BVHScene;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris );
+	bool LoadCompressedFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 };
 
 // Storage for up to four triangles, in SoA layout, for BVH8_CPU.
@@ -1248,6 +1932,34 @@ struct BVHTri4Leaf
 	}
 };
 
+// Storage for up to four quads, in SoA layout, for BVH4_CPU and BVH8_CPU.
+// Quad (v0,v1,v2,v3) is tested as triangles (v0,v1,v3) and (v2,v3,v1).
+struct BVHQuad4Leaf
+{
+	SIMDVEC4 v0x4, v0y4, v0z4;
+	SIMDVEC4 e1x4, e1y4, e1z4;	// v1 - v0
+	SIMDVEC4 e3x4, e3y4, e3z4;	// v3 - v0
+	SIMDVEC4 v2x4, v2y4, v2z4;
+	uint32_t primIdx[4];		// total: 208 bytes.
+	SIMDVEC4 dummy0, dummy1, dummy2; // pad to 4 full cachelines.
+	inline void SetData( const bvhvec3& v0, const bvhvec3& v1, const bvhvec3& v2, const bvhvec3& v3, const uint32_t pidx, const uint32_t slot )
+	{
+		const bvhvec3 e1 = v1 - v0, e3 = v3 - v0;
+		((float*)&v0x4)[slot] = v0.x, ((float*)&v0y4)[slot] = v0.y, ((float*)&v0z4)[slot] = v0.z;
+		((float*)&e1x4)[slot] = e1.x, ((float*)&e1y4)[slot] = e1.y, ((float*)&e1z4)[slot] = e1.z;
+		((float*)&e3x4)[slot] = e3.x, ((float*)&e3y4)[slot] = e3.y, ((float*)&e3z4)[slot] = e3.z;
+		((float*)&v2x4)[slot] = v2.x, ((float*)&v2y4)[slot] = v2.y, ((float*)&v2z4)[slot] = v2.z, primIdx[slot] = pidx;
+	}
+};
+
+// Storage for up to four custom primitives, for BVH4_CPU and BVH8_CPU.
+struct BVHCustom4Leaf
+{
+	uint32_t primIdx[4];
+	uint32_t primCount;
+	uint32_t dummy[11];			// pad to a full cacheline.
+};
+
 // Storage for a single triangle, for BVH8_CPU.
 struct BVHTri1Leaf
 {
@@ -1258,7 +1970,7 @@ struct BVHTri1Leaf
 class BVH8_CPU : public BVHBase
 {
 public:
-	enum { EMPTY_BIT = 1 << 31, LEAF_BIT = 1 << 30 };
+	enum { EMPTY_BIT = 1 << 31, LEAF_BIT = 1 << 30, CUSTOM_BIT = 1 << 29 };
 	struct BVHNode
 	{
 		// 8-way BVH node, optimized for CPU rendering.
@@ -1281,8 +1993,12 @@ public:
 	struct CacheLine { SIMDVEC8 a, b; };
 	BVH8_CPU( BVHContext ctx = {} ) { layout = LAYOUT_BVH8_AVX2; context = ctx; c_int = 2; l_quads = true; }
 	~BVH8_CPU();
-	void Save( const char* fileName );
+	bool Save( const char* fileName );
 	bool Load( const char* fileName, const uint32_t expectedTris );
+	bool Load( const BVHMappedFile& file, const uint32_t expectedTris );
+	bool SaveCompressed( const char* fileName );
+	bool LoadCompressed( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
+	bool LoadCompressed( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void Build( const bvhvec4* vertices, const uint32_t primCount );
 	void Build( const bvhvec4slice& vertices );
 	void Build( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims );
@@ -1291,21 +2007,41 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims );
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices );
+	void BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount );
+	void BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount );
+	void Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount );
 	void Optimize( const uint32_t iterations, bool extreme );
 	void Refit();
 	float SAHCost( const uint32_t nodeIdx ) const;
+	BVHQuality Analyze( const bool epo = true ) const;
 	void ConvertFrom( MBVH<8>& original );
+	void CloneFrom( const BVH8_CPU& original );
+	void Reorder( const NodeOrder order = ORDER_DFS_SAH, const uint32_t treeletDepth = 3 );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
 	// Intersect / IsOccluded specialize for ray octant using templated functions.
 	template <bool posX, bool posY, bool posZ> int32_t Intersect( Ray& ray ) const;
 	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
+	// Intersect a batch of incoherent rays, interleaving TRAVERSAL_INTERLEAVE traversals.
+	void IntersectInterleaved( Ray* rays, const uint32_t count ) const;
 	// BVH8 data
 	CacheLine* bvh8Data = 0;		// Interleaved interior (256b) and leaf (192b) data.
 	MBVH<8> bvh8;					// BVH8_CPU is created from BVH8 and uses its data.
 	bool ownBVH8 = true;			// false when ConvertFrom receives an external bvh8.
 	uint32_t allocatedBlocks = 0;	// node data and triangles are stored in 16-byte blocks.
 	uint32_t usedBlocks = 0;		// the amount of data actually used.
+	// Custom geometry intersection callbacks, see BVH4_CPU.
+	bool (*customIntersect)(Ray&, const unsigned) = 0;
+	bool (*customIsOccluded)(const Ray&, const unsigned) = 0;
+	bool (*customIntersect4)(Ray&, const uint32_t* primIdx, const uint32_t count) = 0;
+	bool (*customIsOccluded4)(const Ray&, const uint32_t* primIdx, const uint32_t count) = 0;
+protected:
+	friend class BVHScene;
+	uint32_t FileSections( BVHFileHeader& header, FileSection* section ) const;
+	bool LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris );
+	bool LoadCompressedFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 };
 
 // BLASInstance: A TLAS is built over BLAS instances, where a single BLAS can be
@@ -1327,6 +2063,122 @@ public:
 	void InvertTransform();
 };
 
+// BVHScene: A TLAS, its instances and all referenced BLASses, stored together in
+// a single file. Each BLAS is embedded as a complete BVH file in its own layout;
+// BLAS pointers become indices on save and are relinked on load. Loading is
+// zero-copy: TLAS and BLAS nodes are used in the mapped file, so BLAS data is
+// paged in only when a BLAS is actually traversed. BLASses must use a layout
+// that TLAS traversal supports: BVH, BVH_SoA, BVH4_CPU or BVH8_CPU.
+struct BLASGeometry
+{
+	// Vertex data for a BLAS that does not store it (BVH, BVH_SoA).
+	bvhvec4slice vertices = {};
+	const uint32_t* indices = 0;
+	uint32_t primCount = 0;
+};
+class BVHScene
+{
+public:
+	BVHScene( BVHContext ctx = {} ) { context = ctx; tlas.context = ctx; }
+	BVHScene( const BVHScene& ) = delete;
+	BVHScene& operator=( const BVHScene& ) = delete;
+	~BVHScene() { Clear(); }
+	static bool Save( const char* fileName, const BVH& tlas );
+	bool Load( const char* fileName, const BLASGeometry* geometry = 0 );
+	void Clear();
+	// Scene data, available after Load.
+	BVH tlas;						// TLAS, with instList and blasList linked to the data below.
+	BLASInstance* instances = 0;	// instance array; a copy, so it can be animated.
+	uint32_t instCount = 0;
+	BVHBase** blasList = 0;			// BLASses, in the layout they were saved in.
+	uint32_t blasCount = 0;
+	BVHContext context;
+private:
+	static uint32_t BLASSections( const BVHBase* blas, BVHFileHeader& header, BVHBase::FileSection* section );
+	static void DeleteBLAS( BVHBase* blas );
+	BVHMappedFile file;				// scene file; TLAS and BLAS data live here.
+};
+
+// BVHBuildCache: Content-addressed on-disk cache for BVH builds. A build is
+// identified by a hash over geometry, layout, builder and BVH settings; the
+// result is stored as a regular BVH file in the cache directory, which must
+// exist. A second, independent hash of the geometry is stored in the file and
+// checked before a cached result is used. An index file in the same directory
+// tracks sizes and use order, so the cache can be kept below a size limit by
+// evicting the least recently used files. The cache is not safe for concurrent
+// use by multiple processes.
+class BVHBuildCache
+{
+public:
+	enum Builder : uint32_t { BUILD = 1, BUILD_HQ, BUILD_QUADS }; // BUILD_QUADS: BVH, MBVH, BVH4_CPU and BVH8_CPU.
+	BVHBuildCache( const char* directory, const uint64_t maxBytes = 1ull << 32 );
+	BVHBuildCache( const BVHBuildCache& ) = delete;
+	BVHBuildCache& operator=( const BVHBuildCache& ) = delete;
+	~BVHBuildCache() { if (indexDirty) WriteIndex(); free64( entry ); }
+	// Build, and optionally optimize, a BVH, or load the result of an identical
+	// earlier build. Returns true on a cache hit. Settings such as c_int, c_trav
+	// and hqbvhbins must be set on bvh before calling this.
+	template <class B> bool Build( B& bvh, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0,
+		const Builder builder = BUILD, const uint32_t optimizeIterations = 0 );
+	uint64_t Key( const BVHBase& bvh, const Builder builder, const uint32_t optimizeIterations,
+		const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount ) const;
+	void Clear();					// removes all cached files.
+	uint64_t maxBytes;				// size limit for the cached files together.
+	uint64_t usedBytes = 0;			// current size of the cached files.
+	uint32_t hits = 0, misses = 0;	// statistics.
+private:
+	struct Entry { uint64_t key, size, lastUse; };
+	void FileName( const uint64_t key, char* fileName ) const;
+	bool Lookup( const uint64_t key );
+	void Insert( const uint64_t key );
+	void Evict();
+	void ReadIndex();
+	void WriteIndex();
+	static uint64_t GeometryHash( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t indexCount, const uint64_t seed );
+	static bool TagFile( const char* fileName, const uint64_t sourceHash );
+	static bool FileMatches( const char* fileName, const uint64_t sourceHash );
+	static void BuildQuads( BVH& bvh, const bvhvec4slice& v, const uint32_t* i, const uint32_t n ) { if (i) bvh.BuildQuads( v, i, n ); else bvh.BuildQuads( v ); }
+	template <int M> static void BuildQuads( MBVH<M>& bvh, const bvhvec4slice& v, const uint32_t* i, const uint32_t n ) { if (i) bvh.BuildQuads( v, i, n ); else bvh.BuildQuads( v ); }
+	static void BuildQuads( BVH4_CPU& bvh, const bvhvec4slice& v, const uint32_t* i, const uint32_t n ) { if (i) bvh.BuildQuads( v, i, n ); else bvh.BuildQuads( v ); }
+	static void BuildQuads( BVH8_CPU& bvh, const bvhvec4slice& v, const uint32_t* i, const uint32_t n ) { if (i) bvh.BuildQuads( v, i, n ); else bvh.BuildQuads( v ); }
+	template <class B> static void BuildQuads( B&, const bvhvec4slice&, const uint32_t*, const uint32_t ) { NoQuadBuilder(); }
+	static void NoQuadBuilder();
+	static bool LoadCached( BVH& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t ) { return bvh.Load( f, v, i, n ); }
+	static bool LoadCached( BVH_GPU& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t ) { return bvh.Load( f, v, i, n ); }
+	static bool LoadCached( BVH_SoA& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t ) { return bvh.Load( f, v, i, n ); }
+	template <int M> static bool LoadCached( MBVH<M>& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t ) { return bvh.Load( f, v, i, n ); }
+	static bool LoadCached( BVH4_CPU& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t vpp ) { return bvh.Load( f, i ? n : v.count / vpp ); }
+	static bool LoadCached( BVH8_CPU& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t vpp ) { return bvh.Load( f, i ? n : v.count / vpp ); }
+	static bool LoadCached( BVH4_GPU& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t vpp ) { return bvh.Load( f, i ? n : v.count / vpp ); }
+	static bool LoadCached( BVH8_CWBVH& bvh, const char* f, const bvhvec4slice& v, const uint32_t* i, const uint32_t n, const uint32_t vpp ) { return bvh.Load( f, i ? n : v.count / vpp ); }
+	char directory[512];
+	enum { FILE_NAME_SIZE = sizeof( directory ) + 32 }; // directory, '/', 16 hex digits, extension.
+	Entry* entry = 0;				// index of cached files.
+	uint32_t entryCount = 0, allocatedEntries = 0;
+	uint64_t useCounter = 0;		// logical clock for LRU eviction.
+	bool indexDirty = false;		// use order changed on a cache hit; written on destruction.
+};
+
+template <class B> bool BVHBuildCache::Build( B& bvh, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount,
+	const Builder builder, const uint32_t optimizeIterations )
+{
+	const uint64_t key = Key( bvh, builder, optimizeIterations, vertices, indices, primCount );
+	const uint32_t vertsPerPrim = builder == BUILD_QUADS ? 4 : 3;
+	const uint64_t sourceHash = GeometryHash( vertices, indices, indices ? primCount * vertsPerPrim : 0, 0x9e3779b97f4a7c15ull );
+	char fileName[FILE_NAME_SIZE];
+	FileName( key, fileName );
+	if (Lookup( key ) && FileMatches( fileName, sourceHash ) &&
+		LoadCached( bvh, fileName, vertices, indices, primCount, vertsPerPrim )) { hits++; return true; }
+	// cache miss: build, and store the result.
+	if (builder == BUILD_QUADS) BuildQuads( bvh, vertices, indices, primCount );
+	else if (builder == BUILD_HQ) { if (indices) bvh.BuildHQ( vertices, indices, primCount ); else bvh.BuildHQ( vertices ); }
+	else { if (indices) bvh.Build( vertices, indices, primCount ); else bvh.Build( vertices ); }
+	if (optimizeIterations > 0) bvh.Optimize( optimizeIterations, false );
+	if (bvh.Save( fileName ) && TagFile( fileName, sourceHash )) Insert( key );
+	misses++;
+	return false;
+}
+
 #ifdef DOUBLE_PRECISION_SUPPORT
 
 // BLASInstanceEx: Double-precision version of BLASInstance.
@@ -1364,6 +2216,33 @@ public:
 #include <intrin.h>			// for __lzcnt
 #endif
 #include <fstream>			// fstream
+#include <mutex>			// for JobSystem, TraversalStats::Report
+#ifndef TINYBVH_NO_THREADS
+#include <thread>			// for JobSystem
+#include <condition_variable>	// for JobSystem
+#include <deque>			// for JobSystem
+#endif
+#include <chrono>			// for BuildStats
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>		// for CreateFileMapping, MapViewOfFile
+#elif defined __unix__ || defined __APPLE__
+#define TINYBVH_USE_MMAP
+#include <sys/mman.h>		// for mmap
+#include <sys/stat.h>		// for fstat
+#include <fcntl.h>			// for open
+#include <unistd.h>			// for close
+#endif
+#if defined __linux__ && !defined __EMSCRIPTEN__ && !defined __ANDROID__
+#define TINYBVH_USE_NUMA
+#include <sched.h>			// for sched_setaffinity
+#include <sys/syscall.h>	// for SYS_mbind, SYS_getcpu
+#endif
 
 // We need quite a bit of type reinterpretation, so we'll
 // turn off the gcc warning here until the end of the file.
@@ -1384,6 +2263,11 @@ static constexpr bool customEnabled = true;
 #else
 static constexpr bool customEnabled = false;
 #endif
+#ifdef ENABLE_QUAD_GEOMETRY
+static constexpr bool quadsEnabled = true;
+#else
+static constexpr bool quadsEnabled = false;
+#endif
 
 namespace tinybvh {
 
@@ -1438,16 +2322,66 @@ loop: R = bvhvec3( tinybvh_rndfloat( s ) - 0.5f, tinybvh_rndfloat( s ) * 0.5f, t
 int32_t BVH4_CPU::Intersect( Ray& ray ) const { BVH_FATAL_ERROR( "BVH4_CPU::Intersect requires SSE. " ); }
 bool BVH4_CPU::IsOccluded( const Ray& ray ) const { BVH_FATAL_ERROR( "BVH4_CPU::IsOccluded requires SSE. " ); }
 #endif
+
+// Run func( i ) for i in [0, count) through the parallelFor of a context.
+template <class F> static void tinybvh_parallel_for( const BVHContext& context, const uint32_t count, const uint32_t grain, F func )
+{
+	context.parallelFor( count, grain, []( void* data, uint32_t first, uint32_t last )
+		{
+			for (uint32_t i = first; i < last; i++) (*(F*)data)( i );
+		}, &func, context.jobUserdata );
+}
+
+// Same, but on the calling thread unless the context enables parallel builds.
+template <class F> static void tinybvh_build_for( const BVHContext& context, const uint32_t count, const uint32_t grain, F func )
+{
+	if (context.parallelBuild) tinybvh_parallel_for( context, count, grain, func );
+	else for (uint32_t i = 0; i < count; i++) func( i );
+}
+
+// Preorder layout for the layout conversions: node n takes size( n ) slots,
+// followed by the subtrees of the children that children( n, child ) lists,
+// in that order. Fills pos (first slot, per source node) and order (reachable
+// nodes, parents first) and returns the slot count. With all positions known
+// up front, the nodes of a conversion can be emitted in parallel.
+template <class S, class C> static uint32_t tinybvh_preorder( const BVHContext& ctx, const uint32_t nodeCount,
+	uint32_t* pos, uint32_t* order, uint32_t& count, S size, C children )
+{
+	uint32_t* total = (uint32_t*)ctx.malloc( nodeCount * sizeof( uint32_t ), ctx.userdata ), child[8];
+	order[0] = 0, count = 1;
+	for (uint32_t i = 0; i < count; i++)
+		for (uint32_t c = children( order[i], child ), j = 0; j < c; j++) order[count++] = child[j];
+	// subtree sizes, bottom-up
+	for (uint32_t i = count; i-- > 0;)
+	{
+		const uint32_t n = order[i];
+		total[n] = size( n );
+		for (uint32_t c = children( n, child ), j = 0; j < c; j++) total[n] += total[child[j]];
+	}
+	// positions, top-down
+	pos[0] = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint32_t n = order[i];
+		uint32_t next = pos[n] + size( n );
+		for (uint32_t c = children( n, child ), j = 0; j < c; j++) pos[child[j]] = next, next += total[child[j]];
+	}
+	const uint32_t slots = total[0];
+	ctx.free( total, ctx.userdata );
+	return slots;
+}
 #if !defined BVH_USEAVX
 void BVH::BuildAVX( const bvhvec4*, const uint32_t ) { BVH_FATAL_ERROR( "BVH::BuildAVX requires AVX." ); }
 void BVH::BuildAVX( const bvhvec4slice& ) { BVH_FATAL_ERROR( "BVH::BuildAVX requires AVX." ); }
 void BVH::BuildAVX( const bvhvec4*, const uint32_t*, const uint32_t ) { BVH_FATAL_ERROR( "BVH::BuildAVX requires AVX." ); }
 void BVH::BuildAVX( const bvhvec4slice&, const uint32_t*, const uint32_t ) { BVH_FATAL_ERROR( "BVH::BuildAVX requires AVX." ); }
 int32_t BVH8_CWBVH::Intersect( Ray& ) const { BVH_FATAL_ERROR( "BVH8_CWBVH::Intersect requires AVX." ); }
+int32_t BVH8_CWBVH::IntersectShortStack( Ray& ) const { BVH_FATAL_ERROR( "BVH8_CWBVH::IntersectShortStack requires AVX." ); }
 #endif // BVH_USEAVX
 #if !defined BVH_USEAVX2
 int32_t BVH8_CPU::Intersect( Ray& ) const { BVH_FATAL_ERROR( "BVH8_CPU::Intersect requires AVX2 and FMA." ); }
 bool BVH8_CPU::IsOccluded( const Ray& ) const { BVH_FATAL_ERROR( "BVH8_CPU::IsOccluded requires AVX2 and FMA." ); }
+void BVH8_CPU::IntersectInterleaved( Ray*, const uint32_t ) const { BVH_FATAL_ERROR( "BVH8_CPU::IntersectInterleaved requires AVX2 and FMA." ); }
 #endif // BVH_USEAVX2
 #if !defined BVH_USEAVX && !defined BVH_USENEON
 int32_t BVH_SoA::Intersect( Ray& ) const { BVH_FATAL_ERROR( "BVH_SoA::Intersect requires AVX or NEON." ); }
@@ -1474,6 +2408,11 @@ bool BVH_SoA::IsOccluded( const Ray& ) const { BVH_FATAL_ERROR( "BVH_SoA::IsOccl
 	i0 = bvh.vertIdx[idx * 3], i1 = bvh.vertIdx[idx * 3 + 1], i2 = bvh.vertIdx[idx * 3 + 2]; \
 	else i0 = idx * 3, i1 = idx * 3 + 1, i2 = idx * 3 + 2;
 
+// code compaction: fetching quad vertices, with or without indices.
+#define GET_QUAD_INDICES_I0_I1_I2_I3( bvh, idx ) if (indexedEnabled && bvh.vertIdx != 0) \
+	i0 = bvh.vertIdx[idx * 4], i1 = bvh.vertIdx[idx * 4 + 1], i2 = bvh.vertIdx[idx * 4 + 2], i3 = bvh.vertIdx[idx * 4 + 3]; \
+	else i0 = idx * 4, i1 = idx * 4 + 1, i2 = idx * 4 + 2, i3 = idx * 4 + 3;
+
 // ray validation: throw an error if the input ray contains nans.
 #define VALIDATE_RAY(r) { float test = r.D.x + r.D.y + r.D.z + ray.hit.t + r.O.x \
 	+ r.O.y + r.O.z; BVH_FATAL_ERROR_IF( std::isnan( test ), "Input ray contains NaNs." ); }
@@ -1505,6 +2444,11 @@ void* BVHBase::AlignedAlloc( size_t size )
 
 void BVHBase::AlignedFree( void* ptr )
 {
+	if (ptr) for (int i = 0; i < TINY_BVH_FILE_SECTIONS; i++) if (mappedData[i] == ptr)
+	{
+		mappedData[i] = 0; // owned by a BVHMappedFile; no longer used by this BVH.
+		return;
+	}
 	if (context.free)
 		context.free( ptr, context.userdata );
 }
@@ -1516,6 +2460,7 @@ void BVHBase::CopyBasePropertiesFrom( const BVHBase& original )
 	this->may_have_holes = original.may_have_holes;
 	this->bvh_over_aabbs = original.bvh_over_aabbs;
 	this->bvh_over_indices = original.bvh_over_indices;
+	this->bvh_over_quads = original.bvh_over_quads;
 	this->context = original.context;
 	this->triCount = original.triCount;
 	this->idxCount = original.idxCount;
@@ -1523,70 +2468,1411 @@ void BVHBase::CopyBasePropertiesFrom( const BVHBase& original )
 	this->aabbMin = original.aabbMin, this->aabbMax = original.aabbMax;
 }
 
-// BVH implementation
+// BVH file format helpers
 // ----------------------------------------------------------------------------
 
-BVH::~BVH()
+static __FORCEINLINE uint64_t tinybvh_mix64( uint64_t h )
 {
-	AlignedFree( bvhNode );
-	AlignedFree( primIdx );
-	AlignedFree( fragment );
+	// murmur3 finaliser: every input bit affects every output bit.
+	h ^= h >> 33, h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33, h *= 0xc4ceb9fe1a85ec53ull;
+	return h ^ (h >> 33);
 }
 
-void BVH::Save( const char* fileName )
+static uint64_t tinybvh_hash( const void* data, const uint64_t size, uint64_t hash )
 {
-	// saving is easy, it's the loadingn that will be complex.
-	std::fstream s{ fileName, s.binary | s.out };
-	uint32_t header = TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16) + (layout << 24);
-	s.write( (char*)&header, sizeof( uint32_t ) );
-	s.write( (char*)&triCount, sizeof( uint32_t ) );
-	s.write( (char*)this, sizeof( BVH ) );
-	s.write( (char*)bvhNode, usedNodes * sizeof( BVHNode ) );
-	s.write( (char*)primIdx, idxCount * sizeof( uint32_t ) );
+	// content hash for cache keys. Unlike the word-wise FNV checksum below,
+	// differences in high bits can't cancel out between words.
+	const uint8_t* bytes = (const uint8_t*)data;
+	const uint64_t words = size >> 3;
+	for (uint64_t i = 0; i < words; i++)
+	{
+		uint64_t w;
+		memcpy( &w, bytes + i * 8, 8 );
+		hash = tinybvh_mix64( hash ^ w ) + 0x9e3779b97f4a7c15ull;
+	}
+	uint64_t tail = 0;
+	if (size & 7) memcpy( &tail, bytes + words * 8, size & 7 );
+	return tinybvh_mix64( hash ^ tail ^ (size << 56) );
 }
 
-bool BVH::Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount )
+static uint64_t tinybvh_checksum( const void* data, const uint64_t size, uint64_t hash = 14695981039346656037ull )
 {
-	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+	// FNV-1a, applied to 64-bit words for speed; trailing bytes are hashed individually.
+	const uint8_t* bytes = (const uint8_t*)data;
+	const uint64_t words = size >> 3;
+	for (uint64_t i = 0; i < words; i++)
+	{
+		uint64_t w;
+		memcpy( &w, bytes + i * 8, 8 );
+		hash = (hash ^ w) * 1099511628211ull;
+	}
+	for (uint64_t i = words * 8; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
 }
 
-bool BVH::Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+static uint64_t tinybvh_header_checksum( const BVHFileHeader& header, const BVHFileSection* table )
 {
-	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+	BVHFileHeader tmp = header;
+	tmp.headerChecksum = 0;
+	const uint64_t hash = tinybvh_checksum( &tmp, sizeof( BVHFileHeader ) );
+	return tinybvh_checksum( table, header.sectionCount * sizeof( BVHFileSection ), hash );
 }
 
-bool BVH::Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+static bool tinybvh_valid_sections( const BVHFileHeader& header, const BVHFileSection* table, const uint64_t fileSize )
+{
+	// a corrupt or truncated file must not lead to out-of-bounds access.
+	if (header.sectionCount > TINY_BVH_FILE_SECTIONS) return false;
+	if (tinybvh_header_checksum( header, table ) != header.headerChecksum) return false;
+	for (uint32_t i = 0; i < header.sectionCount; i++)
+		if ((table[i].offset & 63) || table[i].offset > fileSize || table[i].size > fileSize - table[i].offset) return false;
+	return true;
+}
+
+bool BVHMappedFile::Open( const char* fileName )
+{
+	Close();
+#if defined _WIN32
+	HANDLE f = CreateFileA( fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+	if (f == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx( f, &fileSize ) && fileSize.QuadPart > 0)
+	{
+		HANDLE m = CreateFileMappingA( f, 0, PAGE_READONLY, 0, 0, 0 );
+		void* view = m ? MapViewOfFile( m, FILE_MAP_READ, 0, 0, 0 ) : 0;
+		if (view) data = (const uint8_t*)view, size = (uint64_t)fileSize.QuadPart, mapping = m, mapped = true;
+		else if (m) CloseHandle( m );
+	}
+	CloseHandle( f ); // the mapping keeps the file open.
+	if (mapped) return true;
+#elif defined TINYBVH_USE_MMAP
+	int fd = open( fileName, O_RDONLY );
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat( fd, &st ) == 0 && st.st_size > 0)
+	{
+		void* view = mmap( 0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if (view != MAP_FAILED) data = (const uint8_t*)view, size = (uint64_t)st.st_size, mapped = true;
+	}
+	close( fd ); // the mapping keeps the file open.
+	if (mapped) return true;
+#endif
+	// fallback: read the file into a 64-byte aligned buffer.
+	std::fstream s{ fileName, s.binary | s.in | s.ate };
+	if (!s) return false;
+	const uint64_t fileSize = (uint64_t)s.tellg();
+	uint8_t* buffer = (uint8_t*)malloc64( fileSize );
+	if (!buffer) return false;
+	s.seekg( 0 );
+	s.read( (char*)buffer, fileSize );
+	if (!s) { free64( buffer ); return false; }
+	data = buffer, size = fileSize;
+	return true;
+}
+
+void BVHMappedFile::Close()
+{
+	if (!owner) data = 0, size = 0;
+	if (!data) return;
+#if defined _WIN32
+	if (mapped) UnmapViewOfFile( data ), CloseHandle( (HANDLE)mapping );
+#elif defined TINYBVH_USE_MMAP
+	if (mapped) munmap( (void*)data, size );
+#endif
+	if (!mapped) free64( (void*)data );
+	data = 0, size = 0, mapping = 0, mapped = false;
+}
+
+bool BVHMappedFile::Verify() const
+{
+	if (size < sizeof( BVHFileHeader )) return false;
+	const BVHFileHeader& header = *(const BVHFileHeader*)data;
+	if (header.magic != TINY_BVH_FILE_MAGIC || header.sectionCount > TINY_BVH_FILE_SECTIONS) return false;
+	if (size < sizeof( BVHFileHeader ) + header.sectionCount * sizeof( BVHFileSection )) return false;
+	const BVHFileSection* table = (const BVHFileSection*)(data + sizeof( BVHFileHeader ));
+	if (!tinybvh_valid_sections( header, table, size )) return false;
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t i = 0; i < header.sectionCount; i++) hash = tinybvh_checksum( data + table[i].offset, table[i].size, hash );
+	return hash == header.dataChecksum;
+}
+
+// RayBatch implementation
+// ----------------------------------------------------------------------------
+
+uint32_t RayBatch::Add( const Ray* rays, const uint32_t rayCount )
+{
+	if (count + rayCount > capacity)
+	{
+		// grow both arrays; records are plain data, so they can be copied.
+		const uint32_t newCapacity = tinybvh_max( tinybvh_max( capacity * 2, count + rayCount ), 1024u );
+		RayRecord* newRay = (RayRecord*)context.malloc( newCapacity * sizeof( RayRecord ), context.userdata );
+		if (count) memcpy( newRay, ray, count * sizeof( RayRecord ) );
+		if (ray) context.free( ray, context.userdata );
+		ray = newRay;
+		if (hit)
+		{
+			HitRecord* newHit = (HitRecord*)context.malloc( newCapacity * sizeof( HitRecord ), context.userdata );
+			if (count) memcpy( newHit, hit, count * sizeof( HitRecord ) );
+			context.free( hit, context.userdata ), hit = newHit;
+		}
+		capacity = newCapacity;
+	}
+	for (uint32_t i = 0; i < rayCount; i++)
+	{
+		RayRecord& r = ray[count + i];
+		r.O = rays[i].O, r.D = rays[i].D, r.tmax = rays[i].hit.t, r.mask = rays[i].mask;
+		if (hit) hit[count + i].t = -1;
+	}
+	count += rayCount;
+	return count - rayCount;
+}
+
+void RayBatch::SetHits( const uint32_t first, const Ray* rays, const uint32_t rayCount )
+{
+	BVH_FATAL_ERROR_IF( first + rayCount > count, "RayBatch::SetHits( .. ), index out of range." );
+	BVH_FATAL_ERROR_IF( occlusion, "RayBatch::SetHits( .. ), occlusion batch; use SetOccluded." );
+	if (!hit)
+	{
+		hit = (HitRecord*)context.malloc( capacity * sizeof( HitRecord ), context.userdata );
+		for (uint32_t i = 0; i < count; i++) hit[i].t = -1;
+	}
+	for (uint32_t i = 0; i < rayCount; i++)
+	{
+		HitRecord& h = hit[first + i];
+		h.t = rays[i].hit.t, h.u = rays[i].hit.u, h.v = rays[i].hit.v, h.prim = rays[i].hit.prim;
+	#if INST_IDX_BITS == 32
+		h.inst = rays[i].hit.inst;
+	#else
+		h.inst = 0; // stored in the top bits of prim.
+	#endif
+	}
+}
+
+void RayBatch::SetOccluded( const uint32_t idx, const bool occluded )
+{
+	BVH_FATAL_ERROR_IF( idx >= count, "RayBatch::SetOccluded( .. ), index out of range." );
+	BVH_FATAL_ERROR_IF( !occlusion, "RayBatch::SetOccluded( .. ), not an occlusion batch." );
+	if (!hit)
+	{
+		hit = (HitRecord*)context.malloc( capacity * sizeof( HitRecord ), context.userdata );
+		for (uint32_t i = 0; i < count; i++) hit[i].t = -1;
+	}
+	HitRecord& h = hit[idx];
+	h.t = occluded ? 0 : BVH_FAR, h.u = h.v = 0, h.prim = h.inst = 0;
+}
+
+Ray RayBatch::GetRay( const uint32_t idx ) const
+{
+	const RayRecord& r = ray[idx];
+	return Ray( r.O, r.D, r.tmax, r.mask );
+}
+
+bool RayBatch::Matches( const uint32_t idx, const Ray& traced, const float eps ) const
+{
+	// same distance (within eps) and the same primitive and instance. Note that
+	// layouts may disagree on the primitive for hits on a shared edge.
+	if (!hit || hit[idx].t < 0) return true;
+	const HitRecord& h = hit[idx];
+	const float t0 = h.t, t1 = traced.hit.t;
+	if (t0 >= BVH_FAR || t1 >= BVH_FAR) return t0 == t1;
+#if INST_IDX_BITS == 32
+	if (h.inst != traced.hit.inst) return false;
+#endif
+	return h.prim == traced.hit.prim && fabs( t0 - t1 ) <= eps * tinybvh_max( 1.0f, t0 );
+}
+
+bool RayBatch::Matches( const uint32_t idx, const bool occluded ) const
+{
+	if (!hit || hit[idx].t < 0) return true;
+	return (hit[idx].t < BVH_FAR) == occluded;
+}
+
+bool RayBatch::Save( const char* fileName ) const
+{
+	RayBatchHeader header;
+	memset( &header, 0, sizeof( RayBatchHeader ) );
+	header.magic = TINY_BVH_RAYS_MAGIC, header.fileVersion = TINY_BVH_RAYS_VERSION, header.count = count;
+	header.flags = (hit ? RayBatchHeader::HITS : 0) + (occlusion ? RayBatchHeader::OCCLUSION : 0);
+	header.rayRecordSize = sizeof( RayRecord ), header.hitRecordSize = sizeof( HitRecord );
+	header.checksum = tinybvh_checksum( ray, (uint64_t)count * sizeof( RayRecord ) );
+	if (hit) header.checksum = tinybvh_checksum( hit, (uint64_t)count * sizeof( HitRecord ), header.checksum );
+	std::fstream s{ fileName, s.binary | s.out };
+	if (!s) return false;
+	s.write( (char*)&header, sizeof( RayBatchHeader ) );
+	if (count) s.write( (char*)ray, (uint64_t)count * sizeof( RayRecord ) );
+	if (count && hit) s.write( (char*)hit, (uint64_t)count * sizeof( HitRecord ) );
+	return (bool)s;
+}
+
+bool RayBatch::Load( const char* fileName )
 {
-	// open file and check contents
 	std::fstream s{ fileName, s.binary | s.in };
 	if (!s) return false;
-	BVHContext tmp = context;
-	bool expectIndexed = (indices != nullptr);
-	uint32_t header, fileTriCount;
-	s.read( (char*)&header, sizeof( uint32_t ) );
-	if (((header >> 8) & 255) != TINY_BVH_VERSION_MINOR ||
-		((header >> 16) & 255) != TINY_BVH_VERSION_MAJOR ||
-		(header & 255) != TINY_BVH_VERSION_SUB || (header >> 24) != layout) return false;
-	s.read( (char*)&fileTriCount, sizeof( uint32_t ) );
-	if (expectIndexed && fileTriCount != primCount) return false;
-	if (!expectIndexed && fileTriCount != vertices.count / 3) return false;
-	// all checks passed; safe to overwrite *this
-	s.read( (char*)this, sizeof( BVH ) );
-	bool fileIsIndexed = vertIdx != nullptr;
+	RayBatchHeader header;
+	s.read( (char*)&header, sizeof( RayBatchHeader ) );
+	if (!s || header.magic != TINY_BVH_RAYS_MAGIC || header.fileVersion != TINY_BVH_RAYS_VERSION) return false;
+	if (header.rayRecordSize != sizeof( RayRecord ) || header.hitRecordSize != sizeof( HitRecord )) return false;
+	Clear();
+	occlusion = (header.flags & RayBatchHeader::OCCLUSION) != 0;
+	if (header.count == 0) return true;
+	ray = (RayRecord*)context.malloc( header.count * sizeof( RayRecord ), context.userdata );
+	s.read( (char*)ray, (uint64_t)header.count * sizeof( RayRecord ) );
+	uint64_t hash = tinybvh_checksum( ray, (uint64_t)header.count * sizeof( RayRecord ) );
+	if (header.flags & RayBatchHeader::HITS)
+	{
+		hit = (HitRecord*)context.malloc( header.count * sizeof( HitRecord ), context.userdata );
+		s.read( (char*)hit, (uint64_t)header.count * sizeof( HitRecord ) );
+		hash = tinybvh_checksum( hit, (uint64_t)header.count * sizeof( HitRecord ), hash );
+	}
+	count = capacity = header.count;
+	if (s && hash == header.checksum) return true;
+	Clear();
+	return false;
+}
+
+void RayBatch::Clear()
+{
+	if (ray) context.free( ray, context.userdata );
+	if (hit) context.free( hit, context.userdata );
+	ray = 0, hit = 0, count = capacity = 0;
+}
+
+BVHFileHeader BVHBase::FileHeader() const
+{
+	BVHFileHeader header;
+	memset( &header, 0, sizeof( BVHFileHeader ) );
+	header.magic = TINY_BVH_FILE_MAGIC, header.fileVersion = TINY_BVH_FILE_VERSION;
+	header.libVersion = TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16);
+	header.layout = layout, header.flags = header.bvhFlags = FileFlags();
+	header.triCount = triCount, header.idxCount = idxCount, header.nodeCount = usedNodes;
+	header.c_trav = c_trav, header.c_int = c_int, header.hqbvhbins = hqbvhbins;
+	header.aabbMin[0] = aabbMin.x, header.aabbMin[1] = aabbMin.y, header.aabbMin[2] = aabbMin.z;
+	header.aabbMax[0] = aabbMax.x, header.aabbMax[1] = aabbMax.y, header.aabbMax[2] = aabbMax.z;
+	return header;
+}
+
+void BVHBase::ApplyFileHeader( const BVHFileHeader& header )
+{
+	// restore everything except context and layout; those belong to *this.
+	ApplyFileFlags( header.flags );
+	triCount = (uint32_t)header.triCount, idxCount = (uint32_t)header.idxCount, usedNodes = (uint32_t)header.nodeCount;
+	c_trav = header.c_trav, c_int = header.c_int, hqbvhbins = header.hqbvhbins;
+	aabbMin = bvhvec3( header.aabbMin[0], header.aabbMin[1], header.aabbMin[2] );
+	aabbMax = bvhvec3( header.aabbMax[0], header.aabbMax[1], header.aabbMax[2] );
+}
+
+uint32_t BVHBase::FileFlags() const
+{
+	return (rebuildable ? BVHFileHeader::REBUILDABLE : 0) + (refittable ? BVHFileHeader::REFITTABLE : 0) +
+		(may_have_holes ? BVHFileHeader::HOLES : 0) + (bvh_over_aabbs ? BVHFileHeader::OVER_AABBS : 0) +
+		(bvh_over_indices ? BVHFileHeader::OVER_INDICES : 0) + (bvh_over_quads ? BVHFileHeader::OVER_QUADS : 0) +
+		(l_quads ? BVHFileHeader::L_QUADS : 0) + (hqbvhoddeven ? BVHFileHeader::ODDEVEN : 0);
+}
+
+void BVHBase::ApplyFileFlags( const uint32_t flags )
+{
+	rebuildable = (flags & BVHFileHeader::REBUILDABLE) != 0;
+	refittable = (flags & BVHFileHeader::REFITTABLE) != 0;
+	may_have_holes = (flags & BVHFileHeader::HOLES) != 0;
+	bvh_over_aabbs = (flags & BVHFileHeader::OVER_AABBS) != 0;
+	bvh_over_indices = (flags & BVHFileHeader::OVER_INDICES) != 0;
+	bvh_over_quads = (flags & BVHFileHeader::OVER_QUADS) != 0;
+	l_quads = (flags & BVHFileHeader::L_QUADS) != 0;
+	hqbvhoddeven = (flags & BVHFileHeader::ODDEVEN) != 0;
+}
+
+static uint64_t tinybvh_layout_sections( BVHFileSection* table, const BVHBase::FileSection* section, const uint32_t count )
+{
+	// lay out the sections: each one starts at a 64-byte boundary. Returns the file size.
+	uint64_t offset = make_multiple_of( sizeof( BVHFileHeader ) + count * sizeof( BVHFileSection ), 64 );
+	uint64_t fileSize = sizeof( BVHFileHeader ) + count * sizeof( BVHFileSection );
+	for (uint32_t i = 0; i < count; i++)
+	{
+		table[i].type = section[i].type, table[i].dummy = 0;
+		table[i].offset = offset, table[i].size = section[i].size;
+		fileSize = offset + section[i].size;
+		offset = make_multiple_of( fileSize, 64 );
+	}
+	return fileSize;
+}
+
+static void tinybvh_write_padding( std::fstream& s, uint64_t bytes )
+{
+	const char zeroes[64] = {};
+	for (; bytes > 64; bytes -= 64) s.write( zeroes, 64 );
+	s.write( zeroes, bytes );
+}
+
+static bool tinybvh_write_sections( std::fstream& s, BVHFileHeader& header, const BVHBase::FileSection* section, const uint32_t count )
+{
+	// write a complete BVH file, starting at the current position in the stream.
+	BVHFileSection table[TINY_BVH_FILE_SECTIONS];
+	tinybvh_layout_sections( table, section, count );
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t i = 0; i < count; i++) hash = tinybvh_checksum( section[i].data, section[i].size, hash );
+	header.sectionCount = count, header.dataChecksum = hash;
+	header.headerChecksum = tinybvh_header_checksum( header, table );
+	s.write( (char*)&header, sizeof( BVHFileHeader ) );
+	s.write( (char*)table, count * sizeof( BVHFileSection ) );
+	uint64_t pos = sizeof( BVHFileHeader ) + count * sizeof( BVHFileSection );
+	for (uint32_t i = 0; i < count; i++)
+	{
+		tinybvh_write_padding( s, table[i].offset - pos );
+		s.write( (char*)section[i].data, section[i].size );
+		pos = table[i].offset + section[i].size;
+	}
+	return (bool)s;
+}
+
+static bool tinybvh_seal_file( const char* fileName )
+{
+	// calculate the checksums of a file that was written in parts.
+	BVHMappedFile file;
+	if (!file.Open( fileName ) || file.size < sizeof( BVHFileHeader )) return false;
+	BVHFileHeader header = *(const BVHFileHeader*)file.data;
+	if (header.sectionCount > TINY_BVH_FILE_SECTIONS) return false;
+	if (file.size < sizeof( BVHFileHeader ) + header.sectionCount * sizeof( BVHFileSection )) return false;
+	const BVHFileSection* table = (const BVHFileSection*)(file.data + sizeof( BVHFileHeader ));
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t i = 0; i < header.sectionCount; i++)
+	{
+		if (table[i].offset > file.size || table[i].size > file.size - table[i].offset) return false;
+		hash = tinybvh_checksum( file.data + table[i].offset, table[i].size, hash );
+	}
+	header.dataChecksum = hash;
+	header.headerChecksum = tinybvh_header_checksum( header, table );
+	file.Close();
+	std::fstream s{ fileName, s.binary | s.in | s.out };
+	s.write( (char*)&header, sizeof( BVHFileHeader ) );
+	return (bool)s;
+}
+
+// Packed streams, used by the compressed formats. A stream stores an array of
+// 32-bit words in chunks that can be decoded independently (and in parallel):
+// uint64_t wordCount, chunkCount, chunkOffset[chunkCount + 1], chunk data.
+// For stride > 0, each word is XOR-ed with the word 'stride' positions earlier,
+// i.e. the same field in the previous record, and only its significant bytes
+// are stored, with a 4-bit byte count per word. This is lossless float
+// compression: bounds of neighbouring nodes share sign, exponent and high
+// mantissa bits, so their XOR has few significant bytes. For stride == 0, words are
+// stored as zigzag-encoded deltas in a variable-length encoding, which suits
+// primitive indices.
+#define TINY_BVH_PACK_CHUNK		16384 // words per chunk
+
+static void tinybvh_pack_chunk( const uint32_t* src, const uint64_t count, const uint32_t stride, uint8_t*& out )
+{
+	uint8_t* nibbles = 0;
+	uint32_t prev = 0;
+	for (uint64_t i = 0; i < count; i++)
+	{
+		if (stride == 0)
+		{
+			const int32_t delta = (int32_t)(src[i] - prev);
+			uint32_t z = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+			for (prev = src[i]; z >= 128; z >>= 7) *out++ = (uint8_t)(z | 128);
+			*out++ = (uint8_t)z;
+			continue;
+		}
+		const uint32_t x = src[i] ^ (i >= stride ? src[i - stride] : 0);
+		const uint32_t bytes = x == 0 ? 0 : x < 0x100 ? 1 : x < 0x10000 ? 2 : x < 0x1000000 ? 3 : 4;
+		if ((i & 1) == 0) nibbles = out++, *nibbles = (uint8_t)bytes; else *nibbles |= (uint8_t)(bytes << 4);
+		for (uint32_t b = 0; b < bytes; b++) *out++ = (uint8_t)(x >> (b * 8));
+	}
+}
+
+static bool tinybvh_unpack_chunk( const uint8_t* in, const uint8_t* end, uint32_t* dst, const uint64_t count, const uint32_t stride )
+{
+	uint32_t nibbles = 0, prev = 0;
+	for (uint64_t i = 0; i < count; i++)
+	{
+		if (stride == 0)
+		{
+			uint32_t z = 0;
+			for (uint32_t shift = 0;; shift += 7)
+			{
+				if (in >= end || shift > 28) return false;
+				const uint8_t b = *in++;
+				z |= (uint32_t)(b & 127) << shift;
+				if (b < 128) break;
+			}
+			dst[i] = prev = prev + ((z >> 1) ^ (0u - (z & 1)));
+			continue;
+		}
+		if ((i & 1) == 0) { if (in >= end) return false; nibbles = *in++; }
+		const uint32_t bytes = (i & 1) ? nibbles >> 4 : nibbles & 15;
+		if (bytes > 4 || bytes > (uint64_t)(end - in)) return false;
+		uint32_t x = 0;
+		for (uint32_t b = 0; b < bytes; b++) x |= (uint32_t)*in++ << (b * 8);
+		dst[i] = x ^ (i >= stride ? dst[i - stride] : 0);
+	}
+	return in == end;
+}
+
+static uint8_t* tinybvh_pack_stream( const uint32_t* src, const uint64_t count, const uint32_t stride, uint64_t& packedSize )
+{
+	// chunks contain whole records, so the XOR predictor can restart at each chunk.
+	const uint64_t chunkWords = stride ? (TINY_BVH_PACK_CHUNK / stride) * stride : TINY_BVH_PACK_CHUNK;
+	const uint64_t chunks = (count + chunkWords - 1) / chunkWords, headerSize = (chunks + 3) * 8;
+	uint8_t* stream = (uint8_t*)malloc64( headerSize + count * 5 + count / 2 + 8 );
+	uint64_t* streamHeader = (uint64_t*)stream;
+	streamHeader[0] = count, streamHeader[1] = chunks;
+	uint8_t* out = stream + headerSize;
+	for (uint64_t i = 0; i < chunks; i++)
+	{
+		streamHeader[i + 2] = out - stream;
+		const uint64_t words = count - i * chunkWords;
+		tinybvh_pack_chunk( src + i * chunkWords, words < chunkWords ? words : chunkWords, stride, out );
+	}
+	streamHeader[chunks + 2] = packedSize = out - stream;
+	return stream;
+}
+
+static bool tinybvh_unpack_stream( const uint8_t* stream, const uint64_t size, uint32_t*& dst, uint64_t& count, const uint32_t stride, BVHBase& alloc )
+{
+	// returns the words in a new buffer, allocated via the context of 'alloc'.
+	if (size < 16) return false;
+	const uint64_t* streamHeader = (const uint64_t*)stream;
+	const uint64_t chunkWords = stride ? (TINY_BVH_PACK_CHUNK / stride) * stride : TINY_BVH_PACK_CHUNK;
+	count = streamHeader[0];
+	const uint64_t chunks = streamHeader[1];
+	if (chunks != (count + chunkWords - 1) / chunkWords || count > size * 2 || (chunks + 3) * 8 > size) return false;
+	dst = (uint32_t*)alloc.AlignedAlloc( count * 4 + 4 );
+	std::atomic<bool> ok( true );
+	tinybvh_build_for( alloc.context, (uint32_t)chunks, 1, [&]( const uint32_t i ) // chunks are independent.
+	{
+		const uint64_t start = streamHeader[i + 2], end = streamHeader[i + 3], words = count - i * chunkWords;
+		if (!ok.load( std::memory_order_relaxed )) return;
+		if (start > end || end > size || !tinybvh_unpack_chunk( stream + start, stream + end, dst + i * chunkWords,
+			words < chunkWords ? words : chunkWords, stride )) ok.store( false );
+	} );
+	if (!ok) alloc.AlignedFree( dst ), dst = 0;
+	return ok;
+}
+
+bool BVHBase::WriteFile( const char* fileName, BVHFileHeader& header, const FileSection* section, const uint32_t count ) const
+{
+	BVH_FATAL_ERROR_IF( count > TINY_BVH_FILE_SECTIONS, "BVHBase::WriteFile( .. ), too many sections." );
+	std::fstream s{ fileName, s.binary | s.out | s.trunc };
+	if (!s) return false;
+	return tinybvh_write_sections( s, header, section, count );
+}
+
+bool BVHBase::ReadFile( const char* fileName, const BVHMappedFile* file, BVHFileHeader& header, FileSection* section, const uint32_t count )
+{
+	// reads the sections of a BVH file. If a mapped file is specified, section
+	// pointers point into the mapping; otherwise data is read into new buffers.
+	BVHFileSection table[TINY_BVH_FILE_SECTIONS];
+	std::fstream s;
+	uint64_t fileSize;
+	if (file)
+	{
+		fileSize = file->size;
+		if (!file->data || fileSize < sizeof( BVHFileHeader )) return false;
+		memcpy( &header, file->data, sizeof( BVHFileHeader ) );
+		if (header.sectionCount != count) return false;
+		if (fileSize < sizeof( BVHFileHeader ) + count * sizeof( BVHFileSection )) return false;
+		memcpy( table, file->data + sizeof( BVHFileHeader ), count * sizeof( BVHFileSection ) );
+	}
+	else
+	{
+		s.open( fileName, s.binary | s.in | s.ate );
+		if (!s) return false;
+		fileSize = (uint64_t)s.tellg();
+		s.seekg( 0 );
+		s.read( (char*)&header, sizeof( BVHFileHeader ) );
+		if (!s || header.sectionCount != count) return false;
+		s.read( (char*)table, count * sizeof( BVHFileSection ) );
+		if (!s) return false;
+	}
+	if (header.magic != TINY_BVH_FILE_MAGIC || header.fileVersion != TINY_BVH_FILE_VERSION) return false;
+	if (header.layout != layout || !tinybvh_valid_sections( header, table, fileSize )) return false;
+	for (uint32_t i = 0; i < count; i++) if (table[i].type != section[i].type) return false;
+	// all checks passed; get the section data.
+	for (uint32_t i = 0; i < count; i++)
+	{
+		section[i].size = table[i].size;
+		if (file) { section[i].data = (void*)(file->data + table[i].offset); continue; }
+		section[i].data = AlignedAlloc( table[i].size );
+		s.seekg( table[i].offset );
+		s.read( (char*)section[i].data, table[i].size );
+	}
+	if (file) return true; // zero-copy: see BVHMappedFile::Verify for a full check.
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t i = 0; i < count; i++) hash = tinybvh_checksum( section[i].data, section[i].size, hash );
+	if (!s || hash != header.dataChecksum) { DiscardSections( file, section, count ); return false; }
+	return true;
+}
+
+bool BVHBase::FileMatchesGeometry( const BVHFileHeader& header, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// check that the geometry supplied to Load is what the BVH was built for.
+	const bool expectIndexed = (indices != nullptr);
+	const bool fileIsIndexed = (header.flags & BVHFileHeader::OVER_INDICES) != 0;
+	const uint32_t vertsPerPrim = (header.flags & BVHFileHeader::OVER_QUADS) ? 4 : 3;
 	if (expectIndexed != fileIsIndexed) return false; // not what we expected.
-	if (blasList != nullptr || instList != nullptr) return false; // can't load/save TLAS.
-	context = tmp; // can't load context; function pointers will differ.
-	bvhNode = (BVHNode*)AlignedAlloc( allocatedNodes * sizeof( BVHNode ) );
-	primIdx = (uint32_t*)AlignedAlloc( idxCount * sizeof( uint32_t ) );
+	if (expectIndexed) return header.triCount == primCount;
+	if (header.flags & BVHFileHeader::OVER_AABBS) return true; // custom geometry; no vertices.
+	return header.triCount == vertices.count / vertsPerPrim;
+}
+
+void BVHBase::SetMappedFile( const BVHMappedFile* file, const FileSection* section, const uint32_t count )
+{
+	// remember the exact section pointers rather than the address range of the
+	// file: a range goes stale once the file is closed, and could then contain
+	// memory that this BVH allocates later.
+	memset( mappedData, 0, sizeof( mappedData ) );
+	if (file) for (uint32_t i = 0; i < count; i++) mappedData[i] = section[i].data;
+}
+
+void BVHBase::DiscardSections( const BVHMappedFile* file, FileSection* section, const uint32_t count )
+{
+	// release section data obtained with ReadFile, e.g. after failed validation.
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (!file) AlignedFree( section[i].data );
+		section[i].data = 0;
+	}
+}
+
+bool BVHBase::LoadLayoutFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices,
+	const uint32_t primCount, const size_t nodeSize, BVH& bvh, bool& ownBVH, void*& nodes )
+{
+	// shared by the layouts that keep the BVH they were converted from. Section 0
+	// holds the layout's own nodes: 'nodes' passes in the old buffer, which is
+	// freed, and returns the new one. Sections 1 and 2 are bound to the inner BVH.
+	BVHFileHeader header;
+	FileSection section[3] = {
+		{ BVHFileSection::NODES, 0, 0 }, { BVHFileSection::BVH_NODES, 0, 0 }, { BVHFileSection::PRIM_INDICES, 0, 0 }
+	};
+	if (!ReadFile( fileName, file, header, section, 3 )) return false;
+	if (!FileMatchesGeometry( header, vertices, indices, primCount ) ||
+		section[0].size != header.nodeCount * nodeSize || (section[1].size % sizeof( BVH::BVHNode )) ||
+		section[2].size != header.idxCount * sizeof( uint32_t ))
+	{
+		DiscardSections( file, section, 3 );
+		return false;
+	}
+	// all checks passed; safe to overwrite *this
+	AlignedFree( nodes );
+	if (ownBVH) bvh.AlignedFree( bvh.bvhNode ), bvh.AlignedFree( bvh.primIdx ), bvh.AlignedFree( bvh.fragment );
+	bvh = BVH( context ), ownBVH = true;
+	ApplyFileHeader( header );
+	nodes = section[0].data;
+	allocatedNodes = file ? 0 : usedNodes;
+	SetMappedFile( file, section, 1 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
+	bvh.CopyBasePropertiesFrom( *this );
+	bvh.ApplyFileFlags( header.bvhFlags );
+	bvh.bvhNode = (BVH::BVHNode*)section[1].data;
+	bvh.primIdx = (uint32_t*)section[2].data;
+	bvh.usedNodes = bvh.newNodePtr = (uint32_t)(section[1].size / sizeof( BVH::BVHNode ));
+	bvh.allocatedNodes = file ? 0 : bvh.usedNodes;
+	bvh.SetMappedFile( file, section + 1, 2 );
+	if (file) bvh.rebuildable = bvh.refittable = false;
+	bvh.verts = vertices, bvh.vertIdx = (uint32_t*)indices;
+	return true;
+}
+
+#ifdef TINYBVH_TRAVERSAL_STATS
+
+// TraversalStats implementation
+// ----------------------------------------------------------------------------
+
+// Each thread counts in its own TraversalStats; the threads are kept in a
+// list so Report can merge them. Counters of finished threads are kept.
+struct TraversalStatsSlot
+{
+	TraversalStats stats;
+	TraversalStatsSlot* next = 0;
+	TraversalStatsSlot();
+	~TraversalStatsSlot();
+};
+static std::mutex tinybvh_stats_mutex;
+static TraversalStatsSlot* tinybvh_stats_threads = 0;
+static TraversalStats tinybvh_stats_finished;
+
+TraversalStatsSlot::TraversalStatsSlot()
+{
+	std::lock_guard<std::mutex> lock( tinybvh_stats_mutex );
+	next = tinybvh_stats_threads, tinybvh_stats_threads = this;
+}
+
+TraversalStatsSlot::~TraversalStatsSlot()
+{
+	std::lock_guard<std::mutex> lock( tinybvh_stats_mutex );
+	tinybvh_stats_finished.Merge( stats );
+	TraversalStatsSlot** slot = &tinybvh_stats_threads;
+	while (*slot != this) slot = &(*slot)->next;
+	*slot = next;
+}
+
+TraversalStats& TraversalStats::Local()
+{
+	static thread_local TraversalStatsSlot slot;
+	return slot.stats;
+}
+
+TraversalStats TraversalStats::Report()
+{
+	std::lock_guard<std::mutex> lock( tinybvh_stats_mutex );
+	TraversalStats total = tinybvh_stats_finished;
+	for (TraversalStatsSlot* slot = tinybvh_stats_threads; slot; slot = slot->next) total.Merge( slot->stats );
+	return total;
+}
+
+void TraversalStats::ResetAll()
+{
+	std::lock_guard<std::mutex> lock( tinybvh_stats_mutex );
+	tinybvh_stats_finished.Reset();
+	for (TraversalStatsSlot* slot = tinybvh_stats_threads; slot; slot = slot->next) slot->stats.Reset();
+}
+
+#endif // TINYBVH_TRAVERSAL_STATS
+
+// Job system
+// ----------------------------------------------------------------------------
+
+#ifdef TINYBVH_NO_THREADS
+
+// single-threaded: no pool, loops run on the calling thread.
+JobSystem::JobSystem( const uint32_t, const bool ) {}
+JobSystem::~JobSystem() {}
+
+void JobSystem::Run( const uint32_t count, const uint32_t, JobFunc job, void* data )
+{
+	if (count > 0) job( data, 0, count );
+}
+
+void JobSystem::ParallelForHook( uint32_t count, uint32_t, JobFunc job, void* data, void* )
+{
+	if (count > 0) job( data, 0, count );
+}
+
+#else
+
+struct JobSystem::Impl
+{
+	struct Job { JobFunc func; void* data; uint32_t first, last; std::atomic<uint32_t>* pending; };
+	struct Queue { std::mutex lock; std::deque<Job> jobs; };
+	uint32_t threads = 0;
+	Queue* queue = 0;				// one per thread; queue 0 is shared by threads outside the pool.
+	std::thread* worker = 0;		// threads - 1 workers; the thread that waits is the last one.
+	std::atomic<uint32_t> queued{ 0 };	// jobs in all queues, or about to be.
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	bool quit = false;				// guarded by sleepLock.
+	bool RunOne( const uint32_t self )
+	{
+		// newest job of the own queue, otherwise the oldest job of another queue.
+		if (queued.load() == 0) return false;
+		Job job;
+		bool found = false;
+		for (uint32_t i = 0; i < threads && !found; i++)
+		{
+			Queue& q = queue[(self + i) % threads];
+			std::lock_guard<std::mutex> lock( q.lock );
+			if (q.jobs.empty()) continue;
+			if (i == 0) job = q.jobs.back(), q.jobs.pop_back(); else job = q.jobs.front(), q.jobs.pop_front();
+			found = true;
+		}
+		if (!found) return false;
+		queued.fetch_sub( 1 );
+		job.func( job.data, job.first, job.last );
+		job.pending->fetch_sub( 1, std::memory_order_release );
+		return true;
+	}
+	void Notify()
+	{
+		{ std::lock_guard<std::mutex> lock( sleepLock ); }
+		wake.notify_all();
+	}
+};
+
+// pool and queue of the current thread; queue 0 for threads outside a pool.
+static thread_local const JobSystem* tinybvh_job_owner = 0;
+static thread_local uint32_t tinybvh_job_queue = 0;
+
+JobSystem::JobSystem( const uint32_t threads, const bool pinNUMA )
+{
+	threadCount = threads ? threads : tinybvh_max( std::thread::hardware_concurrency(), 1u );
+	if (threadCount < 2) return;
+	impl = new Impl();
+	impl->threads = threadCount, impl->queue = new Impl::Queue[threadCount];
+	impl->worker = new std::thread[threadCount - 1];
+	for (uint32_t i = 1; i < threadCount; i++) impl->worker[i - 1] = std::thread( [this, i, pinNUMA]()
+		{
+			tinybvh_job_owner = this, tinybvh_job_queue = i;
+			// workers are spread over the nodes in equal blocks; the caller is not pinned.
+			if (pinNUMA) NUMA::PinThread( (uint32_t)((uint64_t)i * NUMA::NodeCount() / threadCount) );
+			while (1)
+			{
+				if (impl->RunOne( i )) continue;
+				std::unique_lock<std::mutex> lock( impl->sleepLock );
+				impl->wake.wait( lock, [this]() { return impl->quit || impl->queued.load() > 0; } );
+				if (impl->quit) return;
+			}
+		} );
+}
+
+JobSystem::~JobSystem()
+{
+	if (!impl) return;
+	{
+		std::lock_guard<std::mutex> lock( impl->sleepLock );
+		impl->quit = true;
+	}
+	impl->wake.notify_all();
+	for (uint32_t i = 0; i < threadCount - 1; i++) impl->worker[i].join();
+	delete[] impl->worker;
+	delete[] impl->queue;
+	delete impl;
+}
+
+void JobSystem::Run( const uint32_t count, const uint32_t grain, JobFunc job, void* data )
+{
+	if (count == 0) return;
+	// at least 'grain' items per chunk, and up to eight chunks per thread.
+	const uint32_t chunk = tinybvh_max( tinybvh_max( grain, 1u ), (count + threadCount * 8 - 1) / (threadCount * 8) );
+	const uint32_t chunks = (count + chunk - 1) / chunk;
+	if (!impl || chunks < 2) { job( data, 0, count ); return; }
+	std::atomic<uint32_t> pending( chunks );
+	Impl::Queue& q = impl->queue[tinybvh_job_owner == this ? tinybvh_job_queue : 0];
+	impl->queued.fetch_add( chunks );
+	{
+		// pushed in reverse, so the owner pops the first chunk first.
+		std::lock_guard<std::mutex> lock( q.lock );
+		for (uint32_t i = chunks; i-- > 0;)
+			q.jobs.push_back( Impl::Job{ job, data, i * chunk, tinybvh_min( (i + 1) * chunk, count ), &pending } );
+	}
+	impl->Notify();
+	Wait( pending );
+}
+
+void JobSystem::Wait( const std::atomic<uint32_t>& pending )
+{
+	const uint32_t self = tinybvh_job_owner == this ? tinybvh_job_queue : 0;
+	while (pending.load( std::memory_order_acquire ) > 0) if (!impl || !impl->RunOne( self )) std::this_thread::yield();
+}
+
+void JobSystem::ParallelForHook( uint32_t count, uint32_t grain, JobFunc job, void* data, void* userdata )
+{
+	(userdata ? *(JobSystem*)userdata : Default()).Run( count, grain, job, data );
+}
+
+#endif // TINYBVH_NO_THREADS
+
+JobSystem& JobSystem::Default()
+{
+	static JobSystem system;
+	return system;
+}
+
+// Huge page allocator
+// ----------------------------------------------------------------------------
+
+#if defined TINYBVH_USE_MMAP && defined MADV_HUGEPAGE
+
+void* mallocHuge( size_t size, void* )
+{
+	// Large blocks get their own mapping on a 2MB boundary: explicit huge pages
+	// if the system has them reserved, otherwise transparent huge pages. The
+	// first 4KB hold the mapping size, so the block itself is 4KB-aligned. Small
+	// blocks come from malloc64, with a zero size in front of them.
+	if (size == 0) return 0;
+	if (size < (1 << 20))
+	{
+		uint8_t* block = (uint8_t*)malloc64( size + 64 );
+		*(size_t*)block = 0;
+		return block + 64;
+	}
+	const size_t page = 2 << 20, bytes = (size + 4096 + page - 1) & ~(page - 1);
+	uint8_t* base = (uint8_t*)mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+	if (base == MAP_FAILED)
+	{
+		// map one page more than needed, and trim to a 2MB boundary.
+		uint8_t* raw = (uint8_t*)mmap( 0, bytes + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if (raw == MAP_FAILED) return 0;
+		base = (uint8_t*)(((size_t)raw + page - 1) & ~(page - 1));
+		if (base > raw) munmap( raw, base - raw );
+		munmap( base + bytes, raw + page - base );
+		madvise( base, bytes, MADV_HUGEPAGE ); // no effect if THP is disabled.
+	}
+	*(size_t*)(base + 4096 - 64) = bytes;
+	return base + 4096;
+}
+
+void freeHuge( void* ptr, void* )
+{
+	if (!ptr) return;
+	uint8_t* block = (uint8_t*)ptr;
+	const size_t bytes = *(size_t*)(block - 64);
+	if (bytes == 0) free64( block - 64 ); else munmap( block - 4096, bytes );
+}
+
+#else
+
+void* mallocHuge( size_t size, void* ) { return malloc64( size ); }
+void freeHuge( void* ptr, void* ) { free64( ptr ); }
+
+#endif
+
+// NUMA support
+// ----------------------------------------------------------------------------
+
+#ifdef TINYBVH_USE_NUMA
+
+// Node topology, read once from sysfs: the CPUs of each node, and the node of
+// each CPU. A machine without /sys/devices/system/node has a single node.
+struct NUMATopology
+{
+	uint32_t nodes = 1;
+	cpu_set_t* cpus = 0;			// per node.
+	uint16_t cpuNode[CPU_SETSIZE] = {};
+};
+
+static bool tinybvh_read_list( const char* fileName, cpu_set_t& set )
+{
+	// sysfs lists look like "0-3,8-11".
+	CPU_ZERO( &set );
+	FILE* f = fopen( fileName, "r" );
+	if (!f) return false;
+	char line[4096];
+	const bool ok = fgets( line, sizeof( line ), f ) != 0;
+	fclose( f );
+	for (char* p = line; ok && *p >= '0' && *p <= '9';)
+	{
+		const unsigned long first = strtoul( p, &p, 10 );
+		const unsigned long last = *p == '-' ? strtoul( p + 1, &p, 10 ) : first;
+		for (unsigned long i = first; i <= last && i < CPU_SETSIZE; i++) CPU_SET( i, &set );
+		if (*p == ',') p++;
+	}
+	return ok;
+}
+
+static const NUMATopology& tinybvh_numa_topology()
+{
+	static const NUMATopology topology = []()
+		{
+			NUMATopology t;
+			cpu_set_t online;
+			if (!tinybvh_read_list( "/sys/devices/system/node/online", online )) return t;
+			for (uint32_t i = 0; i < CPU_SETSIZE; i++) if (CPU_ISSET( i, &online )) t.nodes = i + 1;
+			t.cpus = new cpu_set_t[t.nodes];
+			char fileName[64];
+			for (uint32_t n = 0; n < t.nodes; n++)
+			{
+				snprintf( fileName, sizeof( fileName ), "/sys/devices/system/node/node%u/cpulist", n );
+				tinybvh_read_list( fileName, t.cpus[n] ); // offline node: no CPUs.
+				for (uint32_t c = 0; c < CPU_SETSIZE; c++) if (CPU_ISSET( c, &t.cpus[n] )) t.cpuNode[c] = (uint16_t)n;
+			}
+			return t;
+		}();
+	return topology;
+}
+
+uint32_t NUMA::NodeCount() { return tinybvh_numa_topology().nodes; }
+
+uint32_t NUMA::CurrentNode()
+{
+	// sched_getcpu is a vDSO call, so this is cheap, but not free.
+	const int cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? tinybvh_numa_topology().cpuNode[cpu] : 0;
+}
+
+bool NUMA::PinThread( const uint32_t node )
+{
+	const NUMATopology& t = tinybvh_numa_topology();
+	if (node >= t.nodes || CPU_COUNT( &t.cpus[node] ) == 0) return false;
+	return sched_setaffinity( 0, sizeof( cpu_set_t ), &t.cpus[node] ) == 0;
+}
+
+void* NUMA::Alloc( size_t size, void* userdata )
+{
+	// anonymous pages with a 'preferred node' policy, so the kernel places them
+	// on the node when they are first touched, and elsewhere if the node is full.
+	// The mapping size is stored in the first 64 bytes of the mapping.
+	if (size == 0) return 0;
+	const size_t bytes = size + 64, node = (size_t)userdata, bits = sizeof( unsigned long ) * 8;
+	uint8_t* base = (uint8_t*)mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if (base == MAP_FAILED) return 0;
+	unsigned long mask[1024 / (sizeof( unsigned long ) * 8)] = {};
+	if (node < 1024)
+	{
+		mask[node / bits] = 1ul << (node % bits);
+		const int MPOL_PREFERRED_ = 1;
+		syscall( SYS_mbind, base, bytes, MPOL_PREFERRED_, mask, 1024 + 1, 0 ); // on failure: any node.
+	}
+	*(size_t*)base = bytes;
+	return base + 64;
+}
+
+void NUMA::Free( void* ptr, void* )
+{
+	if (!ptr) return;
+	uint8_t* base = (uint8_t*)ptr - 64;
+	munmap( base, *(size_t*)base );
+}
+
+#else
+
+uint32_t NUMA::NodeCount() { return 1; }
+uint32_t NUMA::CurrentNode() { return 0; }
+bool NUMA::PinThread( const uint32_t ) { return false; }
+void* NUMA::Alloc( size_t size, void* ) { return malloc64( size ); }
+void NUMA::Free( void* ptr, void* ) { free64( ptr ); }
+
+#endif
+
+BVHContext NUMA::Context( const uint32_t node, const BVHContext& base )
+{
+	BVHContext context = base;
+	if (NodeCount() < 2) return context;
+	context.malloc = Alloc, context.free = Free, context.userdata = (void*)(size_t)node;
+	return context;
+}
+
+// Tree quality analysis
+// ----------------------------------------------------------------------------
+
+// Clip a convex polygon (at most 12 vertices after clipping) against an
+// AABB (Sutherland-Hodgeman, six planes) and return the remaining area.
+static float tinybvh_clipped_area( bvhvec3* vin, uint32_t Nin, const bvhvec3& bmin, const bvhvec3& bmax )
+{
+	bvhvec3 vout[12], C;
+	for (uint32_t a = 0; a < 3; a++)
+	{
+		uint32_t Nout = 0;
+		const float l = bmin[a], r = bmax[a];
+		for (uint32_t v = 0; v < Nin; v++)
+		{
+			bvhvec3 v0 = vin[v], v1 = vin[(v + 1) % Nin];
+			const bool v0in = v0[a] >= l, v1in = v1[a] >= l;
+			if (!(v0in || v1in)) continue; else if (v0in ^ v1in)
+				C = v0 + (l - v0[a]) / (v1[a] - v0[a]) * (v1 - v0),
+				C[a] = l /* accurate */, vout[Nout++] = C;
+			if (v1in) vout[Nout++] = v1;
+		}
+		Nin = 0;
+		for (uint32_t v = 0; v < Nout; v++)
+		{
+			bvhvec3 v0 = vout[v], v1 = vout[(v + 1) % Nout];
+			const bool v0in = v0[a] <= r, v1in = v1[a] <= r;
+			if (!(v0in || v1in)) continue; else if (v0in ^ v1in)
+				C = v0 + (r - v0[a]) / (v1[a] - v0[a]) * (v1 - v0),
+				C[a] = r /* accurate */, vin[Nin++] = C;
+			if (v1in) vin[Nin++] = v1;
+		}
+	}
+	if (Nin < 3) return 0;
+	// calculate area of remaining convex shape in vin
+	float area = 0;
+	const bvhvec3 v0 = vin[0];
+	for (uint32_t j = 0; j < Nin - 2; j++)
+		area += 0.5f * tinybvh_length( tinybvh_cross( vin[j + 1] - v0, vin[j + 2] - v0 ) );
+	return area;
+}
+
+// Corners of a triangle or quad of a BVH; returns the number of corners.
+static uint32_t tinybvh_prim_corners( const BVH& bvh, const uint32_t prim, bvhvec3* v )
+{
+	if (quadsEnabled && bvh.bvh_over_quads)
+	{
+		uint32_t i0, i1, i2, i3;
+		GET_QUAD_INDICES_I0_I1_I2_I3( bvh, prim );
+		v[0] = bvh.verts[i0], v[1] = bvh.verts[i1], v[2] = bvh.verts[i2], v[3] = bvh.verts[i3];
+		return 4;
+	}
+	const uint32_t vidx = prim * 3;
+	if (bvh.vertIdx) v[0] = bvh.verts[bvh.vertIdx[vidx]], v[1] = bvh.verts[bvh.vertIdx[vidx + 1]], v[2] = bvh.verts[bvh.vertIdx[vidx + 2]];
+	else v[0] = bvh.verts[vidx], v[1] = bvh.verts[vidx + 1], v[2] = bvh.verts[vidx + 2];
+	return 3;
+}
+
+static bool tinybvh_boxes_overlap( const bvhvec3& amin, const bvhvec3& amax, const bvhvec3& bmin, const bvhvec3& bmax )
+{
+	return amin.x <= bmax.x && amax.x >= bmin.x && amin.y <= bmax.y && amax.y >= bmin.y && amin.z <= bmax.z && amax.z >= bmin.z;
+}
+
+// Each layout presents its tree through a small view class (IsLeaf, Children,
+// Min, Max, PrimCount, Prim, Corners); tinybvh_analyze flattens the tree once
+// and computes all metrics on the flat copy. EPO and LCV query the tree for
+// every node, so these run in parallel.
+struct tinybvh_qnode { bvhvec3 aabbMin; uint32_t first; bvhvec3 aabbMax; uint32_t count; bool leaf; };
+
+template <class V> static BVHQuality tinybvh_analyze( const BVHBase& bvh, const V& view, bool epo )
+{
+	BVHQuality q;
+	const BVHContext& ctx = bvh.context;
+	epo &= view.HasGeometry();
+	// count nodes and primitive references
+	uint32_t stack[1024], depthStack[1024], slotStack[1024], stackPtr = 1, nodeCount = 0, refCount = 0, child[8];
+	stack[0] = 0;
+	while (stackPtr > 0)
+	{
+		const uint32_t n = stack[--stackPtr];
+		nodeCount++;
+		if (view.IsLeaf( n )) { refCount += view.PrimCount( n ); continue; }
+		const uint32_t k = view.Children( n, child );
+		BVH_FATAL_ERROR_IF( stackPtr + k > 1024, "BVH Analyze( .. ), tree too deep." );
+		for (uint32_t i = 0; i < k; i++) stack[stackPtr++] = child[i];
+	}
+	// flatten in depth-first order; leaves get a range of primitive corners
+	tinybvh_qnode* node = (tinybvh_qnode*)ctx.malloc( nodeCount * sizeof( tinybvh_qnode ), ctx.userdata );
+	uint32_t* childList = (uint32_t*)ctx.malloc( nodeCount * sizeof( uint32_t ), ctx.userdata );
+	bvhvec3* corner = epo ? (bvhvec3*)ctx.malloc( refCount * 4 * sizeof( bvhvec3 ), ctx.userdata ) : 0;
+	const uint32_t corners = view.Quads() ? 4 : 3, width = view.Width();
+	uint32_t nodePtr = 0, childPtr = 0, refPtr = 0;
+	float sah = 0;
+	stack[0] = 0, depthStack[0] = 0, slotStack[0] = 0, stackPtr = 1;
+	while (stackPtr > 0)
+	{
+		const uint32_t n = stack[--stackPtr], depth = depthStack[stackPtr], idx = nodePtr++;
+		if (idx > 0) childList[slotStack[stackPtr]] = idx;
+		tinybvh_qnode& qn = node[idx];
+		qn.aabbMin = view.Min( n ), qn.aabbMax = view.Max( n ), qn.leaf = view.IsLeaf( n );
+		const float area = tinybvh_half_area( qn.aabbMax - qn.aabbMin );
+		if (qn.leaf)
+		{
+			qn.first = refPtr, qn.count = view.PrimCount( n );
+			if (epo) for (uint32_t i = 0; i < qn.count; i++) view.Corners( view.Prim( n, i ), corner + (refPtr + i) * 4 );
+			refPtr += qn.count, sah += bvh.c_int * area * qn.count;
+			q.leaves++, q.maxDepth = tinybvh_max( q.maxDepth, depth );
+			q.depthHistogram[tinybvh_min( depth, 63u )]++;
+			q.leafSizeHistogram[tinybvh_min( qn.count, 32u )]++;
+			continue;
+		}
+		const uint32_t k = view.Children( n, child );
+		qn.first = childPtr, qn.count = k, childPtr += k, sah += bvh.c_trav * area;
+		if (width > 2) q.emptySlots += width - k;
+		for (uint32_t a = 0; a < k; a++) for (uint32_t b = a + 1; b < k; b++)
+		{
+			const bvhvec3 amin = view.Min( child[a] ), amax = view.Max( child[a] );
+			const bvhvec3 bmin = view.Min( child[b] ), bmax = view.Max( child[b] );
+			if (tinybvh_boxes_overlap( amin, amax, bmin, bmax ))
+				q.siblingOverlap += tinybvh_half_area( tinybvh_min( amax, bmax ) - tinybvh_max( amin, bmin ) );
+		}
+		// push in reverse, so the first child is visited first
+		for (int32_t i = (int32_t)k - 1; i >= 0; i--)
+			stack[stackPtr] = child[i], depthStack[stackPtr] = depth + 1, slotStack[stackPtr++] = qn.first + i;
+	}
+	// EPO: per node, the area of all primitives outside its subtree that overlap it
+	float* epoCost = epo ? (float*)ctx.malloc( nodeCount * sizeof( float ), ctx.userdata ) : 0;
+	if (epo) tinybvh_parallel_for( bvh.context, nodeCount, 64, [&]( const uint32_t i )
+	{
+		const tinybvh_qnode& n = node[i];
+		uint32_t todo[1024], todoPtr = 1;
+		bvhvec3 vin[12];
+		float area = 0;
+		todo[0] = 0;
+		while (todoPtr > 0)
+		{
+			const uint32_t j = todo[--todoPtr];
+			const tinybvh_qnode& m = node[j];
+			if (j == i || !tinybvh_boxes_overlap( n.aabbMin, n.aabbMax, m.aabbMin, m.aabbMax )) continue;
+			if (!m.leaf) for (uint32_t c = 0; c < m.count; c++) todo[todoPtr++] = childList[m.first + c];
+			else for (uint32_t r = 0; r < m.count; r++)
+			{
+				memcpy( vin, corner + (m.first + r) * 4, 4 * sizeof( bvhvec3 ) );
+				area += tinybvh_clipped_area( vin, corners, n.aabbMin, n.aabbMax );
+			}
+		}
+		epoCost[i] = (n.leaf ? (bvh.c_int * n.count) : bvh.c_trav) * area;
+	} );
+	// LCV: count the leaves pierced by random lines through the root box. Line
+	// origins are area-weighted on the root faces, directions cosine-weighted.
+	const uint32_t lines = 16384;
+	float* pierced = (float*)ctx.malloc( lines * sizeof( float ), ctx.userdata );
+	const bvhvec3 rootMin = node[0].aabbMin, rootExt = node[0].aabbMax - node[0].aabbMin;
+	const float faceArea[3] = { rootExt.y * rootExt.z, rootExt.x * rootExt.z, rootExt.x * rootExt.y };
+	tinybvh_parallel_for( bvh.context, lines, 64, [&]( const uint32_t i )
+	{
+		uint32_t seed = (i + 1) * 0x9e3779b9u;
+		auto rand01 = [&seed]() { seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5; return (float)(seed >> 8) * (1.0f / 16777216.0f); };
+		rand01();
+		float r = rand01() * (faceArea[0] + faceArea[1] + faceArea[2]);
+		const uint32_t a = r < faceArea[0] ? 0 : (r < faceArea[0] + faceArea[1] ? 1 : 2);
+		const uint32_t u = (a + 1) % 3, v = (a + 2) % 3;
+		const bool far = rand01() < 0.5f;
+		bvhvec3 O = rootMin, N( 0 ), T( 0 ), B( 0 );
+		O[a] += far ? rootExt[a] : 0, O[u] += rand01() * rootExt[u], O[v] += rand01() * rootExt[v];
+		N[a] = far ? -1.0f : 1.0f, T[u] = 1, B[v] = 1;
+		const float r1 = rand01(), r2 = rand01() * 6.2831853f, sr1 = sqrtf( r1 );
+		const bvhvec3 D = sqrtf( 1 - r1 ) * N + sr1 * cosf( r2 ) * T + sr1 * sinf( r2 ) * B;
+		Ray ray( O, D );
+		uint32_t todo[1024], todoPtr = 1, count = 0;
+		todo[0] = 0;
+		while (todoPtr > 0)
+		{
+			const tinybvh_qnode& m = node[todo[--todoPtr]];
+			if (tinybvh_intersect_aabb( ray, m.aabbMin, m.aabbMax ) == BVH_FAR) continue;
+			if (m.leaf) count++; else for (uint32_t c = 0; c < m.count; c++) todo[todoPtr++] = childList[m.first + c];
+		}
+		pierced[i] = (float)count;
+	} );
+	double sum = 0, sum2 = 0;
+	for (uint32_t i = 0; i < lines; i++) sum += pierced[i], sum2 += pierced[i] * pierced[i];
+	q.lcv = (float)(sum2 / lines - (sum / lines) * (sum / lines));
+	ctx.free( pierced, ctx.userdata );
+	// finalize; SAH and overlap are relative to the root
+	const float rootArea = tinybvh_half_area( rootExt );
+	q.sah = sah / rootArea, q.siblingOverlap /= rootArea;
+	q.nodes = nodeCount, q.primRefs = refCount;
+	if (epo)
+	{
+		float totalArea = 0;
+		bvhvec3 v[4];
+		for (uint32_t p = 0; p < bvh.triCount; p++)
+		{
+			view.Corners( p, v );
+			for (uint32_t j = 0; j < corners - 2; j++)
+				totalArea += 0.5f * tinybvh_length( tinybvh_cross( v[j + 1] - v[0], v[j + 2] - v[0] ) );
+		}
+		float epoSum = 0;
+		for (uint32_t i = 0; i < nodeCount; i++) epoSum += epoCost[i];
+		q.epo = (1.0f - W_EPO) * q.sah + W_EPO * epoSum / totalArea;
+		ctx.free( epoCost, ctx.userdata );
+	}
+	if (corner) ctx.free( corner, ctx.userdata );
+	ctx.free( childList, ctx.userdata );
+	ctx.free( node, ctx.userdata );
+	return q;
+}
+
+static void tinybvh_set_footprint( BVHQuality& q, const uint64_t bytes, const uint32_t primCount )
+{
+	q.bytes = bytes, q.bytesPerPrim = primCount ? (float)bytes / (float)primCount : 0;
+}
+
+struct tinybvh_bvh_view
+{
+	const BVH& bvh;
+	uint32_t Width() const { return 2; }
+	bool Quads() const { return quadsEnabled && bvh.bvh_over_quads; }
+	bool HasGeometry() const { return bvh.verts.data != 0; }
+	bool IsLeaf( const uint32_t n ) const { return bvh.bvhNode[n].isLeaf(); }
+	uint32_t Children( const uint32_t n, uint32_t* c ) const { c[0] = bvh.bvhNode[n].leftFirst, c[1] = c[0] + 1; return 2; }
+	bvhvec3 Min( const uint32_t n ) const { return bvh.bvhNode[n].aabbMin; }
+	bvhvec3 Max( const uint32_t n ) const { return bvh.bvhNode[n].aabbMax; }
+	uint32_t PrimCount( const uint32_t n ) const { return bvh.bvhNode[n].triCount; }
+	uint32_t Prim( const uint32_t n, const uint32_t i ) const { return bvh.primIdx[bvh.bvhNode[n].leftFirst + i]; }
+	void Corners( const uint32_t p, bvhvec3* v ) const { tinybvh_prim_corners( bvh, p, v ); }
+};
+
+struct tinybvh_verbose_view
+{
+	const BVH_Verbose& bvh;
+	uint32_t Width() const { return 2; }
+	bool Quads() const { return false; }
+	bool HasGeometry() const { return bvh.verts.data != 0; }
+	bool IsLeaf( const uint32_t n ) const { return bvh.bvhNode[n].isLeaf(); }
+	uint32_t Children( const uint32_t n, uint32_t* c ) const { c[0] = bvh.bvhNode[n].left, c[1] = bvh.bvhNode[n].right; return 2; }
+	bvhvec3 Min( const uint32_t n ) const { return bvh.bvhNode[n].aabbMin; }
+	bvhvec3 Max( const uint32_t n ) const { return bvh.bvhNode[n].aabbMax; }
+	uint32_t PrimCount( const uint32_t n ) const { return bvh.bvhNode[n].triCount; }
+	uint32_t Prim( const uint32_t n, const uint32_t i ) const { return bvh.primIdx[bvh.bvhNode[n].firstTri + i]; }
+	void Corners( const uint32_t p, bvhvec3* v ) const { v[0] = bvh.verts[p * 3], v[1] = bvh.verts[p * 3 + 1], v[2] = bvh.verts[p * 3 + 2]; }
+};
+
+template <int M> struct tinybvh_mbvh_view
+{
+	const MBVH<M>& bvh;
+	uint32_t Width() const { return M; }
+	bool Quads() const { return quadsEnabled && bvh.bvh.bvh_over_quads; }
+	bool HasGeometry() const { return bvh.bvh.verts.data != 0; }
+	bool IsLeaf( const uint32_t n ) const { return bvh.mbvhNode[n].isLeaf(); }
+	uint32_t Children( const uint32_t n, uint32_t* c ) const
+	{
+		// empty slots hold 0, as in SAHCost; converted layouts may reorder the slots.
+		uint32_t k = 0;
+		for (uint32_t i = 0; i < M; i++) if (bvh.mbvhNode[n].child[i]) c[k++] = bvh.mbvhNode[n].child[i];
+		return k;
+	}
+	bvhvec3 Min( const uint32_t n ) const { return bvh.mbvhNode[n].aabbMin; }
+	bvhvec3 Max( const uint32_t n ) const { return bvh.mbvhNode[n].aabbMax; }
+	uint32_t PrimCount( const uint32_t n ) const { return bvh.mbvhNode[n].triCount; }
+	uint32_t Prim( const uint32_t n, const uint32_t i ) const { return bvh.bvh.primIdx[bvh.mbvhNode[n].firstTri + i]; }
+	void Corners( const uint32_t p, bvhvec3* v ) const { tinybvh_prim_corners( bvh.bvh, p, v ); }
+};
+
+// Build statistics
+double BuildStats::TotalMs() const
+{
+	double total = 0;
+	for (uint32_t i = 0; i < PHASE_COUNT; i++) total += ms[i];
+	return total;
+}
+
+const char* BuildStats::PhaseName( const Phase phase )
+{
+	static const char* name[PHASE_COUNT] = { "prepare", "subdivide", "compact", "collapse", "convert" };
+	return phase < PHASE_COUNT ? name[phase] : "unknown";
+}
+
+// Adds the lifetime of the timer to a phase of a BuildStats, minus the time of
+// timers that run inside it. Does nothing if stats is null.
+struct tinybvh_phase_timer
+{
+	tinybvh_phase_timer( BuildStats* buildStats, const BuildStats::Phase buildPhase ) : stats( buildStats ), phase( buildPhase )
+	{
+		if (!stats) return;
+		parent = (tinybvh_phase_timer*)stats->activeTimer, stats->activeTimer = this;
+		start = std::chrono::steady_clock::now();
+	}
+	~tinybvh_phase_timer()
+	{
+		if (!stats) return;
+		const double elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+		stats->ms[phase] += elapsed - nested, stats->activeTimer = parent;
+		if (parent) parent->nested += elapsed + before;
+	}
+	void Switch( const BuildStats::Phase next )
+	{
+		// end the current phase and continue timing the next one.
+		if (!stats) return;
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		const double elapsed = std::chrono::duration<double, std::milli>( now - start ).count();
+		stats->ms[phase] += elapsed - nested, before += elapsed, nested = 0, phase = next, start = now;
+	}
+	BuildStats* stats;
+	BuildStats::Phase phase;
+	tinybvh_phase_timer* parent = 0;
+	double nested = 0, before = 0; // time of nested timers; time of earlier phases.
+	std::chrono::steady_clock::time_point start;
+};
+
+static void tinybvh_count_build( BuildStats* stats, const uint32_t prims, const uint32_t nodes, const uint32_t fragments, const uint32_t taskPeak )
+{
+	if (!stats) return;
+	stats->builds++, stats->primitives += prims, stats->nodes += nodes, stats->splitFragments += fragments;
+	stats->taskStackPeak = tinybvh_max( stats->taskStackPeak, taskPeak );
+}
+
+// BVH implementation
+// ----------------------------------------------------------------------------
+
+BVH::~BVH()
+{
+	AlignedFree( bvhNode );
+	AlignedFree( primIdx );
+	AlignedFree( fragment );
+	AlignedFree( rrsHits );
+	AlignedFree( rrsVisits );
+	delete[] lazyState;
+}
+
+bool BVH::Save( const char* fileName )
+{
+	// saving is easy, it's the loading that will be complex.
+	BVH_FATAL_ERROR_IF( instList != 0, "BVH::Save( .. ), can't save a TLAS; use BVHScene::Save." );
+	BVH_FATAL_ERROR_IF( lazyState != 0, "BVH::Save( .. ), lazy BVH; call FinishLazy first." );
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	header = FileHeader();
+	section[0] = { BVHFileSection::NODES, bvhNode, usedNodes * sizeof( BVHNode ) };
+	section[1] = { BVHFileSection::PRIM_INDICES, primIdx, idxCount * sizeof( uint32_t ) };
+	return 2;
+}
+
+bool BVH::Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+bool BVH::Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+bool BVH::Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadFile( fileName, 0, vertices, indices, primCount );
+}
+
+bool BVH::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+bool BVH::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+bool BVH::Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// zero-copy load: nodes and indices are used directly from the mapped file.
+	return LoadFile( 0, &file, vertices, indices, primCount );
+}
+
+bool BVH::LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// open file and check contents
+	BVHFileHeader header;
+	FileSection section[2] = { { BVHFileSection::NODES, 0, 0 }, { BVHFileSection::PRIM_INDICES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 2 )) return false;
+	if (!FileMatchesGeometry( header, vertices, indices, primCount ) ||
+		section[0].size != header.nodeCount * sizeof( BVHNode ) || section[1].size != header.idxCount * sizeof( uint32_t ))
+	{
+		DiscardSections( file, section, 2 );
+		return false;
+	}
+	// all checks passed; safe to overwrite *this
+	AlignedFree( bvhNode );
+	AlignedFree( primIdx );
+	AlignedFree( fragment );
+	ApplyFileHeader( header );
+	bvhNode = (BVHNode*)section[0].data;
+	primIdx = (uint32_t*)section[1].data;
 	fragment = 0; // no need for this in a BVH that can't be rebuilt.
-	s.read( (char*)bvhNode, usedNodes * sizeof( BVHNode ) );
-	s.read( (char*)primIdx, idxCount * sizeof( uint32_t ) );
+	allocatedNodes = file ? 0 : usedNodes, newNodePtr = usedNodes;
+	SetMappedFile( file, section, 2 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
 	verts = vertices; // we can't load vertices since the BVH doesn't own this data.
 	vertIdx = (uint32_t*)indices;
+	instList = 0, blasList = 0, blasCount = 0;
 	// all ok.
 	return true;
 }
 
+void BVH::CloneFrom( const BVH& original )
+{
+	// copy of nodes and indices, allocated with this BVH's own context, e.g. on
+	// another NUMA node. Vertices, instances and BLASses are shared, not copied.
+	BVH_FATAL_ERROR_IF( original.lazyState != 0, "BVH::CloneFrom( .. ), finish the lazy build first." );
+	AlignedFree( bvhNode );
+	AlignedFree( primIdx );
+	AlignedFree( fragment );
+	const BVHContext ownContext = context;
+	CopyBasePropertiesFrom( original );
+	context = ownContext;
+	bvhNode = (BVHNode*)AlignedAlloc( original.usedNodes * sizeof( BVHNode ) );
+	primIdx = (uint32_t*)AlignedAlloc( original.idxCount * sizeof( uint32_t ) );
+	memcpy( bvhNode, original.bvhNode, original.usedNodes * sizeof( BVHNode ) );
+	memcpy( primIdx, original.primIdx, original.idxCount * sizeof( uint32_t ) );
+	fragment = 0, rebuildable = false; // no fragments; refits still work.
+	allocatedNodes = usedNodes = newNodePtr = original.usedNodes;
+	SetMappedFile( 0 );
+	verts = original.verts, vertIdx = original.vertIdx;
+	instList = original.instList, blasList = original.blasList, blasCount = original.blasCount;
+	customIntersect = original.customIntersect, customIsOccluded = original.customIsOccluded;
+}
+
+void BVH::ReserveNodes( const uint32_t capacity )
+{
+	// loaded node data is tightly packed; SplitLeafs needs room to grow.
+	if (allocatedNodes >= capacity) return;
+	BVHNode* newNodes = (BVHNode*)AlignedAlloc( capacity * sizeof( BVHNode ) );
+	memcpy( newNodes, bvhNode, usedNodes * sizeof( BVHNode ) );
+	AlignedFree( bvhNode );
+	bvhNode = newNodes, allocatedNodes = capacity;
+}
+
 void BVH::BuildDefault( const bvhvec4* vertices, const uint32_t primCount )
 {
 	// access point for builds over a raw list of vertices. The stride of
@@ -1634,6 +3920,8 @@ void BVH::BuildDefault( const bvhvec4slice& vertices, const uint32_t* indices, c
 
 void BVH::ConvertFrom( const BVH_Verbose& original, bool compact )
 {
+	BVH_FATAL_ERROR_IF( lazyState != 0, "BVH::ConvertFrom( .. ), lazy BVH; call FinishLazy first." );
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// allocate space
 	const uint32_t spaceNeeded = compact ? original.usedNodes : original.allocatedNodes;
 	if (allocatedNodes < spaceNeeded)
@@ -1687,6 +3975,13 @@ float BVH::SAHCost( const uint32_t nodeIdx ) const
 
 float BVH::PrimArea( const uint32_t p ) const
 {
+	if (quadsEnabled && bvh_over_quads)
+	{
+		uint32_t i0, i1, i2, i3, idx = primIdx[p];
+		GET_QUAD_INDICES_I0_I1_I2_I3( (*this), idx );
+		const bvhvec3 v0 = verts[i0], v1 = verts[i1], v2 = verts[i2], v3 = verts[i3];
+		return 0.5f * (tinybvh_length( tinybvh_cross( v1 - v0, v3 - v0 ) ) + tinybvh_length( tinybvh_cross( v3 - v2, v1 - v2 ) ));
+	}
 	uint32_t vidx = primIdx[p] * 3;
 	bvhvec3 v0, v1, v2;
 	if (vertIdx) v0 = verts[vertIdx[vidx]], v1 = verts[vertIdx[vidx + 1]], v2 = verts[vertIdx[vidx + 2]];
@@ -1714,44 +4009,19 @@ float BVH::EPOArea( const uint32_t subtreeRoot, const uint32_t nodeIdx ) const
 		const bvhvec3 bmin = subtree.aabbMin, bmax = subtree.aabbMax;
 		for( unsigned i = 0; i < n.triCount; i++ )
 		{
-			// Sutherland-Hodgeman against six bounding planes
 			uint32_t Nin = 3, vidx = primIdx[n.leftFirst + i] * 3;
-			bvhvec3 vin[10], vout[10], C;
-			if (vertIdx)
+			bvhvec3 vin[12];
+			if (quadsEnabled && bvh_over_quads)
+			{
+				uint32_t i0, i1, i2, i3, idx = primIdx[n.leftFirst + i];
+				GET_QUAD_INDICES_I0_I1_I2_I3( (*this), idx );
+				vin[0] = verts[i0], vin[1] = verts[i1], vin[2] = verts[i2], vin[3] = verts[i3], Nin = 4;
+			}
+			else if (vertIdx)
 				vin[0] = verts[vertIdx[vidx]], vin[1] = verts[vertIdx[vidx + 1]], vin[2] = verts[vertIdx[vidx + 2]];
 			else
 				vin[0] = verts[vidx], vin[1] = verts[vidx + 1], vin[2] = verts[vidx + 2];
-			for (uint32_t a = 0; a < 3; a++)
-			{
-				uint32_t Nout = 0;
-				const float l = bmin[a], r = bmax[a];
-				for (uint32_t v = 0; v < Nin; v++)
-				{
-					bvhvec3 v0 = vin[v], v1 = vin[(v + 1) % Nin];
-					const bool v0in = v0[a] >= l, v1in = v1[a] >= l;
-					if (!(v0in || v1in)) continue; else if (v0in ^ v1in)
-						C = v0 + (l - v0[a]) / (v1[a] - v0[a]) * (v1 - v0),
-						C[a] = l /* accurate */, vout[Nout++] = C;
-					if (v1in) vout[Nout++] = v1;
-				}
-				Nin = 0;
-				for (uint32_t v = 0; v < Nout; v++)
-				{
-					bvhvec3 v0 = vout[v], v1 = vout[(v + 1) % Nout];
-					const bool v0in = v0[a] <= r, v1in = v1[a] <= r;
-					if (!(v0in || v1in)) continue; else if (v0in ^ v1in)
-						C = v0 + (r - v0[a]) / (v1[a] - v0[a]) * (v1 - v0),
-						C[a] = r /* accurate */, vin[Nin++] = C;
-					if (v1in) vin[Nin++] = v1;
-				}
-			}
-			if (Nin < 3) continue;
-			// calculate area of remaining convex shape in vin
-			const uint32_t tris = Nin - 2;
-			bvhvec3 v0 = vin[0], v1, v2;
-			for( uint32_t j = 0; j < tris; j++ )
-				v1 = vin[j + 1], v2 = vin[j + 2],
-				area += 0.5f * tinybvh_length( tinybvh_cross( v1 - v0, v2 - v0 ) );
+			area += tinybvh_clipped_area( vin, Nin, bmin, bmax );
 		}
 		return area;
 	}
@@ -1777,8 +4047,21 @@ float BVH::EPOCost( const uint32_t nodeIdx ) const
 	return (1.0f - W_EPO) * SAHCost( 0 ) + W_EPO * cost;
 }
 
+BVHQuality BVH::Analyze( const bool epo ) const
+{
+	// Tree quality metrics, see BVHQuality. EPO is by far the most expensive
+	// metric; pass epo = false to skip it.
+	BVHQuality q;
+	if (usedNodes == 0) return q;
+	const tinybvh_bvh_view view = { *this };
+	q = tinybvh_analyze( *this, view, epo );
+	tinybvh_set_footprint( q, usedNodes * sizeof( BVHNode ) + (uint64_t)idxCount * sizeof( uint32_t ), triCount );
+	return q;
+}
+
 void BVH::SplitLeafs( const uint32_t maxPrims )
 {
+	ReserveNodes( idxCount * 2 ); // loaded BVHs are tightly packed.
 	uint32_t stack[64], stackPtr = 0, nodeIdx = 0;
 	while (1)
 	{
@@ -1829,6 +4112,7 @@ void BVH::BuildQuick( const bvhvec4* vertices, const uint32_t primCount )
 void BVH::BuildQuick( const bvhvec4slice& vertices )
 {
 	BVH_FATAL_ERROR_IF( vertices.count == 0, "BVH::BuildQuick( .. ), primCount == 0." );
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::PREPARE );
 	// allocate on first build
 	const uint32_t primCount = vertices.count / 3;
 	const uint32_t spaceNeeded = primCount * 2; // upper limit
@@ -1844,7 +4128,7 @@ void BVH::BuildQuick( const bvhvec4slice& vertices )
 		fragment = (Fragment*)AlignedAlloc( primCount * sizeof( Fragment ) );
 	}
 	else BVH_FATAL_ERROR_IF( !rebuildable, "BVH::BuildQuick( .. ), bvh not rebuildable." );
-	verts = vertices; // note: we're not copying this data; don't delete.
+	verts = vertices, bvh_over_quads = false; // note: we're not copying this data; don't delete.
 	idxCount = triCount = primCount;
 	// reset node pool
 	newNodePtr = 2;
@@ -1860,7 +4144,8 @@ void BVH::BuildQuick( const bvhvec4slice& vertices )
 		root.aabbMax = tinybvh_max( root.aabbMax, fragment[i].bmax ), primIdx[i] = i;
 	}
 	// subdivide recursively
-	uint32_t task[256], taskCount = 0, nodeIdx = 0;
+	timer.Switch( BuildStats::SUBDIVIDE );
+	uint32_t task[256], taskCount = 0, taskPeak = 0, nodeIdx = 0;
 	while (1)
 	{
 		while (1)
@@ -1896,7 +4181,7 @@ void BVH::BuildQuick( const bvhvec4slice& vertices )
 			bvhNode[rci].leftFirst = j, bvhNode[rci].triCount = rightCount;
 			node.leftFirst = lci, node.triCount = 0;
 			// recurse
-			task[taskCount++] = rci, nodeIdx = lci;
+			task[taskCount++] = rci, nodeIdx = lci, taskPeak = tinybvh_max( taskPeak, taskCount );
 		}
 		// fetch subdivision task from stack
 		if (taskCount == 0) break; else nodeIdx = task[--taskCount];
@@ -1906,6 +4191,7 @@ void BVH::BuildQuick( const bvhvec4slice& vertices )
 	refittable = true; // not using spatial splits: can refit this BVH
 	may_have_holes = false; // the reference builder produces a continuous list of nodes
 	usedNodes = newNodePtr;
+	tinybvh_count_build( context.buildStats, triCount, usedNodes, 0, taskPeak );
 }
 
 // Basic single-function binned-SAH-builder.
@@ -1933,17 +4219,89 @@ void BVH::Build( const bvhvec4* vertices, const uint32_t* indices, const uint32_
 	Build( bvhvec4slice{ vertices, prims * 3, sizeof( bvhvec4 ) }, indices, prims );
 }
 
-void BVH::Build( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+void BVH::Build( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+{
+	// build the BVH from vertices stored in a slice, indexed by 'indices'.
+	PrepareBuild( vertices, indices, prims );
+	Build();
+}
+
+void BVH::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount )
+{
+	PrepareCustomBuild( primCount );
+	for (uint32_t i = 0; i < primCount; i++) customGetAABB( i, fragment[i].bmin, fragment[i].bmax );
+	FinalizeCustomBuild();
+}
+
+void BVH::PrepareCustomBuild( const uint32_t primCount )
+{
+	BVH_FATAL_ERROR_IF( primCount == 0, "BVH::Build( void (*customGetAABB)( .. ), instCount ), instCount == 0." );
+	triCount = idxCount = primCount, bvh_over_quads = false;
+	const uint32_t spaceNeeded = primCount * 2; // upper limit
+	if (allocatedNodes < spaceNeeded)
+	{
+		AlignedFree( bvhNode );
+		AlignedFree( primIdx );
+		AlignedFree( fragment );
+		bvhNode = (BVHNode*)AlignedAlloc( spaceNeeded * sizeof( BVHNode ) );
+		allocatedNodes = spaceNeeded;
+		memset( &bvhNode[1], 0, 32 );	// node 1 remains unused, for cache line alignment.
+		primIdx = (uint32_t*)AlignedAlloc( primCount * sizeof( uint32_t ) );
+		fragment = (Fragment*)AlignedAlloc( primCount * sizeof( Fragment ) );
+	}
+}
+
+void BVH::FinalizeCustomBuild()
+{
+	// fragment bounds have been filled in by the caller; complete and build.
+	BVHNode& root = bvhNode[0];
+	root.leftFirst = 0, root.triCount = triCount, root.aabbMin = bvhvec3( BVH_FAR ), root.aabbMax = bvhvec3( -BVH_FAR );
+	for (uint32_t i = 0; i < triCount; i++)
+	{
+		fragment[i].primIdx = i, fragment[i].clipped = 0, primIdx[i] = i;
+		root.aabbMin = tinybvh_min( root.aabbMin, fragment[i].bmin );
+		root.aabbMax = tinybvh_max( root.aabbMax, fragment[i].bmax );
+	}
+	// start build
+	newNodePtr = 2;
+	Build(); // or BuildAVX, for large TLAS.
+}
+
+// Quad builder: each primitive is a quad with vertices v0, v1, v2, v3, in
+// order around the perimeter. Quads are intersected as two triangles sharing
+// edge v1-v3; hit.u and hit.v are reported in the quad parametrization
+// P(u,v) = v0 + u * (v1 - v0) + v * (v3 - v0), which is exact for planar
+// parallelograms. Supported layouts: BVH, MBVH, BVH4_CPU and BVH8_CPU.
+void BVH::BuildQuads( const bvhvec4* vertices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice{ vertices, quadCount * 4, sizeof( bvhvec4 ) } );
+}
+
+void BVH::BuildQuads( const bvhvec4slice& vertices )
+{
+	PrepareQuadBuild( vertices, 0, 0 /* empty index list; quad count is derived from slice */ );
+	Build();
+}
+
+void BVH::BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	// build the BVH over quads, indexed by 'indices', four per quad.
+	BuildQuads( bvhvec4slice{ vertices, quadCount * 4, sizeof( bvhvec4 ) }, indices, quadCount );
+}
+
+void BVH::BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount )
 {
-	// build the BVH from vertices stored in a slice, indexed by 'indices'.
-	PrepareBuild( vertices, indices, prims );
+	PrepareQuadBuild( vertices, indices, quadCount );
 	Build();
 }
 
-void BVH::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount )
+void BVH::PrepareQuadBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quads )
 {
-	BVH_FATAL_ERROR_IF( primCount == 0, "BVH::Build( void (*customGetAABB)( .. ), instCount ), instCount == 0." );
-	triCount = idxCount = primCount;
+	BVH_FATAL_ERROR_IF( !quadsEnabled, "BVH::PrepareQuadBuild( .. ), quads disabled (NO_QUAD_GEOMETRY)." );
+	BVH_FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareQuadBuild( .. ), empty vertex slice." );
+	BVH_FATAL_ERROR_IF( indices != 0 && quads == 0, "BVH::PrepareQuadBuild( .. ), quads == 0." );
+	BVH_FATAL_ERROR_IF( indices == 0 && vertices.count < 4, "BVH::PrepareQuadBuild( .. ), less than four vertices." );
+	const uint32_t primCount = indices ? quads : vertices.count / 4;
 	const uint32_t spaceNeeded = primCount * 2; // upper limit
 	if (allocatedNodes < spaceNeeded)
 	{
@@ -1956,19 +4314,23 @@ void BVH::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), cons
 		primIdx = (uint32_t*)AlignedAlloc( primCount * sizeof( uint32_t ) );
 		fragment = (Fragment*)AlignedAlloc( primCount * sizeof( Fragment ) );
 	}
-	// copy relevant data from instance array
+	else BVH_FATAL_ERROR_IF( !rebuildable, "BVH::PrepareQuadBuild( .. ), bvh not rebuildable." );
+	verts = vertices, idxCount = triCount = primCount, vertIdx = (uint32_t*)indices;
 	BVHNode& root = bvhNode[0];
-	root.leftFirst = 0, root.triCount = primCount, root.aabbMin = bvhvec3( BVH_FAR ), root.aabbMax = bvhvec3( -BVH_FAR );
-	for (uint32_t i = 0; i < primCount; i++)
+	root.leftFirst = 0, root.triCount = triCount, root.aabbMin = bvhvec3( BVH_FAR ), root.aabbMax = bvhvec3( -BVH_FAR );
+	for (uint32_t i0, i1, i2, i3, i = 0; i < triCount; i++)
 	{
-		customGetAABB( i, fragment[i].bmin, fragment[i].bmax );
+		GET_QUAD_INDICES_I0_I1_I2_I3( (*this), i );
+		const bvhvec4 v0 = verts[i0], v1 = verts[i1], v2 = verts[i2], v3 = verts[i3];
+		fragment[i].bmin = tinybvh_min( tinybvh_min( v0, v1 ), tinybvh_min( v2, v3 ) );
+		fragment[i].bmax = tinybvh_max( tinybvh_max( v0, v1 ), tinybvh_max( v2, v3 ) );
 		fragment[i].primIdx = i, fragment[i].clipped = 0, primIdx[i] = i;
 		root.aabbMin = tinybvh_min( root.aabbMin, fragment[i].bmin );
 		root.aabbMax = tinybvh_max( root.aabbMax, fragment[i].bmax );
 	}
-	// start build
+	// reset node pool
 	newNodePtr = 2;
-	Build(); // or BuildAVX, for large TLAS.
+	bvh_over_indices = indices != nullptr, bvh_over_quads = true;
 }
 
 void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t bCount )
@@ -1987,7 +4349,7 @@ void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** bl
 		primIdx = (uint32_t*)AlignedAlloc( instCount * sizeof( uint32_t ) );
 		fragment = (Fragment*)AlignedAlloc( instCount * sizeof( Fragment ) );
 	}
-	instList = instances;
+	instList = instances, bvh_over_quads = false;
 	blasList = blasses;
 	blasCount = bCount;
 	// copy relevant data from instance array
@@ -2013,6 +4375,7 @@ void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** bl
 
 void BVH::PrepareBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims )
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::PREPARE );
 #ifdef SLICEDUMP
 	// this code dumps the passed geometry data to a file - for debugging only.
 	std::fstream df{ "dump.bin", df.binary | df.out };
@@ -2042,6 +4405,8 @@ void BVH::PrepareBuild( const bvhvec4slice& vertices, const uint32_t* indices, c
 	}
 	else BVH_FATAL_ERROR_IF( !rebuildable, "BVH::PrepareBuild( .. ), bvh not rebuildable." );
 	verts = vertices, idxCount = triCount = primCount, vertIdx = (uint32_t*)indices;
+	delete[] lazyState, lazyState = 0, lazyNodes = 0; // a regular build is never lazy.
+	ResetRayStats(); // ray statistics refer to the old tree.
 	// prepare fragments
 	BVH_FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareBuild( .. ), empty vertex slice." );
 	BVHNode& root = bvhNode[0];
@@ -2090,7 +4455,26 @@ void BVH::Build()
 		return;
 	}
 	// subdivide root node recursively
-	uint32_t task[256], taskCount = 0, nodeIdx = 0;
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::SUBDIVIDE );
+	const uint32_t taskPeak = context.parallelBuild && triCount >= PARALLEL_BUILD_PRIMS ? SubdivideParallel( false ) : Subdivide( 0, newNodePtr, 0 );
+	// all done.
+	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	refittable = true; // not using spatial splits: can refit this BVH
+	may_have_holes = false; // the reference builder produces a continuous list of nodes
+	bvh_over_aabbs = (verts == 0); // bvh over aabbs is suitable as TLAS
+	usedNodes = newNodePtr;
+	tinybvh_count_build( context.buildStats, triCount, usedNodes, 0, taskPeak );
+}
+
+// Binned SAH subdivision of the subtree at nodeIdx, shared by Build, the
+// lazy builder and the RDH builder. New node pairs are taken from nodePtr.
+// Nodes with stopPrims or fewer primitives are left as leaves; 0 subdivides
+// all the way. If weight is set, primitives count as weight[prim] instead of 1.
+// Returns the peak size of the task stack. Subtrees over disjoint primIdx and
+// node ranges can be subdivided concurrently.
+uint32_t BVH::Subdivide( uint32_t nodeIdx, uint32_t& nodePtr, const uint32_t stopPrims, const float* weight )
+{
+	uint32_t task[256], taskCount = 0, taskPeak = 0;
 	BVHNode& root = bvhNode[0];
 	bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-20f, bestLMin = 0, bestLMax = 0, bestRMin = 0, bestRMax = 0;
 	while (1)
@@ -2098,11 +4482,14 @@ void BVH::Build()
 		while (1)
 		{
 			BVHNode& node = bvhNode[nodeIdx];
+			if (node.triCount <= stopPrims) break; // lazy build: leave this one for later.
 			// find optimal object split
 			bvhvec3 binMin[3][BVHBINS], binMax[3][BVHBINS];
 			for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < BVHBINS; i++) binMin[a][i] = BVH_FAR, binMax[a][i] = -BVH_FAR;
 			uint32_t count[3][BVHBINS];
+			float binWeight[3][BVHBINS], nodeWeight = 0;
 			memset( count, 0, BVHBINS * 3 * sizeof( uint32_t ) );
+			if (weight) memset( binWeight, 0, BVHBINS * 3 * sizeof( float ) );
 			const bvhvec3 rpd3 = bvhvec3( BVHBINS / (node.aabbMax - node.aabbMin) ), nmin3 = node.aabbMin;
 			for (uint32_t i = 0; i < node.triCount; i++) // process all tris for x,y and z at once
 			{
@@ -2117,6 +4504,11 @@ void BVH::Build()
 				binMax[1][bi.y] = tinybvh_max( binMax[1][bi.y], fragment[fi].bmax ), count[1][bi.y]++;
 				binMin[2][bi.z] = tinybvh_min( binMin[2][bi.z], fragment[fi].bmin );
 				binMax[2][bi.z] = tinybvh_max( binMax[2][bi.z], fragment[fi].bmax ), count[2][bi.z]++;
+				if (weight)
+				{
+					const float w = weight[fi];
+					binWeight[0][bi.x] += w, binWeight[1][bi.y] += w, binWeight[2][bi.z] += w, nodeWeight += w;
+				}
 			}
 			// calculate per-split totals
 			float splitCost = BVH_FAR, rSAV = 1.0f / node.SurfaceArea();
@@ -2126,6 +4518,7 @@ void BVH::Build()
 				bvhvec3 lBMin[BVHBINS - 1], rBMin[BVHBINS - 1], l1 = BVH_FAR, l2 = -BVH_FAR;
 				bvhvec3 lBMax[BVHBINS - 1], rBMax[BVHBINS - 1], r1 = BVH_FAR, r2 = -BVH_FAR;
 				float ANL[BVHBINS - 1], ANR[BVHBINS - 1];
+				float lW = 0, rW = 0;
 				for (uint32_t lN = 0, rN = 0, i = 0; i < BVHBINS - 1; i++)
 				{
 					lBMin[i] = l1 = tinybvh_min( l1, binMin[a][i] );
@@ -2133,8 +4526,9 @@ void BVH::Build()
 					lBMax[i] = l2 = tinybvh_max( l2, binMax[a][i] );
 					rBMax[BVHBINS - 2 - i] = r2 = tinybvh_max( r2, binMax[a][BVHBINS - 1 - i] );
 					lN += count[a][i], rN += count[a][BVHBINS - 1 - i];
-					ANL[i] = lN == 0 ? BVH_FAR : (tinybvh_half_area( l2 - l1 ) * (float)lN);
-					ANR[BVHBINS - 2 - i] = rN == 0 ? BVH_FAR : (tinybvh_half_area( r2 - r1 ) * (float)rN);
+					if (weight) lW += binWeight[a][i], rW += binWeight[a][BVHBINS - 1 - i];
+					ANL[i] = lN == 0 ? BVH_FAR : (tinybvh_half_area( l2 - l1 ) * (weight ? lW : (float)lN));
+					ANR[BVHBINS - 2 - i] = rN == 0 ? BVH_FAR : (tinybvh_half_area( r2 - r1 ) * (weight ? rW : (float)rN));
 				}
 				// evaluate bin totals to find best position for object split
 				for (uint32_t i = 0; i < BVHBINS - 1; i++)
@@ -2148,7 +4542,7 @@ void BVH::Build()
 				}
 			}
 			splitCost = c_trav + c_int * rSAV * splitCost;
-			float noSplitCost = (float)node.triCount * c_int;
+			float noSplitCost = (weight ? nodeWeight : (float)node.triCount) * c_int;
 			if (splitCost >= noSplitCost) break; // not splitting is better.
 			// in-place partition
 			uint32_t j = node.leftFirst + node.triCount, src = node.leftFirst;
@@ -2163,26 +4557,347 @@ void BVH::Build()
 			// create child nodes
 			uint32_t leftCount = src - node.leftFirst, rightCount = node.triCount - leftCount;
 			if (leftCount == 0 || rightCount == 0 || taskCount == BVH_NUM_ELEMS( task )) break; // should not happen.
-			const int32_t lci = newNodePtr++, rci = newNodePtr++;
+			const int32_t lci = nodePtr++, rci = nodePtr++;
 			bvhNode[lci].aabbMin = bestLMin, bvhNode[lci].aabbMax = bestLMax;
 			bvhNode[lci].leftFirst = node.leftFirst, bvhNode[lci].triCount = leftCount;
 			bvhNode[rci].aabbMin = bestRMin, bvhNode[rci].aabbMax = bestRMax;
 			bvhNode[rci].leftFirst = j, bvhNode[rci].triCount = rightCount;
 			node.leftFirst = lci, node.triCount = 0;
 			// recurse
-			task[taskCount++] = rci, nodeIdx = lci;
+			task[taskCount++] = rci, nodeIdx = lci, taskPeak = tinybvh_max( taskPeak, taskCount );
 		}
 		// fetch subdivision task from stack
 		if (taskCount == 0) break; else nodeIdx = task[--taskCount];
 	}
-	// all done.
+	return taskPeak;
+}
+
+// Parallel subdivision, for large builds. The top of the tree is subdivided
+// first; its leaves are then subdivided in parallel, each into the node range
+// that BuildLazy reserves for it: two slots per primitive, behind the top.
+// Compact removes the unused slots. The splits are those of a serial build.
+uint32_t BVH::SubdivideParallel( const bool avx )
+{
+	const uint32_t topPrims = tinybvh_max( triCount / 256, 1024u );
+#ifdef BVH_USEAVX
+	uint32_t taskPeak = avx ? SubdivideAVX( 0, newNodePtr, topPrims ) : Subdivide( 0, newNodePtr, topPrims );
+#else
+	(void)avx;
+	uint32_t taskPeak = Subdivide( 0, newNodePtr, topPrims );
+#endif
+	const uint32_t topNodes = usedNodes = newNodePtr;
+	ReserveNodes( topNodes + triCount * 2 );
+	uint32_t* leaf = (uint32_t*)AlignedAlloc( topNodes * sizeof( uint32_t ) ), leafCount = 0;
+	for (uint32_t i = 0; i < topNodes; i++) if (i != 1 && bvhNode[i].isLeaf()) leaf[leafCount++] = i;
+	std::atomic<uint32_t> peak( taskPeak );
+	tinybvh_parallel_for( context, leafCount, 1, [&]( const uint32_t i )
+		{
+			const BVHNode& node = bvhNode[leaf[i]];
+			const uint32_t subtree = topNodes + node.leftFirst * 2;
+			uint32_t nodePtr = subtree + 2, p;
+			bvhNode[subtree] = node; // slot subtree + 1 remains unused, like node 1.
+		#ifdef BVH_USEAVX
+			p = avx ? SubdivideAVX( subtree, nodePtr, 0 ) : Subdivide( subtree, nodePtr, 0 );
+		#else
+			p = Subdivide( subtree, nodePtr, 0 );
+		#endif
+			uint32_t prev = peak.load();
+			while (p > prev && !peak.compare_exchange_weak( prev, p ));
+		} );
+	// link the subtrees into the top and remove the holes.
+	for (uint32_t i = 0; i < leafCount; i++)
+	{
+		BVHNode& node = bvhNode[leaf[i]];
+		const BVHNode& root = bvhNode[topNodes + node.leftFirst * 2];
+		if (!root.isLeaf()) node = root;
+	}
+	AlignedFree( leaf );
+	usedNodes = topNodes + triCount * 2;
+	Compact();
+	return peak.load();
+}
+
+// Lazy BVH construction.
+// BuildLazy only subdivides the top of the tree; leaves in this top part are
+// 'pending': valid but large leaves over a range of primIdx. A pending node is
+// refined the first time a ray visits it, into a block of nodes reserved for
+// it behind the top: two slots per primitive, at lazyNodes + 2 * first prim.
+// Ranges are disjoint, so refinement needs no shared node counter, and the
+// top nodes are never modified. Refinement does reorder the primIdx range of
+// the pending node, so a thread that finds a node being refined waits until
+// it is done. The result has the same splits as BVH::Build.
+void BVH::BuildLazy( const bvhvec4* vertices, const uint32_t primCount, const uint32_t pendingPrims )
+{
+	BuildLazy( bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, pendingPrims );
+}
+
+void BVH::BuildLazy( const bvhvec4slice& vertices, const uint32_t pendingPrims )
+{
+	BuildLazy( vertices, 0, 0, pendingPrims );
+}
+
+void BVH::BuildLazy( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims, const uint32_t pendingPrims )
+{
+	PrepareBuild( vertices, indices, prims );
+	const uint32_t taskPeak = Subdivide( 0, newNodePtr, tinybvh_max( pendingPrims, 1u ) );
+	if (context.buildStats) context.buildStats->taskStackPeak = tinybvh_max( context.buildStats->taskStackPeak, taskPeak );
+	// reserve room for the refined subtrees; pairs stay cache line aligned.
+	lazyNodes = usedNodes = newNodePtr;
+	ReserveNodes( lazyNodes + triCount * 2 );
+	usedNodes = lazyNodes + triCount * 2;
+	lazyState = new std::atomic<uint32_t>[lazyNodes];
+	for (uint32_t i = 0; i < lazyNodes; i++) lazyState[i].store( LAZY_PENDING, std::memory_order_relaxed );
 	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
-	refittable = true; // not using spatial splits: can refit this BVH
-	may_have_holes = false; // the reference builder produces a continuous list of nodes
-	bvh_over_aabbs = (verts == 0); // bvh over aabbs is suitable as TLAS
+	refittable = false; // the reserved blocks are mostly empty until refined
+	may_have_holes = true;
+	bvh_over_aabbs = false;
+}
+
+uint32_t BVH::ExpandLazy( const uint32_t nodeIdx )
+{
+	// refine a pending node, once. Returns the root of the refined subtree; if
+	// another thread is refining it right now, waits for that. Thread-safe.
+	if (nodeIdx >= lazyNodes || !bvhNode[nodeIdx].isLeaf()) return nodeIdx;
+	const BVHNode& node = bvhNode[nodeIdx];
+	const uint32_t subtree = lazyNodes + node.leftFirst * 2;
+	std::atomic<uint32_t>& state = lazyState[nodeIdx];
+	if (state.load( std::memory_order_acquire ) == LAZY_DONE) return subtree;
+	uint32_t expected = LAZY_PENDING;
+	if (!state.compare_exchange_strong( expected, LAZY_BUSY, std::memory_order_acquire ))
+	{
+		// the primIdx range is being partitioned; its leaf can't be used meanwhile.
+		while (state.load( std::memory_order_acquire ) != LAZY_DONE)
+		{
+		#ifndef TINYBVH_NO_THREADS
+			std::this_thread::yield();
+		#endif
+		}
+		return subtree;
+	}
+	bvhNode[subtree] = node; // slot subtree + 1 remains unused, like node 1.
+	uint32_t nodePtr = subtree + 2;
+	Subdivide( subtree, nodePtr, 0 );
+	state.store( LAZY_DONE, std::memory_order_release );
+	return subtree;
+}
+
+void BVH::FinishLazy()
+{
+	// refine whatever is still pending and link the subtrees into the top, so
+	// the regular traversal code sees the full tree. Compact then removes the
+	// unused slots, which leaves a regular, refittable BVH. Not thread-safe.
+	if (!lazyState) return;
+	for (uint32_t i = 0; i < lazyNodes; i++) if (i != 1 && bvhNode[i].isLeaf()) bvhNode[i] = bvhNode[ExpandLazy( i )];
+	delete[] lazyState, lazyState = 0, lazyNodes = 0;
+	Compact();
+	refittable = true, may_have_holes = false;
+}
+
+int32_t BVH::IntersectLazy( Ray& ray )
+{
+	// traversal for a BVH built with BuildLazy: the regular kernel, with pending
+	// nodes refined on the way, or waited for while another thread refines them.
+	VALIDATE_RAY( ray );
+	LazyVisit visit = { {}, this };
+	return IntersectVisit( ray, visit );
+}
+
+bool BVH::IsOccludedLazy( const Ray& ray )
+{
+	VALIDATE_RAY( ray );
+	LazyVisit visit = { {}, this };
+	return IsOccludedVisit( ray, visit );
+}
+
+// Ray distribution heuristic (RDH).
+// Ray statistics are gathered with IntersectAndSample (e.g. for a fraction of
+// the rays of a frame) or SampleRays (for a representative ray set). BuildRDH
+// then rebuilds the BVH with a binned SAH in which each primitive counts in
+// proportion to the measured ray density around it, so the tree is refined
+// where the rays are. Sampling is not thread-safe.
+int32_t BVH::IntersectAndSample( Ray& ray )
+{
+	// regular traversal, counting node visits and the final hit.
+	VALIDATE_RAY( ray );
+	BVH_FATAL_ERROR_IF( bvh_over_quads || verts.data == 0, "BVH::IntersectAndSample( .. ), triangles only." );
+	if (!rrsVisits)
+	{
+		rrsVisits = (uint32_t*)AlignedAlloc( usedNodes * sizeof( uint32_t ) );
+		rrsHits = (uint32_t*)AlignedAlloc( triCount * sizeof( uint32_t ) );
+		memset( rrsVisits, 0, usedNodes * sizeof( uint32_t ) );
+		memset( rrsHits, 0, triCount * sizeof( uint32_t ) );
+	}
+	struct Sample : NoVisit
+	{
+		uint32_t* visits;
+		void Interior( const uint32_t nodeIdx ) { visits[nodeIdx]++; }
+		void Leaf( const uint32_t nodeIdx, const BVHNode& ) { visits[nodeIdx]++; }
+	} sample = { {}, rrsVisits };
+	const int32_t cost = IntersectVisit( ray, sample );
+	if (ray.hit.t < BVH_FAR) rrsHits[ray.hit.prim & PRIM_IDX_MASK]++;
+	rrsRays++;
+	return cost;
+}
+
+float BVH::SampleRays( const Ray* rays, const uint32_t rayCount )
+{
+	// sample a ray set; returns the average traversal cost per ray.
+	float cost = 0;
+	for (uint32_t i = 0; i < rayCount; i++)
+	{
+		Ray ray = rays[i];
+		cost += (float)IntersectAndSample( ray );
+	}
+	return rayCount ? cost / (float)rayCount : 0;
+}
+
+void BVH::ResetRayStats()
+{
+	AlignedFree( rrsHits );
+	AlignedFree( rrsVisits );
+	rrsHits = rrsVisits = 0, rrsRays = 0;
+}
+
+void BVH::BuildRDH( const float rayWeight )
+{
+	// rebuild over the same triangles. Primitive weight: (1 - rayWeight) plus
+	// rayWeight times the ray density, i.e. the visits of its leaf plus its hits,
+	// relative to the average. Without samples this is a regular SAH build.
+	BVH_FATAL_ERROR_IF( bvh_over_quads || verts.data == 0, "BVH::BuildRDH( .. ), triangles only." );
+	float* weight = 0;
+	if (rrsRays > 0)
+	{
+		weight = (float*)AlignedAlloc( triCount * sizeof( float ) );
+		memset( weight, 0, triCount * sizeof( float ) );
+		double sum = 0;
+		uint32_t nodeIdx = 0, stack[64], stackPtr = 0;
+		while (1)
+		{
+			const BVHNode& node = bvhNode[nodeIdx];
+			if (node.isLeaf())
+			{
+				for (uint32_t i = 0; i < node.triCount; i++)
+				{
+					const uint32_t pi = primIdx[node.leftFirst + i];
+					const float density = (float)rrsVisits[nodeIdx] + (float)rrsHits[pi];
+					weight[pi] += density, sum += density; // spatial splits: a prim can be in several leaves.
+				}
+				if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+				continue;
+			}
+			nodeIdx = node.leftFirst, stack[stackPtr++] = node.leftFirst + 1;
+		}
+		const float w = tinybvh_clamp( rayWeight, 0.0f, RDH_MAX_WEIGHT ); // keep unvisited prims in play
+		const float scale = sum > 0 ? w * (float)((double)triCount / sum) : 0;
+		for (uint32_t i = 0; i < triCount; i++) weight[i] = (1 - w) + weight[i] * scale;
+	}
+	PrepareBuild( verts, vertIdx, vertIdx ? triCount : 0 );
+	const uint32_t taskPeak = Subdivide( 0, newNodePtr, 0, weight );
+	if (context.buildStats) context.buildStats->taskStackPeak = tinybvh_max( context.buildStats->taskStackPeak, taskPeak );
+	AlignedFree( weight );
+	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	refittable = true, may_have_holes = false, bvh_over_aabbs = false;
 	usedNodes = newNodePtr;
 }
 
+float BVH::OptimizeRDH( const Ray* rays, const uint32_t rayCount, const uint32_t iterations, const float rayWeight )
+{
+	// alternate sampling and RDH rebuilds; keeps the tree with the lowest measured
+	// cost, which may be the original one. Returns its average cost per ray.
+	const float initialCost = SampleRays( rays, rayCount );
+	float bestCost = idxCount == triCount ? initialCost : BVH_FAR; // spatial splits: can't restore it.
+	const uint32_t capacity = tinybvh_max( usedNodes, triCount * 2 );
+	BVHNode* bestNodes = (BVHNode*)AlignedAlloc( capacity * sizeof( BVHNode ) );
+	uint32_t* bestIdx = (uint32_t*)AlignedAlloc( triCount * sizeof( uint32_t ) );
+	uint32_t bestUsed = usedNodes;
+	bool bestHoles = may_have_holes, bestRefittable = refittable, bestIsCurrent = true;
+	if (bestCost < BVH_FAR)
+	{
+		memcpy( bestNodes, bvhNode, usedNodes * sizeof( BVHNode ) );
+		memcpy( bestIdx, primIdx, triCount * sizeof( uint32_t ) );
+	}
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		BuildRDH( rayWeight );
+		const float cost = SampleRays( rays, rayCount );
+		bestIsCurrent = cost < bestCost;
+		if (!bestIsCurrent) continue;
+		bestCost = cost, bestUsed = usedNodes, bestHoles = false, bestRefittable = true;
+		memcpy( bestNodes, bvhNode, usedNodes * sizeof( BVHNode ) );
+		memcpy( bestIdx, primIdx, triCount * sizeof( uint32_t ) );
+	}
+	if (!bestIsCurrent)
+	{
+		memcpy( bvhNode, bestNodes, bestUsed * sizeof( BVHNode ) );
+		memcpy( primIdx, bestIdx, triCount * sizeof( uint32_t ) );
+		usedNodes = bestUsed, may_have_holes = bestHoles, refittable = bestRefittable;
+		ResetRayStats();
+	}
+	AlignedFree( bestNodes );
+	AlignedFree( bestIdx );
+	return bestCost < BVH_FAR ? bestCost : initialCost;
+}
+
+// Traversal cost heatmap.
+// TraceHeatmap traces a ray batch (e.g. one ray per pixel) with the regular
+// Intersect kernel and stores, per ray, the number of visited nodes and tested
+// primitives in rayNodes and rayPrims (either may be null). These match the
+// TraversalStats counters, which give the same per-ray counts for the other
+// layouts when TINYBVH_TRAVERSAL_STATS is defined. Optionally, the cost is also
+// attributed to the tree: nodeHeat (usedNodes entries) receives c_trav per
+// visit plus, for leaves, c_int per tested primitive; primHeat (triCount
+// entries) receives the number of tests per primitive. Both are accumulated,
+// so clear them first.
+// SubtreeHeat turns per-node heat into per-subtree heat, so that nodeHeat[0]
+// holds the total and hot subtrees can be found by descending from the root.
+void BVH::TraceHeatmap( const Ray* rays, const uint32_t rayCount, float* rayNodes, float* rayPrims, float* nodeHeat, uint32_t* primHeat ) const
+{
+	BVH_FATAL_ERROR_IF( isTLAS(), "BVH::TraceHeatmap( .. ), not for a TLAS." );
+	BVH_FATAL_ERROR_IF( lazyState != 0, "BVH::TraceHeatmap( .. ), BVH is still lazy; call FinishLazy first." );
+	struct Heat : NoVisit
+	{
+		const uint32_t* primIdx;
+		float* nodeHeat, travCost, intCost;
+		uint32_t* primHeat, visits, tests;
+		void Interior( const uint32_t nodeIdx ) { visits++; if (nodeHeat) nodeHeat[nodeIdx] += travCost; }
+		void Leaf( const uint32_t nodeIdx, const BVHNode& node )
+		{
+			visits++, tests += node.triCount;
+			if (nodeHeat) nodeHeat[nodeIdx] += travCost + intCost * (float)node.triCount;
+			if (primHeat) for (uint32_t i = 0; i < node.triCount; i++) primHeat[primIdx[node.leftFirst + i]]++;
+		}
+	} heat = { {}, primIdx, nodeHeat, c_trav, c_int, primHeat, 0, 0 };
+	for (uint32_t r = 0; r < rayCount; r++)
+	{
+		Ray ray = rays[r];
+		VALIDATE_RAY( ray );
+		heat.visits = heat.tests = 0;
+		IntersectVisit( ray, heat );
+		if (rayNodes) rayNodes[r] = (float)heat.visits;
+		if (rayPrims) rayPrims[r] = (float)heat.tests;
+	}
+}
+
+void BVH::SubtreeHeat( float* nodeHeat )
+{
+	// collect nodes in depth-first order, then add children to parents in reverse.
+	uint32_t* order = (uint32_t*)AlignedAlloc( usedNodes * sizeof( uint32_t ) );
+	uint32_t stack[64], stackPtr = 0, count = 0, nodeIdx = 0;
+	while (1)
+	{
+		order[count++] = nodeIdx;
+		const BVHNode& node = bvhNode[nodeIdx];
+		if (node.isLeaf()) { if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr]; }
+		else nodeIdx = node.leftFirst, stack[stackPtr++] = node.leftFirst + 1;
+	}
+	for (int32_t i = (int32_t)count - 1; i >= 0; i--)
+	{
+		const BVHNode& node = bvhNode[order[i]];
+		if (!node.isLeaf()) nodeHeat[order[i]] += nodeHeat[node.leftFirst] + nodeHeat[node.leftFirst + 1];
+	}
+	AlignedFree( order );
+}
+
 void BVH::QuickSort( const float* a, uint32_t* q, int f, int l ) // minimal qsort
 {
 	int s[4096], p = 0, h, i, r;
@@ -2197,6 +4912,7 @@ start: while (f >= l) { if (p == 0) return; else f = s[--p], l = s[--p]; }
 // be prevented.
 void BVH::BuildFullSweep()
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::SUBDIVIDE );
 	// allocate and calculate fragment centroids, per axis
 	float* centroid[3];
 	for (int a = 0; a < 3; a++) centroid[a] = (float*)AlignedAlloc( triCount * sizeof( float ) );
@@ -2219,7 +4935,7 @@ void BVH::BuildFullSweep()
 	// allocate space for right sweep
 	float* SAR = (float*)AlignedAlloc( triCount * sizeof( float ) );
 	// subdivide root node recursively
-	uint32_t task[256], taskCount = 0, nodeIdx = 0;
+	uint32_t task[256], taskCount = 0, taskPeak = 0, nodeIdx = 0;
 	bvhvec3 minDim = (bvhNode->aabbMax - bvhNode->aabbMin) * 1e-20f;
 	while (1)
 	{
@@ -2289,7 +5005,7 @@ void BVH::BuildFullSweep()
 			bvhNode[newNodePtr++].triCount = rightCount;
 			node.leftFirst = newNodePtr - 2, node.triCount = 0;
 			// recurse
-			task[taskCount++] = newNodePtr - 1, nodeIdx = newNodePtr - 2;
+			task[taskCount++] = newNodePtr - 1, nodeIdx = newNodePtr - 2, taskPeak = tinybvh_max( taskPeak, taskCount );
 		}
 		// fetch subdivision task from stack
 		if (taskCount == 0) break; else nodeIdx = task[--taskCount];
@@ -2306,6 +5022,7 @@ void BVH::BuildFullSweep()
 	may_have_holes = false; // the reference builder produces a continuous list of nodes
 	bvh_over_aabbs = (verts == 0); // bvh over aabbs is suitable as TLAS
 	usedNodes = newNodePtr;
+	tinybvh_count_build( context.buildStats, triCount, usedNodes, 0, taskPeak );
 }
 
 // SBVH builder.
@@ -2342,9 +5059,10 @@ void BVH::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, uint32
 
 void BVH::PrepareHQBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims )
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::PREPARE );
 	uint32_t primCount = prims > 0 ? prims : vertices.count / 3;
 	const uint32_t slack = primCount >> 1; // for split prims
-	const uint32_t spaceNeeded = primCount * 3;
+	const uint32_t spaceNeeded = primCount * 3 + 64; // plus the top of the tree, see BuildHQ.
 	// allocate memory on first build
 	if (allocatedNodes < spaceNeeded)
 	{
@@ -2396,7 +5114,7 @@ void BVH::PrepareHQBuild( const bvhvec4slice& vertices, const uint32_t* indices,
 	}
 	// clear remainder of index array
 	memset( primIdx + triCount, 0, slack * 4 );
-	bvh_over_indices = indices != nullptr;
+	bvh_over_indices = indices != nullptr, bvh_over_quads = false;
 	// all set; actual build happens in BVH::BuildHQ.
 }
 
@@ -2412,15 +5130,17 @@ float BVH::NoSplitCostSAH( const int Nparent ) const
 	return (float)(l_quads ? (((Nparent + 3) >> 2) * 4) : Nparent) * c_int;
 }
 
-void BVH::BuildHQTask(
+// Subdivides the subtree at nodeIdx; at maxDepth, the children are pushed to
+// task (which holds maxTasks) instead. Returns the peak size of the local stack.
+uint32_t BVH::BuildHQTask(
 	uint32_t nodeIdx, const uint32_t bins, uint32_t depth, const uint32_t maxDepth,
 	uint32_t sliceStart, uint32_t sliceEnd, const bvhvec3& minDim, const float rootArea,
-	uint32_t* idxTmp, uint32_t& nextFrag, uint32_t& taskCount,
-	SubdivTask* task
+	uint32_t* idxTmp, uint32_t& nodePtr, uint32_t& nextFrag, uint32_t& taskCount,
+	SubdivTask* task, const uint32_t maxTasks
 )
 {
 	ALIGNED(64) SubdivTask localTask[512];
-	uint32_t localTasks = 0;
+	uint32_t localTasks = 0, localPeak = 0, binCount = bins;
 	bvhvec3 bestLMin = 0, bestLMax = 0, bestRMin = 0, bestRMax = 0;
 	while (1)
 	{
@@ -2429,20 +5149,20 @@ void BVH::BuildHQTask(
 			// fetch node to subdivide
 			BVHNode& node = bvhNode[nodeIdx];
 			// alternating bin counts for optimizer.
-			if (hqbvhoddeven) hqbvhbins = bins + (depth & 1); // odd levels get one more
+			if (hqbvhoddeven) binCount = bins + (depth & 1); // odd levels get one more
 			// find optimal object split
 			bvhvec3 binMin[3][MAXHQBINS], binMax[3][MAXHQBINS];
-			for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < hqbvhbins; i++) binMin[a][i] = BVH_FAR, binMax[a][i] = -BVH_FAR;
+			for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < binCount; i++) binMin[a][i] = BVH_FAR, binMax[a][i] = -BVH_FAR;
 			uint32_t count[3][MAXHQBINS];
-			for (uint32_t i = 0; i < 3; i++) memset( count[i], 0, hqbvhbins * 4 );
-			const bvhvec3 rpd3 = bvhvec3( (float)hqbvhbins / (node.aabbMax - node.aabbMin) ), nmin3 = node.aabbMin;
+			for (uint32_t i = 0; i < 3; i++) memset( count[i], 0, binCount * 4 );
+			const bvhvec3 rpd3 = bvhvec3( (float)binCount / (node.aabbMax - node.aabbMin) ), nmin3 = node.aabbMin;
 			for (uint32_t i = 0; i < node.triCount; i++) // process all tris for x,y and z at once
 			{
 				const uint32_t fi = primIdx[node.leftFirst + i];
 				bvhint3 bi = bvhint3( ((fragment[fi].bmin + fragment[fi].bmax) * 0.5f - nmin3) * rpd3 );
-				bi.x = tinybvh_clamp( bi.x, 0, hqbvhbins - 1 );
-				bi.y = tinybvh_clamp( bi.y, 0, hqbvhbins - 1 );
-				bi.z = tinybvh_clamp( bi.z, 0, hqbvhbins - 1 );
+				bi.x = tinybvh_clamp( bi.x, 0, binCount - 1 );
+				bi.y = tinybvh_clamp( bi.y, 0, binCount - 1 );
+				bi.z = tinybvh_clamp( bi.z, 0, binCount - 1 );
 				binMin[0][bi.x] = tinybvh_min( binMin[0][bi.x], fragment[fi].bmin );
 				binMax[0][bi.x] = tinybvh_max( binMax[0][bi.x], fragment[fi].bmax ), count[0][bi.x]++;
 				binMin[1][bi.y] = tinybvh_min( binMin[1][bi.y], fragment[fi].bmin );
@@ -2460,19 +5180,19 @@ void BVH::BuildHQTask(
 				bvhvec3 lBMax[MAXHQBINS - 1], rBMax[MAXHQBINS - 1], r1 = BVH_FAR, r2 = -BVH_FAR;
 				float AL[MAXHQBINS - 1], AR[MAXHQBINS - 1];		// left and right area per split plane
 				int NL[MAXHQBINS - 1], NR[MAXHQBINS - 1];		// summed left and right tricount
-				for (uint32_t lN = 0, rN = 0, lP = 0, rP = 0, i = 0; i < hqbvhbins - 1; i++)
+				for (uint32_t lN = 0, rN = 0, lP = 0, rP = 0, i = 0; i < binCount - 1; i++)
 				{
 					lBMin[i] = l1 = tinybvh_min( l1, binMin[a][i] );
-					rBMin[hqbvhbins - 2 - i] = r1 = tinybvh_min( r1, binMin[a][hqbvhbins - 1 - i] );
+					rBMin[binCount - 2 - i] = r1 = tinybvh_min( r1, binMin[a][binCount - 1 - i] );
 					lBMax[i] = l2 = tinybvh_max( l2, binMax[a][i] );
-					rBMax[hqbvhbins - 2 - i] = r2 = tinybvh_max( r2, binMax[a][hqbvhbins - 1 - i] );
-					lN += count[a][i], rN += count[a][hqbvhbins - 1 - i];
-					NL[i] = lN, NR[hqbvhbins - 2 - i] = rN;
+					rBMax[binCount - 2 - i] = r2 = tinybvh_max( r2, binMax[a][binCount - 1 - i] );
+					lN += count[a][i], rN += count[a][binCount - 1 - i];
+					NL[i] = lN, NR[binCount - 2 - i] = rN;
 					AL[i] = lN == 0 ? BVH_FAR : tinybvh_half_area( l2 - l1 );
-					AR[hqbvhbins - 2 - i] = rN == 0 ? BVH_FAR : tinybvh_half_area( r2 - r1 );
+					AR[binCount - 2 - i] = rN == 0 ? BVH_FAR : tinybvh_half_area( r2 - r1 );
 				}
 				// evaluate bin totals to find best position for object split
-				for (uint32_t i = 0; i < hqbvhbins - 1; i++)
+				for (uint32_t i = 0; i < binCount - 1; i++)
 				{
 					const float C = SplitCostSAH( rSAV, AL[i], NL[i], AR[i], NR[i] );
 					if (C >= splitCost) continue;
@@ -2493,17 +5213,17 @@ void BVH::BuildHQTask(
 					// setup bins
 					bvhvec3 sbinMin[MAXHQBINS], sbinMax[MAXHQBINS];
 					int countIn[MAXHQBINS], countOut[MAXHQBINS];
-					memset( countIn, 0, hqbvhbins * 4 );
-					memset( countOut, 0, hqbvhbins * 4 );
-					for (uint32_t i = 0; i < hqbvhbins; i++) sbinMin[i] = BVH_FAR, sbinMax[i] = -BVH_FAR;
+					memset( countIn, 0, binCount * 4 );
+					memset( countOut, 0, binCount * 4 );
+					for (uint32_t i = 0; i < binCount; i++) sbinMin[i] = BVH_FAR, sbinMax[i] = -BVH_FAR;
 					// populate bins with clipped fragments
-					const float planeDist = (node.aabbMax[a] - node.aabbMin[a]) / (hqbvhbins * 0.9999f);
+					const float planeDist = (node.aabbMax[a] - node.aabbMin[a]) / (binCount * 0.9999f);
 					const float rPlaneDist = 1.0f / planeDist, nodeMin = node.aabbMin[a];
 					for (unsigned i = 0; i < node.triCount; i++)
 					{
 						const uint32_t fi = primIdx[node.leftFirst + i];
-						const int bin1 = tinybvh_clamp( (int32_t)((fragment[fi].bmin[a] - nodeMin) * rPlaneDist), 0, hqbvhbins - 1 );
-						const int bin2 = tinybvh_clamp( (int32_t)((fragment[fi].bmax[a] - nodeMin) * rPlaneDist), 0, hqbvhbins - 1 );
+						const int bin1 = tinybvh_clamp( (int32_t)((fragment[fi].bmin[a] - nodeMin) * rPlaneDist), 0, binCount - 1 );
+						const int bin2 = tinybvh_clamp( (int32_t)((fragment[fi].bmax[a] - nodeMin) * rPlaneDist), 0, binCount - 1 );
 						countIn[bin1]++, countOut[bin2]++;
 						if (bin2 == bin1) // fragment fits in a single bin
 							sbinMin[bin1] = tinybvh_min( sbinMin[bin1], fragment[fi].bmin ),
@@ -2513,7 +5233,7 @@ void BVH::BuildHQTask(
 							// clip fragment to each bin it overlaps
 							bvhvec3 bmin = node.aabbMin, bmax = node.aabbMax;
 							bmin[a] = nodeMin + planeDist * j;
-							bmax[a] = j == (hqbvhbins - 2) ? node.aabbMax[a] : (bmin[a] + planeDist);
+							bmax[a] = j == (binCount - 2) ? node.aabbMax[a] : (bmin[a] + planeDist);
 							Fragment orig = fragment[fi];
 							Fragment tmpFrag;
 							if (!ClipFrag( orig, tmpFrag, bmin, bmax, minDim, a )) continue;
@@ -2526,17 +5246,17 @@ void BVH::BuildHQTask(
 					bvhvec3 lBMax[MAXHQBINS - 1], rBMax[MAXHQBINS - 1], r1 = BVH_FAR, r2 = -BVH_FAR;
 					float AL[MAXHQBINS], AR[MAXHQBINS];
 					int NL[MAXHQBINS], NR[MAXHQBINS];
-					for (uint32_t lN = 0, rN = 0, lP = 0, rP = 0, i = 0; i < hqbvhbins - 1; i++)
+					for (uint32_t lN = 0, rN = 0, lP = 0, rP = 0, i = 0; i < binCount - 1; i++)
 					{
-						lBMin[i] = l1 = tinybvh_min( l1, sbinMin[i] ), rBMin[hqbvhbins - 2 - i] = r1 = tinybvh_min( r1, sbinMin[hqbvhbins - 1 - i] );
-						lBMax[i] = l2 = tinybvh_max( l2, sbinMax[i] ), rBMax[hqbvhbins - 2 - i] = r2 = tinybvh_max( r2, sbinMax[hqbvhbins - 1 - i] );
-						lN += countIn[i], rN += countOut[hqbvhbins - 1 - i];
+						lBMin[i] = l1 = tinybvh_min( l1, sbinMin[i] ), rBMin[binCount - 2 - i] = r1 = tinybvh_min( r1, sbinMin[binCount - 1 - i] );
+						lBMax[i] = l2 = tinybvh_max( l2, sbinMax[i] ), rBMax[binCount - 2 - i] = r2 = tinybvh_max( r2, sbinMax[binCount - 1 - i] );
+						lN += countIn[i], rN += countOut[binCount - 1 - i];
 						AL[i] = lN == 0 ? BVH_FAR : tinybvh_half_area( l2 - l1 );
-						AR[hqbvhbins - 2 - i] = rN == 0 ? BVH_FAR : tinybvh_half_area( r2 - r1 );
-						NL[i] = lN, NR[hqbvhbins - 2 - i] = rN;
+						AR[binCount - 2 - i] = rN == 0 ? BVH_FAR : tinybvh_half_area( r2 - r1 );
+						NL[i] = lN, NR[binCount - 2 - i] = rN;
 					}
 					// find best position for spatial split
-					for (uint32_t i = 0; i < hqbvhbins - 1; i++)
+					for (uint32_t i = 0; i < binCount - 1; i++)
 					{
 						const float Cspatial = SplitCostSAH( rSAV, AL[i], NL[i], AR[i], NR[i] );
 						if (Cspatial < minSplitCost && NL[i] + NR[i] < budget && NL[i] * NR[i] > 0)
@@ -2561,7 +5281,7 @@ void BVH::BuildHQTask(
 			if (spatial)
 			{
 				// spatial partitioning
-				const float planeDist = (node.aabbMax[bestAxis] - node.aabbMin[bestAxis]) / (hqbvhbins * 0.9999f);
+				const float planeDist = (node.aabbMax[bestAxis] - node.aabbMin[bestAxis]) / (binCount * 0.9999f);
 				const float rPlaneDist = 1.0f / planeDist, nodeMin = node.aabbMin[bestAxis];
 				for (uint32_t i = 0; i < node.triCount; i++)
 				{
@@ -2631,7 +5351,7 @@ void BVH::BuildHQTask(
 				{
 					const uint32_t fr = primIdx[src + i];
 					int32_t bi = (int32_t)(((fragment[fr].bmin[bestAxis] + fragment[fr].bmax[bestAxis]) * 0.5f - nmin) * rpd);
-					bi = tinybvh_clamp( bi, 0, hqbvhbins - 1 );
+					bi = tinybvh_clamp( bi, 0, binCount - 1 );
 					if (bi <= (int32_t)bestPos) idxTmp[A++] = fr; else idxTmp[--B] = fr;
 				}
 			}
@@ -2639,7 +5359,7 @@ void BVH::BuildHQTask(
 			memcpy( primIdx + sliceStart, idxTmp + sliceStart, (sliceEnd - sliceStart) * 4 );
 			// create child nodes
 			uint32_t leftCount = A - sliceStart, rightCount = sliceEnd - B;
-			if (leftCount == 0 || rightCount == 0 || taskCount == 1024 /* BVH_NUM_ELEMS( task ) */)
+			if (leftCount == 0 || rightCount == 0 || (depth + 1 == maxDepth && taskCount + 2 > maxTasks))
 			{
 				// spatial split failed. We shouldn't get here, but we do sometimes..
 				for (uint32_t i = 0; i < node.triCount; i++)
@@ -2648,7 +5368,7 @@ void BVH::BuildHQTask(
 				node.aabbMax = tinybvh_max( bestLMax, bestRMax );
 				break;
 			}
-			int32_t leftChildIdx = newNodePtr++, rightChildIdx = newNodePtr++;
+			int32_t leftChildIdx = nodePtr++, rightChildIdx = nodePtr++;
 			bvhNode[leftChildIdx].aabbMin = bestLMin, bvhNode[leftChildIdx].aabbMax = bestLMax;
 			bvhNode[leftChildIdx].leftFirst = sliceStart, bvhNode[leftChildIdx].triCount = leftCount;
 			bvhNode[rightChildIdx].aabbMin = bestRMin, bvhNode[rightChildIdx].aabbMax = bestRMax;
@@ -2667,10 +5387,11 @@ void BVH::BuildHQTask(
 			// proceed with left child, push right child on local stack
 			localTask[localTasks].node = rightChildIdx, localTask[localTasks].depth = depth;
 			localTask[localTasks].sliceStart = (A + B) >> 1, localTask[localTasks++].sliceEnd = sliceEnd;
+			localPeak = tinybvh_max( localPeak, localTasks );
 			nodeIdx = leftChildIdx, sliceEnd = (A + B) >> 1;
 		}
 		// pop a local task, if any are left
-		if (localTasks == 0) return;
+		if (localTasks == 0) return localPeak;
 		nodeIdx = localTask[--localTasks].node, depth = localTask[localTasks].depth;
 		sliceStart = localTask[localTasks].sliceStart, sliceEnd = localTask[localTasks].sliceEnd;
 	}
@@ -2678,38 +5399,59 @@ void BVH::BuildHQTask(
 
 void BVH::BuildHQ()
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::SUBDIVIDE );
 	const uint32_t slack = triCount >> 1; // for split prims
-	uint32_t* idxTmp = (uint32_t*)AlignedAlloc( (triCount + slack) * sizeof( uint32_t ) );
-	memset( idxTmp, 0, (triCount + slack) * 4 );
+	const uint32_t slots = triCount + slack;
+	uint32_t* idxTmp = (uint32_t*)AlignedAlloc( slots * sizeof( uint32_t ) );
+	memset( idxTmp, 0, slots * 4 );
 	// reset node pool
 	newNodePtr = 2;
 	uint32_t nextFrag = triCount;
-	// subdivide recursively
+	// subdivide the top of the tree; this yields up to 32 independent tasks.
 	BVHNode& root = bvhNode[0];
 	const float rootArea = tinybvh_half_area( root.aabbMax - root.aabbMin );
 	ALIGNED( 64 ) SubdivTask task[128];
-	uint32_t taskCount = 0, nodeIdx = 0, sliceStart = 0, sliceEnd = triCount + slack, depth = 0, bins = hqbvhbins;
+	uint32_t taskCount = 0, bins = hqbvhbins;
 	const bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-7f /* don't touch, carefully picked */;
-	BuildHQTask( nodeIdx, bins, depth, 5, sliceStart, sliceEnd, minDim, 
-		rootArea, idxTmp, nextFrag, taskCount, task );
-	for( unsigned i = 0; i < taskCount; i++ )
-	{
-		nodeIdx = task[i].node, depth = task[i].depth,
-		sliceStart = task[i].sliceStart, sliceEnd = task[i].sliceEnd;
-		BuildHQTask( nodeIdx, bins, depth, 5, sliceStart, sliceEnd, minDim, rootArea, idxTmp, nextFrag, taskCount, task );
+	uint32_t taskPeak = BuildHQTask( 0, bins, 0, 5, 0, slots, minDim, rootArea, idxTmp, newNodePtr, nextFrag, taskCount, task, BVH_NUM_ELEMS( task ) );
+	// each task owns a slice of primIdx, a block of nodes behind the top (two per
+	// slot, like SubdivideParallel) and a range of fragments for its spatial
+	// splits: a slice of n slots that holds m fragments adds at most n - m.
+	const uint32_t topNodes = usedNodes = newNodePtr, topFrags = nextFrag - triCount;
+	ReserveNodes( topNodes + slots * 2 );
+	uint32_t fragFirst[128], fragNext[128], peak[128];
+	for (uint32_t i = 0; i < taskCount; i++)
+	{
+		const uint32_t sliceSize = task[i].sliceEnd - task[i].sliceStart;
+		fragFirst[i] = fragNext[i] = nextFrag, nextFrag += sliceSize - bvhNode[task[i].node].triCount;
 	}
+	tinybvh_build_for( context, taskCount, 1, [&]( const uint32_t i )
+		{
+			const SubdivTask& t = task[i];
+			const uint32_t subtree = topNodes + t.sliceStart * 2;
+			uint32_t nodePtr = subtree + 2, tasks = taskCount; // tasks at maxDepth push no further tasks.
+			bvhNode[subtree] = bvhNode[t.node]; // slot subtree + 1 remains unused, like node 1.
+			peak[i] = BuildHQTask( subtree, bins, t.depth, 5, t.sliceStart, t.sliceEnd, minDim, rootArea, idxTmp, nodePtr, fragNext[i], tasks, task, BVH_NUM_ELEMS( task ) );
+		} );
+	// link the subtrees into the top; Compact removes the holes.
+	uint32_t splitFrags = topFrags;
+	for (uint32_t i = 0; i < taskCount; i++)
+		bvhNode[task[i].node] = bvhNode[topNodes + task[i].sliceStart * 2],
+		splitFrags += fragNext[i] - fragFirst[i], taskPeak = tinybvh_max( taskPeak, peak[i] );
 	// all done.
 	AlignedFree( idxTmp );
 	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
 	refittable = false; // can't refit an SBVH
 	may_have_holes = false; // there may be holes in the index list, but not in the node list
-	usedNodes = newNodePtr;
+	usedNodes = topNodes + slots * 2;
 	Compact();
+	tinybvh_count_build( context.buildStats, triCount, usedNodes, splitFrags, taskPeak );
 }
 
 // Optimize: Will happen via BVH_Verbose.
 void BVH::Optimize( const uint32_t iterations, bool extreme, bool stochastic )
 {
+	BVH_FATAL_ERROR_IF( lazyState != 0, "BVH::Optimize( .. ), lazy BVH; call FinishLazy first." );
 	BVH_Verbose* verbose = new BVH_Verbose();
 	verbose->ConvertFrom( *this );
 	verbose->Optimize( iterations, extreme, stochastic );
@@ -2726,13 +5468,23 @@ void BVH::Refit( const uint32_t /* unused */ )
 	BVH_FATAL_ERROR_IF( bvhNode == 0, "BVH::Refit( .. ), bvhNode == 0." );
 	BVH_FATAL_ERROR_IF( may_have_holes, "BVH::Refit( .. ), bvh may have holes." );
 	BVH_FATAL_ERROR_IF( isTLAS(), "BVH::Refit( .. ), do not refit a TLAS, use Build(..)." );
-	for (int32_t i = usedNodes - 1; i >= 0; i--) if (i != 1)
+	// leafs: adjust to current triangle vertex positions. Independent, so these
+	// may run in parallel; interior nodes follow in a single reverse pass.
+	tinybvh_build_for( context, usedNodes, 256, [&]( const uint32_t i )
 	{
 		BVHNode& node = bvhNode[i];
-		if (node.isLeaf()) // leaf: adjust to current triangle vertex positions
+		if (i != 1 && node.isLeaf())
 		{
 			bvhvec4 bmin( BVH_FAR ), bmax( -BVH_FAR );
-			if (vertIdx) for (uint32_t first = node.leftFirst, j = 0; j < node.triCount; j++)
+			if (quadsEnabled && bvh_over_quads) for (uint32_t i0, i1, i2, i3, first = node.leftFirst, j = 0; j < node.triCount; j++)
+			{
+				const uint32_t pi = primIdx[first + j];
+				GET_QUAD_INDICES_I0_I1_I2_I3( (*this), pi );
+				const bvhvec4 v0 = verts[i0], v1 = verts[i1], v2 = verts[i2], v3 = verts[i3];
+				bmin = tinybvh_min( bmin, tinybvh_min( tinybvh_min( v0, v1 ), tinybvh_min( v2, v3 ) ) );
+				bmax = tinybvh_max( bmax, tinybvh_max( tinybvh_max( v0, v1 ), tinybvh_max( v2, v3 ) ) );
+			}
+			else if (vertIdx) for (uint32_t first = node.leftFirst, j = 0; j < node.triCount; j++)
 			{
 				const uint32_t vidx = primIdx[first + j] * 3;
 				const uint32_t i0 = vertIdx[vidx], i1 = vertIdx[vidx + 1], i2 = vertIdx[vidx + 2];
@@ -2750,8 +5502,12 @@ void BVH::Refit( const uint32_t /* unused */ )
 				bmin = tinybvh_min( t1, t3 ), bmax = tinybvh_max( t2, t4 );
 			}
 			node.aabbMin = bmin, node.aabbMax = bmax;
-			continue;
 		}
+	} );
+	for (int32_t i = usedNodes - 1; i >= 0; i--) if (i != 1)
+	{
+		BVHNode& node = bvhNode[i];
+		if (node.isLeaf()) continue;
 		// interior node: adjust to child bounds
 		const BVHNode& left = bvhNode[node.leftFirst], & right = bvhNode[node.leftFirst + 1];
 		node.aabbMin = tinybvh_min( left.aabbMin, right.aabbMin );
@@ -2783,6 +5539,7 @@ uint32_t BVH::CombineLeafs( const uint32_t primCount, uint32_t& firstIdx, uint32
 
 bool BVH::IntersectSphere( const bvhvec3& pos, const float r ) const
 {
+	BVH_FATAL_ERROR_IF( bvh_over_quads, "BVH::IntersectSphere( .. ), not supported for quads." );
 	const bvhvec3 bmin = pos - bvhvec3( r ), bmax = pos + bvhvec3( r );
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
@@ -2930,55 +5687,42 @@ int32_t BVH::IntersectRaw( Ray& ray ) const
 
 #endif
 
-#define SLAB_TEST_TWO_NODES \
-	float tx1a = (posX ? child1->aabbMin.x : child1->aabbMax.x) * ray.rD.x - rox; /* expect fma. */ \
-	float ty1a = (posY ? child1->aabbMin.y : child1->aabbMax.y) * ray.rD.y - roy; \
-	float tz1a = (posZ ? child1->aabbMin.z : child1->aabbMax.z) * ray.rD.z - roz; \
-	float tx1b = (posX ? child2->aabbMin.x : child2->aabbMax.x) * ray.rD.x - rox; \
-	float ty1b = (posY ? child2->aabbMin.y : child2->aabbMax.y) * ray.rD.y - roy; \
-	float tz1b = (posZ ? child2->aabbMin.z : child2->aabbMax.z) * ray.rD.z - roz; \
-	float tx2a = (posX ? child1->aabbMax.x : child1->aabbMin.x) * ray.rD.x - rox; \
-	float ty2a = (posY ? child1->aabbMax.y : child1->aabbMin.y) * ray.rD.y - roy; \
-	float tz2a = (posZ ? child1->aabbMax.z : child1->aabbMin.z) * ray.rD.z - roz; \
-	float tx2b = (posX ? child2->aabbMax.x : child2->aabbMin.x) * ray.rD.x - rox; \
-	float ty2b = (posY ? child2->aabbMax.y : child2->aabbMin.y) * ray.rD.y - roy; \
-	float tz2b = (posZ ? child2->aabbMax.z : child2->aabbMin.z) * ray.rD.z - roz; \
-	float tmina = tinybvh_max( tinybvh_max( tx1a, ty1a ), tinybvh_max( tz1a, 0.0f ) ); \
-	float tminb = tinybvh_max( tinybvh_max( tx1b, ty1b ), tinybvh_max( tz1b, 0.0f ) ); \
-	float tmaxa = tinybvh_min( tinybvh_min( tx2a, ty2a ), tinybvh_min( tz2a, ray.hit.t ) ); \
-	float tmaxb = tinybvh_min( tinybvh_min( tx2b, ty2b ), tinybvh_min( tz2b, ray.hit.t ) ); \
-	if (tmaxa >= tmina) dist1 = tmina; \
-	if (tmaxb >= tminb) dist2 = tminb;
-
 int32_t BVH::Intersect( Ray& ray ) const
 {
 	VALIDATE_RAY( ray );
 	if (!isTLAS())
 	{
-		const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
-		if (!posX) goto negx1;
-		if (posY) { if (posZ) return Intersect<true, true, true>( ray ); else return Intersect<true, true, false>( ray ); }
-		if (posZ) return Intersect<true, false, true>( ray ); else return Intersect<true, false, false>( ray );
-	negx1:
-		if (posY) { if (posZ) return Intersect<false, true, true>( ray ); else return Intersect<false, true, false>( ray ); }
-		if (posZ) return Intersect<false, false, true>( ray ); else return Intersect<false, false, false>( ray );
+		NoVisit visit;
+		return IntersectVisit( ray, visit );
 	}
 	else
 	{
 		const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
-		if (!posX) goto negx2;
-		if (posY) { if (posZ) return IntersectTLAS<true, true, true>( ray ); else return IntersectTLAS<true, true, false>( ray ); }
-		if (posZ) return IntersectTLAS<true, false, true>( ray ); else return IntersectTLAS<true, false, false>( ray );
-	negx2:
-		if (posY) { if (posZ) return IntersectTLAS<false, true, true>( ray ); else return IntersectTLAS<false, true, false>( ray ); }
-		if (posZ) return IntersectTLAS<false, false, true>( ray ); else return IntersectTLAS<false, false, false>( ray );
+		if (!posX) goto negx;
+		if (posY) { if (posZ) return IntersectTLAS<BVHBase, true, true, true>( ray ); else return IntersectTLAS<BVHBase, true, true, false>( ray ); }
+		if (posZ) return IntersectTLAS<BVHBase, true, false, true>( ray ); else return IntersectTLAS<BVHBase, true, false, false>( ray );
+	negx:
+		if (posY) { if (posZ) return IntersectTLAS<BVHBase, false, true, true>( ray ); else return IntersectTLAS<BVHBase, false, true, false>( ray ); }
+		if (posZ) return IntersectTLAS<BVHBase, false, false, true>( ray ); else return IntersectTLAS<BVHBase, false, false, false>( ray );
 	}
 }
 
-template <bool posX, bool posY, bool posZ> int32_t BVH::Intersect( Ray& ray ) const
+template <class V> int32_t BVH::IntersectVisit( Ray& ray, V& visit ) const
+{
+	const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+	if (!posX) goto negx;
+	if (posY) { if (posZ) return Intersect<true, true, true>( ray, visit ); else return Intersect<true, true, false>( ray, visit ); }
+	if (posZ) return Intersect<true, false, true>( ray, visit ); else return Intersect<true, false, false>( ray, visit );
+negx:
+	if (posY) { if (posZ) return Intersect<false, true, true>( ray, visit ); else return Intersect<false, true, false>( ray, visit ); }
+	if (posZ) return Intersect<false, false, true>( ray, visit ); else return Intersect<false, false, false>( ray, visit );
+}
+
+template <bool posX, bool posY, bool posZ, class V> int32_t BVH::Intersect( Ray& ray, V& visit ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	float cost = 0;
 	const float rox = ray.O.x * ray.rD.x;
 	const float roy = ray.O.y * ray.rD.y;
@@ -2988,11 +5732,21 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::Intersect( Ray& ray ) co
 		cost += c_trav;
 		if (node->isLeaf())
 		{
+			const uint32_t nodeIdx = (uint32_t)(node - bvhNode), subtree = visit.Expand( nodeIdx );
+			if (subtree != nodeIdx) { node = &bvhNode[subtree]; continue; }
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
+			visit.Leaf( nodeIdx, *node );
 			// Performance note: if indexed primitives (ENABLE_INDEXED_GEOMETRY) and custom
 			// geometry (ENABLE_CUSTOM_GEOMETRY) are both disabled, this leaf code reduces
 			// to a regular loop over triangles. Otherwise, the extra flexibility comes at
 			// a small performance cost.
-			if (indexedEnabled && vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
+			if (quadsEnabled && bvh_over_quads) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
+			{
+				uint32_t i0, i1, i2, i3, pi = primIdx[node->leftFirst + i];
+				GET_QUAD_INDICES_I0_I1_I2_I3( (*this), pi );
+				IntersectQuad( ray, pi, verts, i0, i1, i2, i3 );
+			}
+			else if (indexedEnabled && vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
 			{
 				const uint32_t pi = primIdx[node->leftFirst + i];
 				const uint32_t i0 = vertIdx[pi * 3], i1 = vertIdx[pi * 3 + 1], i2 = vertIdx[pi * 3 + 2];
@@ -3019,6 +5773,8 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::Intersect( Ray& ray ) co
 		}
 		BVHNode* child1 = &bvhNode[node->leftFirst], * child2 = &bvhNode[node->leftFirst + 1];
 		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
+		visit.Interior( (uint32_t)(node - bvhNode) );
 		SLAB_TEST_TWO_NODES;
 		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
 		if (dist1 == BVH_FAR /* missed both child nodes */)
@@ -3029,15 +5785,82 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::Intersect( Ray& ray ) co
 		{
 			node = child1; /* continue with the nearest */
 			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return (int32_t)cost; // cast to not break interface.
 }
 
-template <bool posX, bool posY, bool posZ> int32_t BVH::IntersectTLAS( Ray& ray ) const
+// TLAS leaf: BLAS traversal for a known BLAS layout B, or with run-time layout
+// dispatch for B = BVHBase (mixed scenes).
+template <class B> static __FORCEINLINE int32_t IntersectBLAS( const BVHBase* blas, Ray& ray )
+{
+	return ((const B*)blas)->Intersect( ray );
+}
+
+template <class B> static __FORCEINLINE bool BLASOccludes( const BVHBase* blas, const Ray& ray )
+{
+	return ((const B*)blas)->IsOccluded( ray );
+}
+
+template <> __FORCEINLINE int32_t IntersectBLAS<BVHBase>( const BVHBase* blas, Ray& ray )
+{
+	// Note: Valid BVH layout options for BLASses are the regular BVH layout,
+	// the AVX-optimized BVH_SOA layout and the wide BVH4_CPU layout. If all
+	// BLASses are of the same layout this reduces to nearly zero cost for
+	// a small set of predictable branches; BVH::IntersectTLAS<B> removes it.
+	assert( blas->layout == BVHBase::LAYOUT_BVH || blas->layout == BVHBase::LAYOUT_BVH4_CPU ||
+		blas->layout == BVHBase::LAYOUT_BVH_SOA || blas->layout == BVHBase::LAYOUT_BVH8_AVX2 );
+	int32_t cost = 0;
+	if (blas->layout == BVHBase::LAYOUT_BVH)
+	{
+		// regular (triangle) BVH traversal
+		cost += ((BVH*)blas)->Intersect( ray );
+	}
+	else
+	{
+	#ifdef BVH_USESSE
+		if (blas->layout == BVHBase::LAYOUT_BVH4_CPU) cost += ((BVH4_CPU*)blas)->Intersect( ray );
+	#endif
+	#ifdef BVH_USEAVX
+		if (blas->layout == BVHBase::LAYOUT_BVH_SOA) cost += ((BVH_SoA*)blas)->Intersect( ray );
+	#endif
+	#ifdef BVH_USEAVX2
+		if (blas->layout == BVHBase::LAYOUT_BVH8_AVX2) cost += ((BVH8_CPU*)blas)->Intersect( ray );
+	#endif
+	}
+	return cost;
+}
+
+template <> __FORCEINLINE bool BLASOccludes<BVHBase>( const BVHBase* blas, const Ray& ray )
+{
+	assert( blas->layout == BVHBase::LAYOUT_BVH || blas->layout == BVHBase::LAYOUT_BVH_SOA ||
+		blas->layout == BVHBase::LAYOUT_BVH8_AVX2 || blas->layout == BVHBase::LAYOUT_BVH4_CPU );
+	if (blas->layout == BVHBase::LAYOUT_BVH)
+	{
+		// regular (triangle) BVH traversal
+		if (((BVH*)blas)->IsOccluded( ray )) return true;
+	}
+	else
+	{
+	#ifdef BVH_USESSE
+		if (blas->layout == BVHBase::LAYOUT_BVH4_CPU) { if (((BVH4_CPU*)blas)->IsOccluded( ray )) return true; }
+	#endif
+	#ifdef BVH_USEAVX
+		if (blas->layout == BVHBase::LAYOUT_BVH_SOA) { if (((BVH_SoA*)blas)->IsOccluded( ray )) return true; }
+	#endif
+	#ifdef BVH_USEAVX2
+		if (blas->layout == BVHBase::LAYOUT_BVH8_AVX2) { if (((BVH8_CPU*)blas)->IsOccluded( ray )) return true; }
+	#endif
+	}
+	return false;
+}
+
+template <class B, bool posX, bool posY, bool posZ> int32_t BVH::IntersectTLAS( Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	float cost = 0;
 	const float rox = ray.O.x * ray.rD.x;
 	const float roy = ray.O.y * ray.rD.y;
@@ -3047,6 +5870,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::IntersectTLAS( Ray& ray
 		cost += c_trav;
 		if (node->isLeaf())
 		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
 			Ray tmp;
 			for (uint32_t i = 0; i < node->triCount; i++)
 			{
@@ -3063,29 +5887,8 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::IntersectTLAS( Ray& ray
 				tmp.hit = ray.hit;
 				tmp.rD = tinybvh_rcp( tmp.D );
 				// 2. Traverse BLAS with the transformed ray
-				// Note: Valid BVH layout options for BLASses are the regular BVH layout,
-				// the AVX-optimized BVH_SOA layout and the wide BVH4_CPU layout. If all
-				// BLASses are of the same layout this reduces to nearly zero cost for
-				// a small set of predictable branches.
-				assert( blas->layout == LAYOUT_BVH || blas->layout == LAYOUT_BVH4_CPU ||
-					blas->layout == LAYOUT_BVH_SOA || blas->layout == LAYOUT_BVH8_AVX2 );
-				if (blas->layout == LAYOUT_BVH)
-				{
-					// regular (triangle) BVH traversal
-					cost += ((BVH*)blas)->Intersect( tmp );
-				}
-				else
-				{
-				#ifdef BVH_USESSE
-					if (blas->layout == LAYOUT_BVH4_CPU) cost += ((BVH4_CPU*)blas)->Intersect( tmp );
-				#endif
-				#ifdef BVH_USEAVX
-					if (blas->layout == LAYOUT_BVH_SOA) cost += ((BVH_SoA*)blas)->Intersect( tmp );
-				#endif
-				#ifdef BVH_USEAVX2
-					if (blas->layout == LAYOUT_BVH8_AVX2) cost += ((BVH8_CPU*)blas)->Intersect( tmp );
-				#endif
-				}
+				BVH_STAT( stats.blasEntries++ );
+				cost += IntersectBLAS<B>( blas, tmp );
 				// 3. Restore ray
 				ray.hit = tmp.hit;
 			}
@@ -3094,6 +5897,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::IntersectTLAS( Ray& ray
 		}
 		BVHNode* child1 = &bvhNode[node->leftFirst], * child2 = &bvhNode[node->leftFirst + 1];
 		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
 		SLAB_TEST_TWO_NODES;
 		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
 		if (dist1 == BVH_FAR /* missed both child nodes */)
@@ -3104,6 +5908,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH::IntersectTLAS( Ray& ray
 		{
 			node = child1; /* continue with the nearest */
 			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return (int32_t)cost;
@@ -3114,30 +5919,37 @@ bool BVH::IsOccluded( const Ray& ray ) const
 	VALIDATE_RAY( ray );
 	if (!isTLAS())
 	{
-		const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
-		if (!posX) goto negx1;
-		if (posY) { if (posZ) return IsOccluded<true, true, true>( ray ); else return IsOccluded<true, true, false>( ray ); }
-		if (posZ) return IsOccluded<true, false, true>( ray ); else return IsOccluded<true, false, false>( ray );
-	negx1:
-		if (posY) { if (posZ) return IsOccluded<false, true, true>( ray ); else return IsOccluded<false, true, false>( ray ); }
-		if (posZ) return IsOccluded<false, false, true>( ray ); else return IsOccluded<false, false, false>( ray );
+		NoVisit visit;
+		return IsOccludedVisit( ray, visit );
 	}
 	else
 	{
 		const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
-		if (!posX) goto negx2;
-		if (posY) { if (posZ) return IsOccludedTLAS<true, true, true>( ray ); else return IsOccludedTLAS<true, true, false>( ray ); }
-		if (posZ) return IsOccludedTLAS<true, false, true>( ray ); else return IsOccludedTLAS<true, false, false>( ray );
-	negx2:
-		if (posY) { if (posZ) return IsOccludedTLAS<false, true, true>( ray ); else return IsOccludedTLAS<false, true, false>( ray ); }
-		if (posZ) return IsOccludedTLAS<false, false, true>( ray ); else return IsOccludedTLAS<false, false, false>( ray );
+		if (!posX) goto negx;
+		if (posY) { if (posZ) return IsOccludedTLAS<BVHBase, true, true, true>( ray ); else return IsOccludedTLAS<BVHBase, true, true, false>( ray ); }
+		if (posZ) return IsOccludedTLAS<BVHBase, true, false, true>( ray ); else return IsOccludedTLAS<BVHBase, true, false, false>( ray );
+	negx:
+		if (posY) { if (posZ) return IsOccludedTLAS<BVHBase, false, true, true>( ray ); else return IsOccludedTLAS<BVHBase, false, true, false>( ray ); }
+		if (posZ) return IsOccludedTLAS<BVHBase, false, false, true>( ray ); else return IsOccludedTLAS<BVHBase, false, false, false>( ray );
 	}
 }
 
-template <bool posX, bool posY, bool posZ> bool BVH::IsOccluded( const Ray& ray ) const
+template <class V> bool BVH::IsOccludedVisit( const Ray& ray, V& visit ) const
+{
+	const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+	if (!posX) goto negx;
+	if (posY) { if (posZ) return IsOccluded<true, true, true>( ray, visit ); else return IsOccluded<true, true, false>( ray, visit ); }
+	if (posZ) return IsOccluded<true, false, true>( ray, visit ); else return IsOccluded<true, false, false>( ray, visit );
+negx:
+	if (posY) { if (posZ) return IsOccluded<false, true, true>( ray, visit ); else return IsOccluded<false, true, false>( ray, visit ); }
+	if (posZ) return IsOccluded<false, false, true>( ray, visit ); else return IsOccluded<false, false, false>( ray, visit );
+}
+
+template <bool posX, bool posY, bool posZ, class V> bool BVH::IsOccluded( const Ray& ray, V& visit ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	const float rox = ray.O.x * ray.rD.x;
 	const float roy = ray.O.y * ray.rD.y;
 	const float roz = ray.O.z * ray.rD.z;
@@ -3145,7 +5957,17 @@ template <bool posX, bool posY, bool posZ> bool BVH::IsOccluded( const Ray& ray
 	{
 		if (node->isLeaf())
 		{
-			if (indexedEnabled && vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++)
+			const uint32_t nodeIdx = (uint32_t)(node - bvhNode), subtree = visit.Expand( nodeIdx );
+			if (subtree != nodeIdx) { node = &bvhNode[subtree]; continue; }
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
+			visit.Leaf( nodeIdx, *node );
+			if (quadsEnabled && bvh_over_quads) for (uint32_t i = 0; i < node->triCount; i++)
+			{
+				uint32_t i0, i1, i2, i3, pi = primIdx[node->leftFirst + i];
+				GET_QUAD_INDICES_I0_I1_I2_I3( (*this), pi );
+				if (QuadOccludes( ray, verts, i0, i1, i2, i3 )) return true;
+			}
+			else if (indexedEnabled && vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++)
 			{
 				const uint32_t pi = primIdx[node->leftFirst + i] * 3;
 				const uint32_t i0 = vertIdx[pi], i1 = vertIdx[pi + 1], i2 = vertIdx[pi + 2];
@@ -3167,6 +5989,8 @@ template <bool posX, bool posY, bool posZ> bool BVH::IsOccluded( const Ray& ray
 		BVHNode* child1 = &bvhNode[node->leftFirst];
 		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
 		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
+		visit.Interior( (uint32_t)(node - bvhNode) );
 		SLAB_TEST_TWO_NODES;
 		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
 		if (dist1 == BVH_FAR /* missed both child nodes */)
@@ -3177,15 +6001,17 @@ template <bool posX, bool posY, bool posZ> bool BVH::IsOccluded( const Ray& ray
 		{
 			node = child1; /* continue with the nearest */
 			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return false;
 }
 
-template <bool posX, bool posY, bool posZ> bool BVH::IsOccludedTLAS( const Ray& ray ) const
+template <class B, bool posX, bool posY, bool posZ> bool BVH::IsOccludedTLAS( const Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	Ray tmp;
 	const float rox = ray.O.x * ray.rD.x;
 	const float roy = ray.O.y * ray.rD.y;
@@ -3194,6 +6020,7 @@ template <bool posX, bool posY, bool posZ> bool BVH::IsOccludedTLAS( const Ray&
 	{
 		if (node->isLeaf())
 		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
 			for (uint32_t i = 0; i < node->triCount; i++)
 			{
 				// BLAS traversal
@@ -3207,31 +6034,15 @@ template <bool posX, bool posY, bool posZ> bool BVH::IsOccludedTLAS( const Ray&
 				tmp.hit.t = ray.hit.t;
 				tmp.rD = tinybvh_rcp( tmp.D );
 				// 2. Traverse BLAS with the transformed ray
-				assert( blas->layout == LAYOUT_BVH || blas->layout == LAYOUT_BVH_SOA ||
-					blas->layout == LAYOUT_BVH8_AVX2 || blas->layout == LAYOUT_BVH4_CPU );
-				if (blas->layout == LAYOUT_BVH)
-				{
-					// regular (triangle) BVH traversal
-					if (((BVH*)blas)->IsOccluded( tmp )) return true;
-				}
-				else
-				{
-				#ifdef BVH_USESSE
-					if (blas->layout == LAYOUT_BVH4_CPU) { if (((BVH4_CPU*)blas)->IsOccluded( tmp )) return true; }
-				#endif
-				#ifdef BVH_USEAVX
-					if (blas->layout == LAYOUT_BVH_SOA) { if (((BVH_SoA*)blas)->IsOccluded( tmp )) return true; }
-				#endif
-				#ifdef BVH_USEAVX2
-					if (blas->layout == LAYOUT_BVH8_AVX2) { if (((BVH8_CPU*)blas)->IsOccluded( tmp )) return true; }
-				#endif
-				}
+				BVH_STAT( stats.blasEntries++ );
+				if (BLASOccludes<B>( blas, tmp )) return true;
 			}
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
 		BVHNode* child1 = &bvhNode[node->leftFirst], * child2 = &bvhNode[node->leftFirst + 1];
 		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
 		SLAB_TEST_TWO_NODES;
 		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
 		if (dist1 == BVH_FAR /* missed both child nodes */)
@@ -3242,11 +6053,54 @@ template <bool posX, bool posY, bool posZ> bool BVH::IsOccludedTLAS( const Ray&
 		{
 			node = child1; /* continue with the nearest */
 			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return false;
 }
 
+// TLAS traversal for scenes where all BLASses have layout B (BVH, BVH4_CPU,
+// BVH_SoA or BVH8_CPU): the BLAS kernel is resolved at compile time. Use the
+// regular Intersect / IsOccluded for scenes with mixed BLAS layouts.
+template <class B> int32_t BVH::IntersectTLAS( Ray& ray ) const
+{
+	VALIDATE_RAY( ray );
+	const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+	if (!posX) goto negx;
+	if (posY) { if (posZ) return IntersectTLAS<B, true, true, true>( ray ); else return IntersectTLAS<B, true, true, false>( ray ); }
+	if (posZ) return IntersectTLAS<B, true, false, true>( ray ); else return IntersectTLAS<B, true, false, false>( ray );
+negx:
+	if (posY) { if (posZ) return IntersectTLAS<B, false, true, true>( ray ); else return IntersectTLAS<B, false, true, false>( ray ); }
+	if (posZ) return IntersectTLAS<B, false, false, true>( ray ); else return IntersectTLAS<B, false, false, false>( ray );
+}
+
+template <class B> bool BVH::IsOccludedTLAS( const Ray& ray ) const
+{
+	VALIDATE_RAY( ray );
+	const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+	if (!posX) goto negx;
+	if (posY) { if (posZ) return IsOccludedTLAS<B, true, true, true>( ray ); else return IsOccludedTLAS<B, true, true, false>( ray ); }
+	if (posZ) return IsOccludedTLAS<B, true, false, true>( ray ); else return IsOccludedTLAS<B, true, false, false>( ray );
+negx:
+	if (posY) { if (posZ) return IsOccludedTLAS<B, false, true, true>( ray ); else return IsOccludedTLAS<B, false, true, false>( ray ); }
+	if (posZ) return IsOccludedTLAS<B, false, false, true>( ray ); else return IsOccludedTLAS<B, false, false, false>( ray );
+}
+
+template int32_t BVH::IntersectTLAS<BVH>( Ray& ray ) const;
+template bool BVH::IsOccludedTLAS<BVH>( const Ray& ray ) const;
+#ifdef BVH_USESSE
+template int32_t BVH::IntersectTLAS<BVH4_CPU>( Ray& ray ) const;
+template bool BVH::IsOccludedTLAS<BVH4_CPU>( const Ray& ray ) const;
+#endif
+#ifdef BVH_USEAVX
+template int32_t BVH::IntersectTLAS<BVH_SoA>( Ray& ray ) const;
+template bool BVH::IsOccludedTLAS<BVH_SoA>( const Ray& ray ) const;
+#endif
+#ifdef BVH_USEAVX2
+template int32_t BVH::IntersectTLAS<BVH8_CPU>( Ray& ray ) const;
+template bool BVH::IsOccludedTLAS<BVH8_CPU>( const Ray& ray ) const;
+#endif
+
 // Intersect a WALD_32BYTE BVH with a ray packet.
 // The 256 rays travel together to better utilize the caches and to amortize the cost
 // of memory transfers over the rays in the bundle.
@@ -3428,7 +6282,7 @@ int32_t BVH::NodeCount() const
 {
 	// Determine the number of nodes in the tree. Typically the result should
 	// be usedNodes - 1 (second node is always unused), but some builders may
-	// have unused nodes besides node 1. TODO: Support more layouts.
+	// have unused nodes besides node 1. Analyze reports this for all layouts.
 	uint32_t retVal = 0, nodeIdx = 0, stack[64], stackPtr = 0;
 	while (1)
 	{
@@ -3442,9 +6296,8 @@ int32_t BVH::NodeCount() const
 
 int32_t BVH::LeafCount() const
 {
-	// Determine the number of nodes in the tree. Typically the result should
-	// be usedNodes - 1 (second node is always unused), but some builders may
-	// have unused nodes besides node 1. TODO: Support more layouts.
+	// Determine the number of leaves in the tree, skipping unused nodes.
+	// Analyze reports this for all layouts.
 	uint32_t retVal = 0, nodeIdx = 0, stack[64], stackPtr = 0;
 	while (1)
 	{
@@ -3461,14 +6314,16 @@ int32_t BVH::LeafCount() const
 // compacted tree to work correctly.
 void BVH::Compact()
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::COMPACT );
 	BVH_FATAL_ERROR_IF( bvhNode == 0, "BVH::Compact(), bvhNode == 0." );
+	BVH_FATAL_ERROR_IF( lazyState != 0, "BVH::Compact(), lazy BVH; call FinishLazy first." );
 	if (bvhNode[0].isLeaf()) return; // nothing to compact.
 	BVHNode* tmp = (BVHNode*)AlignedAlloc( sizeof( BVHNode ) * allocatedNodes /* do *not* trim */ );
 	uint32_t* idx = (uint32_t*)AlignedAlloc( sizeof( uint32_t ) * idxCount );
 	memcpy( tmp, bvhNode, 2 * sizeof( BVHNode ) );
 	newNodePtr = 2;
 	uint32_t newIdxPtr = 0;
-	uint32_t nodeIdx = 0, stack[128], stackPtr = 0;
+	uint32_t nodeIdx = 0, stack[256], stackPtr = 0;
 	while (1)
 	{
 		BVHNode& node = tmp[nodeIdx];
@@ -3488,6 +6343,7 @@ void BVH::Compact()
 			const uint32_t todo1 = newNodePtr, todo2 = newNodePtr + 1;
 			node.leftFirst = newNodePtr, newNodePtr += 2;
 			nodeIdx = todo1;
+			BVH_FATAL_ERROR_IF( stackPtr == BVH_NUM_ELEMS( stack ), "BVH::Compact(), tree too deep." );
 			stack[stackPtr++] = todo2;
 		}
 	}
@@ -3498,11 +6354,152 @@ void BVH::Compact()
 	primIdx = idx;
 }
 
+// Node reordering helpers.
+// tinybvh_treelet_order lays out a tree of 'units' (node pairs, wide nodes) as
+// a sequence of treelets: breadth-first for treeletDepth levels, treelets in
+// depth-first order. A depth of 1 yields a plain depth-first order. Callback
+// 'children' returns the child units of a unit, in the preferred order.
+template <class F> static uint32_t tinybvh_treelet_order( const uint32_t root, uint32_t* order, uint32_t* stack, const uint32_t treeletDepth, F children )
+{
+	uint32_t emitted = 0, stackPtr = 0;
+	stack[stackPtr++] = root;
+	while (stackPtr > 0)
+	{
+		const uint32_t first = emitted, frontier = --stackPtr;
+		order[emitted++] = stack[stackPtr];
+		for (uint32_t level = 1, levelEnd = emitted, i = first; i < emitted; i++)
+		{
+			if (i == levelEnd) level++, levelEnd = emitted;
+			uint32_t child[8];
+			const uint32_t n = children( order[i], child );
+			for (uint32_t c = 0; c < n; c++)
+				if (level < treeletDepth) order[emitted++] = child[c]; else stack[stackPtr++] = child[c];
+		}
+		// reverse the frontier so the first child of the treelet is popped first.
+		if (stackPtr > frontier) for (uint32_t a = frontier, b = stackPtr - 1; a < b; a++, b--)
+			tinybvh_swap( stack[a], stack[b] );
+	}
+	return emitted;
+}
+
+// Block reordering for BVH4_CPU (N = 4) and BVH8_CPU (N = 8). An interior node
+// stores six arrays of N floats (child bounds) followed by N child slots; leaf
+// blocks are stored right behind their parent. Lanes are not permuted, so the
+// per-octant child orders stay valid. Returns the number of used blocks.
+template <int N> static uint32_t tinybvh_reorder_blocks( BVHBase& bvh, uint8_t* data, const uint32_t usedBlocks,
+	const uint32_t leafBlocks, const BVHBase::NodeOrder order, const uint32_t treeletDepth )
+{
+	const uint32_t EMPTY = 1u << 31, LEAF = 1u << 30, MASK = 0x1fffffff, nodeBlocks = N / 2;
+	const bool sortSA = order != BVHBase::ORDER_DFS;
+	const uint32_t depth = order == BVHBase::ORDER_TREELETS ? tinybvh_max( treeletDepth, 1u ) : 1;
+	uint8_t* tmp = (uint8_t*)bvh.AlignedAlloc( usedBlocks * 64 );
+	uint32_t* unit = (uint32_t*)bvh.AlignedAlloc( usedBlocks * 3 * sizeof( uint32_t ) );
+	uint32_t* stack = unit + usedBlocks, * newIdx = unit + usedBlocks * 2;
+	memcpy( tmp, data, usedBlocks * 64 );
+	auto lanes = [&]( const uint32_t block, uint32_t* lane ) -> uint32_t
+	{
+		// occupied lanes of a node, largest child surface area first if requested.
+		const float* b = (const float*)(tmp + block * 64);
+		const uint32_t* slot = (const uint32_t*)(b + N * 6);
+		float area[N];
+		uint32_t n = 0;
+		for (uint32_t i = 0; i < N; i++) if (!(slot[i] & EMPTY))
+		{
+			const float ex = b[N + i] - b[i], ey = b[N * 3 + i] - b[N * 2 + i], ez = b[N * 5 + i] - b[N * 4 + i];
+			area[i] = ex * ey + ey * ez + ez * ex;
+			uint32_t j = n++;
+			if (sortSA) while (j > 0 && area[lane[j - 1]] < area[i]) lane[j] = lane[j - 1], j--;
+			lane[j] = i;
+		}
+		return n;
+	};
+	const uint32_t units = tinybvh_treelet_order( 0, unit, stack, depth, [&]( const uint32_t block, uint32_t* child ) -> uint32_t
+	{
+		const uint32_t* slot = (const uint32_t*)(tmp + block * 64 + N * 24);
+		uint32_t lane[N], n = 0;
+		for (uint32_t count = lanes( block, lane ), i = 0; i < count; i++)
+			if (!(slot[lane[i]] & LEAF)) child[n++] = slot[lane[i]] & MASK;
+		return n;
+	} );
+	// assign new block offsets, then copy and patch the child slots.
+	uint32_t blockPtr = 0;
+	for (uint32_t u = 0; u < units; u++)
+	{
+		const uint32_t block = unit[u], * slot = (const uint32_t*)(tmp + block * 64 + N * 24);
+		uint32_t lane[N];
+		newIdx[block] = blockPtr, blockPtr += nodeBlocks;
+		for (uint32_t count = lanes( block, lane ), i = 0; i < count; i++) if (slot[lane[i]] & LEAF)
+			newIdx[slot[lane[i]] & MASK] = blockPtr, blockPtr += leafBlocks;
+	}
+	for (uint32_t u = 0; u < units; u++)
+	{
+		const uint32_t block = unit[u];
+		memcpy( data + newIdx[block] * 64, tmp + block * 64, nodeBlocks * 64 );
+		uint32_t* slot = (uint32_t*)(data + newIdx[block] * 64 + N * 24);
+		for (uint32_t i = 0; i < N; i++) if (!(slot[i] & EMPTY))
+		{
+			const uint32_t child = slot[i] & MASK;
+			slot[i] = (slot[i] & ~MASK) + newIdx[child];
+			if (slot[i] & LEAF) memcpy( data + newIdx[child] * 64, tmp + child * 64, leafBlocks * 64 );
+		}
+	}
+	bvh.AlignedFree( unit );
+	bvh.AlignedFree( tmp );
+	return blockPtr;
+}
+
+void BVH::Reorder( const NodeOrder order, const uint32_t treeletDepth )
+{
+	// lay out the node pairs for memory locality; see NodeOrder. With ORDER_DFS_SAH
+	// and ORDER_TREELETS the larger child of a pair also goes first. Removes holes;
+	// primIdx is not affected.
+	BVH_FATAL_ERROR_IF( bvhNode == 0, "BVH::Reorder( .. ), bvhNode == 0." );
+	BVH_FATAL_ERROR_IF( lazyState != 0, "BVH::Reorder( .. ), lazy BVH; call FinishLazy first." );
+	if (bvhNode[0].isLeaf()) return; // nothing to reorder.
+	const bool sortSA = order != ORDER_DFS;
+	const uint32_t depth = order == ORDER_TREELETS ? tinybvh_max( treeletDepth, 1u ) : 1;
+	BVHNode* tmp = (BVHNode*)AlignedAlloc( usedNodes * sizeof( BVHNode ) );
+	uint32_t* unit = (uint32_t*)AlignedAlloc( usedNodes * 3 * sizeof( uint32_t ) );
+	uint32_t* stack = unit + usedNodes, * newIdx = unit + usedNodes * 2;
+	memcpy( tmp, bvhNode, usedNodes * sizeof( BVHNode ) );
+	// a unit is a node pair, identified by its first node; the root is a unit by itself.
+	auto larger = [&]( const uint32_t u ) -> uint32_t
+	{
+		return (u == 0 || !sortSA || tmp[u].SurfaceArea() >= tmp[u + 1].SurfaceArea()) ? u : (u + 1);
+	};
+	const uint32_t units = tinybvh_treelet_order( 0, unit, stack, depth, [&]( const uint32_t u, uint32_t* child ) -> uint32_t
+	{
+		const uint32_t a = larger( u ), b = u == 0 ? 0 : (u * 2 + 1 - a);
+		uint32_t n = 0;
+		if (!tmp[a].isLeaf()) child[n++] = tmp[a].leftFirst;
+		if (u > 0 && !tmp[b].isLeaf()) child[n++] = tmp[b].leftFirst;
+		return n;
+	} );
+	newIdx[0] = 0;
+	for (uint32_t nodePtr = 2, i = 1; i < units; i++, nodePtr += 2)
+	{
+		const uint32_t u = unit[i], a = larger( u );
+		newIdx[a] = nodePtr, newIdx[u * 2 + 1 - a] = nodePtr + 1;
+	}
+	for (uint32_t i = 0; i < units; i++) for (uint32_t j = 0; j < (unit[i] ? 2u : 1u); j++)
+	{
+		const uint32_t n = unit[i] + j;
+		BVHNode& node = bvhNode[newIdx[n]];
+		node = tmp[n];
+		if (!node.isLeaf()) node.leftFirst = tinybvh_min( newIdx[node.leftFirst], newIdx[node.leftFirst + 1] );
+	}
+	usedNodes = units * 2;
+	may_have_holes = false;
+	AlignedFree( unit );
+	AlignedFree( tmp );
+}
+
 // BVH_Verbose implementation
 // ----------------------------------------------------------------------------
 
 void BVH_Verbose::ConvertFrom( const BVH& original, bool /* unused here */ )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// allocate space
 	uint32_t spaceNeeded = original.triCount * (refittable ? 2 : 3);
 	if (allocatedNodes < spaceNeeded)
@@ -3548,7 +6545,7 @@ int32_t BVH_Verbose::NodeCount() const
 {
 	// Determine the number of nodes in the tree. Typically the result should
 	// be usedNodes - 1 (second node is always unused), but some builders may
-	// have unused nodes besides node 1. TODO: Support more layouts.
+	// have unused nodes besides node 1. Analyze reports this for all layouts.
 	uint32_t retVal = 0, nodeIdx = 0, stack[64], stackPtr = 0;
 	while (1)
 	{
@@ -3571,6 +6568,16 @@ float BVH_Verbose::SAHCost( const uint32_t nodeIdx ) const
 	return nodeIdx == 0 ? (cost / SAn) : cost;
 }
 
+BVHQuality BVH_Verbose::Analyze( const bool epo ) const
+{
+	BVHQuality q;
+	if (usedNodes == 0) return q;
+	const tinybvh_verbose_view view = { *this };
+	q = tinybvh_analyze( *this, view, epo );
+	tinybvh_set_footprint( q, usedNodes * sizeof( BVHNode ) + (uint64_t)idxCount * sizeof( uint32_t ), triCount );
+	return q;
+}
+
 void BVH_Verbose::Refit( const uint32_t nodeIdx, bool skipLeafs )
 {
 	BVH_FATAL_ERROR_IF( !refittable && !skipLeafs, "BVH_Verbose::Refit( .. ), refitting an SBVH." );
@@ -3632,6 +6639,7 @@ void BVH_Verbose::CheckFit( const uint32_t nodeIdx, bool skipLeafs )
 
 void BVH_Verbose::Compact()
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::COMPACT );
 	BVH_FATAL_ERROR_IF( bvhNode == 0, "BVH_Verbose::Compact(), bvhNode == 0." );
 	if (bvhNode[0].isLeaf()) return; // nothing to compact.
 	BVHNode* tmp = (BVHNode*)AlignedAlloc( sizeof( BVHNode ) * usedNodes );
@@ -3923,6 +6931,71 @@ void BVH_GPU::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, ui
 	ConvertFrom( bvh, false );
 }
 
+bool BVH_GPU::Save( const char* fileName )
+{
+	BVH_FATAL_ERROR_IF( bvh.instList != 0, "BVH_GPU::Save( .. ), can't save a TLAS." );
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH_GPU::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	// store the BVH_GPU nodes and the underlying BVH, which owns the primitive indices.
+	header = FileHeader();
+	header.bvhFlags = bvh.FileFlags();
+	section[0] = { BVHFileSection::NODES, bvhNode, usedNodes * sizeof( BVHNode ) };
+	section[1] = { BVHFileSection::BVH_NODES, bvh.bvhNode, bvh.usedNodes * sizeof( BVH::BVHNode ) };
+	section[2] = { BVHFileSection::PRIM_INDICES, bvh.primIdx, bvh.idxCount * sizeof( uint32_t ) };
+	return 3;
+}
+
+BVHQuality BVH_GPU::Analyze( const bool epo ) const
+{
+	BVHQuality q = bvh.Analyze( epo );
+	tinybvh_set_footprint( q, usedNodes * sizeof( BVHNode ) + (uint64_t)bvh.idxCount * sizeof( uint32_t ), triCount );
+	return q;
+}
+
+bool BVH_GPU::Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+bool BVH_GPU::Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+bool BVH_GPU::Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadFile( fileName, 0, vertices, indices, primCount );
+}
+
+bool BVH_GPU::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+bool BVH_GPU::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+bool BVH_GPU::Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadFile( 0, &file, vertices, indices, primCount );
+}
+
+bool BVH_GPU::LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	void* nodes = bvhNode;
+	if (!LoadLayoutFile( fileName, file, vertices, indices, primCount, sizeof( BVHNode ), bvh, ownBVH, nodes )) return false;
+	bvhNode = (BVHNode*)nodes;
+	return true;
+}
+
 void BVH_GPU::Optimize( const uint32_t iterations, bool extreme )
 {
 	bvh.Optimize( iterations, extreme );
@@ -3931,9 +7004,11 @@ void BVH_GPU::Optimize( const uint32_t iterations, bool extreme )
 
 void BVH_GPU::ConvertFrom( const BVH& original, bool compact )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// get a copy of the original bvh
 	if (&original != &bvh) ownBVH = false; // bvh isn't ours; don't delete in destructor.
 	bvh = original;
+	BVH_FATAL_ERROR_IF( bvh.bvh_over_quads, "BVH_GPU::ConvertFrom( .. ), quads not supported for this layout." );
 	// allocate space
 	const uint32_t spaceNeeded = compact ? original.usedNodes : original.allocatedNodes;
 	if (allocatedNodes < spaceNeeded)
@@ -3944,20 +7019,33 @@ void BVH_GPU::ConvertFrom( const BVH& original, bool compact )
 	}
 	memset( bvhNode, 0, sizeof( BVHNode ) * spaceNeeded );
 	CopyBasePropertiesFrom( original );
-	// recursively convert nodes
-	uint32_t newNodePtr = 0, nodeIdx = 0, stack[128], stackPtr = 0;
-	while (1)
+	// convert nodes: preorder, left child first; the nodes convert independently.
+	const BVHContext& ctx = original.context;
+	uint32_t* pos = (uint32_t*)ctx.malloc( original.usedNodes * 3 * sizeof( uint32_t ), ctx.userdata ), count;
+	uint32_t* order = pos + original.usedNodes, * parent = order + original.usedNodes;
+	usedNodes = tinybvh_preorder( ctx, original.usedNodes, pos, order, count, []( uint32_t ) { return 1u; },
+		[&]( const uint32_t n, uint32_t* child )
+		{
+			const BVH::BVHNode& orig = original.bvhNode[n];
+			if (orig.isLeaf()) return 0u;
+			child[0] = orig.leftFirst, child[1] = orig.leftFirst + 1;
+			return 2u;
+		} );
+	parent[0] = NO_PARENT;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const BVH::BVHNode& orig = original.bvhNode[order[i]];
+		if (!orig.isLeaf()) parent[orig.leftFirst] = parent[orig.leftFirst + 1] = pos[order[i]];
+	}
+	tinybvh_build_for( ctx, count, 256, [&]( const uint32_t i )
 	{
+		const uint32_t nodeIdx = order[i], idx = pos[nodeIdx];
 		const BVH::BVHNode& orig = original.bvhNode[nodeIdx];
-		const uint32_t idx = newNodePtr++;
 		if (orig.isLeaf())
 		{
 			this->bvhNode[idx].triCount = orig.triCount;
 			this->bvhNode[idx].firstTri = orig.leftFirst;
-			if (!stackPtr) break;
-			nodeIdx = stack[--stackPtr];
-			uint32_t newNodeParent = stack[--stackPtr];
-			this->bvhNode[newNodeParent].right = newNodePtr;
+			this->bvhNode[idx].left = parent[nodeIdx];
 		}
 		else
 		{
@@ -3965,13 +7053,11 @@ void BVH_GPU::ConvertFrom( const BVH& original, bool compact )
 			const BVH::BVHNode& right = original.bvhNode[orig.leftFirst + 1];
 			this->bvhNode[idx].lmin = left.aabbMin, this->bvhNode[idx].rmin = right.aabbMin;
 			this->bvhNode[idx].lmax = left.aabbMax, this->bvhNode[idx].rmax = right.aabbMax;
-			this->bvhNode[idx].left = newNodePtr; // right will be filled when popped
-			stack[stackPtr++] = idx;
-			stack[stackPtr++] = orig.leftFirst + 1;
-			nodeIdx = orig.leftFirst;
+			this->bvhNode[idx].left = pos[orig.leftFirst], this->bvhNode[idx].right = pos[orig.leftFirst + 1];
+			this->bvhNode[idx].firstTri = parent[nodeIdx];
 		}
-	}
-	usedNodes = newNodePtr;
+	} );
+	ctx.free( pos, ctx.userdata );
 }
 
 int32_t BVH_GPU::Intersect( Ray& ray ) const
@@ -4031,6 +7117,64 @@ int32_t BVH_GPU::Intersect( Ray& ray ) const
 	return (int32_t)cost; // cast to not break interface.
 }
 
+int32_t BVH_GPU::IntersectStackless( Ray& ray ) const
+{
+	// Parent-pointer traversal: instead of popping a stack, go back up to the
+	// parent and use the node we came from to decide where to go next. The
+	// near/far order of two children depends only on the ray, so it is the
+	// same on the way down and on the way up; the far child is culled against
+	// the hit distance at the time it is reached.
+	VALIDATE_RAY( ray );
+	const bvhvec4slice& verts = bvh.verts;
+	const uint32_t* primIdx = bvh.primIdx;
+	uint32_t nodeIdx = 0, fromIdx = NO_PARENT;
+	float cost = 0;
+	while (1)
+	{
+		const BVHNode* node = bvhNode + nodeIdx;
+		uint32_t nextIdx = node->parent();
+		cost += c_trav;
+		if (node->isLeaf())
+		{
+			if (indexedEnabled && bvh.vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
+			{
+				const uint32_t pi = primIdx[node->firstTri + i];
+				const uint32_t i0 = bvh.vertIdx[pi * 3], i1 = bvh.vertIdx[pi * 3 + 1], i2 = bvh.vertIdx[pi * 3 + 2];
+				IntersectTri( ray, pi, verts, i0, i1, i2 );
+			}
+			else for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
+			{
+				const uint32_t pi = primIdx[node->firstTri + i];
+				IntersectTri( ray, pi, verts, pi * 3, pi * 3 + 1, pi * 3 + 2 );
+			}
+		}
+		else
+		{
+			const bvhvec3 lmin = node->lmin - ray.O, lmax = node->lmax - ray.O;
+			const bvhvec3 rmin = node->rmin - ray.O, rmax = node->rmax - ray.O;
+			const bvhvec3 t1a = lmin * ray.rD, t2a = lmax * ray.rD;
+			const bvhvec3 t1b = rmin * ray.rD, t2b = rmax * ray.rD;
+			const float tmina = tinybvh_max( tinybvh_max( tinybvh_min( t1a.x, t2a.x ), tinybvh_min( t1a.y, t2a.y ) ), tinybvh_min( t1a.z, t2a.z ) );
+			const float tmaxa = tinybvh_min( tinybvh_min( tinybvh_max( t1a.x, t2a.x ), tinybvh_max( t1a.y, t2a.y ) ), tinybvh_max( t1a.z, t2a.z ) );
+			const float tminb = tinybvh_max( tinybvh_max( tinybvh_min( t1b.x, t2b.x ), tinybvh_min( t1b.y, t2b.y ) ), tinybvh_min( t1b.z, t2b.z ) );
+			const float tmaxb = tinybvh_min( tinybvh_min( tinybvh_max( t1b.x, t2b.x ), tinybvh_max( t1b.y, t2b.y ) ), tinybvh_max( t1b.z, t2b.z ) );
+			bool hitNear = tmaxa >= tmina && tmina < ray.hit.t && tmaxa >= 0;
+			bool hitFar = tmaxb >= tminb && tminb < ray.hit.t && tmaxb >= 0;
+			uint32_t nearIdx = node->left, farIdx = node->right;
+			if (tmina > tminb)
+			{
+				bool h = hitNear; hitNear = hitFar; hitFar = h;
+				uint32_t i = nearIdx; nearIdx = farIdx; farIdx = i;
+			}
+			if (fromIdx == nextIdx /* coming down */) { if (hitNear) nextIdx = nearIdx; else if (hitFar) nextIdx = farIdx; }
+			else if (fromIdx == nearIdx && hitFar) nextIdx = farIdx;
+		}
+		if (nextIdx == NO_PARENT) break;
+		fromIdx = nodeIdx, nodeIdx = nextIdx;
+	}
+	return (int32_t)cost; // cast to not break interface.
+}
+
 // BVH_SoA implementation
 // ----------------------------------------------------------------------------
 
@@ -4096,9 +7240,31 @@ void BVH_SoA::Optimize( const uint32_t iterations, bool extreme )
 	ConvertFrom( bvh, false );
 }
 
-void BVH_SoA::Save( const char* fileName )
+bool BVH_SoA::Save( const char* fileName )
+{
+	BVH_FATAL_ERROR_IF( bvh.instList != 0, "BVH_SoA::Save( .. ), can't save a TLAS." );
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH_SoA::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	// store the SoA nodes and the underlying BVH, which owns the primitive indices.
+	header = FileHeader();
+	header.bvhFlags = bvh.FileFlags();
+	section[0] = { BVHFileSection::NODES, bvhNode, usedNodes * sizeof( BVHNode ) };
+	section[1] = { BVHFileSection::BVH_NODES, bvh.bvhNode, bvh.usedNodes * sizeof( BVH::BVHNode ) };
+	section[2] = { BVHFileSection::PRIM_INDICES, bvh.primIdx, bvh.idxCount * sizeof( uint32_t ) };
+	return 3;
+}
+
+BVHQuality BVH_SoA::Analyze( const bool epo ) const
 {
-	bvh.Save( fileName );
+	BVHQuality q = bvh.Analyze( epo );
+	tinybvh_set_footprint( q, usedNodes * sizeof( BVHNode ) + (uint64_t)bvh.idxCount * sizeof( uint32_t ), triCount );
+	return q;
 }
 
 bool BVH_SoA::Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount )
@@ -4113,16 +7279,39 @@ bool BVH_SoA::Load( const char* fileName, const bvhvec4* vertices, const uint32_
 
 bool BVH_SoA::Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
 {
-	if (!bvh.Load( fileName, vertices, indices, primCount )) return false;
-	ConvertFrom( bvh, false );
+	return LoadFile( fileName, 0, vertices, indices, primCount );
+}
+
+bool BVH_SoA::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+bool BVH_SoA::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+bool BVH_SoA::Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadFile( 0, &file, vertices, indices, primCount );
+}
+
+bool BVH_SoA::LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	void* nodes = bvhNode;
+	if (!LoadLayoutFile( fileName, file, vertices, indices, primCount, sizeof( BVHNode ), bvh, ownBVH, nodes )) return false;
+	bvhNode = (BVHNode*)nodes;
 	return true;
 }
 
 void BVH_SoA::ConvertFrom( const BVH& original, bool compact )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// get a copy of the original bvh
 	if (&original != &bvh) ownBVH = false; // bvh isn't ours; don't delete in destructor.
 	bvh = original;
+	BVH_FATAL_ERROR_IF( bvh.bvh_over_quads, "BVH_SoA::ConvertFrom( .. ), quads not supported for this layout." );
 	// allocate space
 	const uint32_t spaceNeeded = compact ? bvh.usedNodes : bvh.allocatedNodes;
 	if (allocatedNodes < spaceNeeded)
@@ -4133,20 +7322,26 @@ void BVH_SoA::ConvertFrom( const BVH& original, bool compact )
 	}
 	memset( bvhNode, 0, sizeof( BVHNode ) * spaceNeeded );
 	CopyBasePropertiesFrom( bvh );
-	// recursively convert nodes
-	uint32_t newAlt2Node = 0, nodeIdx = 0, stack[128], stackPtr = 0;
-	while (1)
-	{
-		const BVH::BVHNode& node = bvh.bvhNode[nodeIdx];
-		const uint32_t idx = newAlt2Node++;
+	// convert nodes: preorder, left child first; the nodes convert independently.
+	const BVHContext& ctx = bvh.context;
+	uint32_t* pos = (uint32_t*)ctx.malloc( bvh.usedNodes * 2 * sizeof( uint32_t ), ctx.userdata ), count;
+	uint32_t* order = pos + bvh.usedNodes;
+	usedNodes = tinybvh_preorder( ctx, bvh.usedNodes, pos, order, count, []( uint32_t ) { return 1u; },
+		[&]( const uint32_t n, uint32_t* child )
+		{
+			const BVH::BVHNode& node = bvh.bvhNode[n];
+			if (node.isLeaf()) return 0u;
+			child[0] = node.leftFirst, child[1] = node.leftFirst + 1;
+			return 2u;
+		} );
+	tinybvh_build_for( ctx, count, 256, [&]( const uint32_t i )
+	{
+		const uint32_t idx = pos[order[i]];
+		const BVH::BVHNode& node = bvh.bvhNode[order[i]];
 		if (node.isLeaf())
 		{
 			bvhNode[idx].triCount = node.triCount;
 			bvhNode[idx].firstTri = node.leftFirst;
-			if (!stackPtr) break;
-			nodeIdx = stack[--stackPtr];
-			uint32_t newNodeParent = stack[--stackPtr];
-			bvhNode[newNodeParent].right = newAlt2Node;
 		}
 		else
 		{
@@ -4157,13 +7352,10 @@ void BVH_SoA::ConvertFrom( const BVH& original, bool compact )
 			bvhNode[idx].xxxx = SIMD_SETRVEC( left.aabbMin.x, left.aabbMax.x, right.aabbMin.x, right.aabbMax.x );
 			bvhNode[idx].yyyy = SIMD_SETRVEC( left.aabbMin.y, left.aabbMax.y, right.aabbMin.y, right.aabbMax.y );
 			bvhNode[idx].zzzz = SIMD_SETRVEC( left.aabbMin.z, left.aabbMax.z, right.aabbMin.z, right.aabbMax.z );
-			bvhNode[idx].left = newAlt2Node; // right will be filled when popped
-			stack[stackPtr++] = idx;
-			stack[stackPtr++] = node.leftFirst + 1;
-			nodeIdx = node.leftFirst;
+			bvhNode[idx].left = pos[node.leftFirst], bvhNode[idx].right = pos[node.leftFirst + 1];
 		}
-	}
-	usedNodes = newAlt2Node;
+	} );
+	ctx.free( pos, ctx.userdata );
 }
 
 // BVH_SoA::Intersect can be found in the BVH_USEAVX section later in this file.
@@ -4203,6 +7395,30 @@ template<int M> void MBVH<M>::Build( const bvhvec4slice& vertices, const uint32_
 	ConvertFrom( bvh, true );
 }
 
+template<int M> void MBVH<M>::BuildQuads( const bvhvec4* vertices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice( vertices, quadCount * 4, sizeof( bvhvec4 ) ) );
+}
+
+template<int M> void MBVH<M>::BuildQuads( const bvhvec4slice& vertices )
+{
+	bvh.context = context;
+	bvh.BuildQuads( vertices );
+	ConvertFrom( bvh, true );
+}
+
+template<int M> void MBVH<M>::BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice{ vertices, quadCount * 4, sizeof( bvhvec4 ) }, indices, quadCount );
+}
+
+template<int M> void MBVH<M>::BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	bvh.context = context;
+	bvh.BuildQuads( vertices, indices, quadCount );
+	ConvertFrom( bvh, true );
+}
+
 template<int M> void MBVH<M>::BuildHQ( const bvhvec4* vertices, const uint32_t primCount )
 {
 	BuildHQ( bvhvec4slice( vertices, primCount * 3, sizeof( bvhvec4 ) ) );
@@ -4227,6 +7443,58 @@ template<int M> void MBVH<M>::BuildHQ( const bvhvec4slice& vertices, const uint3
 	ConvertFrom( bvh, true );
 }
 
+template<int M> bool MBVH<M>::Save( const char* fileName )
+{
+	// store the M-wide nodes and the underlying BVH, which owns the primitive indices.
+	BVH_FATAL_ERROR_IF( bvh.instList != 0, "MBVH<M>::Save( .. ), can't save a TLAS." );
+	BVHFileHeader header = FileHeader();
+	header.bvhFlags = bvh.FileFlags();
+	const FileSection section[3] = {
+		{ BVHFileSection::NODES, mbvhNode, usedNodes * sizeof( MBVHNode ) },
+		{ BVHFileSection::BVH_NODES, bvh.bvhNode, bvh.usedNodes * sizeof( BVH::BVHNode ) },
+		{ BVHFileSection::PRIM_INDICES, bvh.primIdx, bvh.idxCount * sizeof( uint32_t ) }
+	};
+	return WriteFile( fileName, header, section, 3 );
+}
+
+template<int M> bool MBVH<M>::Load( const char* fileName, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+template<int M> bool MBVH<M>::Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( fileName, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+template<int M> bool MBVH<M>::Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadFile( fileName, 0, vertices, indices, primCount );
+}
+
+template<int M> bool MBVH<M>::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+
+template<int M> bool MBVH<M>::Load( const BVHMappedFile& file, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return Load( file, bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) }, indices, primCount );
+}
+
+template<int M> bool MBVH<M>::Load( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadFile( 0, &file, vertices, indices, primCount );
+}
+
+template<int M> bool MBVH<M>::LoadFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	void* nodes = mbvhNode;
+	if (!LoadLayoutFile( fileName, file, vertices, indices, primCount, sizeof( MBVHNode ), bvh, ownBVH, nodes )) return false;
+	mbvhNode = (MBVHNode*)nodes;
+	return true;
+}
+
 template<int M> void MBVH<M>::Optimize( const uint32_t iterations, bool extreme )
 {
 	bvh.Optimize( iterations, extreme );
@@ -4248,7 +7516,15 @@ template<int M> void MBVH<M>::Refit( const uint32_t nodeIdx )
 	if (node.isLeaf())
 	{
 		bvhvec3 bmin( BVH_FAR ), bmax( -BVH_FAR );
-		if (bvh.vertIdx) for (uint32_t first = node.firstTri, j = 0; j < node.triCount; j++)
+		if (quadsEnabled && bvh.bvh_over_quads) for (uint32_t i0, i1, i2, i3, first = node.firstTri, j = 0; j < node.triCount; j++)
+		{
+			const uint32_t pi = bvh.primIdx[first + j];
+			GET_QUAD_INDICES_I0_I1_I2_I3( bvh, pi );
+			const bvhvec3 v0 = bvh.verts[i0], v1 = bvh.verts[i1], v2 = bvh.verts[i2], v3 = bvh.verts[i3];
+			bmin = tinybvh_min( bmin, tinybvh_min( tinybvh_min( v0, v1 ), tinybvh_min( v2, v3 ) ) );
+			bmax = tinybvh_max( bmax, tinybvh_max( tinybvh_max( v0, v1 ), tinybvh_max( v2, v3 ) ) );
+		}
+		else if (bvh.vertIdx) for (uint32_t first = node.firstTri, j = 0; j < node.triCount; j++)
 		{
 			const uint32_t vidx = bvh.primIdx[first + j] * 3;
 			const uint32_t i0 = bvh.vertIdx[vidx], i1 = bvh.vertIdx[vidx + 1], i2 = bvh.vertIdx[vidx + 2];
@@ -4276,6 +7552,7 @@ template<int M> void MBVH<M>::Refit( const uint32_t nodeIdx )
 			bmin = tinybvh_min( bmin, child.aabbMin );
 			bmax = tinybvh_max( bmax, child.aabbMax );
 		}
+		node.aabbMin = bmin, node.aabbMax = bmax;
 	}
 	if (nodeIdx == 0) aabbMin = node.aabbMin, aabbMax = node.aabbMax;
 }
@@ -4292,8 +7569,19 @@ template<int M> float MBVH<M>::SAHCost( const uint32_t nodeIdx ) const
 	return nodeIdx == 0 ? (cost / sa) : cost;
 }
 
+template<int M> BVHQuality MBVH<M>::Analyze( const bool epo ) const
+{
+	BVHQuality q;
+	if (usedNodes == 0) return q;
+	const tinybvh_mbvh_view<M> view = { *this };
+	q = tinybvh_analyze( *this, view, epo );
+	tinybvh_set_footprint( q, usedNodes * sizeof( MBVHNode ) + (uint64_t)bvh.idxCount * sizeof( uint32_t ), triCount );
+	return q;
+}
+
 template<int M> void MBVH<M>::ConvertFrom( const BVH& original, bool compact )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::COLLAPSE );
 	// get a copy of the original bvh
 	if (&original != &bvh) ownBVH = false; // bvh isn't ours; don't delete in destructor.
 	bvh = original;
@@ -4310,19 +7598,20 @@ template<int M> void MBVH<M>::ConvertFrom( const BVH& original, bool compact )
 	memset( mbvhNode, 0, sizeof( MBVHNode ) * spaceNeeded );
 	CopyBasePropertiesFrom( original );
 	// create an mbvh node for each bvh2 node
-	for (uint32_t i = 0; i < original.usedNodes; i++) if (i != 1)
+	tinybvh_build_for( original.context, original.usedNodes, 1024, [&]( const uint32_t i )
 	{
+		if (i == 1) return;
 		BVH::BVHNode& orig = original.bvhNode[i];
 		MBVHNode& node = this->mbvhNode[i];
 		node.aabbMin = orig.aabbMin, node.aabbMax = orig.aabbMax;
 		if (orig.isLeaf()) node.triCount = orig.triCount, node.firstTri = orig.leftFirst;
 		else node.child[0] = orig.leftFirst, node.child[1] = orig.leftFirst + 1, node.childCount = 2;
-	}
-	// collapse
-	uint32_t stack[128], stackPtr = 0, nodeIdx = 0; // i.e., root node
-	while (1)
+	} );
+	// collapse: a node adopts grandchildren until it has M children. This only
+	// changes the node itself, so subtrees are independent: collapse the top of
+	// the tree breadth-first, then the subtrees below it in parallel.
+	auto collapse = [&]( MBVHNode& node )
 	{
-		MBVHNode& node = this->mbvhNode[nodeIdx];
 		while (node.childCount < M)
 		{
 			int32_t bestChild = -1;
@@ -4343,16 +7632,34 @@ template<int M> void MBVH<M>::ConvertFrom( const BVH& original, bool compact )
 			for (uint32_t i = 1; i < child.childCount; i++)
 				node.child[node.childCount++] = child.child[i];
 		}
-		// we're done with the node; proceed with the children.
+	};
+	uint32_t top[256], topFirst = 0, topLast = 1;
+	top[0] = 0; // i.e., root node
+	while (topFirst < topLast && topLast - topFirst < 32 && topLast + M <= 256)
+	{
+		MBVHNode& node = this->mbvhNode[top[topFirst++]];
+		collapse( node );
 		for (uint32_t i = 0; i < node.childCount; i++)
+			if (!this->mbvhNode[node.child[i]].isLeaf()) top[topLast++] = node.child[i];
+	}
+	tinybvh_build_for( original.context, topLast - topFirst, 1, [&]( const uint32_t t )
+	{
+		uint32_t stack[128], stackPtr = 0, nodeIdx = top[topFirst + t];
+		while (1)
 		{
-			const uint32_t childIdx = node.child[i];
-			const MBVHNode& child = this->mbvhNode[childIdx];
-			if (!child.isLeaf()) stack[stackPtr++] = childIdx;
+			MBVHNode& node = this->mbvhNode[nodeIdx];
+			collapse( node );
+			// we're done with the node; proceed with the children.
+			for (uint32_t i = 0; i < node.childCount; i++)
+			{
+				const uint32_t childIdx = node.child[i];
+				const MBVHNode& child = this->mbvhNode[childIdx];
+				if (!child.isLeaf()) stack[stackPtr++] = childIdx;
+			}
+			if (stackPtr == 0) break;
+			nodeIdx = stack[--stackPtr];
 		}
-		if (stackPtr == 0) break;
-		nodeIdx = stack[--stackPtr];
-	}
+	} );
 	// special case where root is leaf: add extra level - cwbvh needs this.
 	MBVHNode& root = this->mbvhNode[0];
 	if (root.isLeaf())
@@ -4426,6 +7733,62 @@ void BVH4_GPU::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, u
 	ConvertFrom( bvh4, true );
 }
 
+bool BVH4_GPU::Save( const char* fileName )
+{
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH4_GPU::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	header = FileHeader();
+	section[0] = { BVHFileSection::NODES, bvh4Data, usedBlocks * sizeof( bvhvec4 ) };
+	return 1;
+}
+
+BVHQuality BVH4_GPU::Analyze( const bool epo ) const
+{
+	BVHQuality q = bvh4.Analyze( epo );
+	tinybvh_set_footprint( q, usedBlocks * sizeof( bvhvec4 ), triCount );
+	return q;
+}
+
+bool BVH4_GPU::Load( const char* fileName, const uint32_t expectedTris )
+{
+	return LoadFile( fileName, 0, expectedTris );
+}
+
+bool BVH4_GPU::Load( const BVHMappedFile& file, const uint32_t expectedTris )
+{
+	// zero-copy load: traversal uses the node data in the mapped file directly.
+	return LoadFile( 0, &file, expectedTris );
+}
+
+bool BVH4_GPU::LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris )
+{
+	// open file and check contents
+	BVHFileHeader header;
+	FileSection section[1] = { { BVHFileSection::NODES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 1 )) return false;
+	if (header.triCount != expectedTris || (section[0].size % sizeof( bvhvec4 )))
+	{
+		DiscardSections( file, section, 1 );
+		return false;
+	}
+	// all checks passed; safe to overwrite *this
+	AlignedFree( bvh4Data );
+	ApplyFileHeader( header );
+	bvh4Data = (bvhvec4*)section[0].data;
+	usedBlocks = (uint32_t)(section[0].size / sizeof( bvhvec4 ));
+	allocatedBlocks = file ? 0 : usedBlocks;
+	SetMappedFile( file, section, 1 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
+	bvh4 = MBVH<4>();
+	return true;
+}
+
 void BVH4_GPU::Optimize( const uint32_t iterations, bool extreme )
 {
 	bvh4.Optimize( iterations, extreme );
@@ -4434,9 +7797,11 @@ void BVH4_GPU::Optimize( const uint32_t iterations, bool extreme )
 
 void BVH4_GPU::ConvertFrom( const MBVH<4>& original, bool compact )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// get a copy of the original bvh4
 	if (&original != &bvh4) ownBVH4 = false; // bvh isn't ours; don't delete in destructor.
 	bvh4 = original;
+	BVH_FATAL_ERROR_IF( bvh4.bvh_over_quads, "BVH4_GPU::ConvertFrom( .. ), quads not supported for this layout." );
 	// Convert a 4-wide BVH to a format suitable for GPU traversal. Layout:
 	// offs 0:   aabbMin (12 bytes), 4x quantized child xmin (4 bytes)
 	// offs 16:  aabbMax (12 bytes), 4x quantized child xmax (4 bytes)
@@ -4697,6 +8062,38 @@ void BVH4_CPU::Build( const bvhvec4slice& vertices, const uint32_t* indices, uin
 	ConvertFrom( bvh4 );
 }
 
+void BVH4_CPU::BuildQuads( const bvhvec4* vertices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice( vertices, quadCount * 4, sizeof( bvhvec4 ) ) );
+}
+
+void BVH4_CPU::BuildQuads( const bvhvec4slice& vertices )
+{
+	bvh4.bvh.context = bvh4.context = context;
+	bvh4.bvh.BuildQuads( vertices );
+	ConvertFrom( bvh4 );
+}
+
+void BVH4_CPU::BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice{ vertices, quadCount * 4, sizeof( bvhvec4 ) }, indices, quadCount );
+}
+
+void BVH4_CPU::BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	bvh4.bvh.context = bvh4.context = context;
+	bvh4.bvh.BuildQuads( vertices, indices, quadCount );
+	ConvertFrom( bvh4 );
+}
+
+void BVH4_CPU::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount )
+{
+	// build over custom primitives; set the custom intersection callbacks first.
+	bvh4.bvh.context = bvh4.context = context;
+	bvh4.bvh.Build( customGetAABB, primCount );
+	ConvertFrom( bvh4 );
+}
+
 void BVH4_CPU::BuildHQ( const bvhvec4* vertices, const uint32_t primCount )
 {
 	BuildHQ( bvhvec4slice( vertices, primCount * 3, sizeof( bvhvec4 ) ) );
@@ -4721,39 +8118,74 @@ void BVH4_CPU::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, u
 	ConvertFrom( bvh4 );
 }
 
-void BVH4_CPU::Save( const char* fileName )
+bool BVH4_CPU::Save( const char* fileName )
 {
-	std::fstream s{ fileName, s.binary | s.out };
-	uint32_t header = TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16) + (layout << 24);
-	s.write( (char*)&header, sizeof( uint32_t ) );
-	s.write( (char*)&triCount, sizeof( uint32_t ) );
-	s.write( (char*)this, sizeof( BVH4_CPU ) );
-	s.write( (char*)bvh4Data, usedBlocks * 64 );
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH4_CPU::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	header = FileHeader();
+	section[0] = { BVHFileSection::NODES, bvh4Data, usedBlocks * sizeof( CacheLine ) };
+	return 1;
 }
 
 bool BVH4_CPU::Load( const char* fileName, const uint32_t expectedTris )
+{
+	return LoadFile( fileName, 0, expectedTris );
+}
+
+bool BVH4_CPU::Load( const BVHMappedFile& file, const uint32_t expectedTris )
+{
+	// zero-copy load: traversal uses the node data in the mapped file directly.
+	return LoadFile( 0, &file, expectedTris );
+}
+
+bool BVH4_CPU::LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris )
 {
 	// open file and check contents
-	std::fstream s{ fileName, s.binary | s.in };
-	if (!s) return false;
-	BVHContext tmp = context;
-	uint32_t header, fileTriCount;
-	s.read( (char*)&header, sizeof( uint32_t ) );
-	if (((header >> 8) & 255) != TINY_BVH_VERSION_MINOR ||
-		((header >> 16) & 255) != TINY_BVH_VERSION_MAJOR ||
-		(header & 255) != TINY_BVH_VERSION_SUB || (header >> 24) != layout) return false;
-	s.read( (char*)&fileTriCount, sizeof( uint32_t ) );
-	if (fileTriCount != expectedTris) return false;
+	BVHFileHeader header;
+	FileSection section[1] = { { BVHFileSection::NODES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 1 )) return false;
+	if (header.triCount != expectedTris || (section[0].size % sizeof( CacheLine )))
+	{
+		DiscardSections( file, section, 1 );
+		return false;
+	}
 	// all checks passed; safe to overwrite *this
-	s.read( (char*)this, sizeof( BVH8_CPU ) );
-	context = tmp; // can't load context; function pointers will differ.
-	bvh4Data = (CacheLine*)AlignedAlloc( usedBlocks * 64 );
-	allocatedBlocks = usedBlocks;
-	s.read( (char*)bvh4Data, usedBlocks * 64 );
+	AlignedFree( bvh4Data );
+	ApplyFileHeader( header );
+	bvh4Data = (CacheLine*)section[0].data;
+	usedBlocks = (uint32_t)(section[0].size / sizeof( CacheLine ));
+	allocatedBlocks = file ? 0 : usedBlocks;
+	SetMappedFile( file, section, 1 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
 	bvh4 = MBVH<4>();
 	return true;
 }
 
+void BVH4_CPU::CloneFrom( const BVH4_CPU& original )
+{
+	// copy of the node and leaf data, allocated with this BVH's own context, e.g.
+	// on another NUMA node. The copy can be traversed, but not refitted.
+	if (!ownBVH4) bvh4 = MBVH<4>();
+	AlignedFree( bvh4Data );
+	const BVHContext ownContext = context;
+	CopyBasePropertiesFrom( original );
+	context = ownContext, rebuildable = refittable = false;
+	bvh4Data = (CacheLine*)AlignedAlloc( original.usedBlocks * sizeof( CacheLine ) );
+	memcpy( bvh4Data, original.bvh4Data, original.usedBlocks * sizeof( CacheLine ) );
+	allocatedBlocks = usedBlocks = original.usedBlocks;
+	SetMappedFile( 0 );
+	bvh4 = MBVH<4>();
+	ownBVH4 = true;
+	customIntersect = original.customIntersect, customIsOccluded = original.customIsOccluded;
+	customIntersect4 = original.customIntersect4, customIsOccluded4 = original.customIsOccluded4;
+}
+
 void BVH4_CPU::Optimize( const uint32_t iterations, bool extreme )
 {
 	bvh4.Optimize( iterations, extreme );
@@ -4762,19 +8194,99 @@ void BVH4_CPU::Optimize( const uint32_t iterations, bool extreme )
 
 void BVH4_CPU::Refit()
 {
-	bvh4.Refit();
+	// ConvertFrom collapses bvh4.bvh again, so that is the one to refit.
+	bvh4.bvh.Refit();
 	ConvertFrom( bvh4 );
 }
 
+void BVH4_CPU::Reorder( const NodeOrder order, const uint32_t treeletDepth )
+{
+	// lay out the node and leaf blocks for memory locality; see BVH::Reorder.
+	const uint32_t leafBlocks = (uint32_t)((customEnabled && bvh_over_aabbs) ? sizeof( BVHCustom4Leaf ) :
+		bvh_over_quads ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	usedBlocks = tinybvh_reorder_blocks<4>( *this, (uint8_t*)bvh4Data, usedBlocks, leafBlocks, order, treeletDepth );
+}
+
 float BVH4_CPU::SAHCost( const uint32_t nodeIdx ) const
 {
 	return bvh4.SAHCost( nodeIdx );
 }
 
+// View on the node blocks of BVH4_CPU and BVH8_CPU, so Analyze also works after
+// Load and CloneFrom, when the MBVH is empty. A node is a child slot in a block,
+// with id (block << 3) + slot + 1; id 0 is the root block. The blocks hold W floats
+// for xmin, xmax, ymin, ymax, zmin and zmax, followed by W child words. EPO
+// needs the original vertices, so it is only available when the MBVH is there.
+template <class T, int W> struct tinybvh_block_view
+{
+	const T& bvh;
+	const uint8_t* data; // bvh4Data or bvh8Data; 64-byte blocks.
+	const BVH& source; // the MBVH's bvh; holds the vertices if it was kept.
+	uint32_t Width() const { return W; }
+	bool Quads() const { return quadsEnabled && bvh.bvh_over_quads; }
+	bool HasGeometry() const { return source.verts.data != 0 && source.triCount == bvh.triCount; }
+	const float* Block( const uint32_t b ) const { return (const float*)(data + (uint64_t)b * 64); }
+	uint32_t Word( const uint32_t n ) const { return ((const uint32_t*)Block( (n - 1) >> 3 ))[6 * W + ((n - 1) & 7)]; }
+	bool IsLeaf( const uint32_t n ) const { return n > 0 && (Word( n ) & T::LEAF_BIT); }
+	uint32_t Children( const uint32_t n, uint32_t* c ) const
+	{
+		const uint32_t b = n == 0 ? 0 : (Word( n ) & 0x1fffffff), * child = (const uint32_t*)Block( b ) + 6 * W;
+		uint32_t k = 0;
+		for (uint32_t i = 0; i < W; i++) if (!(child[i] & T::EMPTY_BIT)) c[k++] = (b << 3) + i + 1;
+		return k;
+	}
+	bvhvec3 Bound( const uint32_t n, const uint32_t side ) const
+	{
+		if (n == 0)
+		{
+			// root: union of the children of the root block.
+			uint32_t c[8], k = Children( 0, c );
+			if (k == 0) return side ? bvh.aabbMax : bvh.aabbMin;
+			bvhvec3 r = Bound( c[0], side );
+			for (uint32_t i = 1; i < k; i++) r = side ? tinybvh_max( r, Bound( c[i], side ) ) : tinybvh_min( r, Bound( c[i], side ) );
+			return r;
+		}
+		const float* f = Block( (n - 1) >> 3 ) + ((n - 1) & 7) + side * W;
+		return bvhvec3( f[0], f[2 * W], f[4 * W] );
+	}
+	bvhvec3 Min( const uint32_t n ) const { return Bound( n, 0 ); }
+	bvhvec3 Max( const uint32_t n ) const { return Bound( n, 1 ); }
+	const uint32_t* LeafPrims( const uint32_t n ) const
+	{
+		const uint32_t w = Word( n );
+		const float* leaf = Block( w & 0x1fffffff );
+		if (w & T::CUSTOM_BIT) return ((const BVHCustom4Leaf*)leaf)->primIdx;
+		return Quads() ? ((const BVHQuad4Leaf*)leaf)->primIdx : ((const BVHTri4Leaf*)leaf)->primIdx;
+	}
+	uint32_t PrimCount( const uint32_t n ) const
+	{
+		// geometry leafs repeat their last primitive in the unused slots.
+		if (Word( n ) & T::CUSTOM_BIT) return ((const BVHCustom4Leaf*)Block( Word( n ) & 0x1fffffff ))->primCount;
+		const uint32_t* prim = LeafPrims( n );
+		uint32_t count = 1;
+		while (count < 4 && prim[count] != prim[count - 1]) count++;
+		return count;
+	}
+	uint32_t Prim( const uint32_t n, const uint32_t i ) const { return LeafPrims( n )[i]; }
+	void Corners( const uint32_t p, bvhvec3* v ) const { tinybvh_prim_corners( source, p, v ); }
+};
+
+BVHQuality BVH4_CPU::Analyze( const bool epo ) const
+{
+	BVHQuality q;
+	if (usedBlocks == 0) return q;
+	BVH_FATAL_ERROR_IF( usedBlocks >= (1u << 28), "BVH4_CPU::Analyze( .. ), too many blocks." );
+	const tinybvh_block_view<BVH4_CPU, 4> view = { *this, (const uint8_t*)bvh4Data, bvh4.bvh };
+	q = tinybvh_analyze( *this, view, epo );
+	tinybvh_set_footprint( q, usedBlocks * sizeof( CacheLine ), triCount );
+	return q;
+}
+
 #define SORT(a,b) { if (dist[a] < dist[b]) { float h = dist[a]; dist[a] = dist[b], dist[b] = h; } }
 
 void BVH4_CPU::ConvertFrom( MBVH<4>& original )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// Note: identical to BVH8_CPU version, just with fewer lanes.
 	// get a copy of the input bvh4
 	if (&original != &bvh4) ownBVH4 = false; // bvh isn't ours; don't delete in destructor.
@@ -4787,27 +8299,56 @@ void BVH4_CPU::ConvertFrom( MBVH<4>& original )
 	// allocate if needed
 	uint32_t nodesNeeded = bvh4.usedNodes, leafsNeeded = bvh4.LeafCount();
 	uint32_t blocksNeeded = nodesNeeded * (sizeof( BVHNode ) / 64); // here, block = cacheline.
-	blocksNeeded += leafsNeeded * (sizeof( BVHTri4Leaf ) / 64);
+	const bool customLeafs = customEnabled && bvh4.bvh_over_aabbs;
+	const uint32_t leafBlocks = (uint32_t)(customLeafs ? sizeof( BVHCustom4Leaf ) :
+		bvh4.bvh_over_quads ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	blocksNeeded += leafsNeeded * leafBlocks;
 	if (allocatedBlocks < blocksNeeded)
 	{
 		AlignedFree( bvh4Data );
-		void* (*allocator)(size_t, void*) = malloc64;
+		// stronger alignment for the default allocator only; free64 releases all three.
+		void* (*allocator)(size_t, void*) = context.malloc;
 	#if defined BVH8_ALIGN_4K
-		allocator = malloc4k;
+		if (allocator == malloc64) allocator = malloc4k;
 	#elif defined BVH8_ALIGN_32K
-		allocator = malloc32k;
+		if (allocator == malloc64) allocator = malloc32k;
 	#endif
-		bvh4Data = (CacheLine*)allocator( blocksNeeded * 64, 0 );
+		bvh4Data = (CacheLine*)allocator( blocksNeeded * 64, context.userdata );
 		allocatedBlocks = blocksNeeded;
 	}
-	CopyBasePropertiesFrom( bvh4 );
-	// start conversion
-	uint32_t newBlockPtr = 0, nodeIdx = 0, stack[256], stackPtr = 0;
-	while (1)
-	{
-		const MBVH<4>::MBVHNode& orig = bvh4.mbvhNode[nodeIdx];
+	CopyBasePropertiesFrom( bvh4 );
+	if (bvh4.bvh.customIntersect) customIntersect = bvh4.bvh.customIntersect, customIsOccluded = bvh4.bvh.customIsOccluded;
+	BVH_FATAL_ERROR_IF( customLeafs && customIntersect == 0 && customIntersect4 == 0,
+		"BVH4_CPU::ConvertFrom( .. ), custom leafs without customIntersect or customIntersect4." );
+	BVH_FATAL_ERROR_IF( customLeafs && customIsOccluded == 0 && customIsOccluded4 == 0,
+		"BVH4_CPU::ConvertFrom( .. ), custom leafs without customIsOccluded or customIsOccluded4." );
+	// lay out the blocks in preorder: a node, the leafs of its leaf children, then
+	// the subtrees of its other children. The nodes then convert independently.
+	const BVHContext& ctx = original.context;
+	const uint32_t nodeBlocks = sizeof( BVHNode ) / 64;
+	uint32_t* pos = (uint32_t*)ctx.malloc( bvh4.usedNodes * 2 * sizeof( uint32_t ), ctx.userdata ), count;
+	uint32_t* order = pos + bvh4.usedNodes;
+	usedBlocks = tinybvh_preorder( ctx, bvh4.usedNodes, pos, order, count,
+		[&]( const uint32_t n )
+		{
+			uint32_t blocks = nodeBlocks;
+			for (uint32_t i = 0; i < 4; i++) if (const uint32_t c = bvh4.mbvhNode[n].child[i])
+				if (bvh4.mbvhNode[c].isLeaf()) blocks += leafBlocks;
+			return blocks;
+		},
+		[&]( const uint32_t n, uint32_t* child )
+		{
+			uint32_t kids = 0;
+			for (uint32_t i = 0; i < 4; i++) if (const uint32_t c = bvh4.mbvhNode[n].child[i])
+				if (!bvh4.mbvhNode[c].isLeaf()) child[kids++] = c;
+			return kids;
+		} );
+	tinybvh_build_for( ctx, count, 64, [&]( const uint32_t n )
+	{
+		uint32_t newBlockPtr = pos[order[n]];
+		const MBVH<4>::MBVHNode& orig = bvh4.mbvhNode[order[n]];
 		BVHNode* newNode = (BVHNode*)(bvh4Data + newBlockPtr);
-		newBlockPtr += sizeof( BVHNode ) / 64;
+		newBlockPtr += nodeBlocks;
 		memset( newNode, 0, sizeof( BVHNode ) );
 		// calculate the permutation offsets for the node
 		for (uint32_t q = 0; q < 8; q++)
@@ -4834,12 +8375,36 @@ void BVH4_CPU::ConvertFrom( MBVH<4>& original )
 			((float*)&newNode->xmin4)[cidx] = child.aabbMin.x, ((float*)&newNode->xmax4)[cidx] = child.aabbMax.x;
 			((float*)&newNode->ymin4)[cidx] = child.aabbMin.y, ((float*)&newNode->ymax4)[cidx] = child.aabbMax.y;
 			((float*)&newNode->zmin4)[cidx] = child.aabbMin.z, ((float*)&newNode->zmax4)[cidx] = child.aabbMax.z;
-			if (child.isLeaf())
+			if (child.isLeaf() && customLeafs)
+			{
+				// emit leaf node: up to 4 custom primitive indices.
+				((uint32_t*)&newNode->child4)[cidx] = newBlockPtr + LEAF_BIT + CUSTOM_BIT;
+				BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh4Data + newBlockPtr);
+				newBlockPtr += leafBlocks;
+				leaf->primCount = child.triCount;
+				for (uint32_t l = 0; l < 4; l++)
+					leaf->primIdx[l] = bvh4.bvh.primIdx[child.firstTri + tinybvh_min( l, child.triCount - 1u )];
+			}
+			else if (child.isLeaf() && quadsEnabled && bvh_over_quads)
+			{
+				// emit leaf node: group of up to 4 quads in SoA format.
+				((uint32_t*)&newNode->child4)[cidx] = newBlockPtr + LEAF_BIT;
+				BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh4Data + newBlockPtr);
+				newBlockPtr += leafBlocks;
+				for (uint32_t i0, i1, i2, i3, l = 0; l < 4; l++)
+				{
+					uint32_t primIdx = bvh4.bvh.primIdx[child.firstTri + tinybvh_min( l, child.triCount - 1u )];
+					GET_QUAD_INDICES_I0_I1_I2_I3( bvh4.bvh, primIdx );
+					const bvhvec4slice& v = bvh4.bvh.verts;
+					leaf->SetData( v[i0], v[i1], v[i2], v[i3], primIdx, l );
+				}
+			}
+			else if (child.isLeaf())
 			{
 				// emit leaf node: group of up to 4 triangles in AoS format.
 				((uint32_t*)&newNode->child4)[cidx] = newBlockPtr + LEAF_BIT;
 				BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh4Data + newBlockPtr);
-				newBlockPtr += sizeof( BVHTri4Leaf ) / 64;
+				newBlockPtr += leafBlocks;
 				for (uint32_t i0, i1, i2, l = 0; l < 4; l++)
 				{
 					uint32_t primIdx = bvh4.bvh.primIdx[child.firstTri + tinybvh_min( l, child.triCount - 1u )];
@@ -4848,12 +8413,7 @@ void BVH4_CPU::ConvertFrom( MBVH<4>& original )
 					leaf->SetData( v0, e1, e2, primIdx, l );
 				}
 			}
-			else
-			{
-				uint32_t* slot = (uint32_t*)&newNode->child4 + cidx;
-				stack[stackPtr++] = (uint32_t)(slot - (uint32_t*)bvh4Data);
-				stack[stackPtr++] = orig.child[i];
-			}
+			else ((uint32_t*)&newNode->child4)[cidx] = pos[orig.child[i]];
 			cidx++;
 		}
 		for (; cidx < 4; cidx++)
@@ -4861,13 +8421,8 @@ void BVH4_CPU::ConvertFrom( MBVH<4>& original )
 			((float*)&newNode->ymin4)[cidx] = 1e30f, ((float*)&newNode->ymax4)[cidx] = 1.00001e30f,
 			((float*)&newNode->zmin4)[cidx] = 1e30f, ((float*)&newNode->zmax4)[cidx] = 1.00001e30f,
 			((uint32_t*)&newNode->child4)[cidx] |= EMPTY_BIT;
-		// pop next task
-		if (!stackPtr) break;
-		nodeIdx = stack[--stackPtr];
-		const uint32_t offset = stack[--stackPtr];
-		((uint32_t*)bvh4Data)[offset] = newBlockPtr;
-	}
-	usedBlocks = newBlockPtr;
+	} );
+	ctx.free( pos, ctx.userdata );
 }
 
 // BVH8_CPU implementation
@@ -4905,6 +8460,38 @@ void BVH8_CPU::Build( const bvhvec4slice& vertices, const uint32_t* indices, uin
 	ConvertFrom( bvh8 );
 }
 
+void BVH8_CPU::BuildQuads( const bvhvec4* vertices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice( vertices, quadCount * 4, sizeof( bvhvec4 ) ) );
+}
+
+void BVH8_CPU::BuildQuads( const bvhvec4slice& vertices )
+{
+	bvh8.bvh.context = bvh8.context = context;
+	bvh8.bvh.BuildQuads( vertices );
+	ConvertFrom( bvh8 );
+}
+
+void BVH8_CPU::BuildQuads( const bvhvec4* vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	BuildQuads( bvhvec4slice{ vertices, quadCount * 4, sizeof( bvhvec4 ) }, indices, quadCount );
+}
+
+void BVH8_CPU::BuildQuads( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t quadCount )
+{
+	bvh8.bvh.context = bvh8.context = context;
+	bvh8.bvh.BuildQuads( vertices, indices, quadCount );
+	ConvertFrom( bvh8 );
+}
+
+void BVH8_CPU::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount )
+{
+	// build over custom primitives; set the custom intersection callbacks first.
+	bvh8.bvh.context = bvh8.context = context;
+	bvh8.bvh.Build( customGetAABB, primCount );
+	ConvertFrom( bvh8 );
+}
+
 void BVH8_CPU::BuildHQ( const bvhvec4* vertices, const uint32_t primCount )
 {
 	BuildHQ( bvhvec4slice( vertices, primCount * 3, sizeof( bvhvec4 ) ) );
@@ -4929,35 +8516,212 @@ void BVH8_CPU::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, u
 	ConvertFrom( bvh8 );
 }
 
-void BVH8_CPU::Save( const char* fileName )
+bool BVH8_CPU::Save( const char* fileName )
 {
-	std::fstream s{ fileName, s.binary | s.out };
-	uint32_t header = TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16) + (layout << 24);
-	s.write( (char*)&header, sizeof( uint32_t ) );
-	s.write( (char*)&triCount, sizeof( uint32_t ) );
-	s.write( (char*)this, sizeof( BVH8_CPU ) );
-	s.write( (char*)bvh8Data, usedBlocks * 64 );
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH8_CPU::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	header = FileHeader();
+	section[0] = { BVHFileSection::NODES, bvh8Data, usedBlocks * sizeof( CacheLine ) };
+	return 1;
 }
 
 bool BVH8_CPU::Load( const char* fileName, const uint32_t expectedTris )
+{
+	return LoadFile( fileName, 0, expectedTris );
+}
+
+bool BVH8_CPU::Load( const BVHMappedFile& file, const uint32_t expectedTris )
+{
+	// zero-copy load: traversal uses the node data in the mapped file directly.
+	return LoadFile( 0, &file, expectedTris );
+}
+
+bool BVH8_CPU::LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris )
 {
 	// open file and check contents
-	std::fstream s{ fileName, s.binary | s.in };
-	if (!s) return false;
-	BVHContext tmp = context;
-	uint32_t header, fileTriCount;
-	s.read( (char*)&header, sizeof( uint32_t ) );
-	if (((header >> 8) & 255) != TINY_BVH_VERSION_MINOR ||
-		((header >> 16) & 255) != TINY_BVH_VERSION_MAJOR ||
-		(header & 255) != TINY_BVH_VERSION_SUB || (header >> 24) != layout) return false;
-	s.read( (char*)&fileTriCount, sizeof( uint32_t ) );
-	if (fileTriCount != expectedTris) return false;
+	BVHFileHeader header;
+	FileSection section[1] = { { BVHFileSection::NODES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 1 )) return false;
+	if (header.triCount != expectedTris || (section[0].size % sizeof( CacheLine )))
+	{
+		DiscardSections( file, section, 1 );
+		return false;
+	}
+	// all checks passed; safe to overwrite *this
+	AlignedFree( bvh8Data );
+	ApplyFileHeader( header );
+	bvh8Data = (CacheLine*)section[0].data;
+	usedBlocks = (uint32_t)(section[0].size / sizeof( CacheLine ));
+	allocatedBlocks = file ? 0 : usedBlocks;
+	SetMappedFile( file, section, 1 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
+	bvh8 = MBVH<8>();
+	return true;
+}
+
+void BVH8_CPU::CloneFrom( const BVH8_CPU& original )
+{
+	// copy of the node and leaf data, allocated with this BVH's own context, e.g.
+	// on another NUMA node. The copy can be traversed, but not refitted.
+	if (!ownBVH8) bvh8 = MBVH<8>();
+	AlignedFree( bvh8Data );
+	const BVHContext ownContext = context;
+	CopyBasePropertiesFrom( original );
+	context = ownContext, rebuildable = refittable = false;
+	bvh8Data = (CacheLine*)AlignedAlloc( original.usedBlocks * sizeof( CacheLine ) );
+	memcpy( bvh8Data, original.bvh8Data, original.usedBlocks * sizeof( CacheLine ) );
+	allocatedBlocks = usedBlocks = original.usedBlocks;
+	SetMappedFile( 0 );
+	bvh8 = MBVH<8>();
+	ownBVH8 = true;
+	customIntersect = original.customIntersect, customIsOccluded = original.customIsOccluded;
+	customIntersect4 = original.customIntersect4, customIsOccluded4 = original.customIsOccluded4;
+}
+
+bool BVH8_CPU::SaveCompressed( const char* fileName )
+{
+	// Compressed file: the blocks of interior nodes (and custom leafs) form one
+	// packed stream; triangle and quad leafs are replaced by their primitive
+	// indices, and rebuilt from the original vertices by LoadCompressed.
+	const uint32_t geomLeafBlocks = (uint32_t)((quadsEnabled && bvh_over_quads) ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	const uint32_t nodeBlocks = sizeof( BVHNode ) / 64;
+	uint8_t* blockType = (uint8_t*)AlignedAlloc( usedBlocks ); // 0: node, 1: geometry leaf, 2: custom leaf
+	uint32_t* nodeWords = (uint32_t*)AlignedAlloc( usedBlocks * 64 );
+	uint32_t* leafIdx = (uint32_t*)AlignedAlloc( usedBlocks * 4 * 4 / geomLeafBlocks + 4 );
+	memset( blockType, 0, usedBlocks );
+	uint64_t nodeWordCount = 0, leafIdxCount = 0;
+	for (uint32_t b = 0; b < usedBlocks;)
+	{
+		// child blocks are always emitted after their parent, so one pass suffices.
+		if (blockType[b] == 1)
+		{
+			const uint32_t* primIdx = geomLeafBlocks == 3 ? ((BVHTri4Leaf*)(bvh8Data + b))->primIdx : ((BVHQuad4Leaf*)(bvh8Data + b))->primIdx;
+			for (int i = 0; i < 4; i++) leafIdx[leafIdxCount++] = primIdx[i];
+			b += geomLeafBlocks;
+			continue;
+		}
+		const uint32_t blocks = blockType[b] == 2 ? 1 : nodeBlocks;
+		memcpy( nodeWords + nodeWordCount, bvh8Data + b, blocks * 64 );
+		nodeWordCount += blocks * 16;
+		if (blockType[b] == 0) for (int i = 0; i < 8; i++)
+		{
+			const uint32_t child = ((uint32_t*)&((BVHNode*)(bvh8Data + b))->child8)[i];
+			if (!(child & EMPTY_BIT) && (child & LEAF_BIT)) blockType[child & 0x1fffffff] = (child & CUSTOM_BIT) ? 2 : 1;
+		}
+		b += blocks;
+	}
+	uint64_t packedNodeSize, packedIdxSize;
+	uint8_t* packedNodes = tinybvh_pack_stream( nodeWords, nodeWordCount, nodeBlocks * 16, packedNodeSize );
+	uint8_t* packedIdx = tinybvh_pack_stream( leafIdx, leafIdxCount, 0, packedIdxSize );
+	BVHFileHeader header = FileHeader();
+	const FileSection section[2] = {
+		{ BVHFileSection::PACKED_NODES, packedNodes, packedNodeSize },
+		{ BVHFileSection::PACKED_INDICES, packedIdx, packedIdxSize }
+	};
+	const bool saved = WriteFile( fileName, header, section, 2 );
+	free64( packedNodes );
+	free64( packedIdx );
+	AlignedFree( leafIdx );
+	AlignedFree( nodeWords );
+	AlignedFree( blockType );
+	return saved;
+}
+
+bool BVH8_CPU::LoadCompressed( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadCompressedFile( fileName, 0, vertices, indices, primCount );
+}
+
+bool BVH8_CPU::LoadCompressed( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// decodes straight from the mapping; the result does not refer to the file.
+	return LoadCompressedFile( 0, &file, vertices, indices, primCount );
+}
+
+bool BVH8_CPU::LoadCompressedFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// open file and check contents; ReadFile skips the checksum for mapped files.
+	BVHFileHeader header;
+	FileSection section[2] = { { BVHFileSection::PACKED_NODES, 0, 0 }, { BVHFileSection::PACKED_INDICES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 2 ) || (file && !file->Verify())) return false;
+	uint32_t* nodeWords = 0, * leafIdx = 0;
+	uint64_t nodeWordCount = 0, leafIdxCount = 0;
+	const bool quads = (header.flags & BVHFileHeader::OVER_QUADS) != 0 && quadsEnabled;
+	const uint32_t geomLeafBlocks = (uint32_t)(quads ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	const uint32_t nodeBlocks = sizeof( BVHNode ) / 64;
+	bool ok = FileMatchesGeometry( header, vertices, indices, primCount ) &&
+		tinybvh_unpack_stream( (uint8_t*)section[0].data, section[0].size, nodeWords, nodeWordCount, nodeBlocks * 16, *this ) &&
+		tinybvh_unpack_stream( (uint8_t*)section[1].data, section[1].size, leafIdx, leafIdxCount, 0, *this ) &&
+		(nodeWordCount & 15) == 0 && (leafIdxCount & 3) == 0;
+	DiscardSections( file, section, 2 );
+	// restore the block array; geometry leafs are rebuilt afterwards.
+	const uint64_t blockCount = nodeWordCount / 16 + leafIdxCount / 4 * geomLeafBlocks;
+	CacheLine* blocks = ok ? (CacheLine*)AlignedAlloc( blockCount * 64 ) : 0;
+	uint8_t* blockType = ok ? (uint8_t*)AlignedAlloc( blockCount ) : 0;
+	uint32_t* leafBlock = ok ? (uint32_t*)AlignedAlloc( leafIdxCount + 4 ) : 0;
+	if (ok) memset( blockType, 0, blockCount );
+	uint64_t nodeWordPtr = 0, leafCount = 0;
+	for (uint64_t b = 0; b < blockCount && ok;)
+	{
+		if (blockType[b] == 1)
+		{
+			if (leafCount == leafIdxCount / 4 || b + geomLeafBlocks > blockCount) { ok = false; break; }
+			leafBlock[leafCount++] = (uint32_t)b, b += geomLeafBlocks;
+			continue;
+		}
+		const uint32_t size = blockType[b] == 2 ? 1 : nodeBlocks;
+		if (nodeWordPtr + size * 16 > nodeWordCount || b + size > blockCount) { ok = false; break; }
+		memcpy( blocks + b, nodeWords + nodeWordPtr, size * 64 );
+		nodeWordPtr += size * 16;
+		if (blockType[b] == 0) for (int i = 0; i < 8 && ok; i++)
+		{
+			const uint32_t child = ((uint32_t*)&((BVHNode*)(blocks + b))->child8)[i];
+			if ((child & EMPTY_BIT) || !(child & LEAF_BIT)) continue;
+			const uint32_t childBlock = child & 0x1fffffff;
+			if (childBlock <= b || childBlock >= blockCount) ok = false;
+			else blockType[childBlock] = (child & CUSTOM_BIT) ? 2 : 1;
+		}
+		b += size;
+	}
+	ok = ok && leafCount == leafIdxCount / 4;
+	// rebuild the geometry leafs; each leaf is independent, so this is done in parallel.
+	const uint32_t vertsPerPrim = quads ? 4 : 3;
+	std::atomic<bool> leafsOK( true );
+	if (ok) tinybvh_build_for( context, (uint32_t)leafCount, 256, [&]( const uint32_t i )
+	{
+		for (uint32_t l = 0; l < 4; l++)
+		{
+			const uint32_t primIdx = leafIdx[i * 4 + l];
+			if (primIdx >= header.triCount) { leafsOK.store( false ); return; }
+			uint32_t vi[4];
+			for (uint32_t v = 0; v < vertsPerPrim; v++) vi[v] = indices ? indices[primIdx * vertsPerPrim + v] : primIdx * vertsPerPrim + v;
+			if (quads)
+				((BVHQuad4Leaf*)(blocks + leafBlock[i]))->SetData( vertices[vi[0]], vertices[vi[1]], vertices[vi[2]], vertices[vi[3]], primIdx, l );
+			else
+			{
+				const bvhvec4 v0 = vertices[vi[0]], e1 = vertices[vi[1]] - v0, e2 = vertices[vi[2]] - v0;
+				((BVHTri4Leaf*)(blocks + leafBlock[i]))->SetData( v0, e1, e2, primIdx, l );
+			}
+		}
+	} );
+	ok = ok && leafsOK;
+	AlignedFree( nodeWords );
+	AlignedFree( leafIdx );
+	AlignedFree( blockType );
+	AlignedFree( leafBlock );
+	if (!ok) { AlignedFree( blocks ); return false; }
 	// all checks passed; safe to overwrite *this
-	s.read( (char*)this, sizeof( BVH8_CPU ) );
-	context = tmp; // can't load context; function pointers will differ.
-	bvh8Data = (CacheLine*)AlignedAlloc( usedBlocks * 64 );
-	allocatedBlocks = usedBlocks;
-	s.read( (char*)bvh8Data, usedBlocks * 64 );
+	AlignedFree( bvh8Data );
+	ApplyFileHeader( header );
+	bvh8Data = blocks;
+	usedBlocks = allocatedBlocks = (uint32_t)blockCount;
+	SetMappedFile( 0 );
 	bvh8 = MBVH<8>();
 	return true;
 }
@@ -4970,17 +8734,38 @@ void BVH8_CPU::Optimize( const uint32_t iterations, bool extreme )
 
 void BVH8_CPU::Refit()
 {
-	bvh8.Refit();
+	// ConvertFrom collapses bvh8.bvh again, so that is the one to refit.
+	bvh8.bvh.Refit();
 	ConvertFrom( bvh8 );
 }
 
+void BVH8_CPU::Reorder( const NodeOrder order, const uint32_t treeletDepth )
+{
+	// lay out the node and leaf blocks for memory locality; see BVH::Reorder.
+	const uint32_t leafBlocks = (uint32_t)((customEnabled && bvh_over_aabbs) ? sizeof( BVHCustom4Leaf ) :
+		bvh_over_quads ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	usedBlocks = tinybvh_reorder_blocks<8>( *this, (uint8_t*)bvh8Data, usedBlocks, leafBlocks, order, treeletDepth );
+}
+
 float BVH8_CPU::SAHCost( const uint32_t nodeIdx ) const
 {
 	return bvh8.SAHCost( nodeIdx );
 }
 
+BVHQuality BVH8_CPU::Analyze( const bool epo ) const
+{
+	BVHQuality q;
+	if (usedBlocks == 0) return q;
+	BVH_FATAL_ERROR_IF( usedBlocks >= (1u << 28), "BVH8_CPU::Analyze( .. ), too many blocks." );
+	const tinybvh_block_view<BVH8_CPU, 8> view = { *this, (const uint8_t*)bvh8Data, bvh8.bvh };
+	q = tinybvh_analyze( *this, view, epo );
+	tinybvh_set_footprint( q, usedBlocks * sizeof( CacheLine ), triCount );
+	return q;
+}
+
 void BVH8_CPU::ConvertFrom( MBVH<8>& original )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// get a copy of the input bvh8
 	if (&original != &bvh8) ownBVH8 = false; // bvh isn't ours; don't delete in destructor.
 	bvh8 = original;
@@ -4992,27 +8777,56 @@ void BVH8_CPU::ConvertFrom( MBVH<8>& original )
 	// allocate if needed
 	uint32_t nodesNeeded = bvh8.usedNodes, leafsNeeded = bvh8.LeafCount();
 	uint32_t blocksNeeded = nodesNeeded * (sizeof( BVHNode ) / 64); // here, block = cacheline.
-	blocksNeeded += leafsNeeded * (sizeof( BVHTri4Leaf ) / 64);
+	const bool customLeafs = customEnabled && bvh8.bvh_over_aabbs;
+	const uint32_t leafBlocks = (uint32_t)(customLeafs ? sizeof( BVHCustom4Leaf ) :
+		bvh8.bvh_over_quads ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	blocksNeeded += leafsNeeded * leafBlocks;
 	if (allocatedBlocks < blocksNeeded)
 	{
 		AlignedFree( bvh8Data );
-		void* (*allocator)(size_t, void*) = malloc64;
+		// stronger alignment for the default allocator only; free64 releases all three.
+		void* (*allocator)(size_t, void*) = context.malloc;
 	#if defined BVH8_ALIGN_4K
-		allocator = malloc4k;
+		if (allocator == malloc64) allocator = malloc4k;
 	#elif defined BVH8_ALIGN_32K
-		allocator = malloc32k;
+		if (allocator == malloc64) allocator = malloc32k;
 	#endif
-		bvh8Data = (CacheLine*)allocator( blocksNeeded * 64, 0 );
+		bvh8Data = (CacheLine*)allocator( blocksNeeded * 64, context.userdata );
 		allocatedBlocks = blocksNeeded;
 	}
 	CopyBasePropertiesFrom( bvh8 );
-	// start conversion
-	uint32_t newBlockPtr = 0, nodeIdx = 0, stack[256], stackPtr = 0;
-	while (1)
-	{
-		const MBVH<8>::MBVHNode& orig = bvh8.mbvhNode[nodeIdx];
+	if (bvh8.bvh.customIntersect) customIntersect = bvh8.bvh.customIntersect, customIsOccluded = bvh8.bvh.customIsOccluded;
+	BVH_FATAL_ERROR_IF( customLeafs && customIntersect == 0 && customIntersect4 == 0,
+		"BVH8_CPU::ConvertFrom( .. ), custom leafs without customIntersect or customIntersect4." );
+	BVH_FATAL_ERROR_IF( customLeafs && customIsOccluded == 0 && customIsOccluded4 == 0,
+		"BVH8_CPU::ConvertFrom( .. ), custom leafs without customIsOccluded or customIsOccluded4." );
+	// lay out the blocks in preorder: a node, the leafs of its leaf children, then
+	// the subtrees of its other children. The nodes then convert independently.
+	const BVHContext& ctx = original.context;
+	const uint32_t nodeBlocks = sizeof( BVHNode ) / 64;
+	uint32_t* pos = (uint32_t*)ctx.malloc( bvh8.usedNodes * 2 * sizeof( uint32_t ), ctx.userdata ), count;
+	uint32_t* order = pos + bvh8.usedNodes;
+	usedBlocks = tinybvh_preorder( ctx, bvh8.usedNodes, pos, order, count,
+		[&]( const uint32_t n )
+		{
+			uint32_t blocks = nodeBlocks;
+			for (uint32_t i = 0; i < 8; i++) if (const uint32_t c = bvh8.mbvhNode[n].child[i])
+				if (bvh8.mbvhNode[c].isLeaf()) blocks += leafBlocks;
+			return blocks;
+		},
+		[&]( const uint32_t n, uint32_t* child )
+		{
+			uint32_t kids = 0;
+			for (uint32_t i = 0; i < 8; i++) if (const uint32_t c = bvh8.mbvhNode[n].child[i])
+				if (!bvh8.mbvhNode[c].isLeaf()) child[kids++] = c;
+			return kids;
+		} );
+	tinybvh_build_for( ctx, count, 64, [&]( const uint32_t n )
+	{
+		uint32_t newBlockPtr = pos[order[n]];
+		const MBVH<8>::MBVHNode& orig = bvh8.mbvhNode[order[n]];
 		BVHNode* newNode = (BVHNode*)(bvh8Data + newBlockPtr);
-		newBlockPtr += sizeof( BVHNode ) / 64;
+		newBlockPtr += nodeBlocks;
 		memset( newNode, 0, sizeof( BVHNode ) );
 		// calculate the permutation offsets for the node
 		for (uint32_t q = 0; q < 8; q++)
@@ -5042,12 +8856,36 @@ void BVH8_CPU::ConvertFrom( MBVH<8>& original )
 			((float*)&newNode->xmin8)[cidx] = child.aabbMin.x, ((float*)&newNode->xmax8)[cidx] = child.aabbMax.x;
 			((float*)&newNode->ymin8)[cidx] = child.aabbMin.y, ((float*)&newNode->ymax8)[cidx] = child.aabbMax.y;
 			((float*)&newNode->zmin8)[cidx] = child.aabbMin.z, ((float*)&newNode->zmax8)[cidx] = child.aabbMax.z;
-			if (child.isLeaf())
+			if (child.isLeaf() && customLeafs)
+			{
+				// emit leaf node: up to 4 custom primitive indices.
+				((uint32_t*)&newNode->child8)[cidx] = newBlockPtr + LEAF_BIT + CUSTOM_BIT;
+				BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh8Data + newBlockPtr);
+				newBlockPtr += leafBlocks;
+				leaf->primCount = child.triCount;
+				for (uint32_t l = 0; l < 4; l++)
+					leaf->primIdx[l] = bvh8.bvh.primIdx[child.firstTri + tinybvh_min( l, child.triCount - 1u )];
+			}
+			else if (child.isLeaf() && quadsEnabled && bvh_over_quads)
+			{
+				// emit leaf node: group of up to 4 quads in SoA format.
+				((uint32_t*)&newNode->child8)[cidx] = newBlockPtr + LEAF_BIT;
+				BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh8Data + newBlockPtr);
+				newBlockPtr += leafBlocks;
+				for (uint32_t i0, i1, i2, i3, l = 0; l < 4; l++)
+				{
+					uint32_t primIdx = bvh8.bvh.primIdx[child.firstTri + tinybvh_min( l, child.triCount - 1u )];
+					GET_QUAD_INDICES_I0_I1_I2_I3( bvh8.bvh, primIdx );
+					const bvhvec4slice& v = bvh8.bvh.verts;
+					leaf->SetData( v[i0], v[i1], v[i2], v[i3], primIdx, l );
+				}
+			}
+			else if (child.isLeaf())
 			{
 				// emit leaf node: group of up to 4 triangles in AoS format.
 				((uint32_t*)&newNode->child8)[cidx] = newBlockPtr + LEAF_BIT;
 				BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + newBlockPtr);
-				newBlockPtr += sizeof( BVHTri4Leaf ) / 64;
+				newBlockPtr += leafBlocks;
 				for (uint32_t i0, i1, i2, l = 0; l < 4; l++)
 				{
 					uint32_t primIdx = bvh8.bvh.primIdx[child.firstTri + tinybvh_min( l, child.triCount - 1u )];
@@ -5056,12 +8894,7 @@ void BVH8_CPU::ConvertFrom( MBVH<8>& original )
 					leaf->SetData( v0, e1, e2, primIdx, l );
 				}
 			}
-			else
-			{
-				uint32_t* slot = (uint32_t*)&newNode->child8 + cidx;
-				stack[stackPtr++] = (uint32_t)(slot - (uint32_t*)bvh8Data);
-				stack[stackPtr++] = orig.child[i];
-			}
+			else ((uint32_t*)&newNode->child8)[cidx] = pos[orig.child[i]];
 			cidx++;
 		}
 		for (; cidx < 8; cidx++)
@@ -5071,13 +8904,8 @@ void BVH8_CPU::ConvertFrom( MBVH<8>& original )
 			((float*)&newNode->zmin8)[cidx] = 1e30f, ((float*)&newNode->zmax8)[cidx] = 1.00001e30f;
 			((uint32_t*)&newNode->child8)[cidx] |= EMPTY_BIT;
 		}
-		// pop next task
-		if (!stackPtr) break;
-		nodeIdx = stack[--stackPtr];
-		const uint32_t offset = stack[--stackPtr];
-		((uint32_t*)bvh8Data)[offset] = newBlockPtr;
-	}
-	usedBlocks = newBlockPtr;
+	} );
+	ctx.free( pos, ctx.userdata );
 }
 
 // BVH8_CWBVH implementation
@@ -5101,38 +8929,172 @@ float BVH8_CWBVH::SAHCost( const uint32_t nodeIdx ) const
 	return bvh8.SAHCost( nodeIdx );
 }
 
-void BVH8_CWBVH::Save( const char* fileName )
+BVHQuality BVH8_CWBVH::Analyze( const bool epo ) const
 {
-	std::fstream s{ fileName, s.binary | s.out };
-	uint32_t header = TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16) + (layout << 24);
-	s.write( (char*)&header, sizeof( uint32_t ) );
-	s.write( (char*)&triCount, sizeof( uint32_t ) );
-	s.write( (char*)this, sizeof( BVH8_CWBVH ) );
-	s.write( (char*)bvh8Data, usedBlocks * 16 );
-	s.write( (char*)bvh8Tris, bvh8.idxCount * 4 * 16 );
+	// the compressed nodes can't be analyzed directly; the MBVH is gone after Load.
+	BVH_FATAL_ERROR_IF( usedBlocks > 0 && bvh8.usedNodes == 0, "BVH8_CWBVH::Analyze( .. ), no MBVH (loaded from file?)." );
+	BVHQuality q = bvh8.Analyze( epo );
+	tinybvh_set_footprint( q, (usedBlocks + (uint64_t)idxCount * 4) * sizeof( bvhvec4 ), triCount );
+	return q;
+}
+
+bool BVH8_CWBVH::Save( const char* fileName )
+{
+	BVHFileHeader header;
+	FileSection section[TINY_BVH_FILE_SECTIONS];
+	const uint32_t count = FileSections( header, section );
+	return WriteFile( fileName, header, section, count );
+}
+
+uint32_t BVH8_CWBVH::FileSections( BVHFileHeader& header, FileSection* section ) const
+{
+	header = FileHeader();
+	section[0] = { BVHFileSection::NODES, bvh8Data, usedBlocks * sizeof( bvhvec4 ) };
+	section[1] = { BVHFileSection::LEAF_DATA, bvh8Tris, idxCount * 4 * sizeof( bvhvec4 ) };
+	return 2;
 }
 
 bool BVH8_CWBVH::Load( const char* fileName, const uint32_t expectedTris )
+{
+	return LoadFile( fileName, 0, expectedTris );
+}
+
+bool BVH8_CWBVH::Load( const BVHMappedFile& file, const uint32_t expectedTris )
+{
+	// zero-copy load: traversal uses the node data in the mapped file directly.
+	return LoadFile( 0, &file, expectedTris );
+}
+
+bool BVH8_CWBVH::LoadFile( const char* fileName, const BVHMappedFile* file, const uint32_t expectedTris )
 {
 	// open file and check contents
-	std::fstream s{ fileName, s.binary | s.in };
-	if (!s) return false;
-	BVHContext tmp = context;
-	uint32_t header, fileTriCount;
-	s.read( (char*)&header, sizeof( uint32_t ) );
-	if (((header >> 8) & 255) != TINY_BVH_VERSION_MINOR ||
-		((header >> 16) & 255) != TINY_BVH_VERSION_MAJOR ||
-		(header & 255) != TINY_BVH_VERSION_SUB || (header >> 24) != layout) return false;
-	s.read( (char*)&fileTriCount, sizeof( uint32_t ) );
-	if (fileTriCount != expectedTris) return false;
+	BVHFileHeader header;
+	FileSection section[2] = { { BVHFileSection::NODES, 0, 0 }, { BVHFileSection::LEAF_DATA, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 2 )) return false;
+	if (header.triCount != expectedTris || (section[0].size % sizeof( bvhvec4 )) ||
+		section[1].size != header.idxCount * 4 * sizeof( bvhvec4 ))
+	{
+		DiscardSections( file, section, 2 );
+		return false;
+	}
+	// all checks passed; safe to overwrite *this
+	AlignedFree( bvh8Data );
+	AlignedFree( bvh8Tris );
+	ApplyFileHeader( header );
+	bvh8Data = (bvhvec4*)section[0].data;
+	bvh8Tris = (bvhvec4*)section[1].data;
+	usedBlocks = (uint32_t)(section[0].size / sizeof( bvhvec4 ));
+	allocatedBlocks = file ? 0 : usedBlocks;
+	SetMappedFile( file, section, 2 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
+	bvh8 = MBVH<8>();
+	return true;
+}
+
+void BVH8_CWBVH::CloneFrom( const BVH8_CWBVH& original )
+{
+	// copy of the node and triangle data, allocated with this BVH's own context,
+	// e.g. on another NUMA node. The copy can be traversed, but not rebuilt.
+	if (!ownBVH8) bvh8 = MBVH<8>();
+	AlignedFree( bvh8Data );
+	AlignedFree( bvh8Tris );
+	const BVHContext ownContext = context;
+	CopyBasePropertiesFrom( original );
+	context = ownContext, rebuildable = refittable = false;
+	bvh8Data = (bvhvec4*)AlignedAlloc( original.usedBlocks * sizeof( bvhvec4 ) );
+	bvh8Tris = (bvhvec4*)AlignedAlloc( original.idxCount * 4 * sizeof( bvhvec4 ) );
+	memcpy( bvh8Data, original.bvh8Data, original.usedBlocks * sizeof( bvhvec4 ) );
+	memcpy( bvh8Tris, original.bvh8Tris, original.idxCount * 4 * sizeof( bvhvec4 ) );
+	allocatedBlocks = usedBlocks = original.usedBlocks;
+	SetMappedFile( 0 );
+	bvh8 = MBVH<8>();
+	ownBVH8 = true;
+}
+
+#ifdef CWBVH_COMPRESSED_TRIS
+#define CWBVH_TRI_BLOCKS	4 // blocks of 16 bytes per triangle in bvh8Tris.
+#else
+#define CWBVH_TRI_BLOCKS	3
+#endif
+
+bool BVH8_CWBVH::SaveCompressed( const char* fileName )
+{
+	// Compressed file: CWBVH nodes are already quantized; they are stored as a
+	// packed stream. Triangle data is replaced by triangle indices and rebuilt
+	// from the original vertices by LoadCompressed.
+	uint32_t* triIdx = (uint32_t*)AlignedAlloc( idxCount * 4 + 4 );
+	for (uint32_t i = 0; i < idxCount; i++) triIdx[i] = *(uint32_t*)&bvh8Tris[i * CWBVH_TRI_BLOCKS + CWBVH_TRI_BLOCKS - 1].w;
+	uint64_t packedNodeSize, packedIdxSize;
+	uint8_t* packedNodes = tinybvh_pack_stream( (uint32_t*)bvh8Data, usedBlocks * 4ull, 20 /* 80-byte nodes */, packedNodeSize );
+	uint8_t* packedIdx = tinybvh_pack_stream( triIdx, idxCount, 0, packedIdxSize );
+	BVHFileHeader header = FileHeader();
+	const FileSection section[2] = {
+		{ BVHFileSection::PACKED_NODES, packedNodes, packedNodeSize },
+		{ BVHFileSection::PACKED_INDICES, packedIdx, packedIdxSize }
+	};
+	const bool saved = WriteFile( fileName, header, section, 2 );
+	free64( packedNodes );
+	free64( packedIdx );
+	AlignedFree( triIdx );
+	return saved;
+}
+
+bool BVH8_CWBVH::LoadCompressed( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	return LoadCompressedFile( fileName, 0, vertices, indices, primCount );
+}
+
+bool BVH8_CWBVH::LoadCompressed( const BVHMappedFile& file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// decodes straight from the mapping; the result does not refer to the file.
+	return LoadCompressedFile( 0, &file, vertices, indices, primCount );
+}
+
+bool BVH8_CWBVH::LoadCompressedFile( const char* fileName, const BVHMappedFile* file, const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount )
+{
+	// open file and check contents; ReadFile skips the checksum for mapped files.
+	BVHFileHeader header;
+	FileSection section[2] = { { BVHFileSection::PACKED_NODES, 0, 0 }, { BVHFileSection::PACKED_INDICES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 2 ) || (file && !file->Verify())) return false;
+	uint32_t* nodeWords = 0, * triIdx = 0;
+	uint64_t nodeWordCount = 0, triCountInFile = 0;
+	bool ok = FileMatchesGeometry( header, vertices, indices, primCount ) &&
+		tinybvh_unpack_stream( (uint8_t*)section[0].data, section[0].size, nodeWords, nodeWordCount, 20, *this ) &&
+		tinybvh_unpack_stream( (uint8_t*)section[1].data, section[1].size, triIdx, triCountInFile, 0, *this ) &&
+		(nodeWordCount & 3) == 0 && triCountInFile == header.idxCount;
+	DiscardSections( file, section, 2 );
+	// rebuild the triangle data; triangles are independent, so this is done in parallel.
+	bvhvec4* tris = ok ? (bvhvec4*)AlignedAlloc( header.idxCount * 4 * sizeof( bvhvec4 ) ) : 0;
+	if (ok) memset( tris, 0, header.idxCount * 4 * sizeof( bvhvec4 ) );
+	std::atomic<bool> trisOK( true );
+	if (ok) tinybvh_build_for( context, (uint32_t)triCountInFile, 256, [&]( const uint32_t i )
+	{
+		const uint32_t idx = triIdx[i];
+		if (idx >= header.triCount) { trisOK.store( false ); return; }
+		const uint32_t ti0 = indices ? indices[idx * 3] : idx * 3;
+		const uint32_t ti1 = indices ? indices[idx * 3 + 1] : idx * 3 + 1;
+		const uint32_t ti2 = indices ? indices[idx * 3 + 2] : idx * 3 + 2;
+		bvhvec4* tri = tris + i * CWBVH_TRI_BLOCKS;
+	#ifdef CWBVH_COMPRESSED_TRIS
+		PrecomputeTriangle( vertices, ti0, ti1, ti2, (float*)tri );
+		tri[3] = bvhvec4( 0, 0, 0, *(float*)&idx );
+	#else
+		bvhvec4 t = vertices[ti0];
+		tri[0] = vertices[ti2] - t, tri[1] = vertices[ti1] - t;
+		t.w = *(float*)&idx, tri[2] = t;
+	#endif
+	} );
+	ok = ok && trisOK;
+	AlignedFree( triIdx );
+	if (!ok) { AlignedFree( nodeWords ); AlignedFree( tris ); return false; }
 	// all checks passed; safe to overwrite *this
-	s.read( (char*)this, sizeof( BVH8_CWBVH ) );
-	context = tmp; // can't load context; function pointers will differ.
-	bvh8Data = (bvhvec4*)AlignedAlloc( usedBlocks * 16 );
-	bvh8Tris = (bvhvec4*)AlignedAlloc( bvh8.idxCount * 4 * 16 );
-	allocatedBlocks = usedBlocks;
-	s.read( (char*)bvh8Data, usedBlocks * 16 );
-	s.read( (char*)bvh8Tris, bvh8.idxCount * 4 * 16 );
+	AlignedFree( bvh8Data );
+	AlignedFree( bvh8Tris );
+	ApplyFileHeader( header );
+	bvh8Data = (bvhvec4*)nodeWords;
+	bvh8Tris = tris;
+	usedBlocks = allocatedBlocks = (uint32_t)(nodeWordCount / 4);
+	SetMappedFile( 0 );
 	bvh8 = MBVH<8>();
 	return true;
 }
@@ -5199,9 +9161,11 @@ void BVH8_CWBVH::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices,
 // Compressed Wide BVHs", Ylitie et al. 2017. Adapted from code by "AlanWBFT".
 void BVH8_CWBVH::ConvertFrom( MBVH<8>& original, bool )
 {
+	tinybvh_phase_timer timer( original.context.buildStats, BuildStats::CONVERT );
 	// get a copy of the original bvh8
 	if (&original != &bvh8) ownBVH8 = false; // bvh isn't ours; don't delete in destructor.
 	bvh8 = original;
+	BVH_FATAL_ERROR_IF( bvh8.bvh_over_quads, "BVH8_CWBVH::ConvertFrom( .. ), quads not supported for this layout." );
 	BVH_FATAL_ERROR_IF( bvh8.mbvhNode[0].isLeaf(), "BVH8_CWBVH::ConvertFrom( .. ), converting a single-node bvh." );
 	// allocate memory
 	uint32_t spaceNeeded = bvh8.triCount * 5; // CWBVH nodes use 80 bytes each.
@@ -5348,6 +9312,102 @@ inline __m128 fastrcp4( const __m128 a )
 	return _mm_sub_ps( _mm_add_ps( res, res ), muls );
 }
 
+// Moeller-Trumbore ray/triangle intersection for four triangles; returns the hit mask.
+static __FORCEINLINE __m128 MollerTrumbore4( const __m128 ox4, const __m128 oy4, const __m128 oz4, const __m128 dx4,
+	const __m128 dy4, const __m128 dz4, const __m128 v0x4, const __m128 v0y4, const __m128 v0z4, const __m128 e1x4,
+	const __m128 e1y4, const __m128 e1z4, const __m128 e2x4, const __m128 e2y4, const __m128 e2z4, const __m128 tmax4,
+	__m128& u4, __m128& v4, __m128& ta4 )
+{
+	const __m128 zero4 = _mm_setzero_ps(), one4 = _mm_set1_ps( 1 );
+	const __m128 hx4 = _mm_sub_ps( _mm_mul_ps( dy4, e2z4 ), _mm_mul_ps( dz4, e2y4 ) );
+	const __m128 hy4 = _mm_sub_ps( _mm_mul_ps( dz4, e2x4 ), _mm_mul_ps( dx4, e2z4 ) );
+	const __m128 hz4 = _mm_sub_ps( _mm_mul_ps( dx4, e2y4 ), _mm_mul_ps( dy4, e2x4 ) );
+	const __m128 sx4 = _mm_sub_ps( ox4, v0x4 ), sy4 = _mm_sub_ps( oy4, v0y4 ), sz4 = _mm_sub_ps( oz4, v0z4 );
+	const __m128 det4 = _mm_add_ps( _mm_mul_ps( e1z4, hz4 ), _mm_add_ps( _mm_mul_ps( e1x4, hx4 ), _mm_mul_ps( e1y4, hy4 ) ) );
+	const __m128 qz4 = _mm_sub_ps( _mm_mul_ps( sx4, e1y4 ), _mm_mul_ps( sy4, e1x4 ) );
+	const __m128 qx4 = _mm_sub_ps( _mm_mul_ps( sy4, e1z4 ), _mm_mul_ps( sz4, e1y4 ) );
+	const __m128 qy4 = _mm_sub_ps( _mm_mul_ps( sz4, e1x4 ), _mm_mul_ps( sx4, e1z4 ) );
+	const __m128 inv_det4 = fastrcp4( det4 );
+	u4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( sz4, hz4 ), _mm_add_ps( _mm_mul_ps( sx4, hx4 ), _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
+	v4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( dz4, qz4 ), _mm_add_ps( _mm_mul_ps( dx4, qx4 ), _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
+	ta4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( e2z4, qz4 ), _mm_add_ps( _mm_mul_ps( e2x4, qx4 ), _mm_mul_ps( e2y4, qy4 ) ) ), inv_det4 );
+	const __m128 mask1 = _mm_and_ps( _mm_cmpge_ps( u4, zero4 ), _mm_cmpge_ps( v4, zero4 ) );
+	const __m128 mask2 = _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 );
+	const __m128 mask3 = _mm_and_ps( _mm_cmplt_ps( ta4, tmax4 ), _mm_cmpgt_ps( ta4, zero4 ) );
+	return _mm_and_ps( _mm_and_ps( mask1, mask2 ), mask3 );
+}
+
+// Ray/triangle intersection for a BVHTri4Leaf: four triangles stored as v0, e1, e2.
+static __FORCEINLINE __m128 IntersectTri4( const BVHTri4Leaf* leaf, const __m128 ox4, const __m128 oy4, const __m128 oz4,
+	const __m128 dx4, const __m128 dy4, const __m128 dz4, const __m128 tmax4, __m128& u4, __m128& v4, __m128& ta4 )
+{
+	return MollerTrumbore4( ox4, oy4, oz4, dx4, dy4, dz4, leaf->v0x4, leaf->v0y4, leaf->v0z4,
+		leaf->e1x4, leaf->e1y4, leaf->e1z4, leaf->e2x4, leaf->e2y4, leaf->e2z4, tmax4, u4, v4, ta4 );
+}
+
+// Ray/quad intersection for a BVHQuad4Leaf: per lane, the nearest hit of the two
+// triangles (v0,v1,v3) and (v2,v3,v1) is returned, with (u,v) spanning the quad.
+static __FORCEINLINE __m128 IntersectQuad4( const BVHQuad4Leaf* leaf, const __m128 ox4, const __m128 oy4, const __m128 oz4,
+	const __m128 dx4, const __m128 dy4, const __m128 dz4, const __m128 tmax4, __m128& u4, __m128& v4, __m128& ta4 )
+{
+	__m128 ub4, vb4, tb4;
+	const __m128 ma = MollerTrumbore4( ox4, oy4, oz4, dx4, dy4, dz4, leaf->v0x4, leaf->v0y4, leaf->v0z4,
+		leaf->e1x4, leaf->e1y4, leaf->e1z4, leaf->e3x4, leaf->e3y4, leaf->e3z4, tmax4, u4, v4, ta4 );
+	// second triangle: v2, v3 - v2, v1 - v2
+	const __m128 f1x4 = _mm_sub_ps( _mm_add_ps( leaf->v0x4, leaf->e3x4 ), leaf->v2x4 ), f2x4 = _mm_sub_ps( _mm_add_ps( leaf->v0x4, leaf->e1x4 ), leaf->v2x4 );
+	const __m128 f1y4 = _mm_sub_ps( _mm_add_ps( leaf->v0y4, leaf->e3y4 ), leaf->v2y4 ), f2y4 = _mm_sub_ps( _mm_add_ps( leaf->v0y4, leaf->e1y4 ), leaf->v2y4 );
+	const __m128 f1z4 = _mm_sub_ps( _mm_add_ps( leaf->v0z4, leaf->e3z4 ), leaf->v2z4 ), f2z4 = _mm_sub_ps( _mm_add_ps( leaf->v0z4, leaf->e1z4 ), leaf->v2z4 );
+	const __m128 mb = MollerTrumbore4( ox4, oy4, oz4, dx4, dy4, dz4, leaf->v2x4, leaf->v2y4, leaf->v2z4,
+		f1x4, f1y4, f1z4, f2x4, f2y4, f2z4, tmax4, ub4, vb4, tb4 );
+	const __m128 one4 = _mm_set1_ps( 1 ), useB = _mm_and_ps( mb, _mm_or_ps( _mm_andnot_ps( ma, mb ), _mm_cmplt_ps( tb4, ta4 ) ) );
+	u4 = _mm_blendv_ps( u4, _mm_sub_ps( one4, ub4 ), useB ), v4 = _mm_blendv_ps( v4, _mm_sub_ps( one4, vb4 ), useB );
+	ta4 = _mm_blendv_ps( ta4, tb4, useB );
+	return _mm_or_ps( ma, mb );
+}
+
+// Custom geometry leaf for BVH4_CPU / BVH8_CPU: pass the primitive indices to the
+// batched callback if available, otherwise to the per-primitive callback.
+static __FORCEINLINE bool IntersectCustom4( Ray& ray, const BVHCustom4Leaf* leaf,
+	bool (*batch)(Ray&, const uint32_t*, const uint32_t), bool (*single)(Ray&, const unsigned) )
+{
+	bool hit = false;
+	if (batch) hit = batch( ray, leaf->primIdx, leaf->primCount );
+	else for (uint32_t i = 0; i < leaf->primCount; i++) if (single( ray, leaf->primIdx[i] )) hit = true;
+	if (hit)
+	{
+	#if INST_IDX_BITS == 32
+		ray.hit.inst = ray.instIdx;
+	#else
+		ray.hit.prim = (ray.hit.prim & PRIM_IDX_MASK) + ray.instIdx;
+	#endif
+	}
+	return hit;
+}
+
+static __FORCEINLINE bool Custom4Occludes( const Ray& ray, const BVHCustom4Leaf* leaf,
+	bool (*batch)(const Ray&, const uint32_t*, const uint32_t), bool (*single)(const Ray&, const unsigned) )
+{
+	if (batch) return batch( ray, leaf->primIdx, leaf->primCount );
+	for (uint32_t i = 0; i < leaf->primCount; i++) if (single( ray, leaf->primIdx[i] )) return true;
+	return false;
+}
+
+// Prefetching for BVH4_CPU / BVH8_CPU traversal: a stack entry addresses 64-byte
+// blocks; interior nodes span nodeLines blocks, leaves the leafBlocks of ConvertFrom.
+template <int nodeLines> static __FORCEINLINE void PrefetchEntry( const void* data, const uint32_t entry, const bool quads )
+{
+	const char* p = (const char*)data + (size_t)(entry & 0x1fffffff) * 64;
+	const size_t lines = !(entry & (1 << 30)) ? nodeLines : ((entry & (1 << 29)) ? sizeof( BVHCustom4Leaf ) :
+		quads ? sizeof( BVHQuad4Leaf ) : sizeof( BVHTri4Leaf )) / 64;
+	for (size_t i = 0; i < lines; i++) _mm_prefetch( p + i * 64, _MM_HINT_T0 );
+}
+
+// After pushing children, the entries just below the stack top are popped next.
+template <int nodeLines> static __FORCEINLINE void PrefetchStackTop( const void* data, const uint32_t* top, const uint32_t pushed, const bool quads )
+{
+	for (uint32_t i = 1; i <= TRAVERSAL_PREFETCH && i <= pushed; i++) PrefetchEntry<nodeLines>( data, top[-(int32_t)i], quads );
+}
+
 static uint32_t __popc( uint32_t x )
 {
 #if defined _MSC_VER && !defined __clang__
@@ -5396,6 +9456,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray
 	const __m128 zero4 = _mm_setzero_ps();
 	__m128 t4 = _mm_set1_ps( ray.hit.t );
 	ALIGNED( 64 ) int32_t stackPtr = 0, nodeIdx = 0;
+	BVH_STATS_RAY;
 	union ALIGNED( 32 ) { __m256i c8s; uint32_t cs[8]; };
 	constexpr int signShift = (posX ? 2 : 0) + (posY ? 4 : 0) + (posZ ? 8 : 0);
 	const __m128 rx4 = _mm_set1_ps( ray.O.x * ray.rD.x ), rdx4 = _mm_set1_ps( ray.rD.x );
@@ -5403,7 +9464,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray
 	const __m128 rz4 = _mm_set1_ps( ray.O.z * ray.rD.z ), rdz4 = _mm_set1_ps( ray.rD.z );
 	const __m128 ox4 = _mm_set1_ps( ray.O.x ), oy4 = _mm_set1_ps( ray.O.y ), oz4 = _mm_set1_ps( ray.O.z );
 	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
-	const __m128 one4 = _mm_set1_ps( 1 ), inf4 = _mm_set1_ps( 1e34f );
+	const __m128 inf4 = _mm_set1_ps( 1e34f );
 	const __m128i shftmsk4 = _mm_set1_epi32( 3 ), mul4 = _mm_set1_epi32( 0x04040404 ), add4 = _mm_set1_epi32( 0x03020100 );
 #ifdef _DEBUG
 	// sorry, not even this can be tolerated in this function. Only in debug.
@@ -5417,6 +9478,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray
 		while (!(nodeIdx & LEAF_BIT))
 		{
 			const BVHNode* n = (BVHNode*)(bvh4Data + nodeIdx);
+			BVH_STAT( stats.interiorNodes++, stats.boxTests += 4 );
 			const __m128 tx1 = _mm_sub_ps( _mm_mul_ps( posX ? n->xmin4 : n->xmax4, rdx4 ), rx4 );
 			const __m128 ty1 = _mm_sub_ps( _mm_mul_ps( posY ? n->ymin4 : n->ymax4, rdy4 ), ry4 );
 			const __m128 tz1 = _mm_sub_ps( _mm_mul_ps( posZ ? n->zmin4 : n->zmax4, rdz4 ), rz4 );
@@ -5455,6 +9517,8 @@ template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray
 				_mm_storeu_si128( (__m128i*)(nodeStack + stackPtr), child4 );
 				_mm_storeu_ps( (float*)(distStack + stackPtr), dist4 );
 				stackPtr += validNodes - 1;
+				BVH_STAT( stats.Stack( stackPtr ) );
+				PrefetchStackTop<2>( bvh4Data, (uint32_t*)nodeStack + stackPtr, validNodes - 1, bvh_over_quads );
 				nodeIdx = nodeStack[stackPtr];
 			}
 			else
@@ -5463,26 +9527,33 @@ template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray
 				nodeIdx = nodeStack[--stackPtr];
 			}
 		}
-		// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
 		uint32_t n;
 		memcpy( &n, &nodeIdx, 4 );
-		const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh4Data + (n & 0x1fffffff));
-		const __m128 hx4 = _mm_sub_ps( _mm_mul_ps( dy4, leaf->e2z4 ), _mm_mul_ps( dz4, leaf->e2y4 ) );
-		const __m128 hy4 = _mm_sub_ps( _mm_mul_ps( dz4, leaf->e2x4 ), _mm_mul_ps( dx4, leaf->e2z4 ) );
-		const __m128 hz4 = _mm_sub_ps( _mm_mul_ps( dx4, leaf->e2y4 ), _mm_mul_ps( dy4, leaf->e2x4 ) );
-		const __m128 sx4 = _mm_sub_ps( ox4, leaf->v0x4 ), sy4 = _mm_sub_ps( oy4, leaf->v0y4 ), sz4 = _mm_sub_ps( oz4, leaf->v0z4 );
-		const __m128 det4 = _mm_add_ps( _mm_mul_ps( leaf->e1z4, hz4 ), _mm_add_ps( _mm_mul_ps( leaf->e1x4, hx4 ), _mm_mul_ps( leaf->e1y4, hy4 ) ) );
-		const __m128 qz4 = _mm_sub_ps( _mm_mul_ps( sx4, leaf->e1y4 ), _mm_mul_ps( sy4, leaf->e1x4 ) );
-		const __m128 qx4 = _mm_sub_ps( _mm_mul_ps( sy4, leaf->e1z4 ), _mm_mul_ps( sz4, leaf->e1y4 ) );
-		const __m128 qy4 = _mm_sub_ps( _mm_mul_ps( sz4, leaf->e1x4 ), _mm_mul_ps( sx4, leaf->e1z4 ) );
-		const __m128 inv_det4 = fastrcp4( det4 );
-		const __m128 u4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( sz4, hz4 ), _mm_add_ps( _mm_mul_ps( sx4, hx4 ), _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
-		const __m128 v4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( dz4, qz4 ), _mm_add_ps( _mm_mul_ps( dx4, qx4 ), _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
-		const __m128 ta4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( leaf->e2z4, qz4 ), _mm_add_ps( _mm_mul_ps( leaf->e2x4, qx4 ), _mm_mul_ps( leaf->e2y4, qy4 ) ) ), inv_det4 );
-		const __m128 mask1 = _mm_and_ps( _mm_cmpge_ps( u4, zero4 ), _mm_cmpge_ps( v4, zero4 ) );
-		const __m128 mask2 = _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 );
-		const __m128 mask3 = _mm_and_ps( _mm_cmplt_ps( ta4, t4 ), _mm_cmpgt_ps( ta4, zero4 ) );
-		__m128 combined = _mm_and_ps( _mm_and_ps( mask1, mask2 ), mask3 );
+		BVH_STAT( stats.leafVisits++, stats.primTests += 4 ); // four lanes per leaf
+		if (customEnabled && (n & CUSTOM_BIT))
+		{
+			// custom geometry: the callback updates the hit record
+			const BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh4Data + (n & 0x1fffffff));
+			if (IntersectCustom4( ray, leaf, customIntersect4, customIntersect )) t4 = _mm_set1_ps( ray.hit.t );
+			if (!stackPtr) break;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
+		__m128 combined, u4, v4, ta4;
+		const uint32_t* leafPrimIdx;
+		if (quadsEnabled && bvh_over_quads)
+		{
+			// four quads, each tested as two triangles
+			const BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh4Data + (n & 0x1fffffff));
+			combined = IntersectQuad4( leaf, ox4, oy4, oz4, dx4, dy4, dz4, t4, u4, v4, ta4 ), leafPrimIdx = leaf->primIdx;
+		}
+		else
+		{
+			// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
+			const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh4Data + (n & 0x1fffffff));
+			combined = IntersectTri4( leaf, ox4, oy4, oz4, dx4, dy4, dz4, t4, u4, v4, ta4 );
+			leafPrimIdx = leaf->primIdx;
+		}
 		if (_mm_movemask_ps( combined ))
 		{
 			const __m128 dist4 = _mm_blendv_ps( inf4, ta4, combined );
@@ -5496,9 +9567,9 @@ template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray
 			const __m128 _u4 = u4, _v4 = v4;
 			ray.hit.t = t, ray.hit.u = ((float*)&_u4)[lane], ray.hit.v = ((float*)&_v4)[lane];
 		#if INST_IDX_BITS == 32
-			ray.hit.prim = leaf->primIdx[lane], ray.hit.inst = ray.instIdx;
+			ray.hit.prim = leafPrimIdx[lane], ray.hit.inst = ray.instIdx;
 		#else
-			ray.hit.prim = leaf->primIdx[lane] + ray.instIdx;
+			ray.hit.prim = leafPrimIdx[lane] + ray.instIdx;
 		#endif
 			t4 = _mm_set1_ps( t );
 			// compress stack
@@ -5545,18 +9616,19 @@ template <bool posX, bool posY, bool posZ> bool BVH4_CPU::IsOccluded( const Ray&
 {
 	ALIGNED( 64 ) uint32_t nodeStack[256];
 	ALIGNED( 64 ) int32_t stackPtr = 0, nodeIdx = 0;
+	BVH_STATS_RAY;
 	const __m128 t4 = _mm_set1_ps( ray.hit.t );
 	const __m128 rx4 = _mm_set1_ps( ray.O.x * ray.rD.x ), rdx4 = _mm_set1_ps( ray.rD.x );
 	const __m128 ry4 = _mm_set1_ps( ray.O.y * ray.rD.y ), rdy4 = _mm_set1_ps( ray.rD.y );
 	const __m128 rz4 = _mm_set1_ps( ray.O.z * ray.rD.z ), rdz4 = _mm_set1_ps( ray.rD.z );
 	const __m128 ox4 = _mm_set1_ps( ray.O.x ), oy4 = _mm_set1_ps( ray.O.y ), oz4 = _mm_set1_ps( ray.O.z );
 	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
-	const __m128 one4 = _mm_set1_ps( 1.0f ), zero4 = _mm_setzero_ps();
 	while (1)
 	{
 		while (!(nodeIdx & LEAF_BIT))
 		{
 			const BVHNode* n = (BVHNode*)(bvh4Data + nodeIdx);
+			BVH_STAT( stats.interiorNodes++, stats.boxTests += 4 );
 			const __m128 tx1 = _mm_sub_ps( _mm_mul_ps( posX ? n->xmin4 : n->xmax4, rdx4 ), rx4 );
 			const __m128 ty1 = _mm_sub_ps( _mm_mul_ps( posY ? n->ymin4 : n->ymax4, rdy4 ), ry4 );
 			const __m128 tz1 = _mm_sub_ps( _mm_mul_ps( posZ ? n->zmin4 : n->zmax4, rdz4 ), rz4 );
@@ -5579,6 +9651,8 @@ template <bool posX, bool posY, bool posZ> bool BVH4_CPU::IsOccluded( const Ray&
 				const __m128i child4 = _mm_shuffle_epi8( n->child4, cpi );
 				_mm_storeu_si128( (__m128i*)(nodeStack + stackPtr), child4 );
 				stackPtr += validNodes - 1;
+				BVH_STAT( stats.Stack( stackPtr ) );
+				PrefetchStackTop<2>( bvh4Data, nodeStack + stackPtr, validNodes - 1, bvh_over_quads );
 				nodeIdx = nodeStack[stackPtr];
 			}
 			else
@@ -5589,25 +9663,29 @@ template <bool posX, bool posY, bool posZ> bool BVH4_CPU::IsOccluded( const Ray&
 		}
 		uint32_t n;
 		memcpy( &n, &nodeIdx, 4 );
+		BVH_STAT( stats.leafVisits++, stats.primTests += 4 ); // four lanes per leaf
+		if (customEnabled && (n & CUSTOM_BIT))
+		{
+			const BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh4Data + (n & 0x1fffffff));
+			if (Custom4Occludes( ray, leaf, customIsOccluded4, customIsOccluded )) return true;
+			if (!stackPtr) return false;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
+		if (quadsEnabled && bvh_over_quads)
+		{
+			// four quads, each tested as two triangles
+			__m128 u4, v4, ta4;
+			const BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh4Data + (n & 0x1fffffff));
+			if (_mm_movemask_ps( IntersectQuad4( leaf, ox4, oy4, oz4, dx4, dy4, dz4, t4, u4, v4, ta4 ) )) return true;
+			if (!stackPtr) return false;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
 		// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
 		const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh4Data + (n & 0x1fffffff));
-		const __m128 hx4 = _mm_sub_ps( _mm_mul_ps( dy4, leaf->e2z4 ), _mm_mul_ps( dz4, leaf->e2y4 ) );
-		const __m128 hy4 = _mm_sub_ps( _mm_mul_ps( dz4, leaf->e2x4 ), _mm_mul_ps( dx4, leaf->e2z4 ) );
-		const __m128 hz4 = _mm_sub_ps( _mm_mul_ps( dx4, leaf->e2y4 ), _mm_mul_ps( dy4, leaf->e2x4 ) );
-		const __m128 sx4 = _mm_sub_ps( ox4, leaf->v0x4 ), sy4 = _mm_sub_ps( oy4, leaf->v0y4 ), sz4 = _mm_sub_ps( oz4, leaf->v0z4 );
-		const __m128 det4 = _mm_add_ps( _mm_mul_ps( leaf->e1z4, hz4 ), _mm_add_ps( _mm_mul_ps( leaf->e1x4, hx4 ), _mm_mul_ps( leaf->e1y4, hy4 ) ) );
-		const __m128 qz4 = _mm_sub_ps( _mm_mul_ps( sx4, leaf->e1y4 ), _mm_mul_ps( sy4, leaf->e1x4 ) );
-		const __m128 qx4 = _mm_sub_ps( _mm_mul_ps( sy4, leaf->e1z4 ), _mm_mul_ps( sz4, leaf->e1y4 ) );
-		const __m128 qy4 = _mm_sub_ps( _mm_mul_ps( sz4, leaf->e1x4 ), _mm_mul_ps( sx4, leaf->e1z4 ) );
-		const __m128 inv_det4 = fastrcp4( det4 );
-		const __m128 u4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( sz4, hz4 ), _mm_add_ps( _mm_mul_ps( sx4, hx4 ), _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
-		const __m128 v4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( dz4, qz4 ), _mm_add_ps( _mm_mul_ps( dx4, qx4 ), _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
-		const __m128 ta4 = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( leaf->e2z4, qz4 ), _mm_add_ps( _mm_mul_ps( leaf->e2x4, qx4 ), _mm_mul_ps( leaf->e2y4, qy4 ) ) ), inv_det4 );
-		const __m128 mask1 = _mm_and_ps( _mm_cmpge_ps( u4, zero4 ), _mm_cmpge_ps( v4, zero4 ) );
-		const __m128 mask2 = _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 );
-		const __m128 mask3 = _mm_and_ps( _mm_cmplt_ps( ta4, t4 ), _mm_cmpgt_ps( ta4, zero4 ) );
-		__m128 combined = _mm_and_ps( _mm_and_ps( mask1, mask2 ), mask3 );
-		if (_mm_movemask_ps( combined )) return true;
+		__m128 u4, v4, ta4;
+		if (_mm_movemask_ps( IntersectTri4( leaf, ox4, oy4, oz4, dx4, dy4, dz4, t4, u4, v4, ta4 ) )) return true;
 		if (!stackPtr) return false;
 		nodeIdx = nodeStack[--stackPtr];
 	}
@@ -5688,6 +9766,7 @@ void BVH::BuildAVX( const bvhvec4slice& vertices, const uint32_t* indices, const
 }
 void BVH::PrepareAVXBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims )
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::PREPARE );
 	BVH_FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareAVXBuild( .. ), primCount == 0." );
 	BVH_FATAL_ERROR_IF( vertices.stride & 15, "BVH::PrepareAVXBuild( .. ), stride must be multiple of 16." );
 	// some constants
@@ -5750,9 +9829,22 @@ void BVH::PrepareAVXBuild( const bvhvec4slice& vertices, const uint32_t* indices
 		}
 	}
 	root.aabbMin = *(bvhvec3*)&rootMin, root.aabbMax = *(bvhvec3*)&rootMax;
-	bvh_over_indices = indices != nullptr;
+	bvh_over_indices = indices != nullptr, bvh_over_quads = false;
 }
 void BVH::BuildAVX()
+{
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::SUBDIVIDE );
+	const uint32_t taskPeak = context.parallelBuild && triCount >= PARALLEL_BUILD_PRIMS ? SubdivideParallel( true ) : SubdivideAVX( 0, newNodePtr, 0 );
+	// all done.
+	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	refittable = true; // not using spatial splits: can refit this BVH
+	may_have_holes = false; // the AVX builder produces a continuous list of nodes
+	usedNodes = newNodePtr;
+	tinybvh_count_build( context.buildStats, triCount, usedNodes, 0, taskPeak );
+}
+
+// Subdivision loop of BuildAVX; see Subdivide.
+uint32_t BVH::SubdivideAVX( uint32_t nodeIdx, uint32_t& nodePtr, const uint32_t stopPrims )
 {
 	// aligned data
 	ALIGNED( 64 ) __m256 binbox[3 * AVXBINS];			// 768 bytes
@@ -5772,7 +9864,7 @@ void BVH::BuildAVX()
 	FragSSE* frag4 = (FragSSE*)fragment;
 	__m256* frag8 = (__m256*)fragment;
 	// subdivide recursively
-	ALIGNED( 64 ) uint32_t task[128], taskCount = 0, nodeIdx = 0;
+	ALIGNED( 64 ) uint32_t task[128], taskCount = 0, taskPeak = 0;
 	BVHNode& root = bvhNode[0];
 	const bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-7f;
 	while (1)
@@ -5780,6 +9872,7 @@ void BVH::BuildAVX()
 		while (1)
 		{
 			BVHNode& node = bvhNode[nodeIdx];
+			if (node.triCount <= stopPrims) break; // leave this one for SubdivideParallel.
 			__m128* node4 = (__m128*) & bvhNode[nodeIdx];
 			// find optimal object split
 			const __m128 d4 = _mm_blendv_ps( min1, _mm_sub_ps( node4[1], node4[0] ), mask3 );
@@ -5818,7 +9911,7 @@ void BVH::BuildAVX()
 			binbox[i0] = r0, binbox[AVXBINS + i1] = r1, binbox[2 * AVXBINS + i2] = r2;
 			// calculate per-split totals
 			float splitCost = BVH_FAR, rSAV = 1.0f / node.SurfaceArea();
-			uint32_t bestAxis = 0, bestPos = 0, n = newNodePtr, j = node.leftFirst + node.triCount, src = node.leftFirst;
+			uint32_t bestAxis = 0, bestPos = 0, n = nodePtr, j = node.leftFirst + node.triCount, src = node.leftFirst;
 			const __m256* bb = binbox;
 			for (int32_t a = 0; a < 3; a++, bb += AVXBINS) if ((node.aabbMax[a] - node.aabbMin[a]) > minDim[a])
 			{
@@ -5860,19 +9953,15 @@ void BVH::BuildAVX()
 			if (leftCount == 0 || rightCount == 0 || taskCount == BVH_NUM_ELEMS( task )) break; // should not happen.
 			*(__m256*)& bvhNode[n] = _mm256_xor_ps( bestLBox, signFlip8 );
 			bvhNode[n].leftFirst = node.leftFirst, bvhNode[n].triCount = leftCount;
-			node.leftFirst = n++, node.triCount = 0, newNodePtr += 2;
+			node.leftFirst = n++, node.triCount = 0, nodePtr += 2;
 			*(__m256*)& bvhNode[n] = _mm256_xor_ps( bestRBox, signFlip8 );
 			bvhNode[n].leftFirst = j, bvhNode[n].triCount = rightCount;
-			task[taskCount++] = n, nodeIdx = n - 1;
+			task[taskCount++] = n, nodeIdx = n - 1, taskPeak = tinybvh_max( taskPeak, taskCount );
 		}
 		// fetch subdivision task from stack
 		if (taskCount == 0) break; else nodeIdx = task[--taskCount];
 	}
-	// all done.
-	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
-	refittable = true; // not using spatial splits: can refit this BVH
-	may_have_holes = false; // the AVX builder produces a continuous list of nodes
-	usedNodes = newNodePtr;
+	return taskPeak;
 }
 #if defined _MSC_VER
 #pragma warning ( pop ) // restore 4701
@@ -6090,6 +10179,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 	const bvhvec4slice& verts = bvh.verts;
 	const uint32_t* primIdx = bvh.primIdx;
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	float cost = 0;
 	const __m128 Ox4 = _mm_set1_ps( ray.O.x ), rDx4 = _mm_set1_ps( ray.rD.x );
 	const __m128 Oy4 = _mm_set1_ps( ray.O.y ), rDy4 = _mm_set1_ps( ray.rD.y );
@@ -6099,6 +10189,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		cost += c_trav;
 		if (node->isLeaf())
 		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
 			if (indexedEnabled && bvh.vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
 			{
 				const uint32_t pi = primIdx[node->firstTri + i];
@@ -6133,6 +10224,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		y4 = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
 		z4 = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
 		uint32_t lidx = node->left, ridx = node->right;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
 		const __m128 min4 = _mm_max_ps( _mm_max_ps( _mm_max_ps( x4, y4 ), z4 ), _mm_setzero_ps() );
 		const __m128 max4 = _mm_min_ps( _mm_min_ps( _mm_min_ps( x4, y4 ), z4 ), _mm_set1_ps( ray.hit.t ) );
 		const float tmina_0 = LANE( min4, 0 ), tmaxa_1 = LANE( max4, 1 );
@@ -6152,6 +10244,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		{
 			node = bvhNode + lidx;
 			if (dist2 != BVH_FAR) stack[stackPtr++] = bvhNode + ridx;
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return (int32_t)cost;
@@ -6164,6 +10257,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 	const bvhvec4slice& verts = bvh.verts;
 	const uint32_t* primIdx = bvh.primIdx;
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	const __m128 Ox4 = _mm_set1_ps( ray.O.x ), rDx4 = _mm_set1_ps( ray.rD.x );
 	const __m128 Oy4 = _mm_set1_ps( ray.O.y ), rDy4 = _mm_set1_ps( ray.rD.y );
 	const __m128 Oz4 = _mm_set1_ps( ray.O.z ), rDz4 = _mm_set1_ps( ray.rD.z );
@@ -6171,6 +10265,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 	{
 		if (node->isLeaf())
 		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
 			if (indexedEnabled && bvh.vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++)
 			{
 				const uint32_t pi = primIdx[node->firstTri + i] * 3;
@@ -6205,6 +10300,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 		y4 = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
 		z4 = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
 		uint32_t lidx = node->left, ridx = node->right;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
 		const __m128 min4 = _mm_max_ps( _mm_max_ps( _mm_max_ps( x4, y4 ), z4 ), _mm_setzero_ps() );
 		const __m128 max4 = _mm_min_ps( _mm_min_ps( _mm_min_ps( x4, y4 ), z4 ), _mm_set1_ps( ray.hit.t ) );
 		const float tmina_0 = LANE( min4, 0 ), tmaxa_1 = LANE( max4, 1 );
@@ -6222,40 +10318,169 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 		}
 		else
 		{
-			node = bvhNode + lidx;
-			if (dist2 != BVH_FAR) stack[stackPtr++] = bvhNode + ridx;
+			node = bvhNode + lidx;
+			if (dist2 != BVH_FAR) stack[stackPtr++] = bvhNode + ridx;
+			BVH_STAT( stats.Stack( stackPtr ) );
+		}
+	}
+	return false;
+}
+
+// Intersect_CWBVH:
+// Intersect a compressed 8-wide BVH with a ray. For debugging only, not efficient.
+// Not technically limited to BVH_USEAVX, but __lzcnt and __popcnt will require
+// exotic compiler flags (in combination with __builtin_ia32_lzcnt_u32), so... Since
+// this is just here to test data before it goes to the GPU: MSVC-only for now.
+#define STACK_POP() { ngroup = traversalStack[--stackPtr]; }
+#define STACK_PUSH() { traversalStack[stackPtr++] = ngroup; }
+inline uint32_t extract_byte( const uint32_t i, const uint32_t n ) { return (i >> (n * 8)) & 0xFF; }
+inline uint32_t sign_extend_s8x4( const uint32_t i )
+{
+	// asm("prmt.b32 %0, %1, 0x0, 0x0000BA98;" : "=r"(v) : "r"(i)); // BA98: 1011`1010`1001`1000
+	// with the given parameters, prmt will extend the sign to all bits in a byte.
+	uint32_t b0 = (i & 0b10000000000000000000000000000000) ? 0xff000000 : 0;
+	uint32_t b1 = (i & 0b00000000100000000000000000000000) ? 0x00ff0000 : 0;
+	uint32_t b2 = (i & 0b00000000000000001000000000000000) ? 0x0000ff00 : 0;
+	uint32_t b3 = (i & 0b00000000000000000000000010000000) ? 0x000000ff : 0;
+	return b0 + b1 + b2 + b3; // probably can do better than this.
+}
+// CWBVH node decoding: intersect the ray with the eight quantized child boxes of
+// a compressed node (five bvhvec4's) and return the CWBVH hit mask.
+inline uint32_t DecodeCWBVHNode( const bvhvec4* node, const Ray& ray, const uint32_t octinv, const float tmin, const float tmax )
+{
+	const bvhvec4 n0 = node[0], n1 = node[1], n2 = node[2], n3 = node[3], n4 = node[4], p = n0;
+	bvhint3 e;
+	e.x = (int32_t) * ((int8_t*)&n0.w + 0), e.y = (int32_t) * ((int8_t*)&n0.w + 1), e.z = (int32_t) * ((int8_t*)&n0.w + 2);
+	uint32_t hitmask = 0;
+	const uint32_t vx = (e.x + 127) << 23u; const float adjusted_idirx = *(float*)&vx * ray.rD.x;
+	const uint32_t vy = (e.y + 127) << 23u; const float adjusted_idiry = *(float*)&vy * ray.rD.y;
+	const uint32_t vz = (e.z + 127) << 23u; const float adjusted_idirz = *(float*)&vz * ray.rD.z;
+	const float origx = -(ray.O.x - p.x) * ray.rD.x;
+	const float origy = -(ray.O.y - p.y) * ray.rD.y;
+	const float origz = -(ray.O.z - p.z) * ray.rD.z;
+	{	// First 4
+		const uint32_t meta4 = *(uint32_t*)&n1.z, is_inner4 = (meta4 & (meta4 << 1)) & 0x10101010;
+		const uint32_t inner_mask4 = sign_extend_s8x4( is_inner4 << 3 );
+		const uint32_t bit_index4 = (meta4 ^ (octinv & inner_mask4)) & 0x1F1F1F1F;
+		const uint32_t child_bits4 = (meta4 >> 5) & 0x07070707;
+		uint32_t swizzledLox = (ray.rD.x < 0) ? *(uint32_t*)&n3.z : *(uint32_t*)&n2.x, swizzledHix = (ray.rD.x < 0) ? *(uint32_t*)&n2.x : *(uint32_t*)&n3.z;
+		uint32_t swizzledLoy = (ray.rD.y < 0) ? *(uint32_t*)&n4.x : *(uint32_t*)&n2.z, swizzledHiy = (ray.rD.y < 0) ? *(uint32_t*)&n2.z : *(uint32_t*)&n4.x;
+		uint32_t swizzledLoz = (ray.rD.z < 0) ? *(uint32_t*)&n4.z : *(uint32_t*)&n3.x, swizzledHiz = (ray.rD.z < 0) ? *(uint32_t*)&n3.x : *(uint32_t*)&n4.z;
+		float tminx[4], tminy[4], tminz[4], tmaxx[4], tmaxy[4], tmaxz[4];
+		tminx[0] = ((swizzledLox >> 0) & 0xFF) * adjusted_idirx + origx, tminx[1] = ((swizzledLox >> 8) & 0xFF) * adjusted_idirx + origx, tminx[2] = ((swizzledLox >> 16) & 0xFF) * adjusted_idirx + origx;
+		tminx[3] = ((swizzledLox >> 24) & 0xFF) * adjusted_idirx + origx, tminy[0] = ((swizzledLoy >> 0) & 0xFF) * adjusted_idiry + origy, tminy[1] = ((swizzledLoy >> 8) & 0xFF) * adjusted_idiry + origy;
+		tminy[2] = ((swizzledLoy >> 16) & 0xFF) * adjusted_idiry + origy, tminy[3] = ((swizzledLoy >> 24) & 0xFF) * adjusted_idiry + origy, tminz[0] = ((swizzledLoz >> 0) & 0xFF) * adjusted_idirz + origz;
+		tminz[1] = ((swizzledLoz >> 8) & 0xFF) * adjusted_idirz + origz, tminz[2] = ((swizzledLoz >> 16) & 0xFF) * adjusted_idirz + origz, tminz[3] = ((swizzledLoz >> 24) & 0xFF) * adjusted_idirz + origz;
+		tmaxx[0] = ((swizzledHix >> 0) & 0xFF) * adjusted_idirx + origx, tmaxx[1] = ((swizzledHix >> 8) & 0xFF) * adjusted_idirx + origx, tmaxx[2] = ((swizzledHix >> 16) & 0xFF) * adjusted_idirx + origx;
+		tmaxx[3] = ((swizzledHix >> 24) & 0xFF) * adjusted_idirx + origx, tmaxy[0] = ((swizzledHiy >> 0) & 0xFF) * adjusted_idiry + origy, tmaxy[1] = ((swizzledHiy >> 8) & 0xFF) * adjusted_idiry + origy;
+		tmaxy[2] = ((swizzledHiy >> 16) & 0xFF) * adjusted_idiry + origy, tmaxy[3] = ((swizzledHiy >> 24) & 0xFF) * adjusted_idiry + origy, tmaxz[0] = ((swizzledHiz >> 0) & 0xFF) * adjusted_idirz + origz;
+		tmaxz[1] = ((swizzledHiz >> 8) & 0xFF) * adjusted_idirz + origz, tmaxz[2] = ((swizzledHiz >> 16) & 0xFF) * adjusted_idirz + origz, tmaxz[3] = ((swizzledHiz >> 24) & 0xFF) * adjusted_idirz + origz;
+		for (int32_t i = 0; i < 4; i++)
+		{
+			// Use VMIN, VMAX to compute the slabs
+			const float cmin = tinybvh_max( tinybvh_max( tinybvh_max( tminx[i], tminy[i] ), tminz[i] ), tmin );
+			const float cmax = tinybvh_min( tinybvh_min( tinybvh_min( tmaxx[i], tmaxy[i] ), tmaxz[i] ), tmax );
+			if (cmin <= cmax) hitmask |= extract_byte( child_bits4, i ) << extract_byte( bit_index4, i );
+		}
+	}
+	{	// Second 4
+		const uint32_t meta4 = *(uint32_t*)&n1.w, is_inner4 = (meta4 & (meta4 << 1)) & 0x10101010;
+		const uint32_t inner_mask4 = sign_extend_s8x4( is_inner4 << 3 );
+		const uint32_t bit_index4 = (meta4 ^ (octinv & inner_mask4)) & 0x1F1F1F1F;
+		const uint32_t child_bits4 = (meta4 >> 5) & 0x07070707;
+		uint32_t swizzledLox = (ray.rD.x < 0) ? *(uint32_t*)&n3.w : *(uint32_t*)&n2.y, swizzledHix = (ray.rD.x < 0) ? *(uint32_t*)&n2.y : *(uint32_t*)&n3.w;
+		uint32_t swizzledLoy = (ray.rD.y < 0) ? *(uint32_t*)&n4.y : *(uint32_t*)&n2.w, swizzledHiy = (ray.rD.y < 0) ? *(uint32_t*)&n2.w : *(uint32_t*)&n4.y;
+		uint32_t swizzledLoz = (ray.rD.z < 0) ? *(uint32_t*)&n4.w : *(uint32_t*)&n3.y, swizzledHiz = (ray.rD.z < 0) ? *(uint32_t*)&n3.y : *(uint32_t*)&n4.w;
+		float tminx[4], tminy[4], tminz[4], tmaxx[4], tmaxy[4], tmaxz[4];
+		tminx[0] = ((swizzledLox >> 0) & 0xFF) * adjusted_idirx + origx, tminx[1] = ((swizzledLox >> 8) & 0xFF) * adjusted_idirx + origx, tminx[2] = ((swizzledLox >> 16) & 0xFF) * adjusted_idirx + origx;
+		tminx[3] = ((swizzledLox >> 24) & 0xFF) * adjusted_idirx + origx, tminy[0] = ((swizzledLoy >> 0) & 0xFF) * adjusted_idiry + origy, tminy[1] = ((swizzledLoy >> 8) & 0xFF) * adjusted_idiry + origy;
+		tminy[2] = ((swizzledLoy >> 16) & 0xFF) * adjusted_idiry + origy, tminy[3] = ((swizzledLoy >> 24) & 0xFF) * adjusted_idiry + origy, tminz[0] = ((swizzledLoz >> 0) & 0xFF) * adjusted_idirz + origz;
+		tminz[1] = ((swizzledLoz >> 8) & 0xFF) * adjusted_idirz + origz, tminz[2] = ((swizzledLoz >> 16) & 0xFF) * adjusted_idirz + origz, tminz[3] = ((swizzledLoz >> 24) & 0xFF) * adjusted_idirz + origz;
+		tmaxx[0] = ((swizzledHix >> 0) & 0xFF) * adjusted_idirx + origx, tmaxx[1] = ((swizzledHix >> 8) & 0xFF) * adjusted_idirx + origx, tmaxx[2] = ((swizzledHix >> 16) & 0xFF) * adjusted_idirx + origx;
+		tmaxx[3] = ((swizzledHix >> 24) & 0xFF) * adjusted_idirx + origx, tmaxy[0] = ((swizzledHiy >> 0) & 0xFF) * adjusted_idiry + origy, tmaxy[1] = ((swizzledHiy >> 8) & 0xFF) * adjusted_idiry + origy;
+		tmaxy[2] = ((swizzledHiy >> 16) & 0xFF) * adjusted_idiry + origy, tmaxy[3] = ((swizzledHiy >> 24) & 0xFF) * adjusted_idiry + origy, tmaxz[0] = ((swizzledHiz >> 0) & 0xFF) * adjusted_idirz + origz;
+		tmaxz[1] = ((swizzledHiz >> 8) & 0xFF) * adjusted_idirz + origz, tmaxz[2] = ((swizzledHiz >> 16) & 0xFF) * adjusted_idirz + origz, tmaxz[3] = ((swizzledHiz >> 24) & 0xFF) * adjusted_idirz + origz;
+		for (int32_t i = 0; i < 4; i++)
+		{
+			const float cmin = tinybvh_max( tinybvh_max( tinybvh_max( tminx[i], tminy[i] ), tminz[i] ), tmin );
+			const float cmax = tinybvh_min( tinybvh_min( tinybvh_min( tmaxx[i], tmaxy[i] ), tmaxz[i] ), tmax );
+			if (cmin <= cmax) hitmask |= extract_byte( child_bits4, i ) << extract_byte( bit_index4, i );
+		}
+	}
+	return hitmask;
+}
+
+int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
+{
+	bvhuint2 traversalStack[128];
+	uint32_t hitAddr = 0, stackPtr = 0;
+	bvhvec2 triangleuv( 0, 0 );
+	const bvhvec4* blasNodes = bvh8Data, * blasTris = bvh8Tris;
+	float tmin = 0, tmax = ray.hit.t;
+	const uint32_t octinv = (7 - ((ray.D.x < 0 ? 4 : 0) | (ray.D.y < 0 ? 2 : 0) | (ray.D.z < 0 ? 1 : 0))) * 0x1010101;
+	bvhuint2 ngroup = bvhuint2( 0, 0b10000000000000000000000000000000 ), tgroup = bvhuint2( 0 );
+	BVH_STATS_RAY;
+	do
+	{
+		if (ngroup.y > 0x00FFFFFF)
+		{
+			const uint32_t hits = ngroup.y, imask = ngroup.y;
+			const uint32_t child_bit_index = __bfind( hits ), child_node_base_index = ngroup.x;
+			ngroup.y &= ~(1 << child_bit_index);
+			if (ngroup.y > 0x00FFFFFF) { STACK_PUSH( /* nodeGroup */ ); }
+			BVH_STAT( stats.Stack( stackPtr ) );
+			{
+				const uint32_t slot_index = (child_bit_index - 24) ^ (octinv & 255);
+				const uint32_t relative_index = __popc( imask & ~(0xFFFFFFFF << slot_index) );
+				const uint32_t child_node_index = child_node_base_index + relative_index;
+				BVH_STAT( stats.interiorNodes++, stats.boxTests += 8 );
+				const bvhvec4* node = blasNodes + child_node_index * 5;
+				const uint32_t hitmask = DecodeCWBVHNode( node, ray, octinv, tmin, tmax );
+				ngroup.x = as_uint( node[1].x ), tgroup.x = as_uint( node[1].y );
+				ngroup.y = (hitmask & 0xFF000000) | (as_uint( node[0].w ) >> 24), tgroup.y = hitmask & 0x00FFFFFF;
+			}
+		}
+		else tgroup = ngroup, ngroup = bvhuint2( 0 );
+		BVH_STAT( if (tgroup.y) stats.leafVisits++ );
+		while (tgroup.y != 0)
+		{
+			uint32_t triangleIndex = __bfind( tgroup.y );
+			tgroup.y -= 1 << triangleIndex;
+			BVH_STAT( stats.primTests++ );
+			int32_t triAddr = tgroup.x + triangleIndex * 3;
+			const bvhvec3 e2 = bvhvec3( blasTris[triAddr + 0] ), e1 = bvhvec3( blasTris[triAddr + 1] );
+			const bvhvec3 v0 = blasTris[triAddr + 2];
+			MOLLER_TRUMBORE_TEST( tmax, continue );
+			triangleuv = bvhvec2( u, v ), tmax = t;
+			hitAddr = as_uint( blasTris[triAddr + 2].w );
+		}
+		if (ngroup.y > 0x00FFFFFF) continue;
+		if (stackPtr > 0) { STACK_POP( /* nodeGroup */ ); }
+		else
+		{
+			ray.hit.t = tmax;
+			if (tmax < BVH_FAR) ray.hit.u = triangleuv.x, ray.hit.v = triangleuv.y, ray.hit.prim = hitAddr;
+			break;
 		}
-	}
-	return false;
+	} while (true);
+	return 0;
 }
 
-// Intersect_CWBVH:
-// Intersect a compressed 8-wide BVH with a ray. For debugging only, not efficient.
-// Not technically limited to BVH_USEAVX, but __lzcnt and __popcnt will require
-// exotic compiler flags (in combination with __builtin_ia32_lzcnt_u32), so... Since
-// this is just here to test data before it goes to the GPU: MSVC-only for now.
-#define STACK_POP() { ngroup = traversalStack[--stackPtr]; }
-#define STACK_PUSH() { traversalStack[stackPtr++] = ngroup; }
-inline uint32_t extract_byte( const uint32_t i, const uint32_t n ) { return (i >> (n * 8)) & 0xFF; }
-inline uint32_t sign_extend_s8x4( const uint32_t i )
-{
-	// asm("prmt.b32 %0, %1, 0x0, 0x0000BA98;" : "=r"(v) : "r"(i)); // BA98: 1011`1010`1001`1000
-	// with the given parameters, prmt will extend the sign to all bits in a byte.
-	uint32_t b0 = (i & 0b10000000000000000000000000000000) ? 0xff000000 : 0;
-	uint32_t b1 = (i & 0b00000000100000000000000000000000) ? 0x00ff0000 : 0;
-	uint32_t b2 = (i & 0b00000000000000001000000000000000) ? 0x0000ff00 : 0;
-	uint32_t b3 = (i & 0b00000000000000000000000010000000) ? 0x000000ff : 0;
-	return b0 + b1 + b2 + b3; // probably can do better than this.
-}
-int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
+int32_t BVH8_CWBVH::IntersectShortStack( Ray& ray ) const
 {
-	bvhuint2 traversalStack[128];
-	uint32_t hitAddr = 0, stackPtr = 0;
+	// Same as Intersect, but with a small ring buffer for a stack. On overflow the
+	// oldest entry is overwritten; those subtrees are then covered by finishing
+	// the ray with the full-stack Intersect, using the hit found so far as tmax.
+	// A CWBVH pushes at most one node group per level, so this is rare.
+	bvhuint2 shortStack[CWBVH_SHORT_STACK];
+	uint32_t hitAddr = 0, stackPtr = 0, stackSize = 0;
+	bool dropped = false;
 	bvhvec2 triangleuv( 0, 0 );
 	const bvhvec4* blasNodes = bvh8Data, * blasTris = bvh8Tris;
 	float tmin = 0, tmax = ray.hit.t;
 	const uint32_t octinv = (7 - ((ray.D.x < 0 ? 4 : 0) | (ray.D.y < 0 ? 2 : 0) | (ray.D.z < 0 ? 1 : 0))) * 0x1010101;
 	bvhuint2 ngroup = bvhuint2( 0, 0b10000000000000000000000000000000 ), tgroup = bvhuint2( 0 );
+	BVH_STATS_RAY;
 	do
 	{
 		if (ngroup.y > 0x00FFFFFF)
@@ -6263,81 +10488,30 @@ int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
 			const uint32_t hits = ngroup.y, imask = ngroup.y;
 			const uint32_t child_bit_index = __bfind( hits ), child_node_base_index = ngroup.x;
 			ngroup.y &= ~(1 << child_bit_index);
-			if (ngroup.y > 0x00FFFFFF) { STACK_PUSH( /* nodeGroup */ ); }
+			if (ngroup.y > 0x00FFFFFF)
+			{
+				shortStack[stackPtr++ & (CWBVH_SHORT_STACK - 1)] = ngroup;
+				if (stackSize == CWBVH_SHORT_STACK) dropped = true; else stackSize++;
+			}
+			BVH_STAT( stats.Stack( stackSize ) );
 			{
 				const uint32_t slot_index = (child_bit_index - 24) ^ (octinv & 255);
 				const uint32_t relative_index = __popc( imask & ~(0xFFFFFFFF << slot_index) );
 				const uint32_t child_node_index = child_node_base_index + relative_index;
-				const bvhvec4 n0 = blasNodes[child_node_index * 5 + 0], n1 = blasNodes[child_node_index * 5 + 1];
-				const bvhvec4 n2 = blasNodes[child_node_index * 5 + 2], n3 = blasNodes[child_node_index * 5 + 3];
-				const bvhvec4 n4 = blasNodes[child_node_index * 5 + 4], p = n0;
-				bvhint3 e;
-				e.x = (int32_t) * ((int8_t*)&n0.w + 0), e.y = (int32_t) * ((int8_t*)&n0.w + 1), e.z = (int32_t) * ((int8_t*)&n0.w + 2);
-				ngroup.x = as_uint( n1.x ), tgroup.x = as_uint( n1.y ), tgroup.y = 0;
-				uint32_t hitmask = 0;
-				const uint32_t vx = (e.x + 127) << 23u; const float adjusted_idirx = *(float*)&vx * ray.rD.x;
-				const uint32_t vy = (e.y + 127) << 23u; const float adjusted_idiry = *(float*)&vy * ray.rD.y;
-				const uint32_t vz = (e.z + 127) << 23u; const float adjusted_idirz = *(float*)&vz * ray.rD.z;
-				const float origx = -(ray.O.x - p.x) * ray.rD.x;
-				const float origy = -(ray.O.y - p.y) * ray.rD.y;
-				const float origz = -(ray.O.z - p.z) * ray.rD.z;
-				{	// First 4
-					const uint32_t meta4 = *(uint32_t*)&n1.z, is_inner4 = (meta4 & (meta4 << 1)) & 0x10101010;
-					const uint32_t inner_mask4 = sign_extend_s8x4( is_inner4 << 3 );
-					const uint32_t bit_index4 = (meta4 ^ (octinv & inner_mask4)) & 0x1F1F1F1F;
-					const uint32_t child_bits4 = (meta4 >> 5) & 0x07070707;
-					uint32_t swizzledLox = (ray.rD.x < 0) ? *(uint32_t*)&n3.z : *(uint32_t*)&n2.x, swizzledHix = (ray.rD.x < 0) ? *(uint32_t*)&n2.x : *(uint32_t*)&n3.z;
-					uint32_t swizzledLoy = (ray.rD.y < 0) ? *(uint32_t*)&n4.x : *(uint32_t*)&n2.z, swizzledHiy = (ray.rD.y < 0) ? *(uint32_t*)&n2.z : *(uint32_t*)&n4.x;
-					uint32_t swizzledLoz = (ray.rD.z < 0) ? *(uint32_t*)&n4.z : *(uint32_t*)&n3.x, swizzledHiz = (ray.rD.z < 0) ? *(uint32_t*)&n3.x : *(uint32_t*)&n4.z;
-					float tminx[4], tminy[4], tminz[4], tmaxx[4], tmaxy[4], tmaxz[4];
-					tminx[0] = ((swizzledLox >> 0) & 0xFF) * adjusted_idirx + origx, tminx[1] = ((swizzledLox >> 8) & 0xFF) * adjusted_idirx + origx, tminx[2] = ((swizzledLox >> 16) & 0xFF) * adjusted_idirx + origx;
-					tminx[3] = ((swizzledLox >> 24) & 0xFF) * adjusted_idirx + origx, tminy[0] = ((swizzledLoy >> 0) & 0xFF) * adjusted_idiry + origy, tminy[1] = ((swizzledLoy >> 8) & 0xFF) * adjusted_idiry + origy;
-					tminy[2] = ((swizzledLoy >> 16) & 0xFF) * adjusted_idiry + origy, tminy[3] = ((swizzledLoy >> 24) & 0xFF) * adjusted_idiry + origy, tminz[0] = ((swizzledLoz >> 0) & 0xFF) * adjusted_idirz + origz;
-					tminz[1] = ((swizzledLoz >> 8) & 0xFF) * adjusted_idirz + origz, tminz[2] = ((swizzledLoz >> 16) & 0xFF) * adjusted_idirz + origz, tminz[3] = ((swizzledLoz >> 24) & 0xFF) * adjusted_idirz + origz;
-					tmaxx[0] = ((swizzledHix >> 0) & 0xFF) * adjusted_idirx + origx, tmaxx[1] = ((swizzledHix >> 8) & 0xFF) * adjusted_idirx + origx, tmaxx[2] = ((swizzledHix >> 16) & 0xFF) * adjusted_idirx + origx;
-					tmaxx[3] = ((swizzledHix >> 24) & 0xFF) * adjusted_idirx + origx, tmaxy[0] = ((swizzledHiy >> 0) & 0xFF) * adjusted_idiry + origy, tmaxy[1] = ((swizzledHiy >> 8) & 0xFF) * adjusted_idiry + origy;
-					tmaxy[2] = ((swizzledHiy >> 16) & 0xFF) * adjusted_idiry + origy, tmaxy[3] = ((swizzledHiy >> 24) & 0xFF) * adjusted_idiry + origy, tmaxz[0] = ((swizzledHiz >> 0) & 0xFF) * adjusted_idirz + origz;
-					tmaxz[1] = ((swizzledHiz >> 8) & 0xFF) * adjusted_idirz + origz, tmaxz[2] = ((swizzledHiz >> 16) & 0xFF) * adjusted_idirz + origz, tmaxz[3] = ((swizzledHiz >> 24) & 0xFF) * adjusted_idirz + origz;
-					for (int32_t i = 0; i < 4; i++)
-					{
-						// Use VMIN, VMAX to compute the slabs
-						const float cmin = tinybvh_max( tinybvh_max( tinybvh_max( tminx[i], tminy[i] ), tminz[i] ), tmin );
-						const float cmax = tinybvh_min( tinybvh_min( tinybvh_min( tmaxx[i], tmaxy[i] ), tmaxz[i] ), tmax );
-						if (cmin <= cmax) hitmask |= extract_byte( child_bits4, i ) << extract_byte( bit_index4, i );
-					}
-				}
-				{	// Second 4
-					const uint32_t meta4 = *(uint32_t*)&n1.w, is_inner4 = (meta4 & (meta4 << 1)) & 0x10101010;
-					const uint32_t inner_mask4 = sign_extend_s8x4( is_inner4 << 3 );
-					const uint32_t bit_index4 = (meta4 ^ (octinv & inner_mask4)) & 0x1F1F1F1F;
-					const uint32_t child_bits4 = (meta4 >> 5) & 0x07070707;
-					uint32_t swizzledLox = (ray.rD.x < 0) ? *(uint32_t*)&n3.w : *(uint32_t*)&n2.y, swizzledHix = (ray.rD.x < 0) ? *(uint32_t*)&n2.y : *(uint32_t*)&n3.w;
-					uint32_t swizzledLoy = (ray.rD.y < 0) ? *(uint32_t*)&n4.y : *(uint32_t*)&n2.w, swizzledHiy = (ray.rD.y < 0) ? *(uint32_t*)&n2.w : *(uint32_t*)&n4.y;
-					uint32_t swizzledLoz = (ray.rD.z < 0) ? *(uint32_t*)&n4.w : *(uint32_t*)&n3.y, swizzledHiz = (ray.rD.z < 0) ? *(uint32_t*)&n3.y : *(uint32_t*)&n4.w;
-					float tminx[4], tminy[4], tminz[4], tmaxx[4], tmaxy[4], tmaxz[4];
-					tminx[0] = ((swizzledLox >> 0) & 0xFF) * adjusted_idirx + origx, tminx[1] = ((swizzledLox >> 8) & 0xFF) * adjusted_idirx + origx, tminx[2] = ((swizzledLox >> 16) & 0xFF) * adjusted_idirx + origx;
-					tminx[3] = ((swizzledLox >> 24) & 0xFF) * adjusted_idirx + origx, tminy[0] = ((swizzledLoy >> 0) & 0xFF) * adjusted_idiry + origy, tminy[1] = ((swizzledLoy >> 8) & 0xFF) * adjusted_idiry + origy;
-					tminy[2] = ((swizzledLoy >> 16) & 0xFF) * adjusted_idiry + origy, tminy[3] = ((swizzledLoy >> 24) & 0xFF) * adjusted_idiry + origy, tminz[0] = ((swizzledLoz >> 0) & 0xFF) * adjusted_idirz + origz;
-					tminz[1] = ((swizzledLoz >> 8) & 0xFF) * adjusted_idirz + origz, tminz[2] = ((swizzledLoz >> 16) & 0xFF) * adjusted_idirz + origz, tminz[3] = ((swizzledLoz >> 24) & 0xFF) * adjusted_idirz + origz;
-					tmaxx[0] = ((swizzledHix >> 0) & 0xFF) * adjusted_idirx + origx, tmaxx[1] = ((swizzledHix >> 8) & 0xFF) * adjusted_idirx + origx, tmaxx[2] = ((swizzledHix >> 16) & 0xFF) * adjusted_idirx + origx;
-					tmaxx[3] = ((swizzledHix >> 24) & 0xFF) * adjusted_idirx + origx, tmaxy[0] = ((swizzledHiy >> 0) & 0xFF) * adjusted_idiry + origy, tmaxy[1] = ((swizzledHiy >> 8) & 0xFF) * adjusted_idiry + origy;
-					tmaxy[2] = ((swizzledHiy >> 16) & 0xFF) * adjusted_idiry + origy, tmaxy[3] = ((swizzledHiy >> 24) & 0xFF) * adjusted_idiry + origy, tmaxz[0] = ((swizzledHiz >> 0) & 0xFF) * adjusted_idirz + origz;
-					tmaxz[1] = ((swizzledHiz >> 8) & 0xFF) * adjusted_idirz + origz, tmaxz[2] = ((swizzledHiz >> 16) & 0xFF) * adjusted_idirz + origz, tmaxz[3] = ((swizzledHiz >> 24) & 0xFF) * adjusted_idirz + origz;
-					for (int32_t i = 0; i < 4; i++)
-					{
-						const float cmin = tinybvh_max( tinybvh_max( tinybvh_max( tminx[i], tminy[i] ), tminz[i] ), tmin );
-						const float cmax = tinybvh_min( tinybvh_min( tinybvh_min( tmaxx[i], tmaxy[i] ), tmaxz[i] ), tmax );
-						if (cmin <= cmax) hitmask |= extract_byte( child_bits4, i ) << extract_byte( bit_index4, i );
-					}
-				}
-				ngroup.y = (hitmask & 0xFF000000) | (as_uint( n0.w ) >> 24), tgroup.y = hitmask & 0x00FFFFFF;
+				BVH_STAT( stats.interiorNodes++, stats.boxTests += 8 );
+				const bvhvec4* node = blasNodes + child_node_index * 5;
+				const uint32_t hitmask = DecodeCWBVHNode( node, ray, octinv, tmin, tmax );
+				ngroup.x = as_uint( node[1].x ), tgroup.x = as_uint( node[1].y );
+				ngroup.y = (hitmask & 0xFF000000) | (as_uint( node[0].w ) >> 24), tgroup.y = hitmask & 0x00FFFFFF;
 			}
 		}
 		else tgroup = ngroup, ngroup = bvhuint2( 0 );
+		BVH_STAT( if (tgroup.y) stats.leafVisits++ );
 		while (tgroup.y != 0)
 		{
 			uint32_t triangleIndex = __bfind( tgroup.y );
 			tgroup.y -= 1 << triangleIndex;
+			BVH_STAT( stats.primTests++ );
 			int32_t triAddr = tgroup.x + triangleIndex * 3;
 			const bvhvec3 e2 = bvhvec3( blasTris[triAddr + 0] ), e1 = bvhvec3( blasTris[triAddr + 1] );
 			const bvhvec3 v0 = blasTris[triAddr + 2];
@@ -6346,7 +10520,7 @@ int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
 			hitAddr = as_uint( blasTris[triAddr + 2].w );
 		}
 		if (ngroup.y > 0x00FFFFFF) continue;
-		if (stackPtr > 0) { STACK_POP( /* nodeGroup */ ); }
+		if (stackSize > 0) ngroup = shortStack[--stackPtr & (CWBVH_SHORT_STACK - 1)], stackSize--;
 		else
 		{
 			ray.hit.t = tmax;
@@ -6354,6 +10528,13 @@ int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
 			break;
 		}
 	} while (true);
+	if (dropped)
+	{
+		// Intersect overwrites the hit record even if it finds nothing closer.
+		const Intersection hit = ray.hit;
+		Intersect( ray );
+		if (ray.hit.t == hit.t) ray.hit = hit;
+	}
 	return 0;
 }
 
@@ -6411,6 +10592,70 @@ float min8( const __m256 x )
 	return _mm_cvtss_f32( res );
 }
 
+// Moeller-Trumbore ray/triangle intersection for a BVHTri4Leaf, FMA version.
+static __FORCEINLINE __m128 IntersectTri4FMA( const BVHTri4Leaf* leaf, const __m128 ox4, const __m128 oy4, const __m128 oz4,
+	const __m128 dx4, const __m128 dy4, const __m128 dz4, const __m128 tmax4, __m128& u4, __m128& v4, __m128& ta4 )
+{
+	const __m128 hx4 = _mm_fmsub_ps( dy4, leaf->e2z4, _mm_mul_ps( dz4, leaf->e2y4 ) );
+	const __m128 hy4 = _mm_fmsub_ps( dz4, leaf->e2x4, _mm_mul_ps( dx4, leaf->e2z4 ) );
+	const __m128 hz4 = _mm_fmsub_ps( dx4, leaf->e2y4, _mm_mul_ps( dy4, leaf->e2x4 ) );
+	const __m128 sx4 = _mm_sub_ps( ox4, leaf->v0x4 ), sy4 = _mm_sub_ps( oy4, leaf->v0y4 );
+	const __m128 sz4 = _mm_sub_ps( oz4, leaf->v0z4 );
+	const __m128 det4 = _mm_fmadd_ps( leaf->e1z4, hz4, _mm_fmadd_ps( leaf->e1x4, hx4, _mm_mul_ps( leaf->e1y4, hy4 ) ) );
+	const __m128 qz4 = _mm_fmsub_ps( sx4, leaf->e1y4, _mm_mul_ps( sy4, leaf->e1x4 ) );
+	const __m128 qx4 = _mm_fmsub_ps( sy4, leaf->e1z4, _mm_mul_ps( sz4, leaf->e1y4 ) );
+	const __m128 qy4 = _mm_fmsub_ps( sz4, leaf->e1x4, _mm_mul_ps( sx4, leaf->e1z4 ) );
+	const __m128 inv_det4 = fastrcp4( det4 );
+	u4 = _mm_mul_ps( _mm_fmadd_ps( sz4, hz4, _mm_fmadd_ps( sx4, hx4, _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
+	v4 = _mm_mul_ps( _mm_fmadd_ps( dz4, qz4, _mm_fmadd_ps( dx4, qx4, _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
+	ta4 = _mm_mul_ps( _mm_fmadd_ps( leaf->e2z4, qz4, _mm_fmadd_ps( leaf->e2x4, qx4, _mm_mul_ps( leaf->e2y4, qy4 ) ) ), inv_det4 );
+	const __m128 mask1 = _mm_cmpge_ps( u4, _mm_setzero_ps() ), mask2 = _mm_cmpge_ps( v4, _mm_setzero_ps() );
+	const __m128 mask3 = _mm_cmple_ps( _mm_add_ps( u4, v4 ), _mm_set1_ps( 1 ) );
+	const __m128 mask4 = _mm_cmpgt_ps( ta4, _mm_setzero_ps() ), mask5 = _mm_cmplt_ps( ta4, tmax4 );
+	return _mm_and_ps( _mm_and_ps( _mm_and_ps( mask1, mask2 ), _mm_and_ps( mask3, mask4 ) ), mask5 );
+}
+
+// Store the nearest of up to four leaf hits in the ray and return its distance.
+static __FORCEINLINE float UpdateHit4( Ray& ray, const __m128 combined, const __m128 u4, const __m128 v4,
+	const __m128 ta4, const uint32_t* leafPrimIdx )
+{
+	const __m128 dist4 = _mm_blendv_ps( _mm_set1_ps( 1e34f ), ta4, combined );
+	// compute broadcasted horizontal minimum of dist4
+	const __m128 a = _mm_min_ps( dist4, _mm_shuffle_ps( dist4, dist4, _MM_SHUFFLE( 2, 1, 0, 3 ) ) );
+	const __m128 c = _mm_min_ps( a, _mm_shuffle_ps( a, a, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	const uint32_t lane = __bfind( _mm_movemask_ps( _mm_cmpeq_ps( c, dist4 ) ) );
+	// update hit record
+	const __m128 _d4 = dist4, _u4 = u4, _v4 = v4;
+	const float t = ((float*)&_d4)[lane];
+	ray.hit.t = t, ray.hit.u = ((float*)&_u4)[lane], ray.hit.v = ((float*)&_v4)[lane];
+#if INST_IDX_BITS == 32
+	ray.hit.prim = leafPrimIdx[lane], ray.hit.inst = ray.instIdx;
+#else
+	ray.hit.prim = leafPrimIdx[lane] + ray.instIdx;
+#endif
+	return t;
+}
+
+// Remove stack entries beyond the new hit distance; returns the new stack size.
+static __FORCEINLINE int32_t CompressStack8( int32_t* nodeStack, float* distStack, const int32_t stackPtr, const __m256 t8 )
+{
+	int32_t outStackPtr = 0;
+	for (int32_t i = 0; i < stackPtr; i += 8)
+	{
+		__m256i node8 = _mm256_load_si256( (__m256i*)(nodeStack + i) );
+		__m256 dist8 = _mm256_load_ps( distStack + i );
+		const __m256i mask8 = _mm256_cmpgt_epi32( _mm256_castps_si256( dist8 ), _mm256_castps_si256( t8 ) );
+		const uint32_t mask = _mm256_movemask_ps( _mm256_castsi256_ps( mask8 ) );
+		const __m256i cpi = idxLUT256[mask];
+		dist8 = _mm256_permutevar8x32_ps( dist8, cpi ), node8 = _mm256_permutevar8x32_epi32( node8, cpi );
+		_mm256_storeu_ps( distStack + outStackPtr, dist8 );
+		_mm256_storeu_si256( (__m256i*)(nodeStack + outStackPtr), node8 );
+		const int32_t numItems = tinybvh_min( 8, stackPtr - i ), validMask = (1 << numItems) - 1;
+		outStackPtr += __popc( (255 - mask) & validMask );
+	}
+	return outStackPtr;
+}
+
 template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray ) const
 {
 	ALIGNED( 64 ) int32_t nodeStack[256];
@@ -6418,6 +10663,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 	const __m256 zero8 = _mm256_setzero_ps();
 	__m256 t8 = _mm256_set1_ps( ray.hit.t );
 	ALIGNED( 64 ) int32_t stackPtr = 0, nodeIdx = 0;
+	BVH_STATS_RAY;
 	union ALIGNED( 32 ) { __m256i c8s; uint32_t cs[8]; };
 	constexpr int signShift = (posX ? 3 : 0) + (posY ? 6 : 0) + (posZ ? 12 : 0);
 	const __m256 rx8 = _mm256_set1_ps( ray.O.x * ray.rD.x ), rdx8 = _mm256_set1_ps( ray.rD.x );
@@ -6425,7 +10671,6 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 	const __m256 rz8 = _mm256_set1_ps( ray.O.z * ray.rD.z ), rdz8 = _mm256_set1_ps( ray.rD.z );
 	const __m128 ox4 = _mm_set1_ps( ray.O.x ), oy4 = _mm_set1_ps( ray.O.y ), oz4 = _mm_set1_ps( ray.O.z );
 	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
-	const __m128 one4 = _mm_set1_ps( 1 ), inf4 = _mm_set1_ps( 1e34f );
 #ifdef _DEBUG
 	// sorry, not even this can be tolerated in this function. Only in debug.
 	uint32_t steps = 0;
@@ -6438,6 +10683,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 		while (!(nodeIdx & LEAF_BIT))
 		{
 			const BVHNode* n = (BVHNode*)(bvh8Data + nodeIdx);
+			BVH_STAT( stats.interiorNodes++, stats.boxTests += 8 );
 			const __m256 tx1 = _mm256_fmsub_ps( posX ? n->xmin8 : n->xmax8, rdx8, rx8 );
 			const __m256 ty1 = _mm256_fmsub_ps( posY ? n->ymin8 : n->ymax8, rdy8, ry8 );
 			const __m256 tz1 = _mm256_fmsub_ps( posZ ? n->zmin8 : n->zmax8, rdz8, rz8 );
@@ -6466,6 +10712,8 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				_mm256_storeu_si256( (__m256i*)(nodeStack + stackPtr), child8 );
 				_mm256_storeu_ps( (float*)(distStack + stackPtr), dist8 );
 				stackPtr += 7 - invalidNodes;
+				BVH_STAT( stats.Stack( stackPtr ) );
+				PrefetchStackTop<4>( bvh8Data, (uint32_t*)nodeStack + stackPtr, 7 - invalidNodes, bvh_over_quads );
 				nodeIdx = nodeStack[stackPtr];
 			}
 			else
@@ -6474,62 +10722,38 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				nodeIdx = nodeStack[--stackPtr];
 			}
 		}
-		// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
 		uint32_t n;
 		memcpy( &n, &nodeIdx, 4 );
-		const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (n & 0x1fffffff));
-		const __m128 hx4 = _mm_fmsub_ps( dy4, leaf->e2z4, _mm_mul_ps( dz4, leaf->e2y4 ) );
-		const __m128 hy4 = _mm_fmsub_ps( dz4, leaf->e2x4, _mm_mul_ps( dx4, leaf->e2z4 ) );
-		const __m128 hz4 = _mm_fmsub_ps( dx4, leaf->e2y4, _mm_mul_ps( dy4, leaf->e2x4 ) );
-		const __m128 sx4 = _mm_sub_ps( ox4, leaf->v0x4 ), sy4 = _mm_sub_ps( oy4, leaf->v0y4 );
-		const __m128 sz4 = _mm_sub_ps( oz4, leaf->v0z4 );
-		const __m128 det4 = _mm_fmadd_ps( leaf->e1z4, hz4, _mm_fmadd_ps( leaf->e1x4, hx4, _mm_mul_ps( leaf->e1y4, hy4 ) ) );
-		const __m128 qz4 = _mm_fmsub_ps( sx4, leaf->e1y4, _mm_mul_ps( sy4, leaf->e1x4 ) );
-		const __m128 qx4 = _mm_fmsub_ps( sy4, leaf->e1z4, _mm_mul_ps( sz4, leaf->e1y4 ) );
-		const __m128 qy4 = _mm_fmsub_ps( sz4, leaf->e1x4, _mm_mul_ps( sx4, leaf->e1z4 ) );
-		const __m128 inv_det4 = fastrcp4( det4 );
-		const __m128 u4 = _mm_mul_ps( _mm_fmadd_ps( sz4, hz4, _mm_fmadd_ps( sx4, hx4, _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
-		const __m128 v4 = _mm_mul_ps( _mm_fmadd_ps( dz4, qz4, _mm_fmadd_ps( dx4, qx4, _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
-		const __m128 ta4 = _mm_mul_ps( _mm_fmadd_ps( leaf->e2z4, qz4, _mm_fmadd_ps( leaf->e2x4, qx4, _mm_mul_ps( leaf->e2y4, qy4 ) ) ), inv_det4 );
-		const __m128 mask1 = _mm_cmpge_ps( u4, _mm_setzero_ps() ), mask2 = _mm_cmpge_ps( v4, _mm_setzero_ps() );
-		const __m128 mask3 = _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 );
-		const __m128 mask4 = _mm_cmpgt_ps( ta4, _mm_setzero_ps() );
-		const __m128 mask5 = _mm_cmplt_ps( ta4, _mm256_extractf128_ps( t8, 0 ) );
-		const __m128 combined = _mm_and_ps( _mm_and_ps( _mm_and_ps( mask1, mask2 ), _mm_and_ps( mask3, mask4 ) ), mask5 );
+		BVH_STAT( stats.leafVisits++, stats.primTests += 4 ); // four lanes per leaf
+		if (customEnabled && (n & CUSTOM_BIT))
+		{
+			// custom geometry: the callback updates the hit record
+			const BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh8Data + (n & 0x1fffffff));
+			if (IntersectCustom4( ray, leaf, customIntersect4, customIntersect )) t8 = _mm256_set1_ps( ray.hit.t );
+			if (!stackPtr) break;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
+		__m128 combined, u4, v4, ta4;
+		const uint32_t* leafPrimIdx;
+		if (quadsEnabled && bvh_over_quads)
+		{
+			// four quads, each tested as two triangles
+			const BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh8Data + (n & 0x1fffffff));
+			combined = IntersectQuad4( leaf, ox4, oy4, oz4, dx4, dy4, dz4, _mm256_extractf128_ps( t8, 0 ), u4, v4, ta4 );
+			leafPrimIdx = leaf->primIdx;
+		}
+		else
+		{
+			// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
+			const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (n & 0x1fffffff));
+			combined = IntersectTri4FMA( leaf, ox4, oy4, oz4, dx4, dy4, dz4, _mm256_extractf128_ps( t8, 0 ), u4, v4, ta4 );
+			leafPrimIdx = leaf->primIdx;
+		}
 		if (_mm_movemask_ps( combined ))
 		{
-			const __m128 dist4 = _mm_blendv_ps( inf4, ta4, combined );
-			// compute broadcasted horizontal minimum of dist4
-			const __m128 a = _mm_min_ps( dist4, _mm_shuffle_ps( dist4, dist4, _MM_SHUFFLE( 2, 1, 0, 3 ) ) );
-			const __m128 c = _mm_min_ps( a, _mm_shuffle_ps( a, a, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
-			const uint32_t lane = __bfind( _mm_movemask_ps( _mm_cmpeq_ps( c, dist4 ) ) );
-			// update hit record
-			const __m128 _d4 = dist4;
-			const float t = ((float*)&_d4)[lane];
-			const __m128 _u4 = u4, _v4 = v4;
-			ray.hit.t = t, ray.hit.u = ((float*)&_u4)[lane], ray.hit.v = ((float*)&_v4)[lane];
-		#if INST_IDX_BITS == 32
-			ray.hit.prim = leaf->primIdx[lane], ray.hit.inst = ray.instIdx;
-		#else
-			ray.hit.prim = leaf->primIdx[lane] + ray.instIdx;
-		#endif
-			t8 = _mm256_set1_ps( t );
-			// compress stack
-			uint32_t outStackPtr = 0;
-			for (int32_t i = 0; i < stackPtr; i += 8)
-			{
-				__m256i node8 = _mm256_load_si256( (__m256i*)(nodeStack + i) );
-				__m256 dist8 = _mm256_load_ps( (float*)(distStack + i) );
-				const __m256i mask8 = _mm256_cmpgt_epi32( _mm256_castps_si256( dist8 ), _mm256_castps_si256( t8 ) );
-				const uint32_t mask = _mm256_movemask_ps( _mm256_castsi256_ps( mask8 ) );
-				const __m256i cpi = idxLUT256[mask];
-				dist8 = _mm256_permutevar8x32_ps( dist8, cpi ), node8 = _mm256_permutevar8x32_epi32( node8, cpi );
-				_mm256_storeu_ps( (float*)(distStack + outStackPtr), dist8 );
-				_mm256_storeu_si256( (__m256i*)(nodeStack + outStackPtr), node8 );
-				const int32_t numItems = tinybvh_min( 8, stackPtr - i ), validMask = (1 << numItems) - 1;
-				outStackPtr += __popc( (255 - mask) & validMask );
-			}
-			stackPtr = outStackPtr;
+			t8 = _mm256_set1_ps( UpdateHit4( ray, combined, u4, v4, ta4, leafPrimIdx ) );
+			stackPtr = CompressStack8( nodeStack, distStack, stackPtr, t8 );
 		}
 		if (!stackPtr) break;
 		nodeIdx = nodeStack[--stackPtr];
@@ -6542,6 +10766,152 @@ the_end:
 #endif
 }
 
+// Interleaved traversal: a single thread advances up to TRAVERSAL_INTERLEAVE rays
+// round-robin, one node or leaf per turn, and prefetches the next node of each ray
+// before moving on. The other rays execute while that data arrives, hiding much of
+// the memory latency of incoherent rays. Hits are identical to those of Intersect.
+void BVH8_CPU::IntersectInterleaved( Ray* rays, const uint32_t count ) const
+{
+	struct ALIGNED( 64 ) Lane
+	{
+		int32_t nodeStack[256];
+		float distStack[256];
+		__m256 rx8, ry8, rz8, rdx8, rdy8, rdz8, t8;
+		__m128 ox4, oy4, oz4, dx4, dy4, dz4;
+		__m128i signShift;
+		Ray* ray;
+		int32_t stackPtr, nodeIdx;
+	};
+	ALIGNED( 64 ) Lane lane[TRAVERSAL_INTERLEAVE];
+	uint32_t nextRay = 0;
+	BVH_STAT( TraversalStats& stats = TraversalStats::Local() );
+	const __m256 zero8 = _mm256_setzero_ps();
+	const auto start = [&]( Lane& l, Ray& ray )
+	{
+		VALIDATE_RAY( ray );
+		BVH_STAT( stats.traversals++ );
+		l.ray = &ray, l.stackPtr = l.nodeIdx = 0, l.t8 = _mm256_set1_ps( ray.hit.t );
+		l.rx8 = _mm256_set1_ps( ray.O.x * ray.rD.x ), l.rdx8 = _mm256_set1_ps( ray.rD.x );
+		l.ry8 = _mm256_set1_ps( ray.O.y * ray.rD.y ), l.rdy8 = _mm256_set1_ps( ray.rD.y );
+		l.rz8 = _mm256_set1_ps( ray.O.z * ray.rD.z ), l.rdz8 = _mm256_set1_ps( ray.rD.z );
+		l.ox4 = _mm_set1_ps( ray.O.x ), l.oy4 = _mm_set1_ps( ray.O.y ), l.oz4 = _mm_set1_ps( ray.O.z );
+		l.dx4 = _mm_set1_ps( ray.D.x ), l.dy4 = _mm_set1_ps( ray.D.y ), l.dz4 = _mm_set1_ps( ray.D.z );
+		l.signShift = _mm_cvtsi32_si128( (ray.D.x >= 0 ? 3 : 0) + (ray.D.y >= 0 ? 6 : 0) + (ray.D.z >= 0 ? 12 : 0) );
+	};
+	// advance a ray by one interior node or leaf; false when its traversal completed.
+	const auto nodeStep = [&]( Lane& l ) -> bool
+	{
+		// as in Intersect, but with the near / far planes sorted at run time.
+		const BVHNode* n = (BVHNode*)(bvh8Data + l.nodeIdx);
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 8 );
+		const __m256 x1 = _mm256_fmsub_ps( n->xmin8, l.rdx8, l.rx8 ), x2 = _mm256_fmsub_ps( n->xmax8, l.rdx8, l.rx8 );
+		const __m256 y1 = _mm256_fmsub_ps( n->ymin8, l.rdy8, l.ry8 ), y2 = _mm256_fmsub_ps( n->ymax8, l.rdy8, l.ry8 );
+		const __m256 z1 = _mm256_fmsub_ps( n->zmin8, l.rdz8, l.rz8 ), z2 = _mm256_fmsub_ps( n->zmax8, l.rdz8, l.rz8 );
+		const __m256 tx1 = _mm256_min_ps( x1, x2 ), ty1 = _mm256_min_ps( y1, y2 ), tz1 = _mm256_min_ps( z1, z2 );
+		const __m256 tx2 = _mm256_max_ps( x1, x2 ), ty2 = _mm256_max_ps( y1, y2 ), tz2 = _mm256_max_ps( z1, z2 );
+		__m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( zero8, tx1 ), ty1 ), tz1 );
+		const __m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( tx2, l.t8 ), ty2 ), tz2 );
+		const __m256i mask8 = _mm256_cmpgt_epi32( _mm256_castps_si256( tmin ), _mm256_castps_si256( tmax ) );
+		const uint32_t mask = _mm256_movemask_ps( _mm256_castsi256_ps( mask8 ) );
+		const uint32_t invalidNodes = __popc( mask );
+		if (invalidNodes == 7)
+		{
+			const uint32_t lane = __bfind( 255 - mask );
+			l.nodeIdx = ((uint32_t*)&n->child8)[lane];
+		}
+		else if (invalidNodes < 7)
+		{
+			const __m256i index = _mm256_srl_epi32( n->perm8, l.signShift );
+			const uint32_t m = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_permutevar8x32_epi32( mask8, index ) ) );
+			tmin = _mm256_permutevar8x32_ps( tmin, index );
+			const __m256i cpi = idxLUT256[m];
+			const __m256i c8 = _mm256_permutevar8x32_epi32( n->child8, index );
+			const __m256 dist8 = _mm256_permutevar8x32_ps( tmin, cpi );
+			const __m256i child8 = _mm256_permutevar8x32_epi32( c8, cpi );
+			_mm256_storeu_si256( (__m256i*)(l.nodeStack + l.stackPtr), child8 );
+			_mm256_storeu_ps( l.distStack + l.stackPtr, dist8 );
+			l.stackPtr += 7 - invalidNodes;
+			BVH_STAT( stats.Stack( l.stackPtr ) );
+			l.nodeIdx = l.nodeStack[l.stackPtr];
+		}
+		else
+		{
+			if (!l.stackPtr) return false;
+			l.nodeIdx = l.nodeStack[--l.stackPtr];
+		}
+		PrefetchEntry<4>( bvh8Data, l.nodeIdx, bvh_over_quads );
+		return true;
+	};
+	const auto leafStep = [&]( Lane& l ) -> bool
+	{
+		Ray& ray = *l.ray;
+		uint32_t n;
+		memcpy( &n, &l.nodeIdx, 4 );
+		BVH_STAT( stats.leafVisits++, stats.primTests += 4 ); // four lanes per leaf
+		if (customEnabled && (n & CUSTOM_BIT))
+		{
+			const BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh8Data + (n & 0x1fffffff));
+			if (IntersectCustom4( ray, leaf, customIntersect4, customIntersect )) l.t8 = _mm256_set1_ps( ray.hit.t );
+		}
+		else
+		{
+			__m128 combined, u4, v4, ta4;
+			const uint32_t* leafPrimIdx;
+			if (quadsEnabled && bvh_over_quads)
+			{
+				const BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh8Data + (n & 0x1fffffff));
+				combined = IntersectQuad4( leaf, l.ox4, l.oy4, l.oz4, l.dx4, l.dy4, l.dz4, _mm256_extractf128_ps( l.t8, 0 ), u4, v4, ta4 );
+				leafPrimIdx = leaf->primIdx;
+			}
+			else
+			{
+				const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (n & 0x1fffffff));
+				combined = IntersectTri4FMA( leaf, l.ox4, l.oy4, l.oz4, l.dx4, l.dy4, l.dz4, _mm256_extractf128_ps( l.t8, 0 ), u4, v4, ta4 );
+				leafPrimIdx = leaf->primIdx;
+			}
+			if (_mm_movemask_ps( combined ))
+			{
+				l.t8 = _mm256_set1_ps( UpdateHit4( ray, combined, u4, v4, ta4, leafPrimIdx ) );
+				l.stackPtr = CompressStack8( l.nodeStack, l.distStack, l.stackPtr, l.t8 );
+			}
+		}
+		if (!l.stackPtr) return false;
+		l.nodeIdx = l.nodeStack[--l.stackPtr];
+		PrefetchEntry<4>( bvh8Data, l.nodeIdx, bvh_over_quads );
+		return true;
+	};
+	// fill the lanes, then advance each ray by one step per round. Rays at interior
+	// nodes go first, then rays at leaves, which keeps the branches predictable.
+	uint32_t live = 0;
+	for (uint32_t i = 0; i < TRAVERSAL_INTERLEAVE; i++)
+		if (nextRay < count) start( lane[i], rays[nextRay++] ), live |= 1 << i; else lane[i].nodeIdx = 0;
+	while (live)
+	{
+		uint32_t leaves = 0, done = 0;
+		for (uint32_t i = 0; i < TRAVERSAL_INTERLEAVE; i++) leaves |= (((uint32_t)lane[i].nodeIdx >> 30) & 1) << i;
+		leaves &= live;
+		for (uint32_t m = live - leaves; m;)
+		{
+			const uint32_t i = __bfind( m );
+			m -= 1 << i;
+			if (!nodeStep( lane[i] )) done += 1 << i;
+		}
+		for (uint32_t m = leaves; m;)
+		{
+			const uint32_t i = __bfind( m );
+			m -= 1 << i;
+			if (!leafStep( lane[i] )) done += 1 << i;
+		}
+		while (done)
+		{
+			// a finished lane takes the next ray.
+			const uint32_t i = __bfind( done );
+			done -= 1 << i;
+			if (nextRay < count) start( lane[i], rays[nextRay++] ); else live -= 1 << i;
+		}
+	}
+}
+
 bool BVH8_CPU::IsOccluded( const Ray& ray ) const
 {
 	VALIDATE_RAY( ray );
@@ -6558,6 +10928,7 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 {
 	ALIGNED( 64 ) uint32_t nodeStack[256];
 	ALIGNED( 64 ) int32_t stackPtr = 0, nodeIdx = 0;
+	BVH_STATS_RAY;
 	const __m256 t8 = _mm256_set1_ps( ray.hit.t );
 	const __m256 rx8 = _mm256_set1_ps( ray.O.x * ray.rD.x ), rdx8 = _mm256_set1_ps( ray.rD.x );
 	const __m256 ry8 = _mm256_set1_ps( ray.O.y * ray.rD.y ), rdy8 = _mm256_set1_ps( ray.rD.y );
@@ -6571,6 +10942,7 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 		while (!(nodeIdx & LEAF_BIT))
 		{
 			const BVHNode* n = (BVHNode*)(bvh8Data + nodeIdx);
+			BVH_STAT( stats.interiorNodes++, stats.boxTests += 8 );
 			const __m256i c8 = n->child8;
 			const __m256 tx1 = _mm256_fmsub_ps( posX ? n->xmin8 : n->xmax8, rdx8, rx8 );
 			const __m256 ty1 = _mm256_fmsub_ps( posY ? n->ymin8 : n->ymax8, rdy8, ry8 );
@@ -6594,6 +10966,8 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 				const __m256i child8 = _mm256_permutevar8x32_epi32( c8, cpi );
 				_mm256_storeu_si256( (__m256i*)(nodeStack + stackPtr), child8 );
 				stackPtr += 7 - invalidNodes;
+				BVH_STAT( stats.Stack( stackPtr ) );
+				PrefetchStackTop<4>( bvh8Data, nodeStack + stackPtr, 7 - invalidNodes, bvh_over_quads );
 				nodeIdx = nodeStack[stackPtr];
 			}
 			else
@@ -6604,6 +10978,25 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 		}
 		uint32_t n;
 		memcpy( &n, &nodeIdx, 4 );
+		BVH_STAT( stats.leafVisits++, stats.primTests += 4 ); // four lanes per leaf
+		if (customEnabled && (n & CUSTOM_BIT))
+		{
+			const BVHCustom4Leaf* leaf = (BVHCustom4Leaf*)(bvh8Data + (n & 0x1fffffff));
+			if (Custom4Occludes( ray, leaf, customIsOccluded4, customIsOccluded )) return true;
+			if (!stackPtr) return false;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
+		if (quadsEnabled && bvh_over_quads)
+		{
+			// four quads, each tested as two triangles
+			__m128 u4, v4, ta4;
+			const BVHQuad4Leaf* leaf = (BVHQuad4Leaf*)(bvh8Data + (n & 0x1fffffff));
+			if (_mm_movemask_ps( IntersectQuad4( leaf, ox4, oy4, oz4, dx4, dy4, dz4, _mm256_extractf128_ps( t8, 0 ), u4, v4, ta4 ) )) return true;
+			if (!stackPtr) return false;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
 		// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
 		const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (n & 0x1fffffff));
 		const __m128 hx4 = _mm_fmsub_ps( dy4, leaf->e2z4, _mm_mul_ps( dz4, leaf->e2y4 ) );
@@ -6690,6 +11083,7 @@ void BVH::BuildNEON( const bvhvec4slice& vertices, const uint32_t* indices, cons
 }
 void BVH::PrepareNEONBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims )
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::PREPARE );
 	BVH_FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareNEONBuild( .. ), primCount == 0." );
 	BVH_FATAL_ERROR_IF( vertices.stride & 15, "BVH::PrepareNEONBuild( .. ), stride must be multiple of 16." );
 	// some constants
@@ -6751,7 +11145,7 @@ void BVH::PrepareNEONBuild( const bvhvec4slice& vertices, const uint32_t* indice
 		}
 	}
 	root.aabbMin = *(bvhvec3*)&rootMin, root.aabbMax = *(bvhvec3*)&rootMax;
-	bvh_over_indices = indices != nullptr;
+	bvh_over_indices = indices != nullptr, bvh_over_quads = false;
 }
 
 inline float32x4x2_t _mm256_set1_ps( float v )
@@ -6783,6 +11177,7 @@ inline float32x4x2_t _mm256_xor_ps( float32x4x2_t v0, float32x4x2_t v1 )
 
 void BVH::BuildNEON()
 {
+	tinybvh_phase_timer timer( context.buildStats, BuildStats::SUBDIVIDE );
 	// aligned data
 	ALIGNED( 64 ) float32x4x2_t binbox[3 * AVXBINS];            // 768 bytes
 	ALIGNED( 64 ) float32x4x2_t binboxOrig[3 * AVXBINS];        // 768 bytes
@@ -6802,7 +11197,7 @@ void BVH::BuildNEON()
 	FragSSE* frag4 = (FragSSE*)fragment;
 	float32x4x2_t* frag8 = (float32x4x2_t*)fragment;
 	// subdivide recursively
-	ALIGNED( 64 ) uint32_t task[128], taskCount = 0, nodeIdx = 0;
+	ALIGNED( 64 ) uint32_t task[128], taskCount = 0, taskPeak = 0, nodeIdx = 0;
 	BVHNode& root = bvhNode[0];
 	const bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-7f;
 	while (1)
@@ -6892,7 +11287,7 @@ void BVH::BuildNEON()
 			node.leftFirst = n++, node.triCount = 0, newNodePtr += 2;
 			*(float32x4x2_t*)&bvhNode[n] = _mm256_xor_ps( bestRBox, signFlip8 );
 			bvhNode[n].leftFirst = j, bvhNode[n].triCount = rightCount;
-			task[taskCount++] = n, nodeIdx = n - 1;
+			task[taskCount++] = n, nodeIdx = n - 1, taskPeak = tinybvh_max( taskPeak, taskCount );
 		}
 		// fetch subdivision task from stack
 		if (taskCount == 0) break; else nodeIdx = task[--taskCount];
@@ -6902,6 +11297,7 @@ void BVH::BuildNEON()
 	refittable = true; // not using spatial splits: can refit this BVH
 	may_have_holes = false; // the AVX builder produces a continuous list of nodes
 	usedNodes = newNodePtr;
+	tinybvh_count_build( context.buildStats, triCount, usedNodes, 0, taskPeak );
 }
 
 // Traverse the second alternative BVH layout (ALT_SOA).
@@ -6912,6 +11308,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 	const bvhvec4slice& verts = bvh.verts;
 	const uint32_t* primIdx = bvh.primIdx;
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	float cost = 0;
 	const float32x4_t Ox4 = vdupq_n_f32( ray.O.x ), rDx4 = vdupq_n_f32( ray.rD.x );
 	const float32x4_t Oy4 = vdupq_n_f32( ray.O.y ), rDy4 = vdupq_n_f32( ray.rD.y );
@@ -6922,6 +11319,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		cost += c_trav;
 		if (node->isLeaf())
 		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
 			for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
 			{
 				const uint32_t tidx = primIdx[node->firstTri + i], vertIdx = tidx * 3;
@@ -6954,6 +11352,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		y4 = vcombine_f32( vget_high_f32( t0 ), vget_high_f32( t2 ) );
 		z4 = vcombine_f32( vget_low_f32( t1 ), vget_low_f32( t3 ) );
 		uint32_t lidx = node->left, ridx = node->right;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
 		const float32x4_t min4 = vmaxq_f32( vmaxq_f32( vmaxq_f32( x4, y4 ), z4 ), vdupq_n_f32( 0 ) );
 		const float32x4_t max4 = vminq_f32( vminq_f32( vminq_f32( x4, y4 ), z4 ), vdupq_n_f32( ray.hit.t ) );
 		const float tmina_0 = vgetq_lane_f32( min4, 0 ), tmaxa_1 = vgetq_lane_f32( max4, 1 );
@@ -6973,6 +11372,7 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		{
 			node = bvhNode + lidx;
 			if (dist2 != BVH_FAR) stack[stackPtr++] = bvhNode + ridx;
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return (int32_t)cost;
@@ -6984,6 +11384,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 	const bvhvec4slice& verts = bvh.verts;
 	const uint32_t* primIdx = bvh.primIdx;
 	uint32_t stackPtr = 0;
+	BVH_STATS_RAY;
 	const float32x4_t Ox4 = vdupq_n_f32( ray.O.x ), rDx4 = vdupq_n_f32( ray.rD.x );
 	const float32x4_t Oy4 = vdupq_n_f32( ray.O.y ), rDy4 = vdupq_n_f32( ray.rD.y );
 	const float32x4_t Oz4 = vdupq_n_f32( ray.O.z ), rDz4 = vdupq_n_f32( ray.rD.z );
@@ -6991,6 +11392,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 	{
 		if (node->isLeaf())
 		{
+			BVH_STAT( stats.leafVisits++, stats.primTests += node->triCount );
 			for (uint32_t i = 0; i < node->triCount; i++)
 			{
 				const uint32_t tidx = primIdx[node->firstTri + i], vertIdx = tidx * 3;
@@ -7023,6 +11425,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 		y4 = vcombine_f32( vget_high_f32( t0 ), vget_high_f32( t2 ) );
 		z4 = vcombine_f32( vget_low_f32( t1 ), vget_low_f32( t3 ) );
 		uint32_t lidx = node->left, ridx = node->right;
+		BVH_STAT( stats.interiorNodes++, stats.boxTests += 2 );
 		const float32x4_t min4 = vmaxq_f32( vmaxq_f32( vmaxq_f32( x4, y4 ), z4 ), vdupq_n_f32( 0 ) );
 		const float32x4_t max4 = vminq_f32( vminq_f32( vminq_f32( x4, y4 ), z4 ), vdupq_n_f32( ray.hit.t ) );
 		const float tmina_0 = vgetq_lane_f32( min4, 0 ), tmaxa_1 = vgetq_lane_f32( max4, 1 );
@@ -7042,6 +11445,7 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 		{
 			node = bvhNode + lidx;
 			if (dist2 != BVH_FAR) stack[stackPtr++] = bvhNode + ridx;
+			BVH_STAT( stats.Stack( stackPtr ) );
 		}
 	}
 	return false;
@@ -7065,6 +11469,57 @@ BVH_Double::~BVH_Double()
 	AlignedFree( primIdx );
 }
 
+bool BVH_Double::Save( const char* fileName )
+{
+	BVH_FATAL_ERROR_IF( instList != 0, "BVH_Double::Save( .. ), can't save a TLAS." );
+	BVHFileHeader header = FileHeader();
+	header.triCount = triCount, header.idxCount = idxCount, header.nodeCount = usedNodes; // 64-bit counts
+	const FileSection section[2] = {
+		{ BVHFileSection::NODES, bvhNode, usedNodes * sizeof( BVHNode ) },
+		{ BVHFileSection::PRIM_INDICES, primIdx, idxCount * sizeof( uint64_t ) }
+	};
+	return WriteFile( fileName, header, section, 2 );
+}
+
+bool BVH_Double::Load( const char* fileName, const bvhdbl3* vertices, const uint64_t primCount )
+{
+	return LoadFile( fileName, 0, vertices, primCount );
+}
+
+bool BVH_Double::Load( const BVHMappedFile& file, const bvhdbl3* vertices, const uint64_t primCount )
+{
+	return LoadFile( 0, &file, vertices, primCount );
+}
+
+bool BVH_Double::LoadFile( const char* fileName, const BVHMappedFile* file, const bvhdbl3* vertices, const uint64_t primCount )
+{
+	BVHFileHeader header;
+	FileSection section[2] = { { BVHFileSection::NODES, 0, 0 }, { BVHFileSection::PRIM_INDICES, 0, 0 } };
+	if (!ReadFile( fileName, file, header, section, 2 )) return false;
+	if (header.triCount != primCount || section[0].size != header.nodeCount * sizeof( BVHNode ) ||
+		section[1].size != header.idxCount * sizeof( uint64_t ))
+	{
+		DiscardSections( file, section, 2 );
+		return false;
+	}
+	// all checks passed; safe to overwrite *this
+	AlignedFree( fragment );
+	AlignedFree( bvhNode );
+	AlignedFree( primIdx );
+	ApplyFileHeader( header );
+	triCount = header.triCount, idxCount = header.idxCount, usedNodes = header.nodeCount;
+	bvhNode = (BVHNode*)section[0].data;
+	primIdx = (uint64_t*)section[1].data;
+	fragment = 0, newNodePtr = usedNodes;
+	allocatedNodes = file ? 0 : usedNodes;
+	SetMappedFile( file, section, 2 );
+	if (file) rebuildable = refittable = false; // mapped data is read-only.
+	if (usedNodes) aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax; // header bounds are floats.
+	verts = (bvhdbl3*)vertices;
+	instList = 0, blasList = 0, blasCount = 0;
+	return true;
+}
+
 void BVH_Double::Build( void (*customGetAABB)(const uint64_t, bvhdbl3&, bvhdbl3&), const uint64_t primCount )
 {
 	BVH_FATAL_ERROR_IF( primCount == 0, "BVH_Double::Build( void (*customGetAABB)( .. ), instCount ), instCount == 0." );
@@ -7558,6 +12013,325 @@ void BLASInstance::InvertTransform()
 	for (int i = 0; i < 16; i++) invTransform[i] *= invdet;
 }
 
+// BVHScene
+// Scene file sections: TLAS nodes and indices, the instance array, a table with
+// one BVHFileSection record per BLAS (type: layout, offset and size of the
+// embedded file) and finally the embedded BLAS files themselves.
+uint32_t BVHScene::BLASSections( const BVHBase* blas, BVHFileHeader& header, BVHBase::FileSection* section )
+{
+	switch (blas->layout)
+	{
+	case BVHBase::LAYOUT_BVH: return ((const BVH*)blas)->FileSections( header, section );
+	case BVHBase::LAYOUT_BVH_SOA: return ((const BVH_SoA*)blas)->FileSections( header, section );
+	case BVHBase::LAYOUT_BVH4_CPU: return ((const BVH4_CPU*)blas)->FileSections( header, section );
+	case BVHBase::LAYOUT_BVH8_AVX2: return ((const BVH8_CPU*)blas)->FileSections( header, section );
+	default: return 0; // layout can't be used as a BLAS by TLAS traversal.
+	}
+}
+
+void BVHScene::DeleteBLAS( BVHBase* blas )
+{
+	// BVHBase has no virtual destructor; delete using the actual type.
+	switch (blas->layout)
+	{
+	case BVHBase::LAYOUT_BVH: delete (BVH*)blas; break;
+	case BVHBase::LAYOUT_BVH_SOA: delete (BVH_SoA*)blas; break;
+	case BVHBase::LAYOUT_BVH4_CPU: delete (BVH4_CPU*)blas; break;
+	case BVHBase::LAYOUT_BVH8_AVX2: delete (BVH8_CPU*)blas; break;
+	default: break;
+	}
+}
+
+bool BVHScene::Save( const char* fileName, const BVH& tlas )
+{
+	BVH_FATAL_ERROR_IF( tlas.instList == 0, "BVHScene::Save( .. ), not a TLAS." );
+	BVH_FATAL_ERROR_IF( tlas.blasList == 0, "BVHScene::Save( .. ), TLAS has no blasList." );
+	// determine the size of each embedded BLAS file.
+	const uint32_t blasCount = tlas.blasCount;
+	BVHFileSection* blasTable = (BVHFileSection*)malloc64( (blasCount + 1) * sizeof( BVHFileSection ) );
+	BVHFileHeader header;
+	BVHBase::FileSection section[TINY_BVH_FILE_SECTIONS];
+	BVHFileSection table[TINY_BVH_FILE_SECTIONS];
+	uint64_t dataSize = 0;
+	for (uint32_t i = 0; i < blasCount; i++)
+	{
+		const uint32_t count = BLASSections( tlas.blasList[i], header, section );
+		BVH_FATAL_ERROR_IF( count == 0, "BVHScene::Save( .. ), BLAS layout not supported by TLAS traversal." );
+		blasTable[i].type = tlas.blasList[i]->layout, blasTable[i].dummy = 0;
+		blasTable[i].offset = dataSize, blasTable[i].size = tinybvh_layout_sections( table, section, count );
+		dataSize = make_multiple_of( dataSize + blasTable[i].size, 64 );
+	}
+	// lay out the scene file; checksums are calculated once everything is written.
+	BVHFileHeader sceneHeader = tlas.FileHeader();
+	const BVHBase::FileSection sceneSection[5] = {
+		{ BVHFileSection::NODES, tlas.bvhNode, tlas.usedNodes * sizeof( BVH::BVHNode ) },
+		{ BVHFileSection::PRIM_INDICES, tlas.primIdx, tlas.idxCount * sizeof( uint32_t ) },
+		{ BVHFileSection::INSTANCES, tlas.instList, tlas.idxCount * sizeof( BLASInstance ) },
+		{ BVHFileSection::BLAS_TABLE, blasTable, blasCount * sizeof( BVHFileSection ) },
+		{ BVHFileSection::BLAS_DATA, 0, dataSize }
+	};
+	BVHFileSection sceneTable[5];
+	tinybvh_layout_sections( sceneTable, sceneSection, 5 );
+	for (uint32_t i = 0; i < blasCount; i++) blasTable[i].offset += sceneTable[4].offset;
+	sceneHeader.sectionCount = 5;
+	std::fstream s{ fileName, s.binary | s.out | s.trunc };
+	if (!s) { free64( blasTable ); return false; }
+	s.write( (char*)&sceneHeader, sizeof( BVHFileHeader ) );
+	s.write( (char*)sceneTable, 5 * sizeof( BVHFileSection ) );
+	uint64_t pos = sizeof( BVHFileHeader ) + 5 * sizeof( BVHFileSection );
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		tinybvh_write_padding( s, sceneTable[i].offset - pos );
+		s.write( (char*)sceneSection[i].data, sceneSection[i].size );
+		pos = sceneTable[i].offset + sceneSection[i].size;
+	}
+	// embed the BLASses, each as a complete BVH file in its own layout.
+	for (uint32_t i = 0; i < blasCount && s; i++)
+	{
+		const uint32_t count = BLASSections( tlas.blasList[i], header, section );
+		tinybvh_write_padding( s, blasTable[i].offset - pos );
+		tinybvh_write_sections( s, header, section, count );
+		pos = blasTable[i].offset + blasTable[i].size;
+	}
+	tinybvh_write_padding( s, sceneTable[4].offset + dataSize - pos );
+	free64( blasTable );
+	const bool ok = (bool)s;
+	s.close();
+	return ok && tinybvh_seal_file( fileName );
+}
+
+bool BVHScene::Load( const char* fileName, const BLASGeometry* geometry )
+{
+	Clear();
+	if (!file.Open( fileName )) return false;
+	// the TLAS uses the scene file directly; its header is the scene header.
+	BVHFileHeader header;
+	BVHBase::FileSection section[5] = {
+		{ BVHFileSection::NODES, 0, 0 }, { BVHFileSection::PRIM_INDICES, 0, 0 }, { BVHFileSection::INSTANCES, 0, 0 },
+		{ BVHFileSection::BLAS_TABLE, 0, 0 }, { BVHFileSection::BLAS_DATA, 0, 0 }
+	};
+	if (!tlas.ReadFile( 0, &file, header, section, 5 ) ||
+		section[0].size != header.nodeCount * sizeof( BVH::BVHNode ) || section[1].size != header.idxCount * sizeof( uint32_t ) ||
+		section[2].size != header.idxCount * sizeof( BLASInstance ) || section[3].size % sizeof( BVHFileSection ) != 0)
+	{
+		file.Close();
+		return false;
+	}
+	// recreate the BLASses from the embedded files.
+	const BVHFileSection* blasTable = (const BVHFileSection*)section[3].data;
+	const uint64_t dataStart = (const uint8_t*)section[4].data - file.data, dataEnd = dataStart + section[4].size;
+	blasCount = (uint32_t)(section[3].size / sizeof( BVHFileSection ));
+	if (blasCount == 0) { file.Close(); return false; }
+	blasList = (BVHBase**)context.malloc( blasCount * sizeof( BVHBase* ), context.userdata );
+	memset( blasList, 0, blasCount * sizeof( BVHBase* ) );
+	bool ok = true;
+	for (uint32_t i = 0; i < blasCount && ok; i++)
+	{
+		const BVHFileSection& entry = blasTable[i];
+		if (entry.offset < dataStart || entry.offset > dataEnd || entry.size > dataEnd - entry.offset ||
+			entry.size < sizeof( BVHFileHeader )) { ok = false; break; }
+		const BVHMappedFile blasFile( file, entry.offset, entry.size );
+		const BLASGeometry g = geometry ? geometry[i] : BLASGeometry{};
+		// layouts that store their own leaf data don't use the supplied geometry.
+		const uint32_t prims = (uint32_t)((const BVHFileHeader*)blasFile.data)->triCount;
+		switch (entry.type)
+		{
+		case BVHBase::LAYOUT_BVH: { BVH* b = new BVH( context ); blasList[i] = b; ok = b->Load( blasFile, g.vertices, g.indices, g.primCount ); break; }
+		case BVHBase::LAYOUT_BVH_SOA: { BVH_SoA* b = new BVH_SoA( context ); blasList[i] = b; ok = b->Load( blasFile, g.vertices, g.indices, g.primCount ); break; }
+		case BVHBase::LAYOUT_BVH4_CPU: { BVH4_CPU* b = new BVH4_CPU( context ); blasList[i] = b; ok = b->Load( blasFile, prims ); break; }
+		case BVHBase::LAYOUT_BVH8_AVX2: { BVH8_CPU* b = new BVH8_CPU( context ); blasList[i] = b; ok = b->Load( blasFile, prims ); break; }
+		default: ok = false; break;
+		}
+	}
+	if (!ok) { Clear(); return false; }
+	// copy the instances so they can be modified, and relink the TLAS.
+	instCount = (uint32_t)header.idxCount;
+	instances = (BLASInstance*)context.malloc( instCount * sizeof( BLASInstance ), context.userdata );
+	memcpy( instances, section[2].data, instCount * sizeof( BLASInstance ) );
+	tlas.ApplyFileHeader( header );
+	tlas.bvhNode = (BVH::BVHNode*)section[0].data;
+	tlas.primIdx = (uint32_t*)section[1].data;
+	tlas.allocatedNodes = 0, tlas.newNodePtr = tlas.usedNodes;
+	tlas.SetMappedFile( &file, section, 2 );
+	tlas.refittable = false; // mapped data is read-only; a TLAS Build reallocates.
+	tlas.instList = instances, tlas.blasList = blasList, tlas.blasCount = blasCount;
+	return true;
+}
+
+void BVHScene::Clear()
+{
+	for (uint32_t i = 0; i < blasCount; i++) if (blasList[i]) DeleteBLAS( blasList[i] );
+	if (blasList) context.free( blasList, context.userdata );
+	if (instances) context.free( instances, context.userdata );
+	blasList = 0, blasCount = 0, instances = 0, instCount = 0;
+	// the TLAS may have been rebuilt after loading; release its own buffers.
+	tlas.AlignedFree( tlas.bvhNode );
+	tlas.AlignedFree( tlas.primIdx );
+	tlas.AlignedFree( tlas.fragment );
+	tlas = BVH( context );
+	file.Close();
+}
+
+// BVHBuildCache
+// The index file starts with a small header, followed by one Entry per cached file.
+struct BVHBuildCacheIndex { uint32_t magic, entryCount; uint64_t useCounter; };
+#define TINY_BVH_CACHE_MAGIC	0x43564254 // 'TBVC'
+
+BVHBuildCache::BVHBuildCache( const char* dir, const uint64_t maxSize )
+{
+	maxBytes = maxSize;
+	snprintf( directory, sizeof( directory ), "%s", dir );
+	ReadIndex();
+}
+
+uint64_t BVHBuildCache::Key( const BVHBase& bvh, const Builder builder, const uint32_t optimizeIterations,
+	const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount ) const
+{
+	// everything that affects the outcome of a build goes into the key.
+	const uint32_t settings[10] = {
+		TINY_BVH_FILE_VERSION, TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16),
+		(uint32_t)bvh.layout, (uint32_t)builder, optimizeIterations, bvh.hqbvhbins,
+		(bvh.hqbvhoddeven ? 1u : 0u) + (bvh.l_quads ? 2u : 0u), vertices.count, indices ? primCount : 0, 0
+	};
+	const float costs[2] = { bvh.c_trav, bvh.c_int };
+	uint64_t hash = tinybvh_hash( settings, sizeof( settings ), 0 );
+	hash = tinybvh_hash( costs, sizeof( costs ), hash );
+	const uint32_t vertsPerPrim = builder == BUILD_QUADS ? 4 : 3;
+	return GeometryHash( vertices, indices, indices ? primCount * vertsPerPrim : 0, hash );
+}
+
+uint64_t BVHBuildCache::GeometryHash( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t indexCount, const uint64_t seed )
+{
+	uint64_t hash = seed;
+	for (uint32_t i = 0; i < vertices.count; i++) hash = tinybvh_hash( &vertices[i], sizeof( bvhvec3 ), hash ); // w is unused.
+	if (indices) hash = tinybvh_hash( indices, indexCount * sizeof( uint32_t ), hash );
+	return hash;
+}
+
+void BVHBuildCache::NoQuadBuilder()
+{
+	BVH_FATAL_ERROR( "BVHBuildCache::Build( .. ), BUILD_QUADS is not supported for this layout." );
+}
+
+bool BVHBuildCache::TagFile( const char* fileName, const uint64_t sourceHash )
+{
+	// store the geometry hash in the header of a freshly saved file.
+	std::fstream s{ fileName, s.binary | s.in | s.out };
+	BVHFileHeader header;
+	if (!s.read( (char*)&header, sizeof( BVHFileHeader ) )) return false;
+	header.sourceHash = sourceHash;
+	s.seekp( 0 );
+	s.write( (char*)&header, sizeof( BVHFileHeader ) );
+	if (!s) return false;
+	s.close();
+	return tinybvh_seal_file( fileName );
+}
+
+bool BVHBuildCache::FileMatches( const char* fileName, const uint64_t sourceHash )
+{
+	// the key identifies the file; the stored geometry hash guards against key collisions.
+	std::fstream s{ fileName, s.binary | s.in };
+	BVHFileHeader header;
+	if (!s.read( (char*)&header, sizeof( BVHFileHeader ) )) return false;
+	return header.magic == TINY_BVH_FILE_MAGIC && header.sourceHash == sourceHash;
+}
+
+void BVHBuildCache::FileName( const uint64_t key, char* fileName ) const
+{
+	snprintf( fileName, FILE_NAME_SIZE, "%s/%016llx.tbvh", directory, (unsigned long long)key );
+}
+
+bool BVHBuildCache::Lookup( const uint64_t key )
+{
+	for (uint32_t i = 0; i < entryCount; i++) if (entry[i].key == key)
+	{
+		entry[i].lastUse = ++useCounter, indexDirty = true;
+		return true;
+	}
+	return false;
+}
+
+void BVHBuildCache::Insert( const uint64_t key )
+{
+	char fileName[FILE_NAME_SIZE];
+	FileName( key, fileName );
+	std::fstream s{ fileName, s.binary | s.in | s.ate };
+	if (!s) return; // Save failed; nothing to cache.
+	const uint64_t size = (uint64_t)s.tellg();
+	uint32_t idx = 0;
+	while (idx < entryCount && entry[idx].key != key) idx++;
+	if (idx == entryCount)
+	{
+		if (entryCount == allocatedEntries)
+		{
+			allocatedEntries = allocatedEntries ? allocatedEntries * 2 : 64;
+			Entry* newEntry = (Entry*)malloc64( allocatedEntries * sizeof( Entry ) );
+			if (entryCount) memcpy( newEntry, entry, entryCount * sizeof( Entry ) );
+			free64( entry );
+			entry = newEntry;
+		}
+		entry[entryCount++].size = 0;
+	}
+	usedBytes += size - entry[idx].size;
+	entry[idx].key = key, entry[idx].size = size, entry[idx].lastUse = ++useCounter;
+	Evict();
+	WriteIndex();
+}
+
+void BVHBuildCache::Evict()
+{
+	// remove least recently used files until the cache fits; the newest file always stays.
+	while (usedBytes > maxBytes && entryCount > 1)
+	{
+		uint32_t lru = 0;
+		for (uint32_t i = 1; i < entryCount; i++) if (entry[i].lastUse < entry[lru].lastUse) lru = i;
+		char fileName[FILE_NAME_SIZE];
+		FileName( entry[lru].key, fileName );
+		remove( fileName );
+		usedBytes -= entry[lru].size;
+		entry[lru] = entry[--entryCount];
+	}
+}
+
+void BVHBuildCache::Clear()
+{
+	for (uint32_t i = 0; i < entryCount; i++)
+	{
+		char fileName[FILE_NAME_SIZE];
+		FileName( entry[i].key, fileName );
+		remove( fileName );
+	}
+	entryCount = 0, usedBytes = 0;
+	WriteIndex();
+}
+
+void BVHBuildCache::ReadIndex()
+{
+	char fileName[FILE_NAME_SIZE];
+	snprintf( fileName, sizeof( fileName ), "%s/index.tbvc", directory );
+	std::fstream s{ fileName, s.binary | s.in };
+	BVHBuildCacheIndex index;
+	if (!s.read( (char*)&index, sizeof( BVHBuildCacheIndex ) ) || index.magic != TINY_BVH_CACHE_MAGIC) return;
+	allocatedEntries = index.entryCount + 64;
+	entry = (Entry*)malloc64( allocatedEntries * sizeof( Entry ) );
+	s.read( (char*)entry, index.entryCount * sizeof( Entry ) );
+	if (!s) return; // damaged index: start over.
+	entryCount = index.entryCount, useCounter = index.useCounter;
+	for (uint32_t i = 0; i < entryCount; i++) usedBytes += entry[i].size;
+	if (usedBytes > maxBytes) Evict(), WriteIndex(); // limit may be lower than in a previous session.
+}
+
+void BVHBuildCache::WriteIndex()
+{
+	indexDirty = false;
+	char fileName[FILE_NAME_SIZE];
+	snprintf( fileName, sizeof( fileName ), "%s/index.tbvc", directory );
+	std::fstream s{ fileName, s.binary | s.out | s.trunc };
+	const BVHBuildCacheIndex index = { TINY_BVH_CACHE_MAGIC, entryCount, useCounter };
+	s.write( (char*)&index, sizeof( BVHBuildCacheIndex ) );
+	s.write( (char*)entry, entryCount * sizeof( Entry ) );
+}
+
 #ifdef DOUBLE_PRECISION_SUPPORT
 
 // Update
@@ -7685,6 +12459,34 @@ bool BVHBase::TriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint
 	return true;
 }
 
+// IntersectQuad
+// The quad is split along diagonal v1-v3; barycentrics of the second triangle
+// are mirrored so that (u,v) follow P(u,v) = v0 + u * (v1 - v0) + v * (v3 - v0).
+void BVHBase::IntersectQuad( Ray& ray, const uint32_t idx, const bvhvec4slice& verts, const uint32_t i0, const uint32_t i1, const uint32_t i2, const uint32_t i3 ) const
+{
+	const bvhvec3 p0 = verts[i0], p1 = verts[i1], p2 = verts[i2], p3 = verts[i3];
+	float tmax = ray.hit.t, qu = 0, qv = 0;
+	do { const bvhvec3 v0 = p0, e1 = p1 - p0, e2 = p3 - p0; MOLLER_TRUMBORE_TEST( tmax, break ); tmax = t, qu = u, qv = v; } while (0);
+	do { const bvhvec3 v0 = p2, e1 = p3 - p2, e2 = p1 - p2; MOLLER_TRUMBORE_TEST( tmax, break ); tmax = t, qu = 1 - u, qv = 1 - v; } while (0);
+	if (tmax == ray.hit.t) return;
+	// register a hit: ray is shortened to t
+	ray.hit.t = tmax, ray.hit.u = qu, ray.hit.v = qv;
+#if INST_IDX_BITS == 32
+	ray.hit.prim = idx, ray.hit.inst = ray.instIdx;
+#else
+	ray.hit.prim = idx + ray.instIdx;
+#endif
+}
+
+// QuadOccludes
+bool BVHBase::QuadOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t i0, const uint32_t i1, const uint32_t i2, const uint32_t i3 ) const
+{
+	const bvhvec3 p0 = verts[i0], p1 = verts[i1], p2 = verts[i2], p3 = verts[i3];
+	do { const bvhvec3 v0 = p0, e1 = p1 - p0, e2 = p3 - p0; MOLLER_TRUMBORE_TEST( ray.hit.t, break ); return true; } while (0);
+	do { const bvhvec3 v0 = p2, e1 = p3 - p2, e2 = p1 - p2; MOLLER_TRUMBORE_TEST( ray.hit.t, break ); return true; } while (0);
+	return false;
+}
+
 // PrecomputeTriangle (helper), transforms a triangle to the format used in:
 // Fast Ray-Triangle Intersections by Coordinate Transformation. Baldwin & Weber, 2016.
 void BVHBase::PrecomputeTriangle( const bvhvec4slice& vert, const uint32_t ti0, const uint32_t ti1, const uint32_t ti2, float* T )
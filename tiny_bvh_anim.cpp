@@ -27,8 +27,6 @@ int frameIdx = 0, verts = 0, bverts = 0;
 bvhvec4* triangles = 0;
 bvhvec4* bunny = 0;
 Sphere* spheres = 0;
-static std::atomic<int> tileIdx( 0 );
-static unsigned threadCount = std::thread::hardware_concurrency();
 
 // setup view pyramid for a pinhole camera
 static bvhvec3 eye( -15.24f, 21.5f, 2.54f ), p1, p2, p3;
@@ -131,67 +129,61 @@ bool UpdateCamera( float delta_time_s, fenster& f )
 	return moved > 0;
 }
 
-void TraceWorkerThread( uint32_t* buf, int threadIdx )
+void TraceTile( uint32_t* buf, int tile )
 {
-	const int xtiles = SCRWIDTH / TILESIZE, ytiles = SCRHEIGHT / TILESIZE;
-	const int tiles = xtiles * ytiles;
-	int tile = threadIdx;
-	while (tile < tiles)
+	const int xtiles = SCRWIDTH / TILESIZE;
+	const int tx = tile % xtiles, ty = tile / xtiles;
+	unsigned seed = (tile + 17) * 171717 + frameIdx * 1023;
+	const bvhvec3 L = tinybvh_normalize( bvhvec3( 1, 2, 3 ) );
+	for (int y = 0; y < TILESIZE; y++) for (int x = 0; x < TILESIZE; x++)
 	{
-		const int tx = tile % xtiles, ty = tile / xtiles;
-		unsigned seed = (tile + 17) * 171717 + frameIdx * 1023;
-		const bvhvec3 L = tinybvh_normalize( bvhvec3( 1, 2, 3 ) );
-		for (int y = 0; y < TILESIZE; y++) for (int x = 0; x < TILESIZE; x++)
+		const int pixel_x = tx * TILESIZE + x, pixel_y = ty * TILESIZE + y;
+		const int pixelIdx = pixel_x + pixel_y * SCRWIDTH;
+		// setup primary ray
+		const float u = (float)pixel_x / SCRWIDTH, v = (float)pixel_y / SCRHEIGHT;
+		const bvhvec3 D = tinybvh_normalize( p1 + u * (p2 - p1) + v * (p3 - p1) - eye );
+		Ray ray( eye, D );
+		tlas.Intersect( ray );
+		if (ray.hit.t < 10000)
 		{
-			const int pixel_x = tx * TILESIZE + x, pixel_y = ty * TILESIZE + y;
-			const int pixelIdx = pixel_x + pixel_y * SCRWIDTH;
-			// setup primary ray
-			const float u = (float)pixel_x / SCRWIDTH, v = (float)pixel_y / SCRHEIGHT;
-			const bvhvec3 D = tinybvh_normalize( p1 + u * (p2 - p1) + v * (p3 - p1) - eye );
-			Ray ray( eye, D );
-			tlas.Intersect( ray );
-			if (ray.hit.t < 10000)
+			uint32_t pixel_x = tx * 4 + x, pixel_y = ty * 4 + y;
+		#if INST_IDX_BITS == 32
+			// instance and primitive index are stored in separate fields
+			uint32_t primIdx = ray.hit.prim;
+			uint32_t instIdx = ray.hit.inst;
+		#else
+			// instance and primitive index are stored together for compactness
+			uint32_t primIdx = ray.hit.prim & PRIM_IDX_MASK;
+			uint32_t instIdx = (uint32_t)ray.hit.prim >> INST_IDX_SHFT;
+		#endif
+			BLASInstance& instance = inst[instIdx];
+			uint32_t blasIdx = instance.blasIdx;
+			bvhvec3 N;
+			bvhvec3 I = ray.O + ray.hit.t * ray.D;
+			if (blasIdx != 0)
 			{
-				uint32_t pixel_x = tx * 4 + x, pixel_y = ty * 4 + y;
-			#if INST_IDX_BITS == 32
-				// instance and primitive index are stored in separate fields
-				uint32_t primIdx = ray.hit.prim;
-				uint32_t instIdx = ray.hit.inst;
-			#else
-				// instance and primitive index are stored together for compactness
-				uint32_t primIdx = ray.hit.prim & PRIM_IDX_MASK;
-				uint32_t instIdx = (uint32_t)ray.hit.prim >> INST_IDX_SHFT;
-			#endif
-				BLASInstance& instance = inst[instIdx];
-				uint32_t blasIdx = instance.blasIdx;
-				bvhvec3 N;
-				bvhvec3 I = ray.O + ray.hit.t * ray.D;
-				if (blasIdx != 0)
-				{
-					// we hit the Sponza mesh, which consists of triangles
-					bvhvec3 v0 = triangles[primIdx * 3];
-					bvhvec3 v1 = triangles[primIdx * 3 + 1];
-					bvhvec3 v2 = triangles[primIdx * 3 + 2];
-					N = tinybvh_normalize( tinybvh_cross( v1 - v0, v2 - v0 ) );
-					if (tinybvh_dot( N, ray.D ) > 0) N = -N;
-				}
-				else
-				{
-					// we hit a sphere
-					bvhvec3 C = tinybvh_transform_point( spheres[primIdx].pos, instance.transform );
-					N = tinybvh_normalize( I - C );
-				}
-				// add a shadow
-				bvhvec3 L = bvhvec3( 20, 27, 3 ) - I;
-				const float d = tinybvh_length( L );
-				L *= 1.0f / d;
-				bool occluded = tlas.IsOccluded( Ray( I + L * 0.0001f, L, d ) );
-				// plot
-				int c = (int)((occluded ? 50.0f : 255.9f) * tinybvh_max( 0.0f, tinybvh_dot( N, L ) ));
-				buf[pixelIdx] = c + (c << 8) + (c << 16);
+				// we hit the Sponza mesh, which consists of triangles
+				bvhvec3 v0 = triangles[primIdx * 3];
+				bvhvec3 v1 = triangles[primIdx * 3 + 1];
+				bvhvec3 v2 = triangles[primIdx * 3 + 2];
+				N = tinybvh_normalize( tinybvh_cross( v1 - v0, v2 - v0 ) );
+				if (tinybvh_dot( N, ray.D ) > 0) N = -N;
 			}
+			else
+			{
+				// we hit a sphere
+				bvhvec3 C = tinybvh_transform_point( spheres[primIdx].pos, instance.transform );
+				N = tinybvh_normalize( I - C );
+			}
+			// add a shadow
+			bvhvec3 L = bvhvec3( 20, 27, 3 ) - I;
+			const float d = tinybvh_length( L );
+			L *= 1.0f / d;
+			bool occluded = tlas.IsOccluded( Ray( I + L * 0.0001f, L, d ) );
+			// plot
+			int c = (int)((occluded ? 50.0f : 255.9f) * tinybvh_max( 0.0f, tinybvh_dot( N, L ) ));
+			buf[pixelIdx] = c + (c << 8) + (c << 16);
 		}
-		tile = tileIdx++;
 	}
 }
 
@@ -204,15 +196,12 @@ void Tick( float delta_time_s, fenster& f, uint32_t* buf )
 	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++) buf[i] = 0xaaaaff;
 
 	// render tiles
-	tileIdx = threadCount;
-	std::vector<std::thread> threads;
+	const int tiles = (SCRWIDTH / TILESIZE) * (SCRHEIGHT / TILESIZE);
 #ifdef _DEBUG
-	TraceWorkerThread( buf, 0 );
+	for (int tile = 0; tile < tiles; tile++) TraceTile( buf, tile );
 #else
-	for (uint32_t i = 0; i < threadCount; i++)
-		threads.emplace_back( &TraceWorkerThread, buf, i );
+	JobSystem::Default().ParallelFor( tiles, 1, [&]( uint32_t tile ) { TraceTile( buf, tile ); } );
 #endif
-	for (auto& thread : threads) thread.join();
 
 	// print frame time / rate in window title
 	char title[50];
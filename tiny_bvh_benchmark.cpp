@@ -0,0 +1,872 @@
+// Benchmark harness for tiny_bvh.h, for regression tracking.
+// Unlike tiny_bvh_speedtest, scenes, builders and layouts are selected on the
+// command line. Every measurement is repeated and summarized as median, minimum
+// and the 95% confidence interval of the mean. Results can be written as text,
+// CSV or JSON, and compared against a CSV file written by an earlier run.
+//
+// Usage: tiny_bvh_benchmark [options]
+//   --scenes a,b       scenes in ./testdata, without '.bin' (default: cryteksponza)
+//   --builders a,b     default, quick, ref, sweep, avx, hq, rdh (default: default)
+//   --layouts a,b      bvh, gpu, soa, cpu4, cpu8, gpu4, cwbvh or all (default: bvh)
+//   --warmup n         unmeasured repetitions (default: 1)
+//   --reps n           measured repetitions (default: 5)
+//   --format f         text, csv or json (default: text)
+//   --out file         write results to a file instead of stdout
+//   --baseline file    CSV from an earlier run; flags regressions
+//   --tolerance pct    allowed regression in percent (default: 5)
+//   --threads a,b|max  thread scaling mode: build and trace with each thread count;
+//                      'max' runs 1, 2, 4, .. up to all hardware threads.
+//   --rays a,b         replay ray batch files (see RayBatch) in addition to the
+//                      generated rays; hits are validated if the file has them.
+//   --counters         hardware performance counters per ray and per primitive
+//                      (Linux only; not in thread scaling mode).
+//   --numa             thread scaling mode: pin threads to NUMA nodes, and trace
+//                      a per-node copy of the BVH (bvh, cpu4, cpu8, cwbvh).
+//   --hugepages        allocate BVH data with mallocHuge (2MB pages).
+// Exit code: 0 if all went well, 1 for invalid arguments or missing scenes,
+// 2 if a regression was found.
+
+#define TINYBVH_IMPLEMENTATION
+#include "tiny_bvh.h"
+#ifdef _MSC_VER
+#include "stdio.h"		// for printf
+#include "stdlib.h"		// for atoi
+#else
+#include <cstdio>
+#include <cstdlib>
+#endif
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace tinybvh;
+
+// 'screen resolution' for the primary rays; one ray per pixel.
+#define SCRWIDTH	640
+#define SCRHEIGHT	480
+
+struct Timer
+{
+	Timer() { reset(); }
+	float elapsed() const
+	{
+		auto t2 = std::chrono::high_resolution_clock::now();
+		return (float)std::chrono::duration_cast<std::chrono::duration<double>>(t2 - start).count();
+	}
+	void reset() { start = std::chrono::high_resolution_clock::now(); }
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+// Benchmark settings, from the command line.
+std::vector<std::string> scenes = { "cryteksponza" }, builders = { "default" }, layouts = { "bvh" };
+int warmup = 1, reps = 5;
+float tolerance = 5;
+std::string format = "text", outFile, baselineFile;
+std::vector<uint32_t> threadCounts; // empty: regular single-threaded benchmark.
+bool useCounters = false;
+bool useNUMA = false;
+bool useHugePages = false;
+
+// Summary of a series of measurements.
+struct Summary { double median = 0, min = 0, ci95 = 0; int count = 0; };
+
+Summary Summarize( std::vector<double> v )
+{
+	// median, minimum and 95% confidence interval of the mean (Student's t).
+	static const double t95[] = { 0, 12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36, 2.31, 2.26, 2.23 };
+	Summary s;
+	s.count = (int)v.size();
+	if (v.empty()) return s;
+	std::sort( v.begin(), v.end() );
+	const size_t n = v.size();
+	s.median = n & 1 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]), s.min = v[0];
+	if (n < 2) return s;
+	double mean = 0, var = 0;
+	for (double x : v) mean += x;
+	mean /= n;
+	for (double x : v) var += (x - mean) * (x - mean);
+	const double t = n - 1 <= 10 ? t95[n - 1] : (n - 1 <= 30 ? 2.09 : 1.96);
+	s.ci95 = t * sqrt( var / (n - 1) ) / sqrt( (double)n );
+	return s;
+}
+
+// One reported metric, for one scene / builder / layout combination.
+struct Result
+{
+	std::string scene, builder, layout, metric, unit;
+	uint32_t threads;
+	Summary value;
+	bool higherIsBetter, tracked = true; // untracked metrics are not compared to the baseline.
+	double baseline = -1, change = 0; // change in percent; positive is better.
+	bool regression = false;
+};
+std::vector<Result> results;
+
+void Report( const std::string& scene, const std::string& builder, const std::string& layout,
+	const char* metric, const char* unit, const std::vector<double>& samples, bool higherIsBetter, uint32_t threads = 1 )
+{
+	// construct the strings in place; assigning C strings to default-constructed
+	// members trips a false -Wrestrict in GCC 12.
+	const Result r = { scene, builder, layout, metric, unit, threads, Summarize( samples ), higherIsBetter };
+	results.push_back( r );
+}
+
+// Hardware performance counters, using perf_event_open on Linux. Each event is
+// opened separately for the calling thread, user space only. When there are
+// more events than hardware counters, the kernel multiplexes them; counts are
+// scaled by the fraction of time each event was active.
+// There is no generic L2 miss event: 'l2miss' counts last-level cache
+// references, which are the L2 misses on most x86 CPUs.
+#define COUNTERS 8
+static const char* counterName[COUNTERS] = { "cycles", "instr", "l1miss", "l2miss", "llcmiss", "brmiss", "tlbmiss", "ipc" };
+
+struct Counters
+{
+	int fd[COUNTERS - 1] = { -1, -1, -1, -1, -1, -1, -1 };
+	double total[COUNTERS - 1] = {};
+	bool Open()
+	{
+		// returns false if no event could be opened.
+		bool any = false;
+	#ifdef __linux__
+		const uint64_t cache = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		const uint32_t type[COUNTERS - 1] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+		const uint64_t config[COUNTERS - 1] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_L1D | cache, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_DTLB | cache };
+		for (int i = 0; i < COUNTERS - 1; i++)
+		{
+			perf_event_attr attr;
+			memset( &attr, 0, sizeof( attr ) );
+			attr.size = sizeof( attr ), attr.type = type[i], attr.config = config[i];
+			attr.disabled = 1, attr.exclude_kernel = 1, attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			fd[i] = (int)syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+			any |= fd[i] >= 0;
+		}
+	#endif
+		return any;
+	}
+	void Close()
+	{
+	#ifdef __linux__
+		for (int i = 0; i < COUNTERS - 1; i++) if (fd[i] >= 0) close( fd[i] ), fd[i] = -1;
+	#endif
+	}
+	void Start()
+	{
+	#ifdef __linux__
+		for (int i = 0; i < COUNTERS - 1; i++) if (fd[i] >= 0)
+			ioctl( fd[i], PERF_EVENT_IOC_RESET, 0 ), ioctl( fd[i], PERF_EVENT_IOC_ENABLE, 0 );
+	#endif
+	}
+	void Stop()
+	{
+		// disable the events and add their (scaled) counts to the totals.
+	#ifdef __linux__
+		for (int i = 0; i < COUNTERS - 1; i++) if (fd[i] >= 0) ioctl( fd[i], PERF_EVENT_IOC_DISABLE, 0 );
+		for (int i = 0; i < COUNTERS - 1; i++) if (fd[i] >= 0)
+		{
+			uint64_t v[3] = {}; // value, time enabled, time running
+			if (read( fd[i], v, sizeof( v ) ) == sizeof( v ) && v[2] > 0) total[i] += (double)v[0] * v[1] / v[2];
+		}
+	#endif
+	}
+	void Clear() { for (int i = 0; i < COUNTERS - 1; i++) total[i] = 0; }
+};
+Counters counters;
+
+void ReportCounters( const std::string& scene, const std::string& builder, const std::string& layout,
+	const std::string& phase, const char* unit, const double count )
+{
+	// counter totals of a phase, per ray or per primitive; plus instructions per cycle.
+	for (int i = 0; i < COUNTERS; i++)
+	{
+		const bool ipc = i == COUNTERS - 1;
+		if (ipc ? counters.fd[0] < 0 || counters.fd[1] < 0 || counters.total[0] == 0 : counters.fd[i] < 0) continue;
+		const double value = ipc ? counters.total[1] / counters.total[0] : counters.total[i] / count;
+		Report( scene, builder, layout, (phase + "_" + counterName[i]).c_str(), ipc ? "" : unit, { value }, ipc );
+		results.back().tracked = false;
+	}
+	counters.Clear();
+}
+
+// Scene data and ray sets.
+bvhvec4* triangles = 0;
+uint32_t triCount = 0;
+std::vector<Ray> primaryRays, shadowRays, diffuseRays;
+std::vector<Ray> sampleRays; // for the 'rdh' builder: every 8th primary and diffuse ray.
+
+// Layouts: each is built from a BVH made by the selected builder, the same way
+// the layout's own Build method does it.
+bool BuildBVH( BVH& bvh, const std::string& builder, const bvhvec4slice& tris )
+{
+	bvh.useFullSweep = builder == "sweep";
+	if (builder == "default") // same choice as BVH::BuildDefault.
+	{
+	#if defined BVH_USEAVX
+		bvh.BuildAVX( tris );
+	#elif defined BVH_USENEON
+		bvh.BuildNEON( tris );
+	#else
+		bvh.Build( tris );
+	#endif
+	}
+	else if (builder == "quick") bvh.BuildQuick( tris );
+	else if (builder == "ref" || builder == "sweep") bvh.Build( tris );
+	else if (builder == "hq") bvh.BuildHQ( tris );
+	else if (builder == "rdh") // reference build, refined for the sampled rays; compare with 'ref'.
+	{
+		bvh.Build( tris );
+		bvh.OptimizeRDH( sampleRays.data(), (uint32_t)sampleRays.size() );
+		bvh.ResetRayStats();
+	}
+#ifdef BVH_USEAVX
+	else if (builder == "avx") bvh.BuildAVX( tris );
+#endif
+	else return false;
+	return true;
+}
+bool Build( BVH& b, const std::string& builder, const bvhvec4slice& tris ) { return BuildBVH( b, builder, tris ); }
+bool Build( BVH_GPU& b, const std::string& builder, const bvhvec4slice& tris )
+{
+	b.bvh.context = b.context;
+	if (!BuildBVH( b.bvh, builder, tris )) return false;
+	b.ConvertFrom( b.bvh, false );
+	return true;
+}
+bool Build( BVH4_GPU& b, const std::string& builder, const bvhvec4slice& tris )
+{
+	b.bvh4.bvh.context = b.bvh4.context = b.context;
+	if (!BuildBVH( b.bvh4.bvh, builder, tris )) return false;
+	b.bvh4.ConvertFrom( b.bvh4.bvh, true );
+	b.ConvertFrom( b.bvh4, true );
+	return true;
+}
+#ifdef BVH_USEAVX
+bool Build( BVH_SoA& b, const std::string& builder, const bvhvec4slice& tris )
+{
+	b.bvh.context = b.context;
+	if (!BuildBVH( b.bvh, builder, tris )) return false;
+	b.ConvertFrom( b.bvh, false );
+	return true;
+}
+bool Build( BVH8_CWBVH& b, const std::string& builder, const bvhvec4slice& tris )
+{
+	b.bvh8.bvh.context = b.bvh8.context = b.context;
+	if (!BuildBVH( b.bvh8.bvh, builder, tris )) return false;
+	b.bvh8.bvh.SplitLeafs( 3 );
+	b.bvh8.ConvertFrom( b.bvh8.bvh, true );
+	b.ConvertFrom( b.bvh8, true );
+	return true;
+}
+#endif
+#ifdef BVH_USESSE
+bool Build( BVH4_CPU& b, const std::string& builder, const bvhvec4slice& tris )
+{
+	b.bvh4.bvh.context = b.bvh4.context = b.context;
+	if (!BuildBVH( b.bvh4.bvh, builder, tris )) return false;
+	b.ConvertFrom( b.bvh4 );
+	return true;
+}
+#endif
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+bool Build( BVH8_CPU& b, const std::string& builder, const bvhvec4slice& tris )
+{
+	b.bvh8.bvh.context = b.bvh8.context = b.context;
+	if (!BuildBVH( b.bvh8.bvh, builder, tris )) return false;
+	b.ConvertFrom( b.bvh8 );
+	return true;
+}
+#endif
+
+// Per-node copies for --numa, for the layouts that have CloneFrom.
+template <class T> NUMAReplicas<T>* Replicate( const T& ) { return 0; }
+NUMAReplicas<BVH>* Replicate( const BVH& b ) { return new NUMAReplicas<BVH>( b ); }
+NUMAReplicas<BVH4_CPU>* Replicate( const BVH4_CPU& b ) { return new NUMAReplicas<BVH4_CPU>( b ); }
+NUMAReplicas<BVH8_CPU>* Replicate( const BVH8_CPU& b ) { return new NUMAReplicas<BVH8_CPU>( b ); }
+NUMAReplicas<BVH8_CWBVH>* Replicate( const BVH8_CWBVH& b ) { return new NUMAReplicas<BVH8_CWBVH>( b ); }
+
+// Interleaved multi-ray traversal, for the layouts that have it.
+template <class T> bool IntersectInterleaved( const T&, Ray*, const uint32_t ) { return false; }
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+bool IntersectInterleaved( const BVH8_CPU& b, Ray* rays, const uint32_t count ) { b.IntersectInterleaved( rays, count ); return true; }
+#endif
+
+// Stackless or short-stack traversal, for the layouts that have it.
+template <class T> bool IntersectStackless( const T&, Ray& ) { return false; }
+bool IntersectStackless( const BVH_GPU& b, Ray& ray ) { b.IntersectStackless( ray ); return true; }
+#ifdef BVH_USEAVX
+bool IntersectStackless( const BVH8_CWBVH& b, Ray& ray ) { b.IntersectShortStack( ray ); return true; }
+#endif
+
+struct Layout
+{
+	virtual ~Layout() {}
+	BuildStats stats; // build phase timings, collected by all builds of this layout.
+	virtual bool Build( const std::string& builder, const bvhvec4slice& tris ) = 0;
+	virtual int32_t Intersect( Ray& ray ) const = 0;
+	virtual bool IsOccluded( const Ray& ray ) const = 0;
+	virtual BVHQuality Analyze() const = 0;
+	// Traversal of the copy on a NUMA node, after Replicate; the original if there is none.
+	virtual void Replicate() = 0;
+	virtual int32_t Intersect( Ray& ray, const uint32_t node ) const = 0;
+	virtual bool IsOccluded( const Ray& ray, const uint32_t node ) const = 0;
+	// Returns false if the layout has no interleaved traversal.
+	virtual bool IntersectInterleaved( Ray* rays, const uint32_t count ) const = 0;
+	// Returns false if the layout has no stackless or short-stack traversal.
+	virtual bool IntersectStackless( Ray& ray ) const = 0;
+	// Build on a job system with parallelBuild set; 0 for serial builds.
+	virtual void UseJobs( JobSystem* jobs ) = 0;
+};
+
+template <class T> struct LayoutOf : public Layout
+{
+	T bvh;
+	NUMAReplicas<T>* replicas = 0;
+	LayoutOf()
+	{
+		bvh.context.buildStats = &stats;
+		if (useHugePages) bvh.context.malloc = mallocHuge, bvh.context.free = freeHuge;
+	}
+	~LayoutOf() { delete replicas; }
+	bool Build( const std::string& builder, const bvhvec4slice& tris ) { return ::Build( bvh, builder, tris ); }
+	int32_t Intersect( Ray& ray ) const { return bvh.Intersect( ray ); }
+	bool IsOccluded( const Ray& ray ) const { return bvh.IsOccluded( ray ); }
+	BVHQuality Analyze() const { return bvh.Analyze( false ); }
+	void Replicate() { delete replicas, replicas = ::Replicate( bvh ); }
+	const T& On( const uint32_t node ) const { return replicas ? (*replicas)[node] : bvh; }
+	int32_t Intersect( Ray& ray, const uint32_t node ) const { return On( node ).Intersect( ray ); }
+	bool IsOccluded( const Ray& ray, const uint32_t node ) const { return On( node ).IsOccluded( ray ); }
+	bool IntersectInterleaved( Ray* rays, const uint32_t count ) const { return ::IntersectInterleaved( bvh, rays, count ); }
+	bool IntersectStackless( Ray& ray ) const { return ::IntersectStackless( bvh, ray ); }
+	void UseJobs( JobSystem* jobs ) { bvh.context.parallelBuild = jobs != 0, bvh.context.jobUserdata = jobs; }
+};
+
+Layout* CreateLayout( const std::string& name )
+{
+	// returns 0 for unknown layouts and layouts that are not available on this CPU.
+	if (name == "bvh") return new LayoutOf<BVH>();
+	if (name == "gpu") return new LayoutOf<BVH_GPU>();
+	if (name == "gpu4") return new LayoutOf<BVH4_GPU>();
+#ifdef BVH_USEAVX
+	if (name == "soa") return new LayoutOf<BVH_SoA>();
+	if (name == "cwbvh") return new LayoutOf<BVH8_CWBVH>();
+#endif
+#ifdef BVH_USESSE
+	if (name == "cpu4") return new LayoutOf<BVH4_CPU>();
+#endif
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+	if (name == "cpu8") return new LayoutOf<BVH8_CPU>();
+#endif
+	return 0;
+}
+
+
+// Replayed ray batches, from --rays. Metrics are named after the file.
+struct Replay { std::string name; RayBatch batch; std::vector<Ray> rays; };
+std::vector<std::string> rayFiles;
+std::vector<Replay*> replays;
+
+bool LoadReplays()
+{
+	for (const std::string& file : rayFiles)
+	{
+		Replay* replay = new Replay();
+		replays.push_back( replay );
+		if (!replay->batch.Load( file.c_str() )) { fprintf( stderr, "can't load ray batch '%s'.\n", file.c_str() ); return false; }
+		const size_t slash = file.find_last_of( "/\\" ), start = slash == std::string::npos ? 0 : slash + 1;
+		replay->name = file.substr( start, file.rfind( '.' ) > start ? file.rfind( '.' ) - start : std::string::npos );
+		for (uint32_t i = 0; i < replay->batch.count; i++) replay->rays.push_back( replay->batch.GetRay( i ) );
+		fprintf( stderr, "%s: %i %srays%s\n", replay->name.c_str(), replay->batch.count, replay->batch.occlusion ? "occlusion " : "", replay->batch.hit ? " with hits" : "" );
+	}
+	return true;
+}
+
+bool LoadScene( const std::string& name )
+{
+	// raw triangle data: a 32-bit triangle count, followed by 3 x 16 bytes per triangle.
+	std::fstream s{ "./testdata/" + name + ".bin", s.binary | s.in };
+	if (!s) return false;
+	uint32_t count = 0;
+	s.read( (char*)&count, 4 );
+	tinybvh::free64( triangles );
+	triangles = (bvhvec4*)tinybvh::malloc64( count * 3 * sizeof( bvhvec4 ) );
+	s.read( (char*)triangles, count * 3 * sizeof( bvhvec4 ) );
+	triCount = s ? count : 0;
+	return triCount > 0;
+}
+
+float uniform_rand( uint32_t& seed )
+{
+	seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5;
+	return (float)(seed >> 8) * (1.0f / 16777216.0f);
+}
+
+void GenerateRays( const std::string& scene )
+{
+	// primary rays in 4x4 pixel tiles; shadow rays from the primary hits to a
+	// point light; diffuse rays: a cosine-weighted bounce from the primary hits.
+	BVH ref;
+	BuildBVH( ref, "default", bvhvec4slice( triangles, triCount * 3, sizeof( bvhvec4 ) ) );
+	const bvhvec3 bmin = ref.aabbMin, bmax = ref.aabbMax, C = (bmin + bmax) * 0.5f, E = bmax - bmin;
+	const float diag = tinybvh_length( E ), eps = diag * 1e-5f;
+	bvhvec3 eye, view;
+	if (scene == "cryteksponza") // same view as tiny_bvh_speedtest.
+		eye = bvhvec3( -15.24f, 21.5f, 2.54f ), view = tinybvh_normalize( bvhvec3( 0.826f, -0.438f, -0.356f ) );
+	else
+		eye = C + 1.2f * diag * tinybvh_normalize( bvhvec3( -1, 0.6f, 1.4f ) ), view = tinybvh_normalize( C - eye );
+	const bvhvec3 light = C + bvhvec3( 0.1f * E.x, 0.45f * E.y, 0.1f * E.z );
+	const bvhvec3 right = tinybvh_normalize( tinybvh_cross( bvhvec3( 0, 1, 0 ), view ) );
+	const bvhvec3 up = 0.8f * tinybvh_cross( view, right ), P = eye + 2 * view;
+	const bvhvec3 p1 = P - right + up, p2 = P + right + up, p3 = P - right - up;
+	primaryRays.clear(), shadowRays.clear(), diffuseRays.clear(), sampleRays.clear();
+	uint32_t seed = 0x12345678;
+	for (int ty = 0; ty < SCRHEIGHT / 4; ty++) for (int tx = 0; tx < SCRWIDTH / 4; tx++)
+		for (int y = 0; y < 4; y++) for (int x = 0; x < 4; x++)
+		{
+			const float u = (tx * 4 + x + 0.5f) / SCRWIDTH, v = (ty * 4 + y + 0.5f) / SCRHEIGHT;
+			Ray ray( eye, tinybvh_normalize( p1 + u * (p2 - p1) + v * (p3 - p1) - eye ) );
+			primaryRays.push_back( ray );
+			ref.Intersect( ray );
+			if (ray.hit.t >= BVH_FAR) continue;
+			const uint32_t prim = ray.hit.prim;
+			const bvhvec3 v0 = triangles[prim * 3], v1 = triangles[prim * 3 + 1], v2 = triangles[prim * 3 + 2];
+			bvhvec3 N = tinybvh_normalize( tinybvh_cross( v1 - v0, v2 - v0 ) );
+			if (tinybvh_dot( N, ray.D ) > 0) N *= -1.0f;
+			const bvhvec3 I = ray.O + ray.hit.t * ray.D + eps * N, L = light - I;
+			const float dist = tinybvh_length( L );
+			shadowRays.push_back( Ray( I, L * (1.0f / dist), dist ) );
+			const float r1 = uniform_rand( seed ), r2 = uniform_rand( seed ) * 6.2831853f, sr1 = sqrtf( r1 );
+			const bvhvec3 T = tinybvh_normalize( tinybvh_cross( fabs( N.x ) > 0.9f ? bvhvec3( 0, 1, 0 ) : bvhvec3( 1, 0, 0 ), N ) );
+			const bvhvec3 B = tinybvh_cross( N, T );
+			diffuseRays.push_back( Ray( I, tinybvh_normalize( sqrtf( 1 - r1 ) * N + sr1 * cosf( r2 ) * T + sr1 * sinf( r2 ) * B ) ) );
+		}
+	for (size_t i = 0; i < primaryRays.size(); i += 8) sampleRays.push_back( primaryRays[i] );
+	for (size_t i = 0; i < diffuseRays.size(); i += 8) sampleRays.push_back( diffuseRays[i] );
+}
+
+enum Traversal { SINGLE, INTERLEAVED, STACKLESS };
+std::vector<double> TraceRays( const Layout& layout, const std::vector<Ray>& rays, bool shadow, Traversal traversal = SINGLE )
+{
+	// MRays/s for each measured repetition.
+	std::vector<Ray> batch( rays );
+	std::vector<double> samples;
+	for (int pass = 0; pass < warmup + reps; pass++)
+	{
+		for (size_t i = 0; i < batch.size(); i++) batch[i].hit.t = rays[i].hit.t;
+		if (useCounters && pass >= warmup) counters.Start();
+		Timer t;
+		uint32_t dummy = 0;
+		if (shadow) for (Ray& ray : batch) dummy += layout.IsOccluded( ray ) ? 1 : 0;
+		else if (traversal == INTERLEAVED) layout.IntersectInterleaved( batch.data(), (uint32_t)batch.size() );
+		else if (traversal == STACKLESS) for (Ray& ray : batch) layout.IntersectStackless( ray );
+		else for (Ray& ray : batch) dummy += layout.Intersect( ray );
+		const double time = t.elapsed();
+		if (useCounters && pass >= warmup) counters.Stop();
+		if (pass >= warmup) samples.push_back( (double)batch.size() / time * 1e-6 + dummy * 1e-30 );
+	}
+	return samples;
+}
+
+void RunBenchmark( const std::string& scene, const std::string& builder, const std::string& name )
+{
+	Layout* layout = CreateLayout( name );
+	if (!layout) { fprintf( stderr, "layout '%s' is not available; skipped.\n", name.c_str() ); return; }
+	const bvhvec4slice tris( triangles, triCount * 3, sizeof( bvhvec4 ) );
+	std::vector<double> buildTimes, phaseTimes[BuildStats::PHASE_COUNT];
+	for (int pass = 0; pass < warmup + reps; pass++)
+	{
+		layout->stats.Reset();
+		if (useCounters && pass >= warmup) counters.Start();
+		Timer t;
+		if (!layout->Build( builder, tris ))
+		{
+			fprintf( stderr, "builder '%s' is not available; skipped.\n", builder.c_str() );
+			delete layout;
+			return;
+		}
+		if (pass >= warmup) buildTimes.push_back( t.elapsed() * 1000.0 );
+		if (pass >= warmup) for (uint32_t i = 0; i < BuildStats::PHASE_COUNT; i++) phaseTimes[i].push_back( layout->stats.ms[i] );
+		if (useCounters && pass >= warmup) counters.Stop();
+	}
+	const BVHQuality q = layout->Analyze();
+	Report( scene, builder, name, "build", "ms", buildTimes, false );
+	for (uint32_t i = 0; i < BuildStats::PHASE_COUNT; i++) if (layout->stats.ms[i] > 0)
+	{
+		// phase breakdown of the build; informational.
+		Report( scene, builder, name, (std::string( "build_" ) + BuildStats::PhaseName( (BuildStats::Phase)i )).c_str(), "ms", phaseTimes[i], false );
+		results.back().tracked = false;
+	}
+	Report( scene, builder, name, "fragments", "", { (double)layout->stats.splitFragments }, false );
+	Report( scene, builder, name, "task_peak", "", { (double)layout->stats.taskStackPeak }, false );
+	results.back().tracked = results[results.size() - 2].tracked = false;
+	Report( scene, builder, name, "sah", "", { (double)q.sah }, false );
+	Report( scene, builder, name, "memory", "bytes", { (double)q.bytes }, false );
+	if (useCounters) ReportCounters( scene, builder, name, "build", "/prim", (double)triCount * reps );
+	const char* phases[3] = { "primary", "shadow", "diffuse" };
+	const std::vector<Ray>* rays[3] = { &primaryRays, &shadowRays, &diffuseRays };
+	for (int i = 0; i < 3; i++)
+	{
+		Report( scene, builder, name, phases[i], "MRays/s", TraceRays( *layout, *rays[i], i == 1 ), true );
+		if (useCounters) ReportCounters( scene, builder, name, phases[i], "/ray", (double)rays[i]->size() * reps );
+	}
+	// traversal cost per primary and diffuse ray as returned by Intersect; what the 'rdh' builder minimizes.
+	double cost = 0;
+	for (int i = 0; i < 3; i += 2) for (Ray ray : *rays[i]) cost += layout->Intersect( ray );
+	Report( scene, builder, name, "cost", "/ray", { cost / (double)(primaryRays.size() + diffuseRays.size()) }, false );
+	for (int v = 0; v < 4; v++)
+	{
+		// interleaved and stackless traversal of the primary and diffuse rays; hits must match Intersect.
+		const int i = (v & 1) * 2;
+		const Traversal traversal = v < 2 ? INTERLEAVED : STACKLESS;
+		std::vector<Ray> batch( *rays[i] );
+		if (traversal == INTERLEAVED && !layout->IntersectInterleaved( batch.data(), (uint32_t)batch.size() )) continue;
+		if (traversal == STACKLESS && !layout->IntersectStackless( batch[0] )) continue;
+		if (traversal == STACKLESS) for (size_t j = 1; j < batch.size(); j++) layout->IntersectStackless( batch[j] );
+		const std::string phase = std::string( phases[i] ) + (traversal == INTERLEAVED ? "_il" : "_sl");
+		Report( scene, builder, name, phase.c_str(), "MRays/s", TraceRays( *layout, *rays[i], false, traversal ), true );
+		if (useCounters) ReportCounters( scene, builder, name, phase, "/ray", (double)rays[i]->size() * reps );
+		uint32_t mismatches = 0;
+		for (size_t j = 0; j < batch.size(); j++)
+		{
+			Ray ray = (*rays[i])[j];
+			layout->Intersect( ray );
+			mismatches += memcmp( &ray.hit, &batch[j].hit, sizeof( ray.hit ) ) ? 1 : 0;
+		}
+		if (mismatches) fprintf( stderr, "%s: %i of %i hits differ from Intersect.\n", phase.c_str(), mismatches, (int)batch.size() );
+		Report( scene, builder, name, (phase + "_mismatches").c_str(), "", { (double)mismatches }, false );
+		results.back().tracked = false;
+	}
+	for (const Replay* replay : replays)
+	{
+		Report( scene, builder, name, replay->name.c_str(), "MRays/s", TraceRays( *layout, replay->rays, replay->batch.occlusion ), true );
+		if (useCounters) ReportCounters( scene, builder, name, replay->name, "/ray", (double)replay->rays.size() * reps );
+		if (!replay->batch.hit) continue;
+		uint32_t mismatches = 0;
+		for (uint32_t i = 0; i < replay->batch.count; i++)
+		{
+			Ray ray = replay->rays[i];
+			if (replay->batch.occlusion) { mismatches += replay->batch.Matches( i, layout->IsOccluded( ray ) ) ? 0 : 1; continue; }
+			layout->Intersect( ray );
+			mismatches += replay->batch.Matches( i, ray ) ? 0 : 1;
+		}
+		if (mismatches) fprintf( stderr, "%s: %i of %i hits differ from the recorded hits.\n", replay->name.c_str(), mismatches, replay->batch.count );
+		Report( scene, builder, name, (replay->name + "_mismatches").c_str(), "", { (double)mismatches }, false );
+		results.back().tracked = false;
+	}
+	delete layout;
+}
+
+// Thread scaling. Builds run on a JobSystem with the tested thread count, with
+// BVHContext::parallelBuild set, so the rate is that of one threaded build.
+// Traversal threads share one BVH and take chunks of the ray batch,
+// like the TRAVERSE_2WAY_MT path in tiny_bvh_speedtest. With --numa, workers
+// are spread over the NUMA nodes in equal blocks, like a JobSystem with pinNUMA.
+uint32_t WorkerNode( const uint32_t i, const uint32_t count )
+{
+	return useNUMA ? (uint32_t)((uint64_t)i * NUMA::NodeCount() / count) : 0;
+}
+
+template <class F> double RunThreads( const uint32_t count, F func, std::vector<double>& threadTime )
+{
+	// start 'count' workers at once; returns wall-clock time, and the active
+	// time of each worker in threadTime.
+	std::atomic<uint32_t> ready( 0 );
+	std::atomic<bool> go( false );
+	std::vector<std::thread> pool;
+	threadTime.assign( count, 0 );
+	for (uint32_t i = 0; i < count; i++) pool.emplace_back( [&, i]()
+	{
+		if (useNUMA) NUMA::PinThread( WorkerNode( i, count ) );
+		ready++;
+		while (!go.load()) std::this_thread::yield();
+		Timer t;
+		func( i );
+		threadTime[i] = t.elapsed();
+	} );
+	while (ready.load() < count) std::this_thread::yield();
+	Timer t;
+	go = true;
+	for (std::thread& thread : pool) thread.join();
+	return t.elapsed();
+}
+
+double Variation( const std::vector<double>& v )
+{
+	// coefficient of variation, in percent.
+	double mean = 0, var = 0;
+	for (double x : v) mean += x;
+	mean /= v.size();
+	for (double x : v) var += (x - mean) * (x - mean);
+	return v.size() < 2 || mean == 0 ? 0 : sqrt( var / (v.size() - 1) ) / mean * 100;
+}
+
+struct Scaling { std::vector<double> rate, variation; };
+
+Scaling BuildScaling( Layout& layout, const std::string& builder, const bvhvec4slice& tris, const uint32_t threads )
+{
+	// builds per second of a single build on 'threads' threads; the variation is
+	// between the repetitions, as the job system does not report per-thread times.
+	JobSystem jobs( threads, useNUMA );
+	layout.UseJobs( &jobs );
+	Scaling s;
+	for (int pass = 0; pass < warmup + reps; pass++)
+	{
+		Timer t;
+		layout.Build( builder, tris );
+		const double time = t.elapsed();
+		if (pass >= warmup) s.rate.push_back( 1 / time );
+	}
+	s.variation.push_back( Variation( s.rate ) );
+	layout.UseJobs( 0 );
+	return s;
+}
+
+Scaling TraceScaling( const Layout& layout, const std::vector<Ray>& rays, bool shadow, const uint32_t threads )
+{
+	// MRays/s for all threads together; per-thread MRays/s variation.
+	const uint32_t chunk = 256, chunks = ((uint32_t)rays.size() + chunk - 1) / chunk;
+	std::vector<Ray> batch( rays );
+	std::vector<uint32_t> done( threads );
+	std::vector<double> threadTime;
+	Scaling s;
+	for (int pass = 0; pass < warmup + reps; pass++)
+	{
+		for (size_t i = 0; i < batch.size(); i++) batch[i].hit.t = rays[i].hit.t;
+		std::atomic<uint32_t> next( 0 );
+		const double time = RunThreads( threads, [&]( uint32_t i )
+		{
+			uint32_t count = 0;
+			const uint32_t node = WorkerNode( i, threads );
+			for (uint32_t c = next++; c < chunks; c = next++)
+			{
+				const uint32_t first = c * chunk, last = tinybvh_min( first + chunk, (uint32_t)batch.size() );
+				if (shadow) for (uint32_t r = first; r < last; r++) batch[r].hit.t = layout.IsOccluded( batch[r], node ) ? 0.0f : BVH_FAR;
+				else for (uint32_t r = first; r < last; r++) layout.Intersect( batch[r], node );
+				count += last - first;
+			}
+			done[i] = count;
+		}, threadTime );
+		if (pass < warmup) continue;
+		for (uint32_t i = 0; i < threads; i++) threadTime[i] = done[i] / threadTime[i] * 1e-6;
+		s.rate.push_back( batch.size() / time * 1e-6 ), s.variation.push_back( Variation( threadTime ) );
+	}
+	return s;
+}
+
+void RunScaling( const std::string& scene, const std::string& builder, const std::string& name )
+{
+	// for each thread count: throughput, parallel efficiency relative to the
+	// first thread count, and the variation between threads.
+	Layout* layout = CreateLayout( name );
+	if (!layout) { fprintf( stderr, "layout '%s' is not available; skipped.\n", name.c_str() ); return; }
+	const bvhvec4slice tris( triangles, triCount * 3, sizeof( bvhvec4 ) );
+	if (!layout->Build( builder, tris ))
+	{
+		fprintf( stderr, "builder '%s' is not available; skipped.\n", builder.c_str() );
+		delete layout;
+		return;
+	}
+	if (useNUMA) layout->Replicate();
+	const char* names[4] = { "build", "primary", "shadow", "diffuse" };
+	const char* units[4] = { "builds/s", "MRays/s", "MRays/s", "MRays/s" };
+	const std::vector<Ray>* rays[4] = { 0, &primaryRays, &shadowRays, &diffuseRays };
+	double base[4] = {};
+	for (const uint32_t threads : threadCounts)
+	{
+		fprintf( stderr, "  %i thread(s)\n", threads );
+		for (int i = 0; i < 4; i++)
+		{
+			Scaling s;
+			if (i == 0)
+			{
+				Layout* copy = CreateLayout( name );
+				s = BuildScaling( *copy, builder, tris, threads );
+				delete copy;
+			}
+			else s = TraceScaling( *layout, *rays[i], i == 2, threads );
+			const double rate = Summarize( s.rate ).median;
+			if (threads == threadCounts[0]) base[i] = rate / threads;
+			const std::string metric = names[i];
+			Report( scene, builder, name, metric.c_str(), units[i], s.rate, true, threads );
+			Report( scene, builder, name, (metric + "_eff").c_str(), "%", { rate / (base[i] * threads) * 100 }, true, threads );
+			Report( scene, builder, name, (metric + "_cv").c_str(), "%", s.variation, false, threads );
+			results.back().tracked = false; // too noisy for regression checks.
+		}
+	}
+	delete layout;
+}
+
+std::vector<std::string> Split( const std::string& s, const char separator )
+{
+	std::vector<std::string> parts;
+	size_t start = 0, end;
+	while ((end = s.find( separator, start )) != std::string::npos)
+		parts.push_back( s.substr( start, end - start ) ), start = end + 1;
+	parts.push_back( s.substr( start ) );
+	return parts;
+}
+
+std::string Key( const std::string& scene, const std::string& builder, const std::string& layout, const std::string& metric, uint32_t threads )
+{
+	return scene + "|" + builder + "|" + layout + "|" + metric + "|" + std::to_string( threads );
+}
+
+bool CompareBaseline()
+{
+	// read a CSV written by an earlier run and flag results that got worse by
+	// more than 'tolerance' percent. Returns true if a regression was found.
+	std::ifstream s( baselineFile );
+	if (!s) { fprintf( stderr, "can't open baseline '%s'.\n", baselineFile.c_str() ); return false; }
+	std::string line;
+	std::getline( s, line );
+	const std::vector<std::string> header = Split( line, ',' );
+	int col[5] = { -1, -1, -1, -1, -1 };
+	const char* names[5] = { "scene", "builder", "layout", "metric", "median" };
+	for (size_t i = 0; i < header.size(); i++) for (int j = 0; j < 5; j++) if (header[i] == names[j]) col[j] = (int)i;
+	for (int j = 0; j < 5; j++) if (col[j] < 0) { fprintf( stderr, "baseline has no '%s' column.\n", names[j] ); return false; }
+	const int threadCol = (int)(std::find( header.begin(), header.end(), "threads" ) - header.begin());
+	bool regressed = false;
+	while (std::getline( s, line ))
+	{
+		const std::vector<std::string> f = Split( line, ',' );
+		if (f.size() < header.size()) continue;
+		const uint32_t threads = threadCol < (int)header.size() ? (uint32_t)atoi( f[threadCol].c_str() ) : 1;
+		const std::string key = Key( f[col[0]], f[col[1]], f[col[2]], f[col[3]], threads );
+		const double base = atof( f[col[4]].c_str() );
+		for (Result& r : results) if (Key( r.scene, r.builder, r.layout, r.metric, r.threads ) == key && base > 0 && r.tracked)
+		{
+			r.baseline = base;
+			const double delta = r.higherIsBetter ? r.value.median - base : base - r.value.median;
+			r.change = delta / base * 100;
+			r.regression = r.change < -tolerance;
+			regressed |= r.regression;
+		}
+	}
+	return regressed;
+}
+
+void WriteResults( FILE* f )
+{
+	if (format == "csv")
+	{
+		fprintf( f, "scene,builder,layout,threads,metric,unit,median,min,ci95,reps,baseline,change_pct,regression\n" );
+		for (const Result& r : results)
+		{
+			fprintf( f, "%s,%s,%s,%i,%s,%s,%.6g,%.6g,%.6g,%i,", r.scene.c_str(), r.builder.c_str(), r.layout.c_str(),
+				r.threads, r.metric.c_str(), r.unit.c_str(), r.value.median, r.value.min, r.value.ci95, r.value.count );
+			if (r.baseline >= 0) fprintf( f, "%.6g,%.2f,%i\n", r.baseline, r.change, r.regression ? 1 : 0 );
+			else fprintf( f, ",,\n" );
+		}
+	}
+	else if (format == "json")
+	{
+		fprintf( f, "{\n  \"version\": \"%i.%i.%i\",\n  \"warmup\": %i,\n  \"reps\": %i,\n  \"results\": [\n",
+			TINY_BVH_VERSION_MAJOR, TINY_BVH_VERSION_MINOR, TINY_BVH_VERSION_SUB, warmup, reps );
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const Result& r = results[i];
+			fprintf( f, "    { \"scene\": \"%s\", \"builder\": \"%s\", \"layout\": \"%s\", \"threads\": %i, \"metric\": \"%s\", \"unit\": \"%s\", "
+				"\"median\": %.6g, \"min\": %.6g, \"ci95\": %.6g, \"reps\": %i", r.scene.c_str(), r.builder.c_str(), r.layout.c_str(),
+				r.threads, r.metric.c_str(), r.unit.c_str(), r.value.median, r.value.min, r.value.ci95, r.value.count );
+			if (r.baseline >= 0) fprintf( f, ", \"baseline\": %.6g, \"change_pct\": %.2f, \"regression\": %s",
+				r.baseline, r.change, r.regression ? "true" : "false" );
+			fprintf( f, " }%s\n", i + 1 < results.size() ? "," : "" );
+		}
+		fprintf( f, "  ]\n}\n" );
+	}
+	else for (const Result& r : results)
+	{
+		fprintf( f, "%-14s %-8s %-6s %4it %-16s %12.3f (min %12.3f, +/- %8.3f) %-8s", r.scene.c_str(), r.builder.c_str(),
+			r.layout.c_str(), r.threads, r.metric.c_str(), r.value.median, r.value.min, r.value.ci95, r.unit.c_str() );
+		if (r.baseline >= 0) fprintf( f, " %+6.1f%%%s", r.change, r.regression ? "  REGRESSION" : "" );
+		fprintf( f, "\n" );
+	}
+}
+
+int Usage()
+{
+	fprintf( stderr, "usage: tiny_bvh_benchmark [--scenes a,b] [--builders a,b] [--layouts a,b]\n"
+		"  [--warmup n] [--reps n] [--format text|csv|json] [--out file] [--baseline file.csv] [--tolerance pct]\n"
+		"  [--threads a,b|max] [--numa] [--hugepages] [--rays a.bin,b.bin] [--counters]\n"
+		"builders: default, quick, ref, sweep, avx, hq, rdh; layouts: bvh, gpu, soa, cpu4, cpu8, gpu4, cwbvh, all\n" );
+	return 1;
+}
+
+int main( int argc, char** argv )
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--counters") { useCounters = true; continue; }
+		if (arg == "--numa") { useNUMA = true; continue; }
+		if (arg == "--hugepages") { useHugePages = true; continue; }
+		if (i + 1 == argc) return Usage();
+		const std::string value = argv[++i];
+		if (arg == "--scenes") scenes = Split( value, ',' );
+		else if (arg == "--builders") builders = Split( value, ',' );
+		else if (arg == "--layouts") layouts = value == "all" ? Split( "bvh,gpu,soa,cpu4,cpu8,gpu4,cwbvh", ',' ) : Split( value, ',' );
+		else if (arg == "--warmup") warmup = atoi( value.c_str() );
+		else if (arg == "--reps") reps = atoi( value.c_str() );
+		else if (arg == "--format") format = value;
+		else if (arg == "--out") outFile = value;
+		else if (arg == "--baseline") baselineFile = value;
+		else if (arg == "--rays") rayFiles = Split( value, ',' );
+		else if (arg == "--tolerance") tolerance = (float)atof( value.c_str() );
+		else if (arg == "--threads")
+		{
+			threadCounts.clear();
+			if (value == "max")
+			{
+				const uint32_t hw = tinybvh_max( std::thread::hardware_concurrency(), 1u );
+				for (uint32_t t = 1; t < hw; t *= 2) threadCounts.push_back( t );
+				threadCounts.push_back( hw );
+			}
+			else for (const std::string& t : Split( value, ',' )) threadCounts.push_back( (uint32_t)atoi( t.c_str() ) );
+		}
+		else return Usage();
+	}
+	if (reps < 1 || warmup < 0 || (format != "text" && format != "csv" && format != "json")) return Usage();
+	for (const uint32_t t : threadCounts) if (t < 1 || t > 1024) return Usage();
+	if (useCounters && !threadCounts.empty()) fprintf( stderr, "--counters is ignored in thread scaling mode.\n" ), useCounters = false;
+	if (useNUMA && threadCounts.empty()) fprintf( stderr, "--numa is only used in thread scaling mode.\n" ), useNUMA = false;
+	if (useNUMA) fprintf( stderr, "NUMA: %u node(s)%s\n", NUMA::NodeCount(), NUMA::NodeCount() < 2 ? "; BVHs are not replicated." : "" );
+	if (useCounters && !counters.Open()) fprintf( stderr, "no hardware performance counters available.\n" ), useCounters = false;
+	if (!LoadReplays()) return 1;
+	for (const std::string& scene : scenes)
+	{
+		if (!LoadScene( scene )) { fprintf( stderr, "can't load scene './testdata/%s.bin'.\n", scene.c_str() ); return 1; }
+		fprintf( stderr, "%s: %i triangles\n", scene.c_str(), triCount );
+		GenerateRays( scene );
+		for (const std::string& builder : builders) for (const std::string& layout : layouts)
+		{
+			fprintf( stderr, "- %s / %s\n", builder.c_str(), layout.c_str() );
+			if (threadCounts.empty()) RunBenchmark( scene, builder, layout );
+			else RunScaling( scene, builder, layout );
+		}
+	}
+	const bool regressed = baselineFile.empty() ? false : CompareBaseline();
+	FILE* f = outFile.empty() ? stdout : fopen( outFile.c_str(), "w" );
+	if (!f) { fprintf( stderr, "can't write '%s'.\n", outFile.c_str() ); return 1; }
+	WriteResults( f );
+	if (f != stdout) fclose( f );
+	if (regressed) fprintf( stderr, "regressions found (tolerance %.1f%%).\n", tolerance );
+	counters.Close();
+	for (Replay* replay : replays) delete replay;
+	tinybvh::free64( triangles );
+	return regressed ? 2 : 0;
+}
@@ -58,6 +58,14 @@ void sphereAABB( const unsigned primID, bvhvec3& boundsMin, bvhvec3& boundsMax )
 	boundsMax = spheres[primID].pos + bvhvec3( spheres[primID].r );
 }
 
+// primitive policy: lets BVH::Build<P> and BVH::Intersect<P> inline the callbacks
+struct SpherePrimitive
+{
+	static void GetAABB( const unsigned primID, bvhvec3& bmin, bvhvec3& bmax ) { sphereAABB( primID, bmin, bmax ); }
+	static bool Intersect( tinybvh::Ray& ray, const unsigned primID ) { return sphereIntersect( ray, primID ); }
+	static bool IsOccluded( const tinybvh::Ray& ray, const unsigned primID ) { return sphereIsOccluded( ray, primID ); }
+};
+
 void Init()
 {
 	// load raw vertex data for Crytek's Sponza
@@ -78,12 +86,9 @@ void Init()
 		spheres[i].pos = (v0 + v1 + v2) * 0.33333f;
 	}
 
-	// build the BVH over the aabbs
-	bvh.Build( &sphereAABB, verts / 3 );
-
-	// set custom intersection callbacks
-	bvh.customIntersect = &sphereIntersect;
-	bvh.customIsOccluded = &sphereIsOccluded;
+	// build the BVH over the aabbs; this also sets bvh.customIntersect and
+	// bvh.customIsOccluded, so the regular bvh.Intersect( ray ) works as well.
+	bvh.Build<SpherePrimitive>( verts / 3 );
 }
 
 bool UpdateCamera( float delta_time_s, fenster& f )
@@ -129,7 +134,7 @@ void Tick( float delta_time_s, fenster& f, uint32_t* buf )
 			float u = (float)(tx * 4 + x) / SCRWIDTH, v = (float)(ty * 4 + y) / SCRHEIGHT;
 			bvhvec3 D = tinybvh_normalize( p1 + u * (p2 - p1) + v * (p3 - p1) - eye );
 			Ray ray( eye, D, 1e30f );
-			bvh.Intersect( ray );
+			bvh.Intersect<SpherePrimitive>( ray );
 			if (ray.hit.t < 10000)
 			{
 				int pixel_x = tx * 4 + x, pixel_y = ty * 4 + y, primIdx = ray.hit.prim;
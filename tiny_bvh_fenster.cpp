@@ -5,6 +5,7 @@
 
 // #define COLOR_PRIM // compute color as hashed triangle Index
 // #define COLOR_DEPTH // compute color as depth of intersection
+// #define CAPTURE_RAYS // press 'C' to save a frame's rays, for tiny_bvh_benchmark --rays
 
 #define LOADSCENE
 
@@ -179,6 +180,16 @@ void Tick( float delta_time_s, fenster& f, uint32_t* buf )
 		}
 	}
 
+#ifdef CAPTURE_RAYS
+	// capture primary rays with their hits, and the shadow rays of this frame.
+	static bool captureKey = false;
+	const bool capture = f.keys['C'] && !captureKey;
+	captureKey = f.keys['C'] != 0;
+	RayBatch primaryBatch, shadowBatch;
+	shadowBatch.occlusion = true;
+	if (capture) primaryBatch.Add( rays, N );
+#endif
+
 	// trace primary rays
 	for (int i = 0; i < N; i++) {
 	#ifdef COLOR_DEPTH
@@ -212,7 +223,11 @@ void Tick( float delta_time_s, fenster& f, uint32_t* buf )
 			float dist = tinybvh_length( L );
 			L *= 1.0f / dist;
 			Ray s( I + L * 0.001f, L, dist - 0.002f );
-			float shade = bvh.IsOccluded( s ) ? 0.2f : 1.0f;
+			const bool occluded = bvh.IsOccluded( s );
+		#ifdef CAPTURE_RAYS
+			if (capture) shadowBatch.SetOccluded( shadowBatch.Add( &s ), occluded );
+		#endif
+			float shade = occluded ? 0.2f : 1.0f;
 			// final plot
 			int c = (int)(255.9f * shade * fabs( tinybvh_dot( N, L ) ));
 			buf[pixel_x + pixel_y * SCRWIDTH] = c + (c << 8) + (c << 16);
@@ -220,6 +235,15 @@ void Tick( float delta_time_s, fenster& f, uint32_t* buf )
 		}
 	}
 
+#ifdef CAPTURE_RAYS
+	if (capture)
+	{
+		primaryBatch.SetHits( 0, rays, N );
+		primaryBatch.Save( "primary_rays.bin" ), shadowBatch.Save( "shadow_rays.bin" );
+		printf( "Saved %i primary and %i shadow rays.\n", primaryBatch.count, shadowBatch.count );
+	}
+#endif
+
 	// crosshair
 	for (int x = 0; x < SCRWIDTH; x += 2) buf[x + my * SCRWIDTH] ^= 0xAAAAAA;
 	for (int y = 0; y < SCRHEIGHT; y += 2) buf[mx + y * SCRWIDTH] ^= 0xAAAAAA;
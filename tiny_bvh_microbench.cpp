@@ -0,0 +1,510 @@
+// Micro-benchmarks for the ray/box and ray/triangle kernels of tiny_bvh.h.
+// Each kernel is measured in isolation, on a small data set that stays in the
+// L1 cache ('hot') and on a large data set that is visited in random order
+// ('cold'). Throughput is measured with independent kernel invocations; latency
+// with a chain where each invocation depends on the result of the previous one.
+// Before timing, every kernel is compared against a scalar double precision
+// reference. Rays that graze a box edge or triangle edge are not compared.
+//
+// Kernels:
+//   aabb        tinybvh_intersect_aabb
+//   slab2       SLAB_TEST_TWO_NODES, two sibling BVH nodes per invocation
+//   watertight  BVHBase::IntersectTri (WATERTIGHT_TRITEST)
+//   moller      MOLLER_TRUMBORE_TEST, the IntersectTri path without WATERTIGHT_TRITEST
+//   tri4        IntersectTri4, four triangles in a BVHTri4Leaf (BVH_USESSE only)
+//   cwbvh       DecodeCWBVHNode, one compressed 8-wide node (BVH_USEAVX only)
+//
+// Usage: tiny_bvh_microbench [options]
+//   --kernels a,b      kernels to run, or all (default: all)
+//   --ops n            kernel invocations per measurement (default: 2097152)
+//   --reps n           measurements per kernel; the fastest is reported (default: 3)
+//   --cold-mb n        size of the cache-cold data set in MB (default: 128)
+// Exit code: 0 if all kernels agree with the reference, 1 for invalid arguments,
+// 2 if a kernel disagrees.
+
+#define TINYBVH_IMPLEMENTATION
+#include "tiny_bvh.h"
+#ifdef _MSC_VER
+#include "stdio.h"		// for printf
+#include "stdlib.h"		// for atoi
+#else
+#include <cstdio>
+#include <cstdlib>
+#endif
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace tinybvh;
+
+// Size of the hot data set, and the number of distinct rays; element i of
+// either data set is generated to be tested against ray i % HOT.
+#define HOT		128
+#define CHECKS	65536
+
+struct Timer
+{
+	Timer() { reset(); }
+	float elapsed() const
+	{
+		auto t2 = std::chrono::high_resolution_clock::now();
+		return (float)std::chrono::duration_cast<std::chrono::duration<double>>(t2 - start).count();
+	}
+	void reset() { start = std::chrono::high_resolution_clock::now(); }
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+// Settings, from the command line.
+std::vector<std::string> kernels = { "aabb", "slab2", "watertight", "moller", "tri4", "cwbvh" };
+uint32_t ops = 1 << 21, coldMB = 128;
+int reps = 3;
+
+// Zero at runtime, but unknown to the compiler: used to make the next element
+// index depend on the previous kernel result in the latency measurements.
+volatile uint32_t chainMaskSource = 0;
+volatile uint32_t sink = 0;
+
+// Random numbers; deterministic, so runs can be compared.
+static uint32_t seed = 0x12345678;
+static uint32_t RandomUInt() { seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5; return seed; }
+static float RandomFloat() { return RandomUInt() * 2.3283064365387e-10f; }
+static float RandomSigned() { return RandomFloat() * 2 - 1; }
+static bvhvec3 RandomVec( const float s ) { return bvhvec3( RandomSigned(), RandomSigned(), RandomSigned() ) * s; }
+
+// A ray from outside the unit cube to a random point inside it. 'target' is
+// the distance to that point; primitives are placed around it.
+static Ray RandomRay( float& target )
+{
+	bvhvec3 dir = RandomVec( 1 );
+	while (tinybvh_dot( dir, dir ) < 0.01f || tinybvh_dot( dir, dir ) > 1) dir = RandomVec( 1 );
+	const bvhvec3 O = bvhvec3( 0.5f ) + tinybvh_normalize( dir ) * 3.0f;
+	const bvhvec3 P( 0.1f + 0.8f * RandomFloat(), 0.1f + 0.8f * RandomFloat(), 0.1f + 0.8f * RandomFloat() );
+	target = tinybvh_length( P - O );
+	return Ray( O, tinybvh_normalize( P - O ) );
+}
+
+// Scalar references, in double precision. They return false when the ray is too
+// close to an edge to expect agreement with a single precision kernel.
+static bool RefBox( const Ray& ray, const bvhvec3& bmin, const bvhvec3& bmax, const double tmax, bool& hit, double& t )
+{
+	double tn = -1e30, tf = 1e30;
+	for (int a = 0; a < 3; a++)
+	{
+		const double r = 1.0 / (double)ray.D[a];
+		const double t1 = (bmin[a] - (double)ray.O[a]) * r, t2 = (bmax[a] - (double)ray.O[a]) * r;
+		tn = fmax( tn, fmin( t1, t2 ) ), tf = fmin( tf, fmax( t1, t2 ) );
+	}
+	tn = fmax( tn, 0.0 ), tf = fmin( tf, tmax );
+	hit = tf >= tn, t = tn;
+	return fabs( tf - tn ) > 1e-4 * (1 + fabs( tn ));
+}
+
+static bool RefTri( const Ray& ray, const bvhvec3& v0, const bvhvec3& v1, const bvhvec3& v2, bool& hit, double& t )
+{
+	const double O[3] = { ray.O.x, ray.O.y, ray.O.z }, D[3] = { ray.D.x, ray.D.y, ray.D.z };
+	const double e1[3] = { v1.x - (double)v0.x, v1.y - (double)v0.y, v1.z - (double)v0.z };
+	const double e2[3] = { v2.x - (double)v0.x, v2.y - (double)v0.y, v2.z - (double)v0.z };
+	const double s[3] = { O[0] - v0.x, O[1] - v0.y, O[2] - v0.z };
+	const double h[3] = { D[1] * e2[2] - D[2] * e2[1], D[2] * e2[0] - D[0] * e2[2], D[0] * e2[1] - D[1] * e2[0] };
+	const double q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+	const double det = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+	if (fabs( det ) < 1e-7) return false;
+	const double u = (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]) / det;
+	const double v = (D[0] * q[0] + D[1] * q[1] + D[2] * q[2]) / det;
+	t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) / det;
+	hit = u >= 0 && v >= 0 && u + v <= 1 && t > 0;
+	return fabs( u ) > 1e-4 && fabs( v ) > 1e-4 && fabs( 1 - u - v ) > 1e-4;
+}
+
+static bool SameT( const double a, const double b ) { return fabs( a - b ) <= 1e-4 * (1 + fabs( b )); }
+
+// Kernels. Each has an element type, a generator that places an element around
+// a ray, the kernel itself (returning the bits of its result), and a check
+// against the reference. CWBVH nodes come from a real tree; for these, the
+// generator replaces the ray by one aimed at the node instead.
+struct BoxKernel
+{
+	typedef BVH::BVHNode Elem;
+	static void Prepare() {}
+	static void Generate( Elem& e, Ray& ray, float& target, const uint32_t )
+	{
+		const bvhvec3 P = ray.O + ray.D * target + RandomVec( 0.03f ), ext = bvhvec3( 0.01f ) + RandomVec( 0.02f ) * RandomVec( 1 );
+		e.aabbMin = P - tinybvh_max( ext, bvhvec3( 0.002f ) ), e.aabbMax = P + tinybvh_max( ext, bvhvec3( 0.002f ) );
+		e.leftFirst = e.triCount = 0;
+	}
+};
+
+struct AABB : BoxKernel
+{
+	static __FORCEINLINE uint32_t Run( const Elem& e, Ray& ray ) { return as_uint( tinybvh_intersect_aabb( ray, e.aabbMin, e.aabbMax ) ); }
+	static bool Check( const Elem& e, Ray& ray, uint32_t& hits, uint32_t& tests )
+	{
+		bool hit;
+		double t;
+		if (!RefBox( ray, e.aabbMin, e.aabbMax, ray.hit.t, hit, t )) return true;
+		const float d = tinybvh_intersect_aabb( ray, e.aabbMin, e.aabbMax );
+		hits += hit, tests++;
+		return hit ? (d < BVH_FAR && SameT( d, t )) : d == BVH_FAR;
+	}
+};
+
+struct NodePair { BVH::BVHNode child[2]; };
+
+struct Slab2
+{
+	typedef NodePair Elem;
+	static void Prepare() {}
+	static void Generate( Elem& e, Ray& ray, float& target, const uint32_t i )
+	{
+		BoxKernel::Generate( e.child[0], ray, target, i );
+		BoxKernel::Generate( e.child[1], ray, target, i );
+	}
+	static __FORCEINLINE void Test( const Elem& e, const Ray& ray, float& dist1, float& dist2 )
+	{
+		// same setup as BVH::Intersect, but with the ray octant known at runtime only.
+		const BVH::BVHNode* child1 = &e.child[0], * child2 = &e.child[1];
+		const bool posX = ray.D.x >= 0, posY = ray.D.y >= 0, posZ = ray.D.z >= 0;
+		const float rox = ray.O.x * ray.rD.x, roy = ray.O.y * ray.rD.y, roz = ray.O.z * ray.rD.z;
+		SLAB_TEST_TWO_NODES;
+	}
+	static __FORCEINLINE uint32_t Run( const Elem& e, Ray& ray )
+	{
+		float dist1 = BVH_FAR, dist2 = BVH_FAR;
+		Test( e, ray, dist1, dist2 );
+		return as_uint( dist1 ) + as_uint( dist2 );
+	}
+	static bool Check( const Elem& e, Ray& ray, uint32_t& hits, uint32_t& tests )
+	{
+		float dist[2] = { BVH_FAR, BVH_FAR };
+		Test( e, ray, dist[0], dist[1] );
+		bool ok = true;
+		for (int i = 0; i < 2; i++)
+		{
+			bool hit;
+			double t;
+			if (!RefBox( ray, e.child[i].aabbMin, e.child[i].aabbMax, ray.hit.t, hit, t )) continue;
+			hits += hit, tests++;
+			if (hit ? !(dist[i] < BVH_FAR && SameT( dist[i], t )) : dist[i] != BVH_FAR) ok = false;
+		}
+		return ok;
+	}
+};
+
+struct Tri { bvhvec4 v0, v1, v2; };
+
+struct TriKernel
+{
+	typedef Tri Elem;
+	static void Prepare() {}
+	static void Generate( Elem& e, Ray& ray, float& target, const uint32_t )
+	{
+		const bvhvec3 P = ray.O + ray.D * target + RandomVec( 0.02f );
+		e.v0 = bvhvec4( P + RandomVec( 0.05f ), 0 ), e.v1 = bvhvec4( P + RandomVec( 0.05f ), 0 ), e.v2 = bvhvec4( P + RandomVec( 0.05f ), 0 );
+	}
+};
+
+// BVHBase::IntersectTri is protected; it is only exposed here.
+struct TriTester : public BVHBase { using BVHBase::IntersectTri; };
+static TriTester triTester;
+
+struct Watertight : TriKernel
+{
+	static __FORCEINLINE uint32_t Run( const Elem& e, Ray& ray )
+	{
+		triTester.IntersectTri( ray, 0, bvhvec4slice( &e.v0, 3 ), 0, 1, 2 );
+		const uint32_t r = as_uint( ray.hit.t );
+		ray.hit.t = BVH_FAR;
+		return r;
+	}
+	static bool Check( const Elem& e, Ray& ray, uint32_t& hits, uint32_t& tests )
+	{
+		bool hit;
+		double t;
+		if (!RefTri( ray, e.v0, e.v1, e.v2, hit, t )) return true;
+		triTester.IntersectTri( ray, 0, bvhvec4slice( &e.v0, 3 ), 0, 1, 2 );
+		const float d = ray.hit.t;
+		ray.hit.t = BVH_FAR, hits += hit, tests++;
+		return hit ? (d < BVH_FAR && SameT( d, t )) : d == BVH_FAR;
+	}
+};
+
+struct Moller : TriKernel
+{
+	static __FORCEINLINE float Test( const Elem& e, const Ray& ray )
+	{
+		const bvhvec3 v0 = e.v0, e1 = e.v1 - e.v0, e2 = e.v2 - e.v0;
+		MOLLER_TRUMBORE_TEST( ray.hit.t, return BVH_FAR );
+		(void)u, (void)v;
+		return t;
+	}
+	static __FORCEINLINE uint32_t Run( const Elem& e, Ray& ray ) { return as_uint( Test( e, ray ) ); }
+	static bool Check( const Elem& e, Ray& ray, uint32_t& hits, uint32_t& tests )
+	{
+		bool hit;
+		double t;
+		if (!RefTri( ray, e.v0, e.v1, e.v2, hit, t )) return true;
+		const float d = Test( e, ray );
+		hits += hit, tests++;
+		return hit ? (d < BVH_FAR && SameT( d, t )) : d == BVH_FAR;
+	}
+};
+
+#ifdef BVH_USESSE
+
+struct Tri4
+{
+	typedef BVHTri4Leaf Elem;
+	static void Prepare() {}
+	static void Generate( Elem& e, Ray& ray, float& target, const uint32_t i )
+	{
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			Tri tri;
+			TriKernel::Generate( tri, ray, target, i );
+			e.SetData( tri.v0, tri.v1 - tri.v0, tri.v2 - tri.v0, lane, lane );
+		}
+	}
+	static __FORCEINLINE uint32_t Mask( const Elem& e, const Ray& ray, __m128& ta4 )
+	{
+		__m128 u4, v4;
+		const __m128 ox4 = _mm_set1_ps( ray.O.x ), oy4 = _mm_set1_ps( ray.O.y ), oz4 = _mm_set1_ps( ray.O.z );
+		const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
+		return _mm_movemask_ps( IntersectTri4( &e, ox4, oy4, oz4, dx4, dy4, dz4, _mm_set1_ps( ray.hit.t ), u4, v4, ta4 ) );
+	}
+	static __FORCEINLINE uint32_t Run( const Elem& e, Ray& ray ) { __m128 ta4; return Mask( e, ray, ta4 ); }
+	static bool Check( const Elem& e, Ray& ray, uint32_t& hits, uint32_t& tests )
+	{
+		__m128 ta4;
+		const uint32_t mask = Mask( e, ray, ta4 );
+		const float* ta = (const float*)&ta4;
+		bool ok = true;
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			const bvhvec3 v0( ((const float*)&e.v0x4)[lane], ((const float*)&e.v0y4)[lane], ((const float*)&e.v0z4)[lane] );
+			const bvhvec3 e1( ((const float*)&e.e1x4)[lane], ((const float*)&e.e1y4)[lane], ((const float*)&e.e1z4)[lane] );
+			const bvhvec3 e2( ((const float*)&e.e2x4)[lane], ((const float*)&e.e2y4)[lane], ((const float*)&e.e2z4)[lane] );
+			bool hit;
+			double t;
+			if (!RefTri( ray, v0, v0 + e1, v0 + e2, hit, t )) continue;
+			hits += hit, tests++;
+			const bool laneHit = (mask >> lane) & 1;
+			if (laneHit != hit || (hit && !SameT( ta[lane], t ))) ok = false;
+		}
+		return ok;
+	}
+};
+
+#endif
+
+#ifdef BVH_USEAVX
+
+struct CWNode { bvhvec4 n[5]; };
+
+struct CWBVH
+{
+	typedef CWNode Elem;
+	// interior nodes of a CWBVH over a random triangle soup.
+	static std::vector<CWNode> nodes;
+	static void Prepare()
+	{
+		if (!nodes.empty()) return;
+		std::vector<bvhvec4> tris( 8192 * 3 );
+		for (size_t i = 0; i < tris.size(); i += 3)
+		{
+			const bvhvec3 P( RandomFloat(), RandomFloat(), RandomFloat() );
+			for (int j = 0; j < 3; j++) tris[i + j] = bvhvec4( P + RandomVec( 0.02f ), 0 );
+		}
+		BVH8_CWBVH cwbvh;
+		cwbvh.Build( tris.data(), 8192 );
+		const CWNode* data = (const CWNode*)cwbvh.bvh8Data;
+		nodes.assign( data, data + cwbvh.usedBlocks / 5 );
+	}
+	// dequantized box of child i of a node.
+	static void ChildBox( const Elem& e, const uint32_t i, bvhvec3& bmin, bvhvec3& bmax )
+	{
+		const int8_t* ex = (const int8_t*)&e.n[0].w;
+		const uint8_t* q = (const uint8_t*)&e.n[2];
+		const bvhvec3 scale( ldexpf( 1, ex[0] ), ldexpf( 1, ex[1] ), ldexpf( 1, ex[2] ) ), p = e.n[0];
+		bmin = p + bvhvec3( q[i], q[8 + i], q[16 + i] ) * scale;
+		bmax = p + bvhvec3( q[24 + i], q[32 + i], q[40 + i] ) * scale;
+	}
+	static void Generate( Elem& e, Ray& ray, float& target, const uint32_t i )
+	{
+		// a ray aimed at a random point in the bounds of the node's children.
+		e = nodes[i % nodes.size()];
+		const uint8_t* meta = (const uint8_t*)&e.n[1].z;
+		bvhvec3 bmin( BVH_FAR ), bmax( -BVH_FAR ), cmin, cmax;
+		for (uint32_t c = 0; c < 8; c++) if (meta[c]) ChildBox( e, c, cmin, cmax ), bmin = tinybvh_min( bmin, cmin ), bmax = tinybvh_max( bmax, cmax );
+		const bvhvec3 P = bmin + (bmax - bmin) * bvhvec3( RandomFloat(), RandomFloat(), RandomFloat() );
+		bvhvec3 dir = RandomVec( 1 );
+		while (tinybvh_dot( dir, dir ) < 0.01f || tinybvh_dot( dir, dir ) > 1) dir = RandomVec( 1 );
+		const bvhvec3 O = bvhvec3( 0.5f ) + tinybvh_normalize( dir ) * 3.0f;
+		ray = Ray( O, tinybvh_normalize( P - O ) ), target = tinybvh_length( P - O );
+	}
+	static __FORCEINLINE uint32_t Octinv( const Ray& ray )
+	{
+		return (7 - ((ray.D.x < 0 ? 4 : 0) | (ray.D.y < 0 ? 2 : 0) | (ray.D.z < 0 ? 1 : 0))) * 0x1010101;
+	}
+	static __FORCEINLINE uint32_t Run( const Elem& e, Ray& ray ) { return DecodeCWBVHNode( e.n, ray, Octinv( ray ), 0, ray.hit.t ); }
+	static bool Check( const Elem& e, Ray& ray, uint32_t& hits, uint32_t& tests )
+	{
+		// expected hit mask: child bits at the slot positions, as in BVH8_CWBVH::Intersect.
+		const uint32_t octinv = Octinv( ray ) & 255;
+		const uint8_t* meta = (const uint8_t*)&e.n[1].z;
+		uint32_t expected = 0;
+		for (uint32_t c = 0; c < 8; c++)
+		{
+			bvhvec3 bmin, bmax;
+			bool hit;
+			double t;
+			ChildBox( e, c, bmin, bmax );
+			if (!RefBox( ray, bmin, bmax, ray.hit.t, hit, t )) return true;
+			if (!hit) continue;
+			const uint32_t isInner = (meta[c] & (meta[c] << 1)) & 0x10;
+			const uint32_t bitIndex = (isInner ? meta[c] ^ octinv : meta[c]) & 0x1F;
+			expected |= ((meta[c] >> 5) & 7) << bitIndex, hits += meta[c] != 0;
+		}
+		for (uint32_t c = 0; c < 8; c++) tests += meta[c] != 0;
+		return DecodeCWBVHNode( e.n, ray, Octinv( ray ), 0, ray.hit.t ) == expected;
+	}
+};
+std::vector<CWNode> CWBVH::nodes;
+
+#endif
+
+// Timed loops: independent invocations for throughput, a dependent chain for
+// latency. Returns nanoseconds per invocation.
+template <class K> double Throughput( const typename K::Elem* elems, const uint32_t* order, const uint32_t mask, Ray* rays )
+{
+	uint32_t acc = 0;
+	Timer t;
+	for (uint32_t j = 0; j < ops; j++)
+	{
+		const uint32_t e = order[j & mask];
+		acc += K::Run( elems[e], rays[e & (HOT - 1)] );
+	}
+	const double ns = t.elapsed() * 1e9 / ops;
+	sink = sink + acc;
+	return ns;
+}
+
+template <class K> double Latency( const typename K::Elem* elems, const uint32_t* order, const uint32_t mask, Ray* rays )
+{
+	const uint32_t chainMask = chainMaskSource;
+	uint32_t r = 0;
+	Timer t;
+	for (uint32_t j = 0; j < ops; j++)
+	{
+		const uint32_t e = order[(j + (r & chainMask)) & mask];
+		r = K::Run( elems[e], rays[e & (HOT - 1)] );
+	}
+	const double ns = t.elapsed() * 1e9 / ops;
+	sink = sink + r;
+	return ns;
+}
+
+template <class K> bool RunKernel( const char* name )
+{
+	K::Prepare();
+	// correctness: kernel versus reference, on fresh element/ray pairs.
+	uint32_t failed = 0, hits = 0, tests = 0;
+	{
+		typename K::Elem e;
+		for (uint32_t i = 0; i < CHECKS; i++)
+		{
+			float target;
+			Ray ray = RandomRay( target );
+			K::Generate( e, ray, target, i );
+			if (!K::Check( e, ray, hits, tests )) failed++;
+		}
+	}
+	// data sets: HOT rays, a hot set of HOT elements and a cold set; element i is
+	// tested against ray i % HOT. The cold set is filled with copies of HOT * 64
+	// distinct elements, which keeps generation fast for large sets.
+	std::vector<Ray> rays( HOT );
+	std::vector<float> targets( HOT );
+	for (uint32_t i = 0; i < HOT; i++) rays[i] = RandomRay( targets[i] );
+	uint32_t coldCount = HOT;
+	while ((uint64_t)coldCount * 2 * sizeof( typename K::Elem ) <= (uint64_t)coldMB << 20) coldCount *= 2;
+	const uint32_t distinct = tinybvh_min( coldCount, (uint32_t)HOT * 64 );
+	std::vector<typename K::Elem> cold( coldCount );
+	for (uint32_t i = 0; i < distinct; i++)
+	{
+		if (i < HOT) { K::Generate( cold[i], rays[i], targets[i], i ); continue; }
+		Ray ray = rays[i % HOT];
+		float target = targets[i % HOT];
+		K::Generate( cold[i], ray, target, i );
+	}
+	for (uint32_t i = distinct; i < coldCount; i++) cold[i] = cold[i % distinct];
+	std::vector<typename K::Elem> hot( cold.begin(), cold.begin() + HOT );
+	// visiting order: a random permutation of each set.
+	std::vector<uint32_t> hotOrder( HOT ), coldOrder( coldCount );
+	for (uint32_t i = 0; i < HOT; i++) hotOrder[i] = i;
+	for (uint32_t i = 0; i < coldCount; i++) coldOrder[i] = i;
+	for (uint32_t i = HOT - 1; i > 0; i--) std::swap( hotOrder[i], hotOrder[RandomUInt() % (i + 1)] );
+	for (uint32_t i = coldCount - 1; i > 0; i--) std::swap( coldOrder[i], coldOrder[RandomUInt() % (i + 1)] );
+	double best[4] = { 1e30, 1e30, 1e30, 1e30 };
+	for (int rep = 0; rep < reps; rep++)
+	{
+		best[0] = tinybvh_min( best[0], Throughput<K>( hot.data(), hotOrder.data(), HOT - 1, rays.data() ) );
+		best[1] = tinybvh_min( best[1], Latency<K>( hot.data(), hotOrder.data(), HOT - 1, rays.data() ) );
+		best[2] = tinybvh_min( best[2], Throughput<K>( cold.data(), coldOrder.data(), coldCount - 1, rays.data() ) );
+		best[3] = tinybvh_min( best[3], Latency<K>( cold.data(), coldOrder.data(), coldCount - 1, rays.data() ) );
+	}
+	const double hotKB = HOT * sizeof( typename K::Elem ) / 1024.0, coldMBs = coldCount * (double)sizeof( typename K::Elem ) / (1 << 20);
+	printf( "%-11s hot  %7.1fKB %8.2f %9.1f %8.2f", name, hotKB, best[0], 1e3 / best[0], best[1] );
+	printf( "   %s (%u/%u failed, %.0f%% hits)\n", failed ? "FAIL" : "ok", failed, CHECKS, 100.0 * hits / tinybvh_max( tests, 1u ) );
+	printf( "%-11s cold %7.0fMB %8.2f %9.1f %8.2f\n", name, coldMBs, best[2], 1e3 / best[2], best[3] );
+	return failed == 0;
+}
+
+std::vector<std::string> Split( const std::string& s, const char separator )
+{
+	std::vector<std::string> parts;
+	size_t start = 0, end;
+	while ((end = s.find( separator, start )) != std::string::npos)
+		parts.push_back( s.substr( start, end - start ) ), start = end + 1;
+	parts.push_back( s.substr( start ) );
+	return parts;
+}
+
+int Usage()
+{
+	fprintf( stderr, "usage: tiny_bvh_microbench [--kernels a,b] [--ops n] [--reps n] [--cold-mb n]\n"
+		"kernels: aabb, slab2, watertight, moller, tri4, cwbvh, all\n" );
+	return 1;
+}
+
+int main( int argc, char** argv )
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if (i + 1 == argc) return Usage();
+		const std::string value = argv[++i];
+		if (arg == "--kernels") { if (value != "all") kernels = Split( value, ',' ); }
+		else if (arg == "--ops") ops = (uint32_t)atoi( value.c_str() );
+		else if (arg == "--reps") reps = atoi( value.c_str() );
+		else if (arg == "--cold-mb") coldMB = (uint32_t)atoi( value.c_str() );
+		else return Usage();
+	}
+	if (ops < 1 || reps < 1 || coldMB < 1) return Usage();
+	printf( "kernel      data      size  ns/call  Mcalls/s  latency   check\n" );
+	bool ok = true;
+	for (const std::string& k : kernels)
+	{
+		if (k == "aabb") ok &= RunKernel<AABB>( "aabb" );
+		else if (k == "slab2") ok &= RunKernel<Slab2>( "slab2" );
+		else if (k == "watertight") ok &= RunKernel<Watertight>( "watertight" );
+		else if (k == "moller") ok &= RunKernel<Moller>( "moller" );
+	#ifdef BVH_USESSE
+		else if (k == "tri4") ok &= RunKernel<Tri4>( "tri4" );
+	#endif
+	#ifdef BVH_USEAVX
+		else if (k == "cwbvh") ok &= RunKernel<CWBVH>( "cwbvh" );
+	#endif
+		else fprintf( stderr, "kernel '%s' is not available in this build.\n", k.c_str() );
+	}
+	return ok ? 0 : 2;
+}
@@ -37,6 +37,7 @@
 // --------------------------------------------------
 // #define VERIFY_OPTIMIZED_BVH
 // #define RANDOM_BIN_COUNT
+// #define SAVE_RAYSET		"rayset.bin" // RRS with reference hits, for tiny_bvh_benchmark --rays
 
 // RAY SETS:
 // --------------------------------------------------
@@ -329,6 +330,16 @@ int main()
 	int w = 0;
 #endif
 	RepresentativeRays( RAYSET_TYPE );
+#ifdef SAVE_RAYSET
+	{
+		BVH ref;
+		ref.Build( tris, triCount );
+		RayBatch batch;
+		batch.Add( rayset, RRS_SIZE );
+		for (uint32_t i = 0; i < RRS_SIZE; i++) { Ray r = rayset[i]; ref.Intersect( r ); batch.SetHits( i, &r ); }
+		printf( batch.Save( SAVE_RAYSET ) ? "Saved ray set to %s.\n" : "Failed to save %s.\n", SAVE_RAYSET );
+	}
+#endif
 
 #if STAGE == 1 // STAGE 1: Find optimal bin count between 8 and 99, also try 'odd/even' counts.
 
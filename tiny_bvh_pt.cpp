@@ -25,10 +25,6 @@ static BVH bvh;
 static bvhvec4* tris = 0;
 static int triCount = 0, frameIdx = 0, spp = 0;
 static bvhvec3 accumulator[SCRWIDTH * SCRHEIGHT];
-static std::atomic<int> tileIdx( 0 );
-
-// Multi-threading
-static unsigned threadCount = std::thread::hardware_concurrency();
 
 // Setup view pyramid for a pinhole camera:
 // eye, p1 (top-left), p2 (top-right) and p3 (bottom-left)
@@ -162,32 +158,26 @@ bvhvec3 Trace( Ray ray, unsigned& seed, unsigned depth = 0 )
 	return direct + indirect;
 }
 
-void TraceWorkerThread( uint32_t* buf, float scale, int threadIdx )
+void TraceTile( uint32_t* buf, float scale, int tile )
 {
-	const int xtiles = SCRWIDTH / TILESIZE, ytiles = SCRHEIGHT / TILESIZE;
-	const int tiles = xtiles * ytiles;
-	int tile = threadIdx;
-	while (tile < tiles)
+	const int xtiles = SCRWIDTH / TILESIZE;
+	const int tx = tile % xtiles, ty = tile / xtiles;
+	unsigned seed = (tile + 17) * 171717 + frameIdx * 1023;
+	for (int y = 0; y < TILESIZE; y++) for (int x = 0; x < TILESIZE; x++)
 	{
-		const int tx = tile % xtiles, ty = tile / xtiles;
-		unsigned seed = (tile + 17) * 171717 + frameIdx * 1023;
-		for (int y = 0; y < TILESIZE; y++) for (int x = 0; x < TILESIZE; x++)
-		{
-			const int pixel_x = tx * TILESIZE + x, pixel_y = ty * TILESIZE + y;
-			const int pixelIdx = pixel_x + pixel_y * SCRWIDTH;
-			// setup primary ray
-			const float u = (float)pixel_x / SCRWIDTH, v = (float)pixel_y / SCRHEIGHT;
-			const bvhvec3 D = tinybvh_normalize( p1 + u * (p2 - p1) + v * (p3 - p1) - eye );
-			// trace
-			accumulator[pixelIdx] += Trace( Ray( eye, D ), seed );
-			const bvhvec3 E = accumulator[pixelIdx] * scale;
-			// visualize, with a poor man's gamma correct
-			const int r = (int)tinybvh_min( 255.0f, sqrtf( E.x ) * 255.0f );
-			const int g = (int)tinybvh_min( 255.0f, sqrtf( E.y ) * 255.0f );
-			const int b = (int)tinybvh_min( 255.0f, sqrtf( E.z ) * 255.0f );
-			buf[pixelIdx] = b + (g << 8) + (r << 16);
-		}
-		tile = tileIdx++;
+		const int pixel_x = tx * TILESIZE + x, pixel_y = ty * TILESIZE + y;
+		const int pixelIdx = pixel_x + pixel_y * SCRWIDTH;
+		// setup primary ray
+		const float u = (float)pixel_x / SCRWIDTH, v = (float)pixel_y / SCRHEIGHT;
+		const bvhvec3 D = tinybvh_normalize( p1 + u * (p2 - p1) + v * (p3 - p1) - eye );
+		// trace
+		accumulator[pixelIdx] += Trace( Ray( eye, D ), seed );
+		const bvhvec3 E = accumulator[pixelIdx] * scale;
+		// visualize, with a poor man's gamma correct
+		const int r = (int)tinybvh_min( 255.0f, sqrtf( E.x ) * 255.0f );
+		const int g = (int)tinybvh_min( 255.0f, sqrtf( E.y ) * 255.0f );
+		const int b = (int)tinybvh_min( 255.0f, sqrtf( E.z ) * 255.0f );
+		buf[pixelIdx] = b + (g << 8) + (r << 16);
 	}
 }
 
@@ -202,11 +192,8 @@ void Tick( float delta_time_s, fenster& f, uint32_t* buf )
 	}
 	// render tiles
 	const float scale = 1.0f / spp++;
-	tileIdx = threadCount;
-	std::vector<std::thread> threads;
-	for (uint32_t i = 0; i < threadCount; i++)
-		threads.emplace_back( &TraceWorkerThread, buf, scale, i );
-	for (auto& thread : threads) thread.join();
+	const int tiles = (SCRWIDTH / TILESIZE) * (SCRHEIGHT / TILESIZE);
+	JobSystem::Default().ParallelFor( tiles, 1, [&]( uint32_t tile ) { TraceTile( buf, scale, tile ); } );
 	// print frame time / rate in window title
 	char title[50];
 	sprintf( title, "tiny_bvh %.2f s %.2f Hz", delta_time_s, 1.0f / delta_time_s );
@@ -34,6 +34,8 @@
 #define TRAVERSE_2WAY_MT_PACKET
 #define TRAVERSE_OPTIMIZED_ST
 // #define TRAVERSE_8WAY_OPTIMIZED
+#define VALIDATE_FEATURES
+// #define EXPORT_HEATMAP // writes heatmap_nodes.pfm and heatmap_prims.pfm.
 // #define EMBREE_BUILD // win64-only for now.
 // #define EMBREE_TRAVERSE // win64-only for now.
 // #define MADMAN_BUILD_FAST
@@ -145,6 +147,33 @@ void embreeError( void* userPtr, enum RTCError error, const char* str )
 
 float uniform_rand() { return (float)rand() / (float)RAND_MAX; }
 
+void PrintQuality( const BVHQuality& q )
+{
+	// tree quality beyond the SAH: see BVHQuality in tiny_bvh.h.
+	printf( "  EPO=%.2f, LCV=%.2f, overlap=%.2f, %i leaves, max depth %i, %.1f bytes/prim\n",
+		q.epo, q.lcv, q.siblingOverlap, q.leaves, q.maxDepth, q.bytesPerPrim );
+}
+
+#ifdef EXPORT_HEATMAP
+void SaveHeatmap( const char* file, const float* perRay )
+{
+	// average the 16 samples per pixel of the tiled primary ray batch; store as PFM.
+	static float pixels[SCRWIDTH * SCRHEIGHT];
+	memset( pixels, 0, sizeof( pixels ) );
+	for (unsigned i = 0; i < SCRWIDTH * SCRHEIGHT * 16; i++)
+	{
+		const unsigned tile = i >> 8, p = (i >> 4) & 15;
+		const unsigned x = (tile % (SCRWIDTH / 4)) * 4 + (p & 3), y = (tile / (SCRWIDTH / 4)) * 4 + (p >> 2);
+		pixels[(SCRHEIGHT - 1 - y) * SCRWIDTH + x] += perRay[i] * (1.0f / 16); // PFM is stored bottom-up
+	}
+	FILE* f = fopen( file, "wb" );
+	if (!f) return;
+	fprintf( f, "Pf\n%i %i\n-1\n", SCRWIDTH, SCRHEIGHT );
+	fwrite( pixels, sizeof( float ), SCRWIDTH * SCRHEIGHT, f );
+	fclose( f );
+}
+#endif
+
 void PrepareTest()
 {
 #ifdef _MSC_VER
@@ -376,56 +405,245 @@ void ValidateTraceResult( float* ref, unsigned N, unsigned line )
 	}
 }
 
-// Multi-threading
-#include <atomic>
-#include <thread>
-
-static unsigned threadCount = std::thread::hardware_concurrency();
-static std::atomic<int> batchIdx( 0 );
+// Multi-threading: batches are distributed over the tinybvh job system
 
 #if defined(TRAVERSE_2WAY_MT) || defined(ENABLE_OPENCL)
 
-void IntersectBvhWorkerThread( int batchCount, Ray* fullBatch, int threadIdx )
+void IntersectBvhBatch( Ray* fullBatch, int batch )
 {
-	int batch = threadIdx;
-	while (batch < batchCount)
-	{
-		const int batchStart = batch * 10000;
-		for (int i = 0; i < 10000; i++) mybvh->Intersect( fullBatch[batchStart + i] );
-		batch = batchIdx++;
-	}
+	const int batchStart = batch * 10000;
+	for (int i = 0; i < 10000; i++) mybvh->Intersect( fullBatch[batchStart + i] );
 }
 
 #endif
 
 #ifdef TRAVERSE_2WAY_MT_PACKET
 
-void IntersectBvh256WorkerThread( int batchCount, Ray* fullBatch, int threadIdx )
+void IntersectBvh256Batch( Ray* fullBatch, int batch )
 {
-	int batch = threadIdx;
-	while (batch < batchCount)
-	{
-		const int batchStart = batch * 30 * 256;
-		for (int i = 0; i < 30; i++) mybvh->Intersect256Rays( fullBatch + batchStart + i * 256 );
+	const int batchStart = batch * 30 * 256;
+	for (int i = 0; i < 30; i++) mybvh->Intersect256Rays( fullBatch + batchStart + i * 256 );
+}
 
-		batch = batchIdx++;
+#endif
+
+#ifdef BVH_USEAVX
+
+void IntersectBvh256SSEBatch( Ray* fullBatch, int batch )
+{
+	const int batchStart = batch * 30 * 256;
+	for (int i = 0; i < 30; i++) mybvh->Intersect256RaysSSE( fullBatch + batchStart + i * 256 );
+}
+
+#endif
+
+#ifdef VALIDATE_FEATURES
+
+// Feature validation: compares against the reference BVH and terminates the
+// program if a feature produces wrong results.
+
+template <class T> unsigned CountMismatches( const T& bvh, const Ray* rays, const float* ref, const unsigned N )
+{
+	unsigned mismatches = 0;
+	for (unsigned i = 0; i < N; i++)
+	{
+		Ray ray( rays[i].O, rays[i].D );
+		bvh.Intersect( ray );
+		if (fabs( ray.hit.t - ref[i] ) > 0.001f * ref[i]) mismatches++;
 	}
+	return mismatches;
 }
 
+void ValidateFeature( const char* name, const unsigned mismatches, const unsigned N )
+{
+	// allow some slack, we're using various tri intersectors
+	if (mismatches <= N / 1000) { printf( "- %-25s: ok\n", name ); return; }
+	fprintf( stderr, "Validation of %s failed (%i of %i rays differ).\n", name, mismatches, N );
+	exit( 1 );
+}
+
+void ValidateQuads()
+{
+	// every triangle becomes a quad with a degenerate second half (v3 == v2),
+	// so the quad BVHs must find the same hits as the triangle BVH.
+	const uint32_t quadCount = verts / 3;
+	bvhvec4* quads = (bvhvec4*)tinybvh::malloc64( quadCount * 4 * sizeof( bvhvec4 ) );
+	for (uint32_t i = 0; i < quadCount; i++)
+		quads[i * 4] = triangles[i * 3], quads[i * 4 + 1] = triangles[i * 3 + 1],
+		quads[i * 4 + 2] = quads[i * 4 + 3] = triangles[i * 3 + 2];
+	BVH bvh;
+	bvh.BuildQuads( quads, quadCount );
+	ValidateFeature( "quads, BVH", CountMismatches( bvh, smallBatch[0], refDist, Nsmall ), Nsmall );
+#ifdef BVH_USESSE
+	BVH4_CPU bvh4;
+	bvh4.BuildQuads( quads, quadCount );
+	ValidateFeature( "quads, BVH4_CPU", CountMismatches( bvh4, smallBatch[0], refDist, Nsmall ), Nsmall );
+#endif
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+	BVH8_CPU bvh8;
+	bvh8.BuildQuads( quads, quadCount );
+	ValidateFeature( "quads, BVH8_CPU", CountMismatches( bvh8, smallBatch[0], refDist, Nsmall ), Nsmall );
 #endif
+	tinybvh::free64( quads );
+}
 
-#ifdef BVH_USEAVX
+// custom primitives for the custom leaf validation: the scene triangles themselves.
+static bool TriIntersect( Ray& ray, const unsigned primIdx )
+{
+	const bvhvec3 v0 = triangles[primIdx * 3], v1 = triangles[primIdx * 3 + 1], v2 = triangles[primIdx * 3 + 2];
+	const bvhvec3 e1 = v1 - v0, e2 = v2 - v0;
+	const bvhvec3 h = tinybvh_cross( ray.D, e2 );
+	const float a = tinybvh_dot( e1, h );
+	if (fabs( a ) < 0.0000001f) return false;
+	const float f = 1 / a;
+	const bvhvec3 s = ray.O - v0;
+	const float u = f * tinybvh_dot( s, h );
+	const bvhvec3 q = tinybvh_cross( s, e1 );
+	const float v = f * tinybvh_dot( ray.D, q );
+	if (u < 0 || v < 0 || u + v > 1) return false;
+	const float t = f * tinybvh_dot( e2, q );
+	if (t < 0 || t >= ray.hit.t) return false;
+	ray.hit.t = t, ray.hit.u = u, ray.hit.v = v, ray.hit.prim = primIdx;
+	return true;
+}
+static bool TriIsOccluded( const Ray& ray, const unsigned primIdx )
+{
+	Ray tmp = ray;
+	return TriIntersect( tmp, primIdx );
+}
+static bool TriIntersect4( Ray& ray, const uint32_t* primIdx, const uint32_t count )
+{
+	bool hit = false;
+	for (uint32_t i = 0; i < count; i++) if (TriIntersect( ray, primIdx[i] )) hit = true;
+	return hit;
+}
+static bool TriIsOccluded4( const Ray& ray, const uint32_t* primIdx, const uint32_t count )
+{
+	for (uint32_t i = 0; i < count; i++) if (TriIsOccluded( ray, primIdx[i] )) return true;
+	return false;
+}
+static void TriAABB( const unsigned primIdx, bvhvec3& bmin, bvhvec3& bmax )
+{
+	bmin = tinybvh_min( tinybvh_min( triangles[primIdx * 3], triangles[primIdx * 3 + 1] ), triangles[primIdx * 3 + 2] );
+	bmax = tinybvh_max( tinybvh_max( triangles[primIdx * 3], triangles[primIdx * 3 + 1] ), triangles[primIdx * 3 + 2] );
+}
 
-void IntersectBvh256SSEWorkerThread( int batchCount, Ray* fullBatch, int threadIdx )
+template <class T> unsigned CountOcclusionMismatches( const T& bvh, const Ray* rays, const unsigned N )
 {
-	int batch = threadIdx;
-	while (batch < batchCount)
+	unsigned mismatches = 0;
+	for (unsigned i = 0; i < N; i++)
 	{
-		const int batchStart = batch * 30 * 256;
-		for (int i = 0; i < 30; i++) mybvh->Intersect256RaysSSE( fullBatch + batchStart + i * 256 );
+		Ray ray( rays[i].O, rays[i].D );
+		if (bvh.IsOccluded( ray ) != mybvh->IsOccluded( ray )) mismatches++;
+	}
+	return mismatches;
+}
+
+template <class T> void ValidateCustomLeafs( T& bvh, const char* name )
+{
+	char label[64];
+	// per-primitive callbacks
+	bvh.customIntersect = TriIntersect, bvh.customIsOccluded = TriIsOccluded;
+	bvh.Build( TriAABB, verts / 3 );
+	snprintf( label, sizeof( label ), "custom, %s", name );
+	ValidateFeature( label, CountMismatches( bvh, smallBatch[0], refDist, Nsmall ) +
+		CountOcclusionMismatches( bvh, smallBatch[0], Nsmall ), Nsmall );
+	// batched callbacks take precedence
+	bvh.customIntersect4 = TriIntersect4, bvh.customIsOccluded4 = TriIsOccluded4;
+	bvh.customIntersect = 0, bvh.customIsOccluded = 0;
+	bvh.Build( TriAABB, verts / 3 );
+	snprintf( label, sizeof( label ), "custom4, %s", name );
+	ValidateFeature( label, CountMismatches( bvh, smallBatch[0], refDist, Nsmall ) +
+		CountOcclusionMismatches( bvh, smallBatch[0], Nsmall ), Nsmall );
+}
 
-		batch = batchIdx++;
+void ValidateScene()
+{
+	// save a TLAS over instances of several BLAS layouts, load it back, and
+	// compare: the loaded scene must produce exactly the same hits.
+	BVH blas0;
+	blas0.Build( triangles, verts / 3 );
+	BVHBase* blasses[3] = { &blas0, &blas0, &blas0 };
+	uint32_t blasCount = 1;
+#ifdef BVH_USESSE
+	BVH4_CPU blas1;
+	blas1.Build( triangles, verts / 3 );
+	blasses[blasCount++] = &blas1;
+#endif
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+	BVH8_CPU blas2;
+	blas2.Build( triangles, verts / 3 );
+	blasses[blasCount++] = &blas2;
+#endif
+	BLASInstance inst[3];
+	for (uint32_t i = 0; i < 3; i++)
+		inst[i].blasIdx = i % blasCount, inst[i].transform[3] = (float)i * 0.5f, inst[i].transform[7] = (float)i * 0.25f;
+	BVH tlas;
+	tlas.Build( inst, 3, blasses, blasCount );
+	const char* fileName = "scene_validation.bin";
+	if (!BVHScene::Save( fileName, tlas ))
+	{
+		fprintf( stderr, "Validation of scene save failed.\n" );
+		exit( 1 );
 	}
+	BVHScene scene;
+	BLASGeometry geometry[3];
+	geometry[0].vertices = bvhvec4slice( triangles, verts, sizeof( bvhvec4 ) );
+	const bool loaded = scene.Load( fileName, geometry );
+	remove( fileName );
+	if (!loaded || scene.blasCount != blasCount || scene.instCount != 3)
+	{
+		fprintf( stderr, "Validation of scene load failed.\n" );
+		exit( 1 );
+	}
+	unsigned mismatches = 0;
+	for (unsigned i = 0; i < Nsmall; i++)
+	{
+		Ray ray1( smallBatch[0][i].O, smallBatch[0][i].D ), ray2 = ray1;
+		tlas.Intersect( ray1 );
+		scene.tlas.Intersect( ray2 );
+		if (ray1.hit.t != ray2.hit.t || ray1.hit.prim != ray2.hit.prim) mismatches++;
+		if (tlas.IsOccluded( ray1 ) != scene.tlas.IsOccluded( ray2 )) mismatches++;
+	}
+	if (mismatches == 0) { printf( "- %-25s: ok\n", "scene round-trip" ); return; }
+	fprintf( stderr, "Validation of scene round-trip failed (%i mismatches).\n", mismatches );
+	exit( 1 );
+}
+
+template <class T> unsigned CountHitMismatches( const T& bvh1, const T& bvh2, const Ray* rays, const unsigned N )
+{
+	unsigned mismatches = 0;
+	for (unsigned i = 0; i < N; i++)
+	{
+		Ray ray1( rays[i].O, rays[i].D ), ray2 = ray1;
+		bvh1.Intersect( ray1 );
+		bvh2.Intersect( ray2 );
+		if (ray1.hit.t != ray2.hit.t || ray1.hit.prim != ray2.hit.prim) mismatches++;
+	}
+	return mismatches;
+}
+
+template <class T> void ValidateCompressed( const char* name )
+{
+	// save compressed, load back from the file and from a mapping: the leafs are
+	// rebuilt from the same vertices, so the hits must match exactly.
+	T bvh, loaded, mapped;
+	bvh.Build( triangles, verts / 3 );
+	const char* fileName = "compressed_validation.bin";
+	const bvhvec4slice vertices( triangles, verts, sizeof( bvhvec4 ) );
+	BVHMappedFile file;
+	const bool ok = bvh.SaveCompressed( fileName ) && loaded.LoadCompressed( fileName, vertices ) &&
+		file.Open( fileName ) && mapped.LoadCompressed( file, vertices );
+	file.Close();
+	remove( fileName );
+	char label[64];
+	snprintf( label, sizeof( label ), "compressed, %s", name );
+	unsigned mismatches = ok ? 0 : Nsmall;
+	if (ok) mismatches = CountHitMismatches( bvh, loaded, smallBatch[0], Nsmall ) +
+		CountHitMismatches( bvh, mapped, smallBatch[0], Nsmall );
+	if (mismatches == 0) { printf( "- %-25s: ok\n", label ); return; }
+	fprintf( stderr, "Validation of %s failed (%i mismatches).\n", label, mismatches );
+	exit( 1 );
 }
 
 #endif
@@ -475,6 +693,8 @@ int main()
 	tinyocl::Kernel ailalaine_kernel( "traverse.cl", "batch_ailalaine" );
 	tinyocl::Kernel gpu4way_kernel( "traverse.cl", "batch_gpu4way" );
 	tinyocl::Kernel cwbvh_kernel( "traverse.cl", "batch_cwbvh" );
+	tinyocl::Kernel ailalaine_stackless_kernel( "traverse.cl", "batch_ailalaine_stackless" );
+	tinyocl::Kernel cwbvh_shortstack_kernel( "traverse.cl", "batch_cwbvh_shortstack" );
 	printf( "----------------------------------------------------------------\n" );
 
 #endif
@@ -604,6 +824,7 @@ int main()
 	TestPrimaryRays( _BVH, Nsmall, 3, &avgCost );
 	printf( "%7.2fms for %7i triangles ", buildTime * 1000.0f, verts / 3 );
 	printf( "- %6i nodes, SAH=%.2f, rayCost=%.2f\n", mybvh->usedNodes, mybvh->SAHCost(), avgCost );
+	PrintQuality( mybvh->Analyze() );
 
 #endif
 
@@ -619,6 +840,7 @@ int main()
 	TestPrimaryRays( _SWEEP, Nsmall, 3, &avgCost );
 	printf( "%7.2fms for %7i triangles ", buildTime * 1000.0f, verts / 3 );
 	printf( "- %6i nodes, SAH=%.2f, rayCost=%.2f\n", sweepbvh->usedNodes, sweepbvh->SAHCost(), avgCost );
+	PrintQuality( sweepbvh->Analyze() );
 
 #endif
 
@@ -650,6 +872,7 @@ int main()
 	TestPrimaryRays( _BVH, Nsmall, 3, &avgCost );
 	printf( "%7.2fms for %7i triangles ", buildTime * 1000.0f, verts / 3 );
 	printf( "- %6i nodes, SAH=%.2f, rayCost=%.2f\n", mybvh->usedNodes, mybvh->SAHCost(), avgCost );
+	PrintQuality( mybvh->Analyze() );
 
 #endif
 
@@ -663,6 +886,7 @@ int main()
 	TestPrimaryRays( _BVH, Nsmall, 3, &avgCost );
 	printf( "%7.2fms for %7i triangles ", buildTime * 1000.0f, verts / 3 );
 	printf( "- %6i nodes, SAH=%.2f, rayCost=%.2f\n", mybvh->usedNodes, mybvh->SAHCost(), avgCost );
+	PrintQuality( mybvh->Analyze() );
 
 #endif
 
@@ -676,6 +900,7 @@ int main()
 	TestPrimaryRays( _BVH, Nsmall, 3, &avgCost );
 	printf( "%7.2fms for %7i triangles ", buildTime * 1000.0f, verts / 3 );
 	printf( "- %6i nodes, SAH=%.2f, rayCost=%.2f\n", mybvh->usedNodes, mybvh->SAHCost(), avgCost );
+	PrintQuality( mybvh->Analyze() );
 
 #endif
 
@@ -744,6 +969,42 @@ int main()
 	buildTime = t.elapsed();
 	printf( "%7.2fms for %7i triangles\n", buildTime * 1000.0f, verts / 3 );
 
+#endif
+
+#ifdef EXPORT_HEATMAP
+
+	// traversal cost per pixel, per node and per primitive for the first view
+	printf( "Traversal cost heatmap\n" );
+	mybvh->Build( triangles, verts / 3 );
+	{
+		float* rayNodes = new float[Nfull], * rayPrims = new float[Nfull];
+		float* nodeHeat = new float[mybvh->usedNodes];
+		uint32_t* primHeat = new uint32_t[verts / 3];
+		memset( nodeHeat, 0, mybvh->usedNodes * sizeof( float ) );
+		memset( primHeat, 0, verts / 3 * sizeof( uint32_t ) );
+		mybvh->TraceHeatmap( fullBatch[0], Nfull, rayNodes, rayPrims, nodeHeat, primHeat );
+		SaveHeatmap( "heatmap_nodes.pfm", rayNodes );
+		SaveHeatmap( "heatmap_prims.pfm", rayPrims );
+		mybvh->SubtreeHeat( nodeHeat );
+		uint32_t hottestPrim = 0;
+		for (int i = 1; i < verts / 3; i++) if (primHeat[i] > primHeat[hottestPrim]) hottestPrim = i;
+		printf( "- cost per ray: %.2f, hottest triangle: %i (%i tests)\n", nodeHeat[0] / Nfull, hottestPrim, primHeat[hottestPrim] );
+		// descend into the hotter child while it holds at least a quarter of the total cost
+		uint32_t nodeIdx = 0, depth = 0;
+		while (!mybvh->bvhNode[nodeIdx].isLeaf())
+		{
+			uint32_t hot = mybvh->bvhNode[nodeIdx].leftFirst;
+			if (nodeHeat[hot + 1] > nodeHeat[hot]) hot++;
+			if (nodeHeat[hot] < 0.25f * nodeHeat[0]) break;
+			nodeIdx = hot, depth++;
+		}
+		printf( "- hot subtree: node %i at depth %i, %.1f%% of the cost\n", nodeIdx, depth, 100.0f * nodeHeat[nodeIdx] / nodeHeat[0] );
+		delete[] rayNodes;
+		delete[] rayPrims;
+		delete[] nodeHeat;
+		delete[] primHeat;
+	}
+
 #endif
 
 	// measure single-core bvh construction time - warming caches
@@ -1047,6 +1308,28 @@ int main()
 
 #endif
 
+#ifdef VALIDATE_FEATURES
+
+	printf( "Validating features\n" );
+	ValidateQuads();
+#ifdef BVH_USESSE
+	BVH4_CPU custom4;
+	ValidateCustomLeafs( custom4, "BVH4_CPU" );
+#endif
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+	BVH8_CPU custom8;
+	ValidateCustomLeafs( custom8, "BVH8_CPU" );
+#endif
+	ValidateScene();
+#if defined BVH_USEAVX && defined BVH_USEAVX2
+	ValidateCompressed<BVH8_CPU>( "BVH8_CPU" );
+#endif
+#ifdef BVH_USEAVX
+	ValidateCompressed<BVH8_CWBVH>( "BVH8_CWBVH" );
+#endif
+
+#endif
+
 #ifdef ENABLE_OPENCL
 
 	// report GPU performance
@@ -1054,12 +1337,8 @@ int main()
 
 	// calculate full res reference distances using threaded traversal on CPU.
 	const int batchCount = Nfull / 10000;
-	batchIdx = threadCount;
-	std::vector<std::thread> threads;
 	for (unsigned i = 0; i < Nfull; i++) fullBatch[0][i].hit.t = 1e30f;
-	for (uint32_t i = 0; i < threadCount; i++)
-		threads.emplace_back( &IntersectBvhWorkerThread, batchCount, fullBatch[0], i );
-	for (auto& thread : threads) thread.join();
+	JobSystem::Default().ParallelFor( batchCount, 1, []( uint32_t batch ) { IntersectBvhBatch( fullBatch[0], batch ); } );
 	refDistFull = new float[Nfull];
 	refUFull = 0, refVFull = 0;
 	for (unsigned i = 0; i < Nfull; i++)
@@ -1116,6 +1395,23 @@ int main()
 	printf( "%7.2fMRays/s\n", (float)Nfull / traceTime * 1e-6f );
 	// validate GPU ray tracing result
 	ValidateTraceResult( refDistFull, Nfull, __LINE__ );
+	// same rays, stackless traversal using the parent indices in the nodes
+	printf( "- BVH_GPU sl  - primary: " );
+	traceTime = 0;
+	ailalaine_stackless_kernel.SetArguments( &gpuNodes, &idxData, &triData, &rayData );
+	for (int pass = 0; pass < 9; pass++)
+	{
+		ailalaine_stackless_kernel.Run( Nfull, 64, 0, &event );
+		clWaitForEvents( 1, &event ); // OpenCL kernels run asynchronously
+		clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &startTime, 0 );
+		clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &endTime, 0 );
+		if (pass == 0) continue; // first pass is for cache warming
+		traceTime += (endTime - startTime) * 1e-9f; // event timing is in nanoseconds
+	}
+	rayData.CopyFromDevice();
+	traceTime /= 8.0f;
+	printf( "%7.2fMRays/s\n", (float)Nfull / traceTime * 1e-6f );
+	ValidateTraceResult( refDistFull, Nfull, __LINE__ );
 
 #endif
 
@@ -1216,6 +1512,23 @@ int main()
 	printf( "%7.2fMRays/s\n", (float)Nfull / traceTime * 1e-6f );
 	// validate GPU ray tracing result
 	ValidateTraceResult( refDistFull, Nfull, __LINE__ );
+	// same rays, short stack with a full-stack fallback
+	printf( "- CWBVH short - primary: " );
+	traceTime = 0;
+	cwbvh_shortstack_kernel.SetArguments( &cwbvhNodes, &cwbvhTris, &rayData );
+	for (int pass = 0; pass < 9; pass++)
+	{
+		cwbvh_shortstack_kernel.Run( Nfull, 64, 0, &event );
+		clWaitForEvents( 1, &event ); // OpenCL kernels run asynchronously
+		clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &startTime, 0 );
+		clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &endTime, 0 );
+		if (pass == 0) continue; // first pass is for cache warming
+		traceTime += (endTime - startTime) * 1e-9f; // event timing is in nanoseconds
+	}
+	rayData.CopyFromDevice();
+	traceTime /= 8.0f;
+	printf( "%7.2fMRays/s\n", (float)Nfull / traceTime * 1e-6f );
+	ValidateTraceResult( refDistFull, Nfull, __LINE__ );
 
 #endif
 
@@ -1234,11 +1547,7 @@ int main()
 		if (pass == 1) t.reset(); // first pass is cache warming
 		const int batchCount = Nfull / 10000;
 
-		batchIdx = threadCount;
-		std::vector<std::thread> threads;
-		for (uint32_t i = 0; i < threadCount; i++)
-			threads.emplace_back( &IntersectBvhWorkerThread, batchCount, fullBatch[0], i );
-		for (auto& thread : threads) thread.join();
+		JobSystem::Default().ParallelFor( batchCount, 1, []( uint32_t batch ) { IntersectBvhBatch( fullBatch[0], batch ); } );
 	}
 	traceTime = t.elapsed() / 3.0f;
 	// printf( "%4.2fM rays in %5.1fms (%7.2fMRays/s)\n", (float)Nfull * 1e-6f, traceTime * 1000, (float)Nfull / traceTime * 1e-6f );
@@ -1256,11 +1565,7 @@ int main()
 		if (pass == 1) t.reset(); // first pass is cache warming
 		const int batchCount = Nfull / (30 * 256); // batches of 30 packets of 256 rays
 
-		batchIdx = threadCount;
-		std::vector<std::thread> threads;
-		for (uint32_t i = 0; i < threadCount; i++)
-			threads.emplace_back( &IntersectBvh256WorkerThread, batchCount, fullBatch[0], i );
-		for (auto& thread : threads) thread.join();
+		JobSystem::Default().ParallelFor( batchCount, 1, []( uint32_t batch ) { IntersectBvh256Batch( fullBatch[0], batch ); } );
 	}
 	traceTime = t.elapsed() / 3.0f;
 	// printf( "%4.2fM rays in %5.1fms (%7.2fMRays/s)\n", (float)Nfull * 1e-6f, traceTime * 1000, (float)Nfull / traceTime * 1e-6f );
@@ -1276,11 +1581,7 @@ int main()
 	{
 		if (pass == 1) t.reset(); // first pass is cache warming
 		const int batchCount = Nfull / (30 * 256); // batches of 30 packets of 256 rays
-		batchIdx = threadCount;
-		std::vector<std::thread> threads;
-		for (uint32_t i = 0; i < threadCount; i++)
-			threads.emplace_back( &IntersectBvh256SSEWorkerThread, batchCount, fullBatch[0], i );
-		for (auto& thread : threads) thread.join();
+		JobSystem::Default().ParallelFor( batchCount, 1, []( uint32_t batch ) { IntersectBvh256SSEBatch( fullBatch[0], batch ); } );
 	}
 	traceTime = t.elapsed() / 3.0f;
 	// printf( "%4.2fM rays in %5.1fms (%7.2fMRays/s)\n", (float)Nfull * 1e-6f, traceTime * 1000, (float)Nfull / traceTime * 1e-6f );
@@ -14,6 +14,9 @@ struct Ray
 // BVH traversal stack size 
 #define STACK_SIZE 32
 
+// Stack size of the short-stack CWBVH kernel (power of 2); sync with tiny_bvh.h
+#define CWBVH_SHORT_STACK 8
+
 // Low-level optimizations for specific platforms
 #ifdef ISINTEL // Iris Xe, Arc, ..
 // #define USE_VLOAD_VSTORE
@@ -170,6 +170,87 @@ bool isoccluded_ailalaine( global struct BVHNodeAlt* altNode, global unsigned* i
 	return false;
 }
 
+float4 traverse_ailalaine_stackless( global struct BVHNodeAlt* altNode, global unsigned* idx, global float4* verts, const float3 O, const float3 D, const float3 rD, const float tmax )
+{
+	// stackless traversal: interior nodes store their parent in rmax.w, leaves
+	// in lmin.w (0xffffffff for the root). Instead of popping a stack we go back
+	// up and use the node we came from to decide where to go next. The near/far
+	// order of two children depends only on the ray, so it is the same on the
+	// way down and on the way up.
+	float4 hit;
+	hit.x = tmax;
+	unsigned node = 0, from = 0xffffffff;
+	while (1)
+	{
+		// fetch the node
+		const float4 lmin = altNode[node].lmin, lmax = altNode[node].lmax;
+		const float4 rmin = altNode[node].rmin, rmax = altNode[node].rmax;
+		const unsigned triCount = as_uint( rmin.w );
+		unsigned next;
+		if (triCount > 0)
+		{
+			// process leaf node
+			const unsigned firstTri = as_uint( rmax.w );
+			for (unsigned i = 0; i < triCount; i++)
+			{
+				const unsigned triIdx = idx[firstTri + i];
+#ifdef ISAPPLE
+				// FIX error: initializing 'const __private float4 *__private' with an expression of type '__global float4 *' changes address space of pointer
+				const float4 tri[3] = 
+				{
+					verts[3 * triIdx],
+					verts[3 * triIdx + 1],
+					verts[3 * triIdx + 2],
+				};
+#else
+				const float4* tri = verts + 3 * triIdx;
+#endif
+				// triangle intersection - Mller-Trumbore
+				const float4 edge1 = tri[1] - tri[0], edge2 = tri[2] - tri[0];
+				const float3 h = cross( D, edge2.xyz );
+				const float a = dot( edge1.xyz, h );
+				if (fabs( a ) < 0.0000001f) continue;
+				const float f = 1 / a;
+				const float3 s = O - tri[0].xyz;
+				const float u = f * dot( s, h );
+				const float3 q = cross( s, edge1.xyz );
+				const float v = f * dot( D, q );
+				if (u < 0 || v < 0 || u + v > 1) continue;
+				const float d = f * dot( edge2.xyz, q );
+				if (d > 0.0f && d < hit.x) hit = (float4)(d, u, v, as_float( triIdx ));
+			}
+			next = as_uint( lmin.w );
+		}
+		else
+		{
+			const unsigned parent = as_uint( rmax.w );
+			unsigned nearChild = as_uint( lmin.w ), farChild = as_uint( lmax.w );
+			// child AABB intersection tests
+			const float3 t1a = (lmin.xyz - O) * rD, t2a = (lmax.xyz - O) * rD;
+			const float3 t1b = (rmin.xyz - O) * rD, t2b = (rmax.xyz - O) * rD;
+			const float3 minta = fmin( t1a, t2a ), maxta = fmax( t1a, t2a );
+			const float3 mintb = fmin( t1b, t2b ), maxtb = fmax( t1b, t2b );
+			const float tmina = fmax( fmax( fmax( minta.x, minta.y ), minta.z ), 0 );
+			const float tminb = fmax( fmax( fmax( mintb.x, mintb.y ), mintb.z ), 0 );
+			const float tmaxa = fmin( fmin( fmin( maxta.x, maxta.y ), maxta.z ), hit.x );
+			const float tmaxb = fmin( fmin( fmin( maxtb.x, maxtb.y ), maxtb.z ), hit.x );
+			bool hitNear = tmina <= tmaxa, hitFar = tminb <= tmaxb;
+			// order by entry distance, not by hit, so that the order is stable
+			if (tmina > tminb)
+			{
+				bool h = hitNear; hitNear = hitFar; hitFar = h;
+				unsigned t = nearChild; nearChild = farChild; farChild = t;
+			}
+			if (from == parent) next = hitNear ? nearChild : (hitFar ? farChild : parent);
+			else next = (from == nearChild && hitFar) ? farChild : parent;
+		}
+		if (next == 0xffffffff) break;
+		from = node, node = next;
+	}
+	// write back intersection result
+	return hit;
+}
+
 void kernel batch_ailalaine( global struct BVHNodeAlt* altNode, global unsigned* idx, global float4* verts, global struct Ray* rayData )
 {
 	// fetch ray
@@ -179,4 +260,15 @@ void kernel batch_ailalaine( global struct BVHNodeAlt* altNode, global unsigned*
 	const float3 rD = rayData[threadId].rD.xyz;
 	float4 hit = traverse_ailalaine( altNode, idx, verts, O, D, rD, 1e30f );
 	rayData[threadId].hit = hit;
+}
+
+void kernel batch_ailalaine_stackless( global struct BVHNodeAlt* altNode, global unsigned* idx, global float4* verts, global struct Ray* rayData )
+{
+	// fetch ray
+	const unsigned threadId = get_global_id( 0 );
+	const float3 O = rayData[threadId].O.xyz;
+	const float3 D = rayData[threadId].D.xyz;
+	const float3 rD = rayData[threadId].rD.xyz;
+	float4 hit = traverse_ailalaine_stackless( altNode, idx, verts, O, D, rD, 1e30f );
+	rayData[threadId].hit = hit;
 }
\ No newline at end of file
@@ -74,12 +74,15 @@ inline float fmax_fmax( const float a, const float b, const float c )
 #endif
 }
 
+// stack operations. M is ~0u for a plain stack, or the size - 1 of a ring buffer
+// (power of 2); a push on a full ring buffer overwrites the oldest entry and moves
+// stackBase up. The stack is empty when stackPtr == stackBase.
 #ifdef USE_VLOAD_VSTORE
-#define STACK_POP(X) { unsigned* a = (unsigned*)&stack[--stackPtr]; X = vload2( 0, a ); }
-#define STACK_PUSH(X) { unsigned* a = (unsigned*)&stack[stackPtr++]; vstore2( X, 0, a ); }
+#define STACK_POP(X,M) { unsigned* a = (unsigned*)&stack[--stackPtr & (M)]; X = vload2( 0, a ); }
+#define STACK_PUSH(X,M) { unsigned* a = (unsigned*)&stack[stackPtr & (M)]; vstore2( X, 0, a ); if (stackPtr++ - stackBase > (M)) stackBase++; }
 #else
-#define STACK_POP(X) { X = stack[--stackPtr]; }
-#define STACK_PUSH(X) { stack[stackPtr++] = X; }
+#define STACK_POP(X,M) { X = stack[--stackPtr & (M)]; }
+#define STACK_PUSH(X,M) { stack[stackPtr & (M)] = X; if (stackPtr++ - stackBase > (M)) stackBase++; }
 #endif
 inline unsigned sign_extend_s8x4( const unsigned i )
 {
@@ -120,10 +123,12 @@ inline unsigned sign_extend_s8x4( const unsigned i )
 // kernel
 // based on CUDA code by AlanWBFT https://github.com/AlanIWBFT
 
+// shared by traverse_cwbvh and traverse_cwbvh_shortstack: traverses with the given
+// stack (see STACK_PUSH for stackMask); sets *overflow if entries were dropped.
 #ifdef SIMD_AABBTEST
-float4 traverse_cwbvh( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float4 O, const float4 D, const float4 rD, const float t )
+inline float4 traverse_cwbvh_stack( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float4 O, const float4 D, const float4 rD, const float t, uint2* stack, const uint stackMask, unsigned* overflow )
 #else
-float4 traverse_cwbvh( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float3 O, const float3 D, const float3 rD, const float t )
+inline float4 traverse_cwbvh_stack( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float3 O, const float3 D, const float3 rD, const float t, uint2* stack, const uint stackMask, unsigned* overflow )
 #endif
 {
 	// initialize ray
@@ -131,8 +136,7 @@ float4 traverse_cwbvh( global const float4* cwbvhNodes, global const float4* cwb
 	float4 hit;
 	hit.x = t; // not fetching this from ray data to avoid one memory operation.
 	// prepare traversal
-	uint2 stack[STACK_SIZE];
-	uint hitAddr, stackPtr = 0;
+	uint hitAddr, stackPtr = 0, stackBase = 0;
 	float2 uv;
 	float tmax = t;
 	const uint octinv4 = (7 - ((D.x < 0 ? 4 : 0) | (D.y < 0 ? 2 : 0) | (D.z < 0 ? 1 : 0))) * 0x1010101;
@@ -145,7 +149,7 @@ float4 traverse_cwbvh( global const float4* cwbvhNodes, global const float4* cwb
 			const unsigned child_bit_index = __bfind( hits );
 			const unsigned child_node_base_index = ngroup.x;
 			ngroup.y &= ~(1 << child_bit_index);
-			if (ngroup.y > 0x00FFFFFF) { STACK_PUSH( ngroup ); }
+			if (ngroup.y > 0x00FFFFFF) { STACK_PUSH( ngroup, stackMask ); }
 			{
 				const unsigned slot_index = (child_bit_index - 24) ^ (octinv4 & 255);
 				const unsigned relative_index = __popc( imask & ~(0xFFFFFFFF << slot_index) );
@@ -329,16 +333,32 @@ float4 traverse_cwbvh( global const float4* cwbvhNodes, global const float4* cwb
 		}
 		if (ngroup.y <= 0x00FFFFFF)
 		{
-			if (stackPtr > 0) { STACK_POP( ngroup ); } else
+			if (stackPtr > stackBase) { STACK_POP( ngroup, stackMask ); } else
 			{
 				hit = (float4)(tmax, uv.x, uv.y, as_float( hitAddr ));
 				break;
 			}
 		}
 	} while (true);
+	*overflow = stackBase > 0;
 	return hit;
 }
 
+float4 traverse_cwbvh( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float3or4 O, const float3or4 D, const float3or4 rD, const float t )
+{
+	uint2 stack[STACK_SIZE];
+	unsigned overflow;
+	return traverse_cwbvh_stack( cwbvhNodes, cwbvhTris, O, D, rD, t, stack, ~0u, &overflow );
+}
+
+// short stack: a CWBVH_SHORT_STACK-entry ring buffer. On overflow *overflow is set
+// and the caller finishes the ray with traverse_cwbvh.
+float4 traverse_cwbvh_shortstack( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float3or4 O, const float3or4 D, const float3or4 rD, const float t, unsigned* overflow )
+{
+	uint2 stack[CWBVH_SHORT_STACK];
+	return traverse_cwbvh_stack( cwbvhNodes, cwbvhTris, O, D, rD, t, stack, CWBVH_SHORT_STACK - 1, overflow );
+}
+
 #ifdef SIMD_AABBTEST
 bool isoccluded_cwbvh( global const float4* cwbvhNodes, global const float4* cwbvhTris, const float4 O, const float4 D, const float4 rD, const float t )
 #else
@@ -349,7 +369,7 @@ bool isoccluded_cwbvh( global const float4* cwbvhNodes, global const float4* cwb
 	const unsigned threadId = get_global_id( 0 );
 	// prepare traversal
 	uint2 stack[STACK_SIZE];
-	uint stackPtr = 0;
+	uint stackPtr = 0, stackBase = 0;
 	float tmax = t;
 	const uint octinv4 = (7 - ((D.x < 0 ? 4 : 0) | (D.y < 0 ? 2 : 0) | (D.z < 0 ? 1 : 0))) * 0x1010101;
 	uint2 ngroup = (uint2)(0, 0b10000000000000000000000000000000), tgroup = (uint2)(0);
@@ -361,7 +381,7 @@ bool isoccluded_cwbvh( global const float4* cwbvhNodes, global const float4* cwb
 			const unsigned child_bit_index = __bfind( hits );
 			const unsigned child_node_base_index = ngroup.x;
 			ngroup.y &= ~(1 << child_bit_index);
-			if (ngroup.y > 0x00FFFFFF) { STACK_PUSH( ngroup ); }
+			if (ngroup.y > 0x00FFFFFF) { STACK_PUSH( ngroup, ~0u ); }
 			{
 				const unsigned slot_index = (child_bit_index - 24) ^ (octinv4 & 255);
 				const unsigned relative_index = __popc( imask & ~(0xFFFFFFFF << slot_index) );
@@ -545,7 +565,7 @@ bool isoccluded_cwbvh( global const float4* cwbvhNodes, global const float4* cwb
 			if (d > 0.0f && d < tmax) return true;
 		#endif
 		}
-		if (ngroup.y <= 0x00FFFFFF) { if (stackPtr == 0) break; STACK_POP( ngroup ); }
+		if (ngroup.y <= 0x00FFFFFF) { if (stackPtr == 0) break; STACK_POP( ngroup, ~0u ); }
 	} while (true);
 	return false; // no occlusion found.
 }
@@ -566,4 +586,26 @@ void kernel batch_cwbvh( global const float4* cwbvhNodes, global const float4* c
 	float4 hit = traverse_cwbvh( cwbvhNodes, cwbvhTris, O4.xyz, D4.xyz, rD4.xyz, 1e30f );
 #endif
 	rayData[threadId].hit = hit;
+}
+
+void kernel batch_cwbvh_shortstack( global const float4* cwbvhNodes, global const float4* cwbvhTris, global struct Ray* rayData )
+{
+	// initialize ray
+	const unsigned threadId = get_global_id( 0 );
+	unsigned overflow;
+#ifdef SIMD_AABBTEST
+	float4 O4 = rayData[threadId].O; O4.w = 1;
+	float4 D4 = rayData[threadId].D; D4.w = 0;
+	float4 rD4 = rayData[threadId].rD; rD4.w = 1;
+	float4 hit = traverse_cwbvh_shortstack( cwbvhNodes, cwbvhTris, O4, D4, rD4, 1e30f, &overflow );
+	// the short stack dropped entries: finish with the full stack, using the hit so far as tmax.
+	if (overflow) { const float4 h = traverse_cwbvh( cwbvhNodes, cwbvhTris, O4, D4, rD4, hit.x ); if (h.x < hit.x) hit = h; }
+#else
+	const float4 O4 = rayData[threadId].O;
+	const float4 D4 = rayData[threadId].D;
+	const float4 rD4 = rayData[threadId].rD;
+	float4 hit = traverse_cwbvh_shortstack( cwbvhNodes, cwbvhTris, O4.xyz, D4.xyz, rD4.xyz, 1e30f, &overflow );
+	if (overflow) { const float4 h = traverse_cwbvh( cwbvhNodes, cwbvhTris, O4.xyz, D4.xyz, rD4.xyz, hit.x ); if (h.x < hit.x) hit = h; }
+#endif
+	rayData[threadId].hit = hit;
 }
\ No newline at end of file